@@ -0,0 +1,69 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "ackthin.h"
+
+#include <string.h>
+
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+
+static uint32_t get32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+void ackthin_reset(ackthin_t *t) { t->count = 0; }
+
+bool ackthin_superseded(ackthin_t *t, const uint8_t *pkt, size_t len) {
+  if (len < 20 || pkt[0] >> 4 != 4 || pkt[9] != 6) {
+    return false;
+  }
+  size_t ihl = (pkt[0] & 0x0f) * 4;
+  size_t total = (size_t)pkt[2] << 8 | pkt[3];
+  // 分片的包看不到完整的 TCP 头
+  if (ihl < 20 || total > len || total < ihl + 20 ||
+      ((pkt[6] & 0x3f) | pkt[7]) != 0) {
+    return false;
+  }
+  const uint8_t *tcp = pkt + ihl;
+  size_t doff = (tcp[12] >> 4) * 4;
+  uint8_t flags = tcp[13];
+  if (doff < 20 || total < ihl + doff || !(flags & TCP_ACK) ||
+      (flags & (TCP_SYN | TCP_RST))) {
+    return false;
+  }
+  uint8_t addr[12];
+  memcpy(addr, pkt + 12, 8);
+  memcpy(addr + 8, tcp, 4);
+  uint32_t ack = get32(tcp + 8);
+  bool pure = total == ihl + doff && (flags & ~(TCP_ACK | TCP_PSH)) == 0;
+
+  ackthin_flow_t *f = NULL;
+  for (int i = 0; i < t->count; i++) {
+    if (memcmp(t->flow[i].addr, addr, sizeof(addr)) == 0) {
+      f = &t->flow[i];
+      break;
+    }
+  }
+  if (f != NULL) {
+    // 相同确认号的重复 ACK 要留着，default 配置下快速重传靠它们
+    if (pure && (int32_t)(f->ack - ack) > 0) {
+      return true;
+    }
+    if ((int32_t)(ack - f->ack) > 0) {
+      f->ack = ack;
+    }
+  } else if (t->count < ACKTHIN_FLOWS) {
+    f = &t->flow[t->count++];
+    memcpy(f->addr, addr, sizeof(addr));
+    f->ack = ack;
+  }
+  return false;
+}
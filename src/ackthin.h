@@ -0,0 +1,31 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#ifndef TERMTUNNEL_ACKTHIN_H
+#define TERMTUNNEL_ACKTHIN_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// 出队的一批 IPv4 包里，同一条流排在后面、确认号更大的 ACK 可以代替前面的纯 ACK。
+// TCP 不会缩小窗口的右边沿，后面的 ACK 也带着不旧于前面的窗口信息
+#define ACKTHIN_FLOWS 32
+
+typedef struct {
+  uint8_t addr[12];  // saddr daddr sport dport
+  uint32_t ack;
+} ackthin_flow_t;
+
+typedef struct {
+  ackthin_flow_t flow[ACKTHIN_FLOWS];
+  int count;
+} ackthin_t;
+
+void ackthin_reset(ackthin_t *t);
+// 从这一批的最后一个包往前依次调用，返回 true 表示这个包可以不发
+bool ackthin_superseded(ackthin_t *t, const uint8_t *pkt, size_t len);
+#endif
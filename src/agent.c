@@ -16,8 +16,12 @@
 #include <unistd.h>
 
 #include "config.h"
+#include "link.h"
 #include "log.h"
 #include "pipe.h"
+#include "relay.h"
+#include "route.h"
+#include "slab.h"
 #include "state.h"
 #include "thirdparty/base64.h"
 #include "thirdparty/ya_getopt/ya_getopt.h"
@@ -31,9 +35,6 @@ uv_tty_t agent_stdin_tty;
 static int64_t pending_send = 0;  //记录待转发的字节，用于tty 流控
 int max_suggested_size = 10240;
 
-int32_t g_oneshot_argc;
-char** g_oneshot_argv;
-
 
 void agent_read_stdin(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
 
@@ -42,8 +43,8 @@ static void alloc_buffer(uv_handle_t *handle, size_t suggested_size,
   if (suggested_size > max_suggested_size) {
     suggested_size = max_suggested_size;
   }
-  buf->base = (char *)malloc(suggested_size);
-  buf->len = suggested_size;
+  buf->base = (char *)slab_alloc(suggested_size);
+  buf->len = buf->base != NULL ? suggested_size : 0;
 }
 
 static void write_cb_with_free(uv_write_t *req, int status) {
@@ -53,8 +54,8 @@ static void write_cb_with_free(uv_write_t *req, int status) {
                   agent_read_stdin);
   }
   free(((uv_buf_t *)(req->data))->base);
-  free(req->data);
-  free(req);
+  slab_free(req->data);
+  slab_free(req);
 }
 
 static void write_cb_without_free(uv_write_t *req, int status) {
@@ -63,12 +64,15 @@ static void write_cb_without_free(uv_write_t *req, int status) {
     uv_read_start((uv_stream_t *)&agent_stdin_tty, alloc_buffer,
                   agent_read_stdin);
   }
-  free(req->data);
-  free(req);
+  slab_free(req->data);
+  slab_free(req);
 }
 
 int agent_process_frame(char *data, int data_size);
 
+// termtunnel -r，只转发下级 agent 的帧，不启动 vnet
+static bool relay_only = false;
+
 void agent_timer_callback() {
 #ifdef FLUASH_QUEUE_ON_TIMER
   // 如果队列没有清空，那么就提醒一下。因为async_send是一个不可靠的提醒，另外，提醒后，因为没有逻辑锁，会出现：
@@ -80,6 +84,10 @@ void agent_timer_callback() {
     push_data();
   }
 #endif
+#if VNET_LINK_RELIABLE
+  route_tick();
+#endif
+  relay_tick();
   return;
 }
 
@@ -143,6 +151,7 @@ int process_stdin(char *data, int data_size) {
 void agent_read_stdin(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
   if (nread == 0) {
     log_error("agent read_zero");
+    slab_free(buf->base);
     return;
   }
   if (nread < 0) {
@@ -150,6 +159,7 @@ void agent_read_stdin(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
       log_error("has some xxx");
     }
     log_error("agent read_stop");
+    slab_free(buf->base);
     uv_read_stop(stream);
     return;
   } else {
@@ -164,9 +174,7 @@ void agent_read_stdin(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
       data = (char *)malloc(data_cap);
       if (data == NULL) {
         log_error("malloc stdin buffer failed");
-        if (buf->base) {
-          free(buf->base);
-        }
+        slab_free(buf->base);
         return;
       }
     }
@@ -179,9 +187,7 @@ void agent_read_stdin(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
         if (new_cap > SIZE_MAX / 2) {
           log_error("stdin buffer overflow risk");
           uv_read_stop(stream);
-          if (buf->base) {
-            free(buf->base);
-          }
+          slab_free(buf->base);
           return;
         }
         new_cap *= 2;
@@ -190,9 +196,7 @@ void agent_read_stdin(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
       if (new_data == NULL) {
         log_error("realloc stdin buffer failed");
         uv_read_stop(stream);
-        if (buf->base) {
-          free(buf->base);
-        }
+        slab_free(buf->base);
         return;
       }
       data = new_data;
@@ -202,6 +206,7 @@ void agent_read_stdin(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
     data_size += nread;
 
     int used_data_size = process_stdin(data, data_size);
+    relay_flush();
     int unused_data_size = data_size - used_data_size;
     if (unused_data_size > 0) {
       CHECK((size_t)unused_data_size <= data_cap, "unused_data_size overflow");
@@ -210,9 +215,7 @@ void agent_read_stdin(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
     data_size = unused_data_size;
   }
 
-  if (buf->base) {
-    free(buf->base);
-  }
+  slab_free(buf->base);
 }
 
 int write_binary_to_server(const char *buf, size_t size) {
@@ -265,6 +268,36 @@ int agent_process_frame(char *str_data, int data_size) {
     return 0;
   }
 
+  link_t *link = &route_get(0)->link;
+  // 下级 agent 的帧，见 relay.h
+  if (str_data[0] == '@') {
+    relay_input(str_data, data_size);
+    return 0;
+  }
+  if (data_size > 1 && str_data[0] == 'S') {
+    relay_spawn(str_data, data_size);
+    return 0;
+  }
+  if (relay_only) {
+    log_debug("relay drop frame [%.*s]", data_size, str_data);
+    return 0;
+  }
+  // 经由别的 agent 转发时，server 分配的编号
+  if (data_size > 1 && str_data[0] == 'I') {
+    vnet_set_agent_id(atoi(str_data + 1));
+    return 0;
+  }
+#if VNET_LINK_RELIABLE
+  // server 回复的双方都支持的能力
+  if (data_size > 1 && str_data[0] == 'C') {
+    uint32_t caps = link_parse_caps(str_data + 1, data_size - 1);
+    bool crc32c = caps & LINK_CAP_CRC32C;
+    link_use_crc32c(link, crc32c);
+    vnet_set_checksum(0, !crc32c);
+    return 0;
+  }
+#endif
+
   // base64 type
   if (data_size > 1 && str_data[0] == 'B') {
     size_t result_len = 0;
@@ -272,8 +305,10 @@ int agent_process_frame(char *str_data, int data_size) {
         base64_decode((const unsigned char *)(str_data + 1), data_size - 1,
                       &result_len);
     if (result_len == 0) {
-      // TODO!
       log_error("found a error base64 [%*s]\n", data_size - 1, str_data + 1);
+#if VNET_LINK_RELIABLE
+      link_input_corrupt(link);
+#endif
       return 0;
     }
     agent_handle_binary((char *)result, result_len);
@@ -281,6 +316,9 @@ int agent_process_frame(char *str_data, int data_size) {
     return 0;
   } else {
     log_error("error packet [%*s](%d)\n", data_size, str_data, data_size);
+#if VNET_LINK_RELIABLE
+    link_input_corrupt(link);
+#endif
     return 0;
   }
 
@@ -290,18 +328,22 @@ int agent_process_frame(char *str_data, int data_size) {
 int agent_handle_binary(char *buf, int size) {
   // simple echo
   // block_write_binary_to_server(buf, size);
-  vnet_data_income(buf, size);
+#if VNET_LINK_RELIABLE
+  link_input(&route_get(0)->link, buf, size);
+#else
+  vnet_data_income(0, buf, size);
+#endif
   // block_write_binary_to_server(buf, size);
   return 0;
 }
 
 void agent_write_data_to_server(char *buf, size_t s, bool autofree) {
   pending_send++;
-  uv_write_t *req1 = malloc(sizeof(uv_write_t));
-  uv_buf_t *b = malloc(sizeof(uv_buf_t));
+  uv_write_t *req1 = slab_alloc(sizeof(uv_write_t));
+  uv_buf_t *b = slab_alloc(sizeof(uv_buf_t));
   if (req1 == NULL || b == NULL) {
-    free(req1);
-    free(b);
+    slab_free(req1);
+    slab_free(b);
     if (autofree) {
       free(buf);
     }
@@ -318,16 +360,16 @@ void agent_write_data_to_server(char *buf, size_t s, bool autofree) {
     if (ret != 0) {
       pending_send--;
       free(((uv_buf_t *)(req1->data))->base);
-      free(req1->data);
-      free(req1);
+      slab_free(req1->data);
+      slab_free(req1);
     }
   } else {
     int ret = uv_write(req1, (uv_stream_t *)&agent_stdout_tty, b, 1,
                        write_cb_without_free);
     if (ret != 0) {
       pending_send--;
-      free(req1->data);
-      free(req1);
+      slab_free(req1->data);
+      slab_free(req1);
     }
   }
 }
@@ -337,33 +379,83 @@ static void sigint_handler(int sig) {
   return;
 }
 
-void agent(int argc, char** argv) {
-  bool opt_is_repl = false;
-  if (argc != 0) {
-    // printf("argv %s\n", argv[0]);
-    g_oneshot_argc = argc;
-    g_oneshot_argv = argv;
-  } else {
-    opt_is_repl = true;
+static void write_green_frame(const char *data, int data_size) {
+  int len_result;
+  char *result = green_encode(data, data_size, &len_result);
+  writen(STDOUT_FILENO, result, len_result);
+  free(result);
+}
+
+// oneshot 的参数紧跟在握手后面发出：int32_t argc 和以 0 结尾的字符串，
+// base64 后切成若干 "A...!" 帧，最后一个空的 "A!" 表示结束。
+// server 收齐后直接交给 cli，不用等 vnet 起来再连 agentcall 去取
+static void write_oneshot_args(int argc, char **argv) {
+  size_t size = sizeof(int32_t);
+  for (int i = 0; i < argc; i++) {
+    size += strlen(argv[i]) + 1;
   }
+  char *blob = (char *)malloc(size);
+  if (blob == NULL) {
+    log_error("malloc oneshot args failed");
+    exit(EXIT_FAILURE);
+  }
+  int32_t argc32 = argc;
+  memcpy(blob, &argc32, sizeof(argc32));
+  char *wptr = blob + sizeof(argc32);
+  for (int i = 0; i < argc; i++) {
+    size_t len = strlen(argv[i]) + 1;
+    memcpy(wptr, argv[i], len);
+    wptr += len;
+  }
+  size_t elen = 0;
+  unsigned char *ebuf = base64_encode((unsigned char *)blob, size, &elen);
+  free(blob);
+  if (ebuf == NULL) {
+    log_error("base64_encode failed");
+    exit(EXIT_FAILURE);
+  }
+  char frame[ONESHOT_ARGS_FRAME_SIZE + 2];
+  frame[0] = 'A';
+  for (size_t off = 0; off < elen; off += ONESHOT_ARGS_FRAME_SIZE) {
+    size_t n = elen - off < ONESHOT_ARGS_FRAME_SIZE ? elen - off
+                                                   : ONESHOT_ARGS_FRAME_SIZE;
+    memcpy(frame + 1, ebuf + off, n);
+    frame[n + 1] = '!';
+    write_green_frame(frame, n + 2);
+  }
+  free(ebuf);
+  write_green_frame("A!", 2);
+}
+
+void agent(int argc, char** argv) {
+  bool opt_is_repl = argc == 0;
 
   set_agent_process();
   setvbuf(stdin, NULL, _IONBF, 0);
   agent_set_stdin_noecho();
   atexit(agent_restore_stdin);
   signal(SIGINT, sigint_handler);
-  int len_result;
   char *str_trigger;
   // 判断是否使用 oneshot 模式
-  if (opt_is_repl) {
+  if (relay_only) {
+    str_trigger = "RELAY!";
+  } else if (opt_is_repl) {
     str_trigger = "MAGIC!";
   } else {
     str_trigger = "ONESHOT!";
   }
-  char *result = green_encode(str_trigger, strlen(str_trigger), &len_result);
   usleep(2000);  // 防止粘连，优化显示的目的。 
-  writen(STDOUT_FILENO, result, len_result);
-  free(result);
+  write_green_frame(str_trigger, strlen(str_trigger));
+  if (!opt_is_repl) {
+    write_oneshot_args(argc, argv);
+  }
+#if VNET_LINK_RELIABLE
+  if (!relay_only) {
+    char caps[16];
+    int caps_len = snprintf(caps, sizeof(caps), "C%u!", link_caps());
+    write_green_frame(caps, caps_len);
+  }
+#endif
 
   static uv_timer_t timer_watcher;
   uv_loop_t *loop = uv_default_loop();
@@ -395,9 +487,16 @@ void agent(int argc, char** argv) {
     exit(EXIT_FAILURE);
   }
 
-  libuv_add_vnet_notify();
-  vnet_init(vnet_notify_to_libuv);
+  if (!relay_only) {
+    libuv_add_vnet_notify();
+    vnet_init(vnet_notify_to_libuv);
+  }
   uv_run(uv_default_loop(), UV_RUN_DEFAULT);
   log_info("agent evloop exit");
   exit(EXIT_SUCCESS);
 }
+
+void agent_relay() {
+  relay_only = true;
+  agent(0, NULL);
+}
@@ -11,9 +11,12 @@
 void agent_restore_stdin();
 void agent_set_stdin_noecho();
 
-extern int g_oneshot_argc;
-extern char** g_oneshot_argv;
 // extern void block_write_frame_to_server(char* data, int data_size);
 extern int write_binary_to_server(const char *buf, size_t size);
+// 加上 '!' 之后作为绿色帧写给 server
+extern void write_frame_to_server(char *data, int data_size);
 void agent(int argc, char** argv);
+// termtunnel -r：像 agent 一样握手，但只按 relay.h 转发下级 agent 的帧，
+// 不启动 vnet，下级的流量在这一跳不解码也不经过 TCP/IP
+void agent_relay();
 #endif
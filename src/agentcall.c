@@ -17,6 +17,7 @@
 #include "config.h"
 #include "intent.h"
 #include "agent.h"
+#include "connpool.h"
 #include "lwip/api.h"
 #include "lwip/def.h"
 #include "lwip/ip.h"
@@ -31,11 +32,11 @@
 #include "portforward.h"
 
 static uint16_t agentcall_service_port = 300;
-static const int32_t kMaxOneshotArgc = 1024;
 
 typedef struct thread_arg_pass_t {
   char *strbuf;
   int32_t method;
+  int agent;
 } thread_arg_pass_t;
 
 static void agentcall_server_request(void *p) {
@@ -68,18 +69,21 @@ static void agentcall_server_request(void *p) {
     }
     log_info("agent will bind %s:%hu, write to %s:%hu",
              local_host, local_port, remote_host, remote_port);
-    portforward_static_start(local_host, local_port, remote_host,
-                                 remote_port);
+    portforward_static_start(0, local_host, local_port, remote_host,
+                             remote_port);
 
   }
-  if (method == METHOD_GET_ARGS) {
-    lwip_writen(sd, &g_oneshot_argc, sizeof(g_oneshot_argc));
-    for (int i=0; i < g_oneshot_argc; i++) {
-      lwip_writen(sd, g_oneshot_argv[i], strlen(g_oneshot_argv[i])+1);
+  if (method == METHOD_CALL_WARM_POOL) {
+    char host[IPV4_AND_IPV6_MAX_LENGTH];
+    uint16_t port;
+    int size;
+    if (sscanf(recv_buf, "%63[^:]:%hu:%d", host, &port, &size) != 3) {
+      log_error("invalid METHOD_CALL_WARM_POOL payload: %s", recv_buf);
+      lwip_close(sd);
+      return;
     }
-    log_info("METHOD_GET_ARGS done");
+    connpool_warm(host, port, size);
   }
-
   lwip_close(sd);
   return;
 }
@@ -90,7 +94,7 @@ int agentcall_server_start() {
 }
 
 static void call_send_request(thread_arg_pass_t *tmp) {
-  int nfd = vnet_tcp_connect_with_retry(agentcall_service_port);
+  int nfd = vnet_tcp_connect_with_retry(tmp->agent, agentcall_service_port);
   if (nfd < 0) {
     log_debug("connect agentcall_service_port error");
     return;
@@ -103,51 +107,9 @@ static void call_send_request(thread_arg_pass_t *tmp) {
 }
 
 
-int bootstrap_get_args(void * _) {
-  // 确实 agentcall_service_port 会概率性失败..
-  int nfd = vnet_tcp_connect_with_retry(agentcall_service_port);
-  if (nfd < 0) {
-    log_debug("connect agentcall_service_port error");
-    return 0;
-  }
-  int32_t method = METHOD_GET_ARGS;
-  vnet_send(nfd, &method, sizeof(int32_t));
-  vnet_send(nfd, "", 1);
-  int32_t argc;
-  if (vnet_readn(nfd, &argc, sizeof(int32_t)) == 0) {
-    vnet_close(nfd);
-    return 0;
-  }
-  if (argc < 0 || argc > kMaxOneshotArgc) {
-    log_error("invalid argc from agent: %d", argc);
-    vnet_close(nfd);
-    return 0;
-  }
-  log_debug("count of arg %d", argc);
-  g_oneshot_argc = argc;
-  g_oneshot_argv = malloc(argc * sizeof(char *));
-  if (g_oneshot_argv == NULL && argc > 0) {
-    log_error("malloc g_oneshot_argv failed");
-    vnet_close(nfd);
-    return 0;
-  }
-  char recv_buf[READ_CHUNK_SIZE];
-  for (int i=0; i < argc; i++) {
-    if (vnet_readstring(nfd, recv_buf, READ_CHUNK_SIZE) == 0) {
-      lwip_close(nfd);
-      return 0;
-    }
-    g_oneshot_argv[i] = strdup(recv_buf);
-    log_debug("%s", recv_buf);
-  }
-  termtunnel_notify(_);
-  vnet_close(nfd);
-  return 0;
-}
-
-
-int server_call_agent(int32_t method, char *strbuf) {
+int server_call_agent(int agent, int32_t method, char *strbuf) {
   thread_arg_pass_t *tmp = malloc(sizeof(thread_arg_pass_t));
+  tmp->agent = agent;
   tmp->method = method;
   tmp->strbuf = strdup(strbuf);
   sys_thread_new("call_send", (lwip_thread_fn)call_send_request, tmp, DEFAULT_THREAD_STACKSIZE,
@@ -8,10 +8,7 @@
 #ifndef TERMTUNNEL_AGENTCALL_H
 #define TERMTUNNEL_AGENTCALL_H
 #define METHOD_CALL_FORWARD_STATIC 1
-#define METHOD_GET_ARGS 2
+#define METHOD_CALL_WARM_POOL 3
 int agentcall_server_start();
-int server_call_agent(int32_t method, char *strbuf);
-typedef void (*get_args_callback)(void *handle);
-
-int bootstrap_get_args(void*);
+int server_call_agent(int agent, int32_t method, char *strbuf);
 #endif
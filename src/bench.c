@@ -0,0 +1,113 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "bench.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "log.h"
+#include "lwip/sockets.h"
+#include "lwip/sys.h"
+#include "lwipopts.h"
+#include "progress.h"
+#include "state.h"
+#include "vnet.h"
+
+static int bench_service_port = 702;
+
+typedef struct {
+  int agent;
+  int64_t total;
+  int32_t conns;
+  char name[PROGRESS_NAME_SIZE];
+  progress_t *progress;
+} bench_t;
+
+// 协议：对端一直写到关闭写方向，读完后回 1 个字节再关闭，
+// 发送方收到这个字节才算数据都到了
+static int bench_sink_request(void *p) {
+  int sd = (int)(intptr_t)p;
+  vnet_setsocketdefaultopt(sd);
+  char buf[READ_CHUNK_SIZE];
+  int n;
+  while ((n = lwip_read(sd, buf, sizeof(buf))) > 0) {
+  }
+  if (n == 0) {
+    lwip_write(sd, "", 1);
+  }
+  lwip_close(sd);
+  return 0;
+}
+
+int bench_sink_start() {
+  return vnet_listen_at(bench_service_port, bench_sink_request,
+                        "bench_sink_worker");
+}
+
+static int bench_one(bench_t *b, int64_t size, const char *chunk) {
+  int sd = vnet_tcp_connect(b->agent, bench_service_port);
+  if (sd < 0) {
+    return -1;
+  }
+  while (size > 0) {
+    int n = size < READ_CHUNK_SIZE ? (int)size : READ_CHUNK_SIZE;
+    if (lwip_writen(sd, (void *)chunk, n) != n) {
+      lwip_close(sd);
+      return -1;
+    }
+    progress_add(b->progress, n);
+    size -= n;
+  }
+  char ack;
+  int ret = lwip_shutdown(sd, SHUT_WR) == 0 && vnet_readn(sd, &ack, 1) == 1
+                ? 0
+                : -1;
+  lwip_close(sd);
+  return ret;
+}
+
+static int bench_run(bench_t *b) {
+  char *chunk = calloc(1, READ_CHUNK_SIZE);
+  bool ok = chunk != NULL;
+  int64_t left = b->total;
+  for (int32_t i = 0; ok && i < b->conns; i++) {
+    int64_t size = left / (b->conns - i);
+    ok = bench_one(b, size, chunk) == 0;
+    left -= size;
+  }
+  if (!ok) {
+    log_error("bench failed");
+  }
+  free(chunk);
+  progress_end(b->progress, ok);
+  task_finished(b->name, ok);
+  free(b);
+  return 0;
+}
+
+int bench_start(int agent, int64_t total, int32_t conns) {
+  if (total < 0 || conns <= 0) {
+    return -1;
+  }
+  bench_t *b = (bench_t *)malloc(sizeof(bench_t));
+  if (b == NULL) {
+    log_error("malloc bench_t failed");
+    return -1;
+  }
+  b->agent = agent;
+  b->total = total;
+  b->conns = conns;
+  snprintf(b->name, sizeof(b->name), "bench x%d", conns);
+  b->progress = progress_begin(b->name, total);
+  task_started(b->name);
+  sys_thread_new("bench", (lwip_thread_fn)bench_run, (void *)b,
+                 DEFAULT_THREAD_STACKSIZE, DEFAULT_THREAD_PRIO);
+  return 0;
+}
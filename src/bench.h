@@ -0,0 +1,17 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#ifndef TERMTUNNEL_BENCH_H
+#define TERMTUNNEL_BENCH_H
+#include <stdint.h>
+
+// server 向 agent 灌数据测 vnet 的吞吐，不经过文件系统。
+// total 字节平均分给 conns 条依次建立的连接，连接越多越能看出握手和
+// 慢启动的开销
+int bench_start(int agent, int64_t total, int32_t conns);
+int bench_sink_start(void);
+#endif
@@ -0,0 +1,177 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "chksum.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// 每个 32 位的累加单元一轮最多加这么多块，保证不会溢出
+#define CHKSUM_BLOCKS_PER_ROUND 4096
+
+static uint16_t fold(uint64_t sum) {
+  sum = (sum & 0xffffffffu) + (sum >> 32);
+  sum = (sum & 0xffffffffu) + (sum >> 32);
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  return (uint16_t)sum;
+}
+
+// 反码和与按多宽的字累加无关，只要最后折叠回 16 位
+static inline __attribute__((always_inline)) uint64_t sum_tail(
+    unsigned char *dst, const unsigned char *p, size_t len, bool copy) {
+  uint64_t sum = 0;
+  for (; len >= 4; p += 4, len -= 4) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    if (copy) {
+      memcpy(dst, &v, sizeof(v));
+      dst += 4;
+    }
+    sum += v;
+  }
+  if (len >= 2) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    if (copy) {
+      memcpy(dst, &v, sizeof(v));
+      dst += 2;
+    }
+    sum += v;
+    p += 2;
+    len -= 2;
+  }
+  if (len) {
+    uint16_t v = 0;
+    memcpy(&v, p, 1);
+    if (copy) {
+      *dst = *p;
+    }
+    sum += v;
+  }
+  return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline __attribute__((always_inline, target("sse2"))) uint64_t
+sum_sse2(unsigned char *dst, const unsigned char *p, size_t blocks,
+         bool copy) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = zero;
+  while (blocks) {
+    size_t n = blocks < CHKSUM_BLOCKS_PER_ROUND ? blocks
+                                                : CHKSUM_BLOCKS_PER_ROUND;
+    blocks -= n;
+    __m128i a = zero;
+    for (; n; n--, p += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)p);
+      if (copy) {
+        _mm_storeu_si128((__m128i *)dst, v);
+        dst += 16;
+      }
+      a = _mm_add_epi32(a, _mm_unpacklo_epi16(v, zero));
+      a = _mm_add_epi32(a, _mm_unpackhi_epi16(v, zero));
+    }
+    acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(a, zero));
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(a, zero));
+  }
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i *)lanes, acc);
+  return lanes[0] + lanes[1];
+}
+
+static inline __attribute__((always_inline, target("avx2"))) uint64_t
+sum_avx2(unsigned char *dst, const unsigned char *p, size_t blocks,
+         bool copy) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i acc = zero;
+  while (blocks) {
+    size_t n = blocks < CHKSUM_BLOCKS_PER_ROUND ? blocks
+                                                : CHKSUM_BLOCKS_PER_ROUND;
+    blocks -= n;
+    __m256i a = zero;
+    for (; n; n--, p += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)p);
+      if (copy) {
+        _mm256_storeu_si256((__m256i *)dst, v);
+        dst += 32;
+      }
+      a = _mm256_add_epi32(a, _mm256_unpacklo_epi16(v, zero));
+      a = _mm256_add_epi32(a, _mm256_unpackhi_epi16(v, zero));
+    }
+    acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(a, zero));
+    acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(a, zero));
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes, acc);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("sse2"))) static uint16_t chksum_sse2(
+    unsigned char *dst, const unsigned char *p, size_t len, bool copy) {
+  size_t blocks = len / 16;
+  uint64_t sum = copy ? sum_sse2(dst, p, blocks, true)
+                      : sum_sse2(NULL, p, blocks, false);
+  size_t done = blocks * 16;
+  sum += copy ? sum_tail(dst + done, p + done, len - done, true)
+              : sum_tail(NULL, p + done, len - done, false);
+  return fold(sum);
+}
+
+__attribute__((target("avx2"))) static uint16_t chksum_avx2(
+    unsigned char *dst, const unsigned char *p, size_t len, bool copy) {
+  size_t blocks = len / 32;
+  uint64_t sum = copy ? sum_avx2(dst, p, blocks, true)
+                      : sum_avx2(NULL, p, blocks, false);
+  size_t done = blocks * 32;
+  sum += copy ? sum_tail(dst + done, p + done, len - done, true)
+              : sum_tail(NULL, p + done, len - done, false);
+  return fold(sum);
+}
+
+// 0: 只用标量，1: SSE2，2: AVX2
+static int simd_level() {
+  static int level = -1;
+  if (level < 0) {
+    __builtin_cpu_init();
+    level = __builtin_cpu_supports("avx2")   ? 2
+            : __builtin_cpu_supports("sse2") ? 1
+                                             : 0;
+  }
+  return level;
+}
+#endif
+
+static uint16_t chksum(unsigned char *dst, const unsigned char *p, size_t len,
+                       bool copy) {
+#if defined(__x86_64__) || defined(__i386__)
+  // 太短的包用不上向量
+  if (len >= 64) {
+    switch (simd_level()) {
+      case 2:
+        return chksum_avx2(dst, p, len, copy);
+      case 1:
+        return chksum_sse2(dst, p, len, copy);
+    }
+  }
+#endif
+  return fold(copy ? sum_tail(dst, p, len, true)
+                   : sum_tail(NULL, p, len, false));
+}
+
+uint16_t chksum_inet(const void *data, int len) {
+  return chksum(NULL, (const unsigned char *)data, len, false);
+}
+
+uint16_t chksum_inet_copy(void *dst, const void *src, uint16_t len) {
+  return chksum((unsigned char *)dst, (const unsigned char *)src, len, true);
+}
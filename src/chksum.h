@@ -0,0 +1,18 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#ifndef TERMTUNNEL_CHKSUM_H
+#define TERMTUNNEL_CHKSUM_H
+#include <stdint.h>
+
+// lwIP 的 LWIP_CHKSUM 和 LWIP_CHKSUM_COPY。按内存中的字节序逐 16 位做反码
+// 累加，末尾单独的一个字节当作后面补 0，和 lwip_standard_chksum 的结果一致。
+// x86 上运行时选 AVX2 或 SSE2，其他平台按 32 位累加
+uint16_t chksum_inet(const void *data, int len);
+// 拷贝的同时算校验和，数据只过一遍
+uint16_t chksum_inet_copy(void *dst, const void *src, uint16_t len);
+#endif
@@ -10,6 +10,37 @@
 
 #define READ_CHUNK_SIZE 4096
 #define VIR_MTU 800
+// 1: vnet 是点对点链路，帧里直接是 IPv4 包；0: 以太网帧 + ARP。两端要一致
+#define VNET_RAW_IP 1
+// 1: 压缩点对点链路上的 TCP/IP 头，只在 VNET_RAW_IP 下生效。两端要一致
+#define VNET_HEADER_COMPRESSION 1
+// 1: 出队时丢掉被同一条流更新的 ACK 取代的纯 ACK，只在 VNET_RAW_IP 下生效
+#define VNET_ACK_THINNING 1
+// 1: 帧带序号和 crc，缺帧时立即 NACK 重发（见 link.h）。两端要一致
+#define VNET_LINK_RELIABLE 1
+// 1: 握手时协商，两端都支持就用 crc32c 校验链路帧，
+// 并关掉 lwIP 的 IP/TCP 校验和。需要 VNET_LINK_RELIABLE
+#define VNET_LINK_CRC32C 1
+// 1: vnet 上的 TCP 默认用无损链路的参数（见 lwipopts.h），
+// 环境变量 TERMTUNNEL_TCP_PROFILE=default|lossless 可以覆盖
+#define VNET_TCP_PROFILE_LOSSLESS 1
+#define VNET_TCP_PROFILE_ENV "TERMTUNNEL_TCP_PROFILE"
+// 单条 vnet TCP 连接发送缓冲的上限，和所有连接超出 TCP_SND_BUF 部分的总预算
+#define VNET_SND_BUF_MAX (16 * 1024 * 1024)
+#define VNET_SND_BUF_BUDGET (32 * 1024 * 1024)
+// vnet 上同时打开的 lwIP socket 上限，socket 表按需增长到这么大
+#define VNET_MAX_SOCKETS 65536
+// lwIP 堆的总预算，见 lwipmem.h
+#define VNET_MEM_BUDGET_MB 1024
+#define VNET_MEM_BUDGET_ENV "TERMTUNNEL_VNET_MEM_MB"
+// 一个 server 最多带多少个 agent，含直接在终端里的 0 号。
+// agent k 和 server 之间的网段是 192.168.(k+1).0/24
+#define VNET_MAX_AGENTS 32
+// 经由多少级 agent 转发
+#define VNET_MAX_AGENT_DEPTH 8
+// server 一帧最多取 5 * VIR_MTU，oneshot 参数按这个大小分帧
+#define ONESHOT_ARGS_FRAME_SIZE (2 * VIR_MTU)
+#define ONESHOT_ARGS_MAX_SIZE (1024 * 1024)
 #define TIMEOUT_MS 1000
 #define REPEAT_MS 100
 #define TTY_WATERMARK 100
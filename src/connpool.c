@@ -0,0 +1,316 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+// agent 侧到目标服务的空闲连接池，以 host:port 为 key。
+// 复用已建立的上游连接，省去 DNS 解析和 connect 的开销。
+#define _GNU_SOURCE
+#include "connpool.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "utils.h"
+
+typedef struct pool_entry {
+  char key[300];
+  int fd;
+  time_t since;
+  struct pool_entry *next;
+} pool_entry_t;
+
+static pool_entry_t *idle_head = NULL;
+static int idle_count = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void make_key(char *key, size_t size, char *host, uint16_t port) {
+  snprintf(key, size, "%s:%hu", host, port);
+}
+
+// 对端关闭或者有意料之外的数据，都认为连接不可用。
+bool connpool_fd_alive(int fd) {
+  char c;
+  ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return true;
+  }
+  return false;
+}
+
+int connpool_connect(char *host, uint16_t port) {
+  char *ip = safe_gethostbyname(host, port);
+  if (ip == NULL) {
+    log_info("connpool resolve %s failed", host);
+    return -1;
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+#ifdef __APPLE__
+  addr.sin_len = sizeof(addr);
+#endif
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = inet_addr(ip);
+  free(ip);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    log_info("connpool connect %s:%hu error %s", host, port, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// 调用方需要持有 pool_lock
+static void evict_expired(time_t now) {
+  pool_entry_t **pp = &idle_head;
+  while (*pp != NULL) {
+    pool_entry_t *e = *pp;
+    if (now - e->since > CONNPOOL_IDLE_TIMEOUT_S) {
+      *pp = e->next;
+      close(e->fd);
+      free(e);
+      idle_count--;
+    } else {
+      pp = &e->next;
+    }
+  }
+}
+
+int connpool_acquire(char *host, uint16_t port, bool *reused) {
+  char key[300];
+  make_key(key, sizeof(key), host, port);
+  *reused = false;
+  pthread_mutex_lock(&pool_lock);
+  evict_expired(time(NULL));
+  pool_entry_t **pp = &idle_head;
+  while (*pp != NULL) {
+    pool_entry_t *e = *pp;
+    if (strcmp(e->key, key) != 0) {
+      pp = &e->next;
+      continue;
+    }
+    *pp = e->next;
+    idle_count--;
+    int fd = e->fd;
+    free(e);
+    if (connpool_fd_alive(fd)) {
+      pthread_mutex_unlock(&pool_lock);
+      log_debug("connpool reuse %s fd %d", key, fd);
+      *reused = true;
+      return fd;
+    }
+    close(fd);
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return connpool_connect(host, port);
+}
+
+void connpool_release(char *host, uint16_t port, int fd, bool reusable) {
+  if (fd < 0) {
+    return;
+  }
+  if (!reusable) {
+    close(fd);
+    return;
+  }
+  pool_entry_t *e = (pool_entry_t *)malloc(sizeof(pool_entry_t));
+  if (e == NULL) {
+    close(fd);
+    return;
+  }
+  make_key(e->key, sizeof(e->key), host, port);
+  e->fd = fd;
+  e->since = time(NULL);
+
+  pthread_mutex_lock(&pool_lock);
+  evict_expired(e->since);
+  int same_key = 0;
+  for (pool_entry_t *it = idle_head; it != NULL; it = it->next) {
+    if (strcmp(it->key, e->key) == 0) {
+      same_key++;
+    }
+  }
+  if (same_key >= CONNPOOL_MAX_IDLE_PER_KEY || idle_count >= CONNPOOL_MAX_IDLE) {
+    pthread_mutex_unlock(&pool_lock);
+    close(fd);
+    free(e);
+    return;
+  }
+  e->next = idle_head;
+  idle_head = e;
+  idle_count++;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+// 静态转发的预连接：每个目标一个后台线程，保持 size 个已连接的空闲 socket，
+// vnet 连接进来时直接取用，省掉内网 connect 的延迟。
+typedef struct warm_target {
+  char key[300];
+  char host[256];
+  uint16_t port;
+  int size;
+  int fds[CONNPOOL_MAX_WARM];
+  int count;
+  pthread_cond_t cond;
+  struct warm_target *next;
+} warm_target_t;
+
+static warm_target_t *warm_head = NULL;
+static pthread_mutex_t warm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// mysql 之类服务端先发数据的协议，连上后就有可读数据，
+// 所以这里只把对端关闭和出错当作失效。
+static bool warm_fd_alive(int fd) {
+  char c;
+  ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  if (n > 0) {
+    return true;
+  }
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// 调用方需要持有 warm_lock
+static warm_target_t *warm_find(char *key) {
+  for (warm_target_t *t = warm_head; t != NULL; t = t->next) {
+    if (strcmp(t->key, key) == 0) {
+      return t;
+    }
+  }
+  return NULL;
+}
+
+// 调用方需要持有 warm_lock
+static void warm_sweep(warm_target_t *t) {
+  int kept = 0;
+  for (int i = 0; i < t->count; i++) {
+    if (kept < t->size && warm_fd_alive(t->fds[i])) {
+      t->fds[kept++] = t->fds[i];
+    } else {
+      close(t->fds[i]);
+    }
+  }
+  t->count = kept;
+}
+
+static void *warm_refill_thread(void *arg) {
+  warm_target_t *t = (warm_target_t *)arg;
+  int backoff = 1;
+  pthread_mutex_lock(&warm_lock);
+  while (true) {
+    warm_sweep(t);
+    if (t->count >= t->size) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += CONNPOOL_WARM_CHECK_MS / 1000;
+      deadline.tv_nsec += (CONNPOOL_WARM_CHECK_MS % 1000) * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&t->cond, &warm_lock, &deadline);
+      continue;
+    }
+    pthread_mutex_unlock(&warm_lock);
+    int fd = connpool_connect(t->host, t->port);
+    if (fd < 0) {
+      sleep(backoff);
+      backoff = backoff * 2 > CONNPOOL_WARM_MAX_BACKOFF_S
+                    ? CONNPOOL_WARM_MAX_BACKOFF_S
+                    : backoff * 2;
+      pthread_mutex_lock(&warm_lock);
+      continue;
+    }
+    backoff = 1;
+    int flag = 1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &flag, sizeof(flag));
+    pthread_mutex_lock(&warm_lock);
+    if (t->count < t->size) {
+      t->fds[t->count++] = fd;
+    } else {
+      close(fd);
+    }
+  }
+  return NULL;
+}
+
+// 设置目标的预连接数，size 为 0 时关闭已有的预连接
+int connpool_warm(char *host, uint16_t port, int size) {
+  if (size < 0) {
+    size = 0;
+  }
+  if (size > CONNPOOL_MAX_WARM) {
+    size = CONNPOOL_MAX_WARM;
+  }
+  char key[300];
+  make_key(key, sizeof(key), host, port);
+  pthread_mutex_lock(&warm_lock);
+  warm_target_t *t = warm_find(key);
+  if (t != NULL) {
+    t->size = size;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&warm_lock);
+    log_info("warm pool %s resize to %d", key, size);
+    return 0;
+  }
+  t = (warm_target_t *)calloc(1, sizeof(warm_target_t));
+  if (t == NULL) {
+    pthread_mutex_unlock(&warm_lock);
+    return -1;
+  }
+  snprintf(t->key, sizeof(t->key), "%s", key);
+  snprintf(t->host, sizeof(t->host), "%s", host);
+  t->port = port;
+  t->size = size;
+  pthread_cond_init(&t->cond, NULL);
+  pthread_t worker;
+  if (pthread_create(&worker, NULL, warm_refill_thread, t) != 0) {
+    pthread_cond_destroy(&t->cond);
+    free(t);
+    pthread_mutex_unlock(&warm_lock);
+    return -1;
+  }
+  pthread_detach(worker);
+  t->next = warm_head;
+  warm_head = t;
+  pthread_mutex_unlock(&warm_lock);
+  log_info("warm pool %s size %d", key, size);
+  return 0;
+}
+
+// 取最早建立的预连接，没有可用的返回 -1，由调用方自己 connect
+int connpool_take_warm(char *host, uint16_t port) {
+  char key[300];
+  make_key(key, sizeof(key), host, port);
+  int fd = -1;
+  pthread_mutex_lock(&warm_lock);
+  warm_target_t *t = warm_find(key);
+  while (t != NULL && t->count > 0 && fd < 0) {
+    fd = t->fds[0];
+    t->count--;
+    memmove(t->fds, t->fds + 1, t->count * sizeof(int));
+    if (!warm_fd_alive(fd)) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  if (t != NULL) {
+    pthread_cond_signal(&t->cond);
+  }
+  pthread_mutex_unlock(&warm_lock);
+  return fd;
+}
@@ -0,0 +1,27 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#ifndef TERMTUNNEL_CONNPOOL_H
+#define TERMTUNNEL_CONNPOOL_H
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CONNPOOL_MAX_IDLE_PER_KEY 8
+#define CONNPOOL_MAX_IDLE 64
+#define CONNPOOL_IDLE_TIMEOUT_S 30
+// 静态转发的预连接池
+#define CONNPOOL_MAX_WARM 64
+#define CONNPOOL_WARM_CHECK_MS 1000
+#define CONNPOOL_WARM_MAX_BACKOFF_S 30
+
+int connpool_connect(char *host, uint16_t port);
+int connpool_acquire(char *host, uint16_t port, bool *reused);
+void connpool_release(char *host, uint16_t port, int fd, bool reusable);
+bool connpool_fd_alive(int fd);
+int connpool_warm(char *host, uint16_t port, int size);
+int connpool_take_warm(char *host, uint16_t port);
+#endif
@@ -0,0 +1,472 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+// agent 侧按内容寻址的上传缓存。
+// 条目以探测摘要（大小和首尾各 CONTENTSTORE_PROBE_SIZE 字节的 sha256）命名，
+// 发送端只读首尾就能查询，有同名条目时才读整个文件算 sha256 确认。
+// 上传完成时只记一条记录，不复制数据：文件系统支持 reflink 时
+// 克隆一份到 <名字>.data，否则直接指向上传好的文件。
+// 记录里有来源文件的大小、mtime 和 inode，命中时对不上就说明被改过，丢掉；
+// 完整的 sha256 第一次被查到时才算，之后存在记录里不再重算。
+#define _GNU_SOURCE
+#include "contentstore.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#ifdef __linux__
+#include <linux/fs.h>  // FICLONE
+#endif
+
+#define STORE_IO_SIZE (1024 * 1024)
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+static char *store_dir = NULL;
+static int64_t store_max_bytes = 0;
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t store_once = PTHREAD_ONCE_INIT;
+
+static int mkdir_p(const char *dir) {
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s", dir) >= (int)sizeof(path)) {
+    return -1;
+  }
+  for (char *p = path + 1; *p != '\0'; p++) {
+    if (*p == '/') {
+      *p = '\0';
+      if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+        return -1;
+      }
+      *p = '/';
+    }
+  }
+  return mkdir(path, 0700) != 0 && errno != EEXIST ? -1 : 0;
+}
+
+static void store_init() {
+  char dir[PATH_MAX];
+  const char *env = getenv(CONTENTSTORE_DIR_ENV);
+  if (env != NULL && strcmp(env, "off") == 0) {
+    return;
+  }
+  if (env != NULL && *env != '\0') {
+    snprintf(dir, sizeof(dir), "%s", env);
+  } else {
+    const char *home = getenv("HOME");
+    if (home == NULL || *home == '\0' ||
+        snprintf(dir, sizeof(dir), "%s/%s", home, CONTENTSTORE_DEFAULT_DIR) >=
+            (int)sizeof(dir)) {
+      return;
+    }
+  }
+  if (mkdir_p(dir) != 0) {
+    log_error("content store mkdir %s error %s", dir, strerror(errno));
+    return;
+  }
+  long long size_mb = CONTENTSTORE_DEFAULT_SIZE_MB;
+  const char *size = getenv(CONTENTSTORE_SIZE_ENV);
+  if (size != NULL && atoll(size) > 0) {
+    size_mb = atoll(size);
+  }
+  store_max_bytes = (int64_t)size_mb * 1024 * 1024;
+  store_dir = strdup(dir);
+}
+
+bool contentstore_enabled() {
+  pthread_once(&store_once, store_init);
+  return store_dir != NULL;
+}
+
+static void entry_path(char *out, size_t size,
+                       const unsigned char probe[HASH_SHA256_SIZE],
+                       const char *suffix) {
+  char hex[HASH_SHA256_SIZE * 2 + 1];
+  for (int i = 0; i < HASH_SHA256_SIZE; i++) {
+    snprintf(hex + i * 2, 3, "%02x", probe[i]);
+  }
+  snprintf(out, size, "%s/%s%s", store_dir, hex, suffix);
+}
+
+static int digest_range(int fd, int64_t off, int64_t len, char *buf,
+                        hash_sha256_t *ctx) {
+  while (len != 0) {
+    ssize_t n = pread(fd, buf, len > 0 && len < STORE_IO_SIZE ? len
+                                                              : STORE_IO_SIZE,
+                      off);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      return len > 0 ? -1 : 0;
+    }
+    hash_sha256_update(ctx, buf, n);
+    off += n;
+    len -= len > 0 ? n : 0;
+  }
+  return 0;
+}
+
+int contentstore_digest_fd(int fd, unsigned char digest[HASH_SHA256_SIZE]) {
+  char *buf = (char *)malloc(STORE_IO_SIZE);
+  if (buf == NULL) {
+    return -1;
+  }
+  hash_sha256_t ctx;
+  hash_sha256_init(&ctx);
+  int ret = digest_range(fd, 0, -1, buf, &ctx);
+  hash_sha256_final(&ctx, digest);
+  free(buf);
+  return ret;
+}
+
+int contentstore_probe_fd(int fd, int64_t size,
+                          unsigned char probe[HASH_SHA256_SIZE]) {
+  char *buf = (char *)malloc(STORE_IO_SIZE);
+  if (buf == NULL) {
+    return -1;
+  }
+  unsigned char be[8];
+  for (int i = 0; i < 8; i++) {
+    be[i] = (unsigned char)((uint64_t)size >> (56 - i * 8));
+  }
+  hash_sha256_t ctx;
+  hash_sha256_init(&ctx);
+  hash_sha256_update(&ctx, be, sizeof(be));
+  int64_t head = size < CONTENTSTORE_PROBE_SIZE ? size : CONTENTSTORE_PROBE_SIZE;
+  int64_t tail = size - head < CONTENTSTORE_PROBE_SIZE
+                     ? size - head
+                     : CONTENTSTORE_PROBE_SIZE;
+  int ret = digest_range(fd, 0, head, buf, &ctx) == 0 &&
+                    digest_range(fd, size - tail, tail, buf, &ctx) == 0
+                ? 0
+                : -1;
+  hash_sha256_final(&ctx, probe);
+  free(buf);
+  return ret;
+}
+
+// clone_only 时只做 reflink，不支持就失败，不退回到逐字节复制
+static int copy_file(const char *src, const char *dst, bool clone_only) {
+  int in = open(src, O_RDONLY);
+  if (in < 0) {
+    return -1;
+  }
+  struct stat st;
+  int out = fstat(in, &st) == 0
+                ? open(dst, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777)
+                : -1;
+#ifdef FICLONE
+  // 同一个文件系统上先试 reflink，共享数据块但是写时复制
+  if (out >= 0 && ioctl(out, FICLONE, in) == 0) {
+    close(in);
+    if (close(out) != 0) {
+      unlink(dst);
+      return -1;
+    }
+    return 0;
+  }
+#endif
+  char *buf = clone_only ? NULL : (char *)malloc(STORE_IO_SIZE);
+  int ret = out >= 0 && buf != NULL ? 0 : -1;
+  while (ret == 0) {
+    ssize_t n = read(in, buf, STORE_IO_SIZE);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      ret = n < 0 ? -1 : 0;
+      break;
+    }
+    for (ssize_t done = 0; done < n;) {
+      ssize_t w = write(out, buf + done, n - done);
+      if (w < 0 && errno == EINTR) {
+        continue;
+      }
+      if (w <= 0) {
+        ret = -1;
+        break;
+      }
+      done += w;
+    }
+  }
+  free(buf);
+  close(in);
+  if (out >= 0 && close(out) != 0) {
+    ret = -1;
+  }
+  if (ret != 0 && out >= 0) {
+    unlink(dst);
+  }
+  return ret;
+}
+
+// 先放到临时名字再 rename，目标位置不会出现写了一半的文件。
+// 目标已经存在时沿用它的权限
+static int copy_to(const char *src, const char *dst, bool clone_only) {
+  char tmp[PATH_MAX];
+  if (snprintf(tmp, sizeof(tmp), "%s.ttstore", dst) >= (int)sizeof(tmp)) {
+    return -1;
+  }
+  unlink(tmp);
+  if (copy_file(src, tmp, clone_only) != 0) {
+    return -1;
+  }
+  struct stat old;
+  if (stat(dst, &old) == 0 && S_ISREG(old.st_mode)) {
+    chmod(tmp, old.st_mode & 07777);
+  }
+  if (rename(tmp, dst) != 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+// 一条记录：来源文件的戳、完整的 sha256（还没算过是 -）、来源路径
+typedef struct {
+  int64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t ino;
+  bool has_digest;
+  unsigned char digest[HASH_SHA256_SIZE];
+  char source[PATH_MAX];
+} store_record_t;
+
+static void record_stamp(store_record_t *r, const struct stat *st) {
+  r->size = st->st_size;
+  r->mtime_sec = st->st_mtim.tv_sec;
+  r->mtime_nsec = st->st_mtim.tv_nsec;
+  r->ino = st->st_ino;
+}
+
+static bool record_matches(const store_record_t *r, const struct stat *st) {
+  return S_ISREG(st->st_mode) && r->size == st->st_size &&
+         r->mtime_sec == st->st_mtim.tv_sec &&
+         r->mtime_nsec == st->st_mtim.tv_nsec && r->ino == st->st_ino;
+}
+
+static int record_read(const char *path, store_record_t *r) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return -1;
+  }
+  char hex[HASH_SHA256_SIZE * 2 + 2];
+  long long size, sec, nsec;
+  unsigned long long ino;
+  int ret = -1;
+  if (fscanf(f, "%lld %lld %lld %llu %65s\n", &size, &sec, &nsec, &ino,
+             hex) == 5 &&
+      fgets(r->source, sizeof(r->source), f) != NULL) {
+    r->source[strcspn(r->source, "\n")] = '\0';
+    r->size = size;
+    r->mtime_sec = sec;
+    r->mtime_nsec = nsec;
+    r->ino = ino;
+    r->has_digest = strlen(hex) == HASH_SHA256_SIZE * 2;
+    for (int i = 0; r->has_digest && i < HASH_SHA256_SIZE; i++) {
+      unsigned int b;
+      r->has_digest = sscanf(hex + i * 2, "%2x", &b) == 1;
+      r->digest[i] = (unsigned char)b;
+    }
+    ret = r->source[0] != '\0' ? 0 : -1;
+  }
+  fclose(f);
+  return ret;
+}
+
+static int record_write(const char *path, const store_record_t *r) {
+  char tmp[PATH_MAX];
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+    return -1;
+  }
+  char hex[HASH_SHA256_SIZE * 2 + 1] = "-";
+  for (int i = 0; r->has_digest && i < HASH_SHA256_SIZE; i++) {
+    snprintf(hex + i * 2, 3, "%02x", r->digest[i]);
+  }
+  FILE *f = fopen(tmp, "w");
+  if (f == NULL) {
+    return -1;
+  }
+  int n = fprintf(f, "%lld %lld %lld %llu %s\n%s\n", (long long)r->size,
+                  (long long)r->mtime_sec, (long long)r->mtime_nsec,
+                  (unsigned long long)r->ino, hex, r->source);
+  if (fclose(f) != 0 || n < 0 || rename(tmp, path) != 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+static void drop_locked(const char *record) {
+  char data[PATH_MAX];
+  if (snprintf(data, sizeof(data), "%s.data", record) < (int)sizeof(data)) {
+    unlink(data);
+  }
+  unlink(record);
+}
+
+bool contentstore_has(const unsigned char probe[HASH_SHA256_SIZE],
+                      int64_t size) {
+  if (!contentstore_enabled()) {
+    return false;
+  }
+  char path[PATH_MAX];
+  entry_path(path, sizeof(path), probe, "");
+  store_record_t r;
+  pthread_mutex_lock(&store_lock);
+  bool found = record_read(path, &r) == 0 && r.size == size;
+  pthread_mutex_unlock(&store_lock);
+  return found;
+}
+
+int contentstore_materialize(const unsigned char probe[HASH_SHA256_SIZE],
+                             int64_t size,
+                             const unsigned char digest[HASH_SHA256_SIZE],
+                             const char *dst_path) {
+  if (!contentstore_enabled()) {
+    return -1;
+  }
+  char path[PATH_MAX];
+  entry_path(path, sizeof(path), probe, "");
+  store_record_t r;
+  pthread_mutex_lock(&store_lock);
+  int ret = record_read(path, &r);
+  pthread_mutex_unlock(&store_lock);
+  if (ret != 0 || r.size != size) {
+    return -1;
+  }
+  struct stat st;
+  int fd = open(r.source, O_RDONLY);
+  bool valid = fd >= 0 && fstat(fd, &st) == 0 && record_matches(&r, &st);
+  if (valid && !r.has_digest) {
+    // 第一次被查到，算一次完整的 sha256 记下来，算的过程中被改过就不要了
+    struct stat after;
+    valid = contentstore_digest_fd(fd, r.digest) == 0 &&
+            fstat(fd, &after) == 0 && record_matches(&r, &after);
+    r.has_digest = valid;
+    pthread_mutex_lock(&store_lock);
+    if (valid) {
+      record_write(path, &r);
+    }
+    pthread_mutex_unlock(&store_lock);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (!valid) {
+    log_info("content store entry %s changed, drop it", r.source);
+    pthread_mutex_lock(&store_lock);
+    drop_locked(path);
+    pthread_mutex_unlock(&store_lock);
+    return -1;
+  }
+  if (memcmp(r.digest, digest, HASH_SHA256_SIZE) != 0) {
+    // 大小和首尾相同但是中间不同
+    return -1;
+  }
+  struct stat dst;
+  if (stat(dst_path, &dst) == 0 && dst.st_dev == st.st_dev &&
+      dst.st_ino == st.st_ino) {
+    // 同样的内容传到原来的位置，什么都不用做
+  } else if (copy_to(r.source, dst_path, false) != 0) {
+    log_error("content store materialize %s error %s", dst_path,
+              strerror(errno));
+    return -1;
+  }
+  // 命中时更新记录的 mtime，淘汰时按最近使用排序
+  utimensat(AT_FDCWD, path, NULL, 0);
+  log_info("content store hit, %s", dst_path);
+  return 0;
+}
+
+// 按记录的 mtime 淘汰最久没用的条目，直到记录的内容总大小不超过上限
+static void evict_locked() {
+  while (true) {
+    DIR *d = opendir(store_dir);
+    if (d == NULL) {
+      return;
+    }
+    int64_t total = 0;
+    char oldest[NAME_MAX + 1] = "";
+    time_t oldest_mtime = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+      if (de->d_name[0] == '.' || strchr(de->d_name, '.') != NULL) {
+        continue;
+      }
+      char path[PATH_MAX];
+      struct stat st;
+      store_record_t r;
+      if (snprintf(path, sizeof(path), "%s/%s", store_dir, de->d_name) >=
+              (int)sizeof(path) ||
+          stat(path, &st) != 0 || record_read(path, &r) != 0) {
+        continue;
+      }
+      total += r.size;
+      if (oldest[0] == '\0' || st.st_mtime < oldest_mtime) {
+        snprintf(oldest, sizeof(oldest), "%s", de->d_name);
+        oldest_mtime = st.st_mtime;
+      }
+    }
+    closedir(d);
+    if (total <= store_max_bytes || oldest[0] == '\0') {
+      return;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", store_dir, oldest);
+    drop_locked(path);
+  }
+}
+
+void contentstore_add(const unsigned char probe[HASH_SHA256_SIZE],
+                      int64_t size, const char *path) {
+  if (!contentstore_enabled() || size > store_max_bytes) {
+    return;
+  }
+  char entry[PATH_MAX];
+  char data[PATH_MAX];
+  entry_path(entry, sizeof(entry), probe, "");
+  entry_path(data, sizeof(data), probe, ".data");
+  store_record_t r = {.has_digest = false};
+  struct stat st;
+  pthread_mutex_lock(&store_lock);
+  // 能 reflink 就留一份自己的，否则指向上传好的文件，都不复制数据
+  if (copy_to(path, data, true) == 0 && stat(data, &st) == 0) {
+    snprintf(r.source, sizeof(r.source), "%s", data);
+  } else if (realpath(path, r.source) == NULL || stat(r.source, &st) != 0) {
+    pthread_mutex_unlock(&store_lock);
+    return;
+  } else {
+    unlink(data);
+  }
+  if (st.st_size == size) {
+    record_stamp(&r, &st);
+    if (record_write(entry, &r) == 0) {
+      evict_locked();
+    }
+  }
+  pthread_mutex_unlock(&store_lock);
+}
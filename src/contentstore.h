@@ -0,0 +1,39 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#ifndef TERMTUNNEL_CONTENTSTORE_H
+#define TERMTUNNEL_CONTENTSTORE_H
+#include <stdbool.h>
+#include <stdint.h>
+#include "hash.h"
+
+#define CONTENTSTORE_DIR_ENV "TERMTUNNEL_STORE"
+#define CONTENTSTORE_SIZE_ENV "TERMTUNNEL_STORE_SIZE"
+// 默认放在 $HOME 下，TERMTUNNEL_STORE=off 关闭
+#define CONTENTSTORE_DEFAULT_DIR ".cache/termtunnel/store"
+#define CONTENTSTORE_DEFAULT_SIZE_MB 1024
+// 探测摘要只读文件首尾各这么多字节
+#define CONTENTSTORE_PROBE_SIZE (1024 * 1024)
+// 接收端对探测摘要的回复，CHECK 之后发送端再发完整的 sha256，
+// 接收端回复 HIT 或者 MISS
+#define CONTENTSTORE_MISS 0
+#define CONTENTSTORE_HIT 1
+#define CONTENTSTORE_CHECK 2
+
+bool contentstore_enabled();
+int contentstore_digest_fd(int fd, unsigned char digest[HASH_SHA256_SIZE]);
+int contentstore_probe_fd(int fd, int64_t size,
+                          unsigned char probe[HASH_SHA256_SIZE]);
+bool contentstore_has(const unsigned char probe[HASH_SHA256_SIZE],
+                      int64_t size);
+int contentstore_materialize(const unsigned char probe[HASH_SHA256_SIZE],
+                             int64_t size,
+                             const unsigned char digest[HASH_SHA256_SIZE],
+                             const char *dst_path);
+void contentstore_add(const unsigned char probe[HASH_SHA256_SIZE],
+                      int64_t size, const char *path);
+#endif
@@ -0,0 +1,300 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+// rsync 风格的差量计算。
+// 接收端对旧文件按固定大小分块，计算弱校验（滚动和）和强校验（xxh64）；
+// 发送端在新文件上逐字节滑动窗口，弱校验命中后再比较强校验，
+// 命中的部分输出 COPY 指令，其余部分作为 LITERAL 原样发送。
+#include "delta.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "hash.h"
+
+struct delta_scanner {
+  const delta_signature_t *sig;
+  const unsigned char *data;
+  int64_t size;
+  int64_t block_size;
+  int64_t *heads;  // 弱校验哈希表，存块序号 + 1
+  int64_t *next;
+  uint64_t mask;
+  int64_t pos;
+  int64_t lit_start;
+  uint32_t a;
+  uint32_t b;
+  bool rolling;
+  int64_t copy_start;
+  int64_t copy_count;
+  bool done;
+  int64_t literal_bytes;
+  int64_t copied_bytes;
+};
+
+// 块大小取旧文件大小的平方根，按 1KB 对齐
+int64_t delta_block_size(int64_t old_size) {
+  int64_t root = 0;
+  int64_t bit = (int64_t)1 << 30;
+  while (bit > 0) {
+    if ((root + bit) * (root + bit) <= old_size) {
+      root += bit;
+    }
+    bit >>= 1;
+  }
+  int64_t block = (root + 1023) / 1024 * 1024;
+  if (block < DELTA_MIN_BLOCK_SIZE) {
+    block = DELTA_MIN_BLOCK_SIZE;
+  }
+  if (block > DELTA_MAX_BLOCK_SIZE) {
+    block = DELTA_MAX_BLOCK_SIZE;
+  }
+  return block;
+}
+
+static void weak_init(const unsigned char *p, int64_t len, uint32_t *a,
+                      uint32_t *b) {
+  uint32_t sa = 0;
+  uint32_t sb = 0;
+  for (int64_t i = 0; i < len; i++) {
+    sa += p[i];
+    sb += (uint32_t)(len - i) * p[i];
+  }
+  *a = sa;
+  *b = sb;
+}
+
+static inline uint32_t weak_digest(uint32_t a, uint32_t b) {
+  return (a & 0xffff) | (b << 16);
+}
+
+int delta_signature_build(int fd, int64_t size, delta_signature_t *sig) {
+  sig->block_size = delta_block_size(size);
+  sig->count = size / sig->block_size;
+  sig->blocks = (delta_block_sig_t *)malloc(
+      (sig->count + 1) * sizeof(delta_block_sig_t));
+  unsigned char *buf = (unsigned char *)malloc(sig->block_size);
+  if (sig->blocks == NULL || buf == NULL) {
+    free(buf);
+    delta_signature_free(sig);
+    return -1;
+  }
+  for (int64_t i = 0; i < sig->count; i++) {
+    int64_t done = 0;
+    while (done < sig->block_size) {
+      ssize_t n = pread(fd, buf + done, sig->block_size - done,
+                        i * sig->block_size + done);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        free(buf);
+        delta_signature_free(sig);
+        return -1;
+      }
+      done += n;
+    }
+    uint32_t a, b;
+    weak_init(buf, sig->block_size, &a, &b);
+    sig->blocks[i].weak = weak_digest(a, b);
+    sig->blocks[i].strong = hash_xxh64(buf, sig->block_size, 0);
+  }
+  free(buf);
+  return 0;
+}
+
+void delta_signature_free(delta_signature_t *sig) {
+  free(sig->blocks);
+  sig->blocks = NULL;
+  sig->count = 0;
+}
+
+static inline uint64_t bucket_of(delta_scanner_t *s, uint32_t weak) {
+  return ((uint64_t)weak * 0x9E3779B97F4A7C15ULL >> 32) & s->mask;
+}
+
+delta_scanner_t *delta_scanner_new(const delta_signature_t *sig,
+                                   const unsigned char *data, int64_t size) {
+  delta_scanner_t *s = (delta_scanner_t *)calloc(1, sizeof(delta_scanner_t));
+  if (s == NULL) {
+    return NULL;
+  }
+  s->sig = sig;
+  s->data = data;
+  s->size = size;
+  s->block_size = sig->block_size;
+  uint64_t buckets = 1;
+  while (buckets < (uint64_t)sig->count * 2) {
+    buckets <<= 1;
+  }
+  s->mask = buckets - 1;
+  s->heads = (int64_t *)calloc(buckets, sizeof(int64_t));
+  s->next = (int64_t *)calloc(sig->count + 1, sizeof(int64_t));
+  if (s->heads == NULL || s->next == NULL) {
+    delta_scanner_free(s);
+    return NULL;
+  }
+  // 倒序插入，链表里序号小的块在前
+  for (int64_t i = sig->count - 1; i >= 0; i--) {
+    uint64_t bucket = bucket_of(s, sig->blocks[i].weak);
+    s->next[i] = s->heads[bucket];
+    s->heads[bucket] = i + 1;
+  }
+  return s;
+}
+
+void delta_scanner_free(delta_scanner_t *s) {
+  if (s == NULL) {
+    return;
+  }
+  free(s->heads);
+  free(s->next);
+  free(s);
+}
+
+void delta_scanner_stats(delta_scanner_t *s, int64_t *literal,
+                         int64_t *copied) {
+  *literal = s->literal_bytes;
+  *copied = s->copied_bytes;
+}
+
+static void put_u32(char *buf, size_t *len, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    buf[(*len)++] = (char)(v >> (24 - 8 * i));
+  }
+}
+
+static void put_u64(char *buf, size_t *len, uint64_t v) {
+  for (int i = 0; i < 8; i++) {
+    buf[(*len)++] = (char)(v >> (56 - 8 * i));
+  }
+}
+
+static void emit_literal(delta_scanner_t *s, char *buf, size_t *len,
+                         int64_t n) {
+  buf[(*len)++] = DELTA_OP_LITERAL;
+  put_u32(buf, len, (uint32_t)n);
+  memcpy(buf + *len, s->data + s->lit_start, n);
+  *len += n;
+  s->lit_start += n;
+  s->literal_bytes += n;
+}
+
+static void emit_copy(delta_scanner_t *s, char *buf, size_t *len) {
+  buf[(*len)++] = DELTA_OP_COPY;
+  put_u64(buf, len, s->copy_start);
+  put_u64(buf, len, s->copy_count);
+  s->copied_bytes += s->copy_count * s->block_size;
+  s->copy_count = 0;
+}
+
+// 优先匹配紧接着上一个 COPY 的块，这样连续的块可以合并成一条指令
+static int64_t find_match(delta_scanner_t *s) {
+  uint32_t weak = weak_digest(s->a, s->b);
+  int64_t preferred = s->copy_count > 0 ? s->copy_start + s->copy_count : -1;
+  int64_t found = -1;
+  bool strong_ready = false;
+  uint64_t strong = 0;
+  for (int64_t i = s->heads[bucket_of(s, weak)]; i != 0; i = s->next[i - 1]) {
+    const delta_block_sig_t *blk = &s->sig->blocks[i - 1];
+    if (blk->weak != weak) {
+      continue;
+    }
+    if (!strong_ready) {
+      strong = hash_xxh64(s->data + s->pos, s->block_size, 0);
+      strong_ready = true;
+    }
+    if (blk->strong != strong) {
+      continue;
+    }
+    if (i - 1 == preferred) {
+      return preferred;
+    }
+    if (found < 0) {
+      found = i - 1;
+    }
+  }
+  return found;
+}
+
+static void rolling_advance(delta_scanner_t *s) {
+  unsigned char out = s->data[s->pos];
+  s->pos++;
+  if (s->pos + s->block_size > s->size) {
+    s->rolling = false;
+    return;
+  }
+  unsigned char in = s->data[s->pos + s->block_size - 1];
+  s->a = s->a - out + in;
+  s->b = s->b - (uint32_t)s->block_size * out + s->a;
+}
+
+// 每次最多输出一条指令，或者把窗口向后滑动一个字节
+static void scanner_step(delta_scanner_t *s, char *buf, size_t *len) {
+  int64_t bs = s->block_size;
+  if (s->sig->count > 0 && s->pos + bs <= s->size) {
+    if (!s->rolling) {
+      weak_init(s->data + s->pos, bs, &s->a, &s->b);
+      s->rolling = true;
+    }
+    int64_t match = find_match(s);
+    if (match >= 0) {
+      if (s->lit_start < s->pos) {
+        emit_literal(s, buf, len, s->pos - s->lit_start);
+        return;
+      }
+      if (s->copy_count > 0 && match == s->copy_start + s->copy_count) {
+        s->copy_count++;
+      } else {
+        if (s->copy_count > 0) {
+          emit_copy(s, buf, len);
+        }
+        s->copy_start = match;
+        s->copy_count = 1;
+      }
+      s->pos += bs;
+      s->lit_start = s->pos;
+      s->rolling = false;
+      return;
+    }
+    if (s->copy_count > 0) {
+      emit_copy(s, buf, len);
+      return;
+    }
+    rolling_advance(s);
+    if (s->pos - s->lit_start >= DELTA_MAX_LITERAL) {
+      emit_literal(s, buf, len, DELTA_MAX_LITERAL);
+    }
+    return;
+  }
+  // 剩下不足一个块的尾部
+  if (s->copy_count > 0) {
+    emit_copy(s, buf, len);
+    return;
+  }
+  if (s->lit_start < s->size) {
+    int64_t left = s->size - s->lit_start;
+    emit_literal(s, buf, len,
+                 left < DELTA_MAX_LITERAL ? left : DELTA_MAX_LITERAL);
+    return;
+  }
+  buf[(*len)++] = DELTA_OP_END;
+  put_u64(buf, len, s->size);
+  put_u64(buf, len, hash_xxh64(s->data, s->size, 0));
+  s->done = true;
+}
+
+// 把指令流写入 buf，返回写入的字节数，0 表示已经输出了 END
+size_t delta_scanner_fill(delta_scanner_t *s, char *buf, size_t cap) {
+  size_t len = 0;
+  while (!s->done && cap - len >= DELTA_MAX_OP_SIZE) {
+    scanner_step(s, buf, &len);
+  }
+  return len;
+}
@@ -0,0 +1,47 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#ifndef TERMTUNNEL_DELTA_H
+#define TERMTUNNEL_DELTA_H
+#include <stddef.h>
+#include <stdint.h>
+
+#define DELTA_MIN_BLOCK_SIZE 2048
+#define DELTA_MAX_BLOCK_SIZE (64 * 1024)
+#define DELTA_MAX_LITERAL (64 * 1024)
+// 一条指令的最大长度：类型 + 长度 + 字面数据
+#define DELTA_MAX_OP_SIZE (1 + 4 + DELTA_MAX_LITERAL)
+
+// 指令流：COPY 块序号(u64) 块数(u64)，LITERAL 长度(u32) 数据，
+// END 新文件长度(u64) 新文件 xxh64(u64)
+#define DELTA_OP_COPY 'C'
+#define DELTA_OP_LITERAL 'L'
+#define DELTA_OP_END 'E'
+
+typedef struct {
+  uint32_t weak;
+  uint64_t strong;
+} delta_block_sig_t;
+
+typedef struct {
+  int64_t block_size;
+  int64_t count;
+  delta_block_sig_t *blocks;
+} delta_signature_t;
+
+typedef struct delta_scanner delta_scanner_t;
+
+int64_t delta_block_size(int64_t old_size);
+int delta_signature_build(int fd, int64_t size, delta_signature_t *sig);
+void delta_signature_free(delta_signature_t *sig);
+delta_scanner_t *delta_scanner_new(const delta_signature_t *sig,
+                                   const unsigned char *data, int64_t size);
+size_t delta_scanner_fill(delta_scanner_t *s, char *buf, size_t cap);
+void delta_scanner_stats(delta_scanner_t *s, int64_t *literal,
+                         int64_t *copied);
+void delta_scanner_free(delta_scanner_t *s);
+#endif
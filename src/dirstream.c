@@ -0,0 +1,671 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+// 目录的流式传输，整个目录树在一条连接上像归档文件一样首尾相接地发送。
+// 每个条目是一个紧凑的头加上内容（文件数据或者符号链接目标），
+// 全部条目之后是 END 头，长度字段为条目总数；接收端回复失败条目数(u64)。
+// 发送端由单独的线程遍历目录，和读文件、发送同时进行。
+#define _GNU_SOURCE
+#include "dirstream.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "log.h"
+#include "transfer.h"
+#include "vclient.h"
+
+typedef struct dir_entry {
+  char type;
+  char *path;  // 相对于根目录
+  struct stat st;
+  struct dir_entry *next;
+} dir_entry_t;
+
+typedef struct {
+  const char *root;
+  dir_entry_t *head;
+  dir_entry_t *tail;
+  int count;
+  bool done;
+  bool stop;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} dir_walker_t;
+
+typedef struct {
+  int sd;
+  char *buf;
+  size_t len;
+  size_t pos;
+  progress_t *progress;
+} dir_buffer_t;
+
+static int join_path(char *out, const char *root, const char *rel) {
+  int n = rel[0] == '\0' ? snprintf(out, PATH_MAX, "%s", root)
+                         : snprintf(out, PATH_MAX, "%s/%s", root, rel);
+  return n >= PATH_MAX ? -1 : 0;
+}
+
+static bool walker_push(dir_walker_t *w, char type, const char *path,
+                        const struct stat *st) {
+  dir_entry_t *e = (dir_entry_t *)malloc(sizeof(dir_entry_t));
+  if (e == NULL || (e->path = strdup(path)) == NULL) {
+    free(e);
+    return false;
+  }
+  e->type = type;
+  e->st = *st;
+  e->next = NULL;
+  pthread_mutex_lock(&w->lock);
+  while (w->count >= DIRSTREAM_QUEUE_MAX && !w->stop) {
+    pthread_cond_wait(&w->cond, &w->lock);
+  }
+  bool stop = w->stop;
+  if (!stop) {
+    if (w->tail == NULL) {
+      w->head = e;
+    } else {
+      w->tail->next = e;
+    }
+    w->tail = e;
+    w->count++;
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+  if (stop) {
+    free(e->path);
+    free(e);
+  }
+  return !stop;
+}
+
+static dir_entry_t *walker_pop(dir_walker_t *w) {
+  pthread_mutex_lock(&w->lock);
+  while (w->head == NULL && !w->done) {
+    pthread_cond_wait(&w->cond, &w->lock);
+  }
+  dir_entry_t *e = w->head;
+  if (e != NULL) {
+    w->head = e->next;
+    if (w->head == NULL) {
+      w->tail = NULL;
+    }
+    w->count--;
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return e;
+}
+
+// 深度优先遍历，目录条目总是先于它下面的条目入队
+static void *walker_thread(void *arg) {
+  dir_walker_t *w = (dir_walker_t *)arg;
+  char **stack = NULL;
+  int depth = 0;
+  int cap = 0;
+  char full[PATH_MAX];
+  char rel[PATH_MAX];
+  char *first = strdup("");
+  if (first != NULL) {
+    stack = (char **)malloc(sizeof(char *) * 16);
+    cap = 16;
+    if (stack != NULL) {
+      stack[depth++] = first;
+    } else {
+      free(first);
+    }
+  }
+  bool stopped = false;
+  while (depth > 0) {
+    char *dir = stack[--depth];
+    if (stopped) {
+      free(dir);
+      continue;
+    }
+    DIR *d = join_path(full, w->root, dir) == 0 ? opendir(full) : NULL;
+    if (d == NULL) {
+      log_error("opendir %s error %s", full, strerror(errno));
+    }
+    struct dirent *de;
+    while (d != NULL && (de = readdir(d)) != NULL) {
+      if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+        continue;
+      }
+      int n = dir[0] == '\0'
+                  ? snprintf(rel, sizeof(rel), "%s", de->d_name)
+                  : snprintf(rel, sizeof(rel), "%s/%s", dir, de->d_name);
+      struct stat st;
+      if (n >= (int)sizeof(rel) || join_path(full, w->root, rel) != 0 ||
+          lstat(full, &st) != 0) {
+        log_error("skip %s/%s", dir, de->d_name);
+        continue;
+      }
+      char type;
+      if (S_ISDIR(st.st_mode)) {
+        type = DIRSTREAM_DIR;
+      } else if (S_ISREG(st.st_mode)) {
+        type = DIRSTREAM_FILE;
+      } else if (S_ISLNK(st.st_mode)) {
+        type = DIRSTREAM_SYMLINK;
+      } else {
+        continue;
+      }
+      if (!walker_push(w, type, rel, &st)) {
+        stopped = true;
+        break;
+      }
+      if (type == DIRSTREAM_DIR) {
+        if (depth == cap) {
+          char **grown = (char **)realloc(stack, sizeof(char *) * cap * 2);
+          if (grown == NULL) {
+            continue;
+          }
+          stack = grown;
+          cap *= 2;
+        }
+        char *sub = strdup(rel);
+        if (sub != NULL) {
+          stack[depth++] = sub;
+        }
+      }
+    }
+    if (d != NULL) {
+      closedir(d);
+    }
+    free(dir);
+  }
+  free(stack);
+  pthread_mutex_lock(&w->lock);
+  w->done = true;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+static int buffer_flush(dir_buffer_t *b) {
+  if (b->len > 0 && transfer_write_full(b->sd, b->buf, b->len) != 0) {
+    return -1;
+  }
+  progress_add(b->progress, b->len);
+  b->len = 0;
+  return 0;
+}
+
+static int buffer_put(dir_buffer_t *b, const void *data, size_t n) {
+  if (b->len + n > DIRSTREAM_BUFFER_SIZE && buffer_flush(b) != 0) {
+    return -1;
+  }
+  if (n >= DIRSTREAM_BUFFER_SIZE) {
+    if (transfer_write_full(b->sd, data, n) != 0) {
+      return -1;
+    }
+    progress_add(b->progress, n);
+    return 0;
+  }
+  memcpy(b->buf + b->len, data, n);
+  b->len += n;
+  return 0;
+}
+
+static int buffer_get(dir_buffer_t *b, void *data, size_t n) {
+  char *out = (char *)data;
+  while (n > 0) {
+    if (b->pos == b->len) {
+      ssize_t r = lwip_read(b->sd, b->buf, DIRSTREAM_BUFFER_SIZE);
+      if (r < 0 && (errno == EINTR || errno == EAGAIN)) {
+        continue;
+      }
+      if (r <= 0) {
+        return -1;
+      }
+      b->pos = 0;
+      b->len = r;
+      progress_add(b->progress, r);
+    }
+    size_t take = b->len - b->pos < n ? b->len - b->pos : n;
+    memcpy(out, b->buf + b->pos, take);
+    b->pos += take;
+    out += take;
+    n -= take;
+  }
+  return 0;
+}
+
+static void put_be(unsigned char *p, uint64_t v, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    p[i] = (unsigned char)(v >> (8 * (bytes - 1 - i)));
+  }
+}
+
+static uint64_t get_be(const unsigned char *p, int bytes) {
+  uint64_t v = 0;
+  for (int i = 0; i < bytes; i++) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+static int put_header(dir_buffer_t *b, char type, const char *path,
+                      uint32_t mode, int64_t mtime, uint64_t size) {
+  unsigned char h[DIRSTREAM_HEADER_SIZE];
+  size_t path_len = strlen(path);
+  h[0] = (unsigned char)type;
+  put_be(h + 1, path_len, 2);
+  put_be(h + 3, mode, 4);
+  put_be(h + 7, (uint64_t)mtime, 8);
+  put_be(h + 15, size, 8);
+  if (buffer_put(b, h, sizeof(h)) != 0) {
+    return -1;
+  }
+  return buffer_put(b, path, path_len);
+}
+
+// 文件在发送过程中变短时用 0 补齐头里声明的长度
+static int put_file(dir_buffer_t *b, int fd, uint64_t size, char *chunk) {
+  uint64_t sent = 0;
+  bool short_read = false;
+  while (sent < size) {
+    size_t want = size - sent < TRANSFER_BLOCK_SIZE ? (size_t)(size - sent)
+                                                    : TRANSFER_BLOCK_SIZE;
+    ssize_t n = short_read ? 0 : read(fd, chunk, want);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      memset(chunk, 0, want);
+      n = want;
+      short_read = true;
+    }
+    if (buffer_put(b, chunk, n) != 0) {
+      return -1;
+    }
+    sent += n;
+  }
+  return short_read ? 1 : 0;
+}
+
+static int send_entry(dir_buffer_t *b, const char *root, dir_entry_t *e,
+                      char *chunk) {
+  char full[PATH_MAX];
+  if (strlen(e->path) > UINT16_MAX || join_path(full, root, e->path) != 0) {
+    return 1;
+  }
+  uint32_t mode = e->st.st_mode & 07777;
+  int64_t mtime = e->st.st_mtime;
+  if (e->type == DIRSTREAM_DIR) {
+    return put_header(b, e->type, e->path, mode, mtime, 0);
+  }
+  if (e->type == DIRSTREAM_SYMLINK) {
+    char target[PATH_MAX];
+    ssize_t n = readlink(full, target, sizeof(target));
+    if (n < 0 || n == sizeof(target)) {
+      return 1;
+    }
+    if (put_header(b, e->type, e->path, mode, mtime, n) != 0 ||
+        buffer_put(b, target, n) != 0) {
+      return -1;
+    }
+    return 0;
+  }
+  int fd = open(full, O_RDONLY);
+  if (fd < 0) {
+    log_error("open %s error %s", full, strerror(errno));
+    return 1;
+  }
+  int ret = put_header(b, e->type, e->path, mode, mtime, e->st.st_size);
+  if (ret == 0) {
+    ret = put_file(b, fd, e->st.st_size, chunk);
+    if (ret > 0) {
+      log_warn("%s changed while sending", full);
+      ret = 0;
+    }
+  }
+  close(fd);
+  return ret;
+}
+
+int dirstream_send(int sd, const char *root, progress_t *progress) {
+  dir_walker_t w;
+  memset(&w, 0, sizeof(w));
+  w.root = root;
+  pthread_mutex_init(&w.lock, NULL);
+  pthread_cond_init(&w.cond, NULL);
+  dir_buffer_t b = {sd, (char *)malloc(DIRSTREAM_BUFFER_SIZE), 0, 0, progress};
+  char *chunk = (char *)malloc(TRANSFER_BLOCK_SIZE);
+  int ret = -1;
+  pthread_t walker;
+  if (b.buf == NULL || chunk == NULL ||
+      pthread_create(&walker, NULL, walker_thread, &w) != 0) {
+    goto end;
+  }
+  uint64_t entries = 0;
+  int64_t skipped = 0;
+  bool broken = false;
+  dir_entry_t *e;
+  while (!broken && (e = walker_pop(&w)) != NULL) {
+    int rc = send_entry(&b, root, e, chunk);
+    free(e->path);
+    free(e);
+    if (rc == 0) {
+      entries++;
+    } else if (rc > 0) {
+      skipped++;
+    } else {
+      broken = true;
+    }
+  }
+  // 发送出错时让遍历线程尽快退出
+  pthread_mutex_lock(&w.lock);
+  w.stop = true;
+  pthread_cond_broadcast(&w.cond);
+  pthread_mutex_unlock(&w.lock);
+  pthread_join(walker, NULL);
+  while ((e = w.head) != NULL) {
+    w.head = e->next;
+    free(e->path);
+    free(e);
+  }
+  uint64_t failed;
+  if (!broken && put_header(&b, DIRSTREAM_END, "", 0, 0, entries) == 0 &&
+      buffer_flush(&b) == 0 && transfer_read_u64(sd, &failed) == 0) {
+    log_info("sent %s, %llu entries, %lld skipped, %llu failed remotely",
+             root, (unsigned long long)entries, (long long)skipped,
+             (unsigned long long)failed);
+    ret = failed == 0 && skipped == 0 ? 0 : -1;
+  }
+
+end:
+  free(b.buf);
+  free(chunk);
+  pthread_mutex_destroy(&w.lock);
+  pthread_cond_destroy(&w.cond);
+  return ret;
+}
+
+// 只接受根目录下的相对路径
+static bool safe_path(const char *path) {
+  if (path[0] == '\0' || path[0] == '/') {
+    return false;
+  }
+  const char *p = path;
+  while (*p != '\0') {
+    const char *slash = strchr(p, '/');
+    size_t n = slash != NULL ? (size_t)(slash - p) : strlen(p);
+    if (n == 0 || (n == 1 && p[0] == '.') ||
+        (n == 2 && p[0] == '.' && p[1] == '.')) {
+      return false;
+    }
+    p += n;
+    if (*p == '/') {
+      p++;
+    }
+  }
+  return true;
+}
+
+// 目录的 mtime 和符号链接放到最后处理：
+// 写入子条目会改掉目录的 mtime，先建的符号链接可能把后面的文件引到根目录外面
+typedef struct {
+  char *path;
+  char *target;
+  int64_t mtime;
+} dir_pending_t;
+
+typedef struct {
+  dir_pending_t *items;
+  int64_t count;
+  int64_t cap;
+} dir_pending_list_t;
+
+static bool pending_add(dir_pending_list_t *l, const char *path,
+                        const char *target, int64_t mtime) {
+  if (l->count == l->cap) {
+    int64_t cap = l->cap == 0 ? 64 : l->cap * 2;
+    dir_pending_t *grown =
+        (dir_pending_t *)realloc(l->items, cap * sizeof(dir_pending_t));
+    if (grown == NULL) {
+      return false;
+    }
+    l->items = grown;
+    l->cap = cap;
+  }
+  dir_pending_t *it = &l->items[l->count];
+  it->path = strdup(path);
+  it->target = target != NULL ? strdup(target) : NULL;
+  it->mtime = mtime;
+  if (it->path == NULL || (target != NULL && it->target == NULL)) {
+    free(it->path);
+    free(it->target);
+    return false;
+  }
+  l->count++;
+  return true;
+}
+
+static void pending_free(dir_pending_list_t *l) {
+  for (int64_t i = 0; i < l->count; i++) {
+    free(l->items[i].path);
+    free(l->items[i].target);
+  }
+  free(l->items);
+}
+
+// 从根目录逐级打开父目录，中间每一级都不跟随符号链接，
+// 目标位置原有的指向别处的目录链接不会把条目引到根目录外面。
+// 返回父目录的 fd，name 指向最后一级
+static int open_parent(int root_fd, const char *path, const char **name) {
+  int fd = dup(root_fd);
+  const char *p = path;
+  const char *slash;
+  char part[NAME_MAX + 1];
+  while (fd >= 0 && (slash = strchr(p, '/')) != NULL) {
+    size_t n = (size_t)(slash - p);
+    if (n >= sizeof(part)) {
+      close(fd);
+      return -1;
+    }
+    memcpy(part, p, n);
+    part[n] = '\0';
+    int next = openat(fd, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    close(fd);
+    fd = next;
+    p = slash + 1;
+  }
+  *name = p;
+  return fd;
+}
+
+static void set_mtime(int root_fd, const char *path, int64_t mtime) {
+  struct timespec ts[2];
+  ts[0].tv_sec = mtime;
+  ts[0].tv_nsec = 0;
+  ts[1] = ts[0];
+  const char *name;
+  int dir = open_parent(root_fd, path, &name);
+  if (dir >= 0) {
+    utimensat(dir, name, ts, AT_SYMLINK_NOFOLLOW);
+    close(dir);
+  }
+}
+
+static int write_all(int fd, const char *buf, size_t n) {
+  while (n > 0) {
+    ssize_t w = write(fd, buf, n);
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      return -1;
+    }
+    buf += w;
+    n -= w;
+  }
+  return 0;
+}
+
+// 把文件内容从流里读出来，fd < 0 时只是丢弃
+static int recv_file(dir_buffer_t *b, int fd, uint64_t size, char *chunk,
+                     bool *write_failed) {
+  while (size > 0) {
+    size_t n = size < TRANSFER_BLOCK_SIZE ? (size_t)size : TRANSFER_BLOCK_SIZE;
+    if (buffer_get(b, chunk, n) != 0) {
+      return -1;
+    }
+    if (fd >= 0 && !*write_failed && write_all(fd, chunk, n) != 0) {
+      *write_failed = true;
+    }
+    size -= n;
+  }
+  return 0;
+}
+
+int dirstream_recv(int sd, const char *root, progress_t *progress) {
+  dir_buffer_t b = {sd, (char *)malloc(DIRSTREAM_BUFFER_SIZE), 0, 0, progress};
+  char *chunk = (char *)malloc(TRANSFER_BLOCK_SIZE);
+  dir_pending_list_t dirs = {NULL, 0, 0};
+  dir_pending_list_t links = {NULL, 0, 0};
+  uint64_t entries = 0;
+  uint64_t failed = 0;
+  bool complete = false;
+  int root_fd = -1;
+  if (b.buf == NULL || chunk == NULL) {
+    goto end;
+  }
+  if (mkdir(root, 0755) != 0 && errno != EEXIST) {
+    log_error("mkdir %s error %s", root, strerror(errno));
+    failed++;
+  }
+  // 条目都相对于它打开，打不开时每个条目都失败，流照样读完
+  root_fd = open(root, O_RDONLY | O_DIRECTORY);
+  char path[PATH_MAX];
+  while (true) {
+    unsigned char h[DIRSTREAM_HEADER_SIZE];
+    if (buffer_get(&b, h, sizeof(h)) != 0) {
+      break;
+    }
+    char type = (char)h[0];
+    size_t path_len = get_be(h + 1, 2);
+    mode_t mode = (mode_t)get_be(h + 3, 4) & 07777;
+    int64_t mtime = (int64_t)get_be(h + 7, 8);
+    uint64_t size = get_be(h + 15, 8);
+    if (path_len >= sizeof(path) || buffer_get(&b, path, path_len) != 0) {
+      break;
+    }
+    path[path_len] = '\0';
+    if (type == DIRSTREAM_END) {
+      complete = size == entries;
+      break;
+    }
+    entries++;
+    const char *name = NULL;
+    int dir = root_fd >= 0 && safe_path(path)
+                  ? open_parent(root_fd, path, &name)
+                  : -1;
+    if (type == DIRSTREAM_DIR) {
+      if (dir < 0 ||
+          (mkdirat(dir, name, mode | 0700) != 0 && errno != EEXIST) ||
+          !pending_add(&dirs, path, NULL, mtime)) {
+        failed++;
+      }
+    } else if (type == DIRSTREAM_FILE) {
+      int fd = dir >= 0 ? openat(dir, name,
+                                 O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW,
+                                 mode | 0600)
+                        : -1;
+      if (dir >= 0) {
+        close(dir);
+        dir = -1;
+      }
+      bool write_failed = fd < 0;
+      if (recv_file(&b, fd, size, chunk, &write_failed) != 0) {
+        if (fd >= 0) {
+          close(fd);
+        }
+        break;
+      }
+      if (fd >= 0) {
+        fchmod(fd, mode);
+        struct timespec ts[2];
+        ts[0].tv_sec = mtime;
+        ts[0].tv_nsec = 0;
+        ts[1] = ts[0];
+        futimens(fd, ts);
+        close(fd);
+      }
+      if (write_failed) {
+        log_error("write %s failed", path);
+        failed++;
+      }
+    } else if (type == DIRSTREAM_SYMLINK) {
+      if (size >= PATH_MAX || buffer_get(&b, chunk, size) != 0) {
+        if (dir >= 0) {
+          close(dir);
+        }
+        break;
+      }
+      chunk[size] = '\0';
+      if (dir < 0 || !pending_add(&links, path, chunk, mtime)) {
+        failed++;
+      }
+    } else {
+      log_error("unknown dirstream entry %d", type);
+      if (dir >= 0) {
+        close(dir);
+      }
+      break;
+    }
+    if (dir >= 0) {
+      close(dir);
+    }
+  }
+  for (int64_t i = 0; i < links.count; i++) {
+    dir_pending_t *it = &links.items[i];
+    const char *name;
+    int dir = open_parent(root_fd, it->path, &name);
+    if (dir < 0) {
+      failed++;
+      continue;
+    }
+    unlinkat(dir, name, 0);
+    if (symlinkat(it->target, dir, name) != 0) {
+      log_error("symlink %s error %s", it->path, strerror(errno));
+      failed++;
+    } else {
+      set_mtime(root_fd, it->path, it->mtime);
+    }
+    close(dir);
+  }
+  // 倒序设置，子目录先于父目录
+  for (int64_t i = dirs.count - 1; i >= 0; i--) {
+    set_mtime(root_fd, dirs.items[i].path, dirs.items[i].mtime);
+  }
+  if (complete) {
+    log_info("received %s, %llu entries, %llu failed", root,
+             (unsigned long long)entries, (unsigned long long)failed);
+    transfer_write_u64(sd, failed);
+  }
+
+end:
+  if (root_fd >= 0) {
+    close(root_fd);
+  }
+  pending_free(&dirs);
+  pending_free(&links);
+  free(b.buf);
+  free(chunk);
+  return complete && failed == 0 ? 0 : -1;
+}
@@ -0,0 +1,28 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#ifndef TERMTUNNEL_DIRSTREAM_H
+#define TERMTUNNEL_DIRSTREAM_H
+#include <stdint.h>
+#include "progress.h"
+
+// 条目类型
+#define DIRSTREAM_FILE 'F'
+#define DIRSTREAM_DIR 'D'
+#define DIRSTREAM_SYMLINK 'L'
+#define DIRSTREAM_END 'E'
+
+// 条目头：类型(u8) 路径长度(u16) 权限(u32) mtime(u64) 长度(u64)
+#define DIRSTREAM_HEADER_SIZE (1 + 2 + 4 + 8 + 8)
+// 小文件在发送缓冲区里首尾相接，攒满一次写出
+#define DIRSTREAM_BUFFER_SIZE (1024 * 1024)
+// 遍历线程最多领先发送多少个条目
+#define DIRSTREAM_QUEUE_MAX 4096
+
+int dirstream_send(int sd, const char *root, progress_t *progress);
+int dirstream_recv(int sd, const char *root, progress_t *progress);
+#endif
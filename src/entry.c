@@ -143,6 +143,11 @@ int main(int argc, char *argv[]) {
     agent(argc - 2, argv);
     return 0;
   }
+  if (argc == 2 && strcmp(argv[1], "-r") == 0) {
+    log_info("relay pid %d", getpid());
+    agent_relay();
+    return 0;
+  }
 
   if (pipe(in_fd) == -1) {
     perror("Cannot create the pipe");
@@ -5,6 +5,7 @@
  * https://opensource.org/licenses/MIT
  */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -15,6 +16,8 @@
 #include <unistd.h>
 #include "state.h"
 #include "config.h"
+#include "contentstore.h"
+#include "dirstream.h"
 #include "intent.h"
 #include "log.h"
 #include "lwip/api.h"
@@ -24,49 +27,106 @@
 #include "lwip/sockets.h"
 #include "lwipopts.h"
 #include "netif/etharp.h"
+#include "progress.h"
+#include "transfer.h"
 #include "utils.h"
 #include "vnet.h"
 static int receiver_service_port = 700;
 static int sender_service_port = 701;
 
 typedef struct path_exchange {
+  int agent;
   char src_path[PATH_MAX];
   char dst_path[PATH_MAX];
+  progress_t *progress;
   // uv_async_t *exchange_notify;
-  //  TODO chmod etc
 } path_exchange_t;
 
+// 发起方增开的连接以空路径开头，后面是 transfer_join 的任务 id
+static int dial_service(int agent, uint16_t port) {
+  int nfd = vnet_tcp_connect(agent, port);
+  if (nfd < 0) {
+    return -1;
+  }
+  if (vnet_send(nfd, "", 1) != 1) {
+    vnet_close(nfd);
+    return -1;
+  }
+  return nfd;
+}
+
+static int dial_receiver(void *arg) {
+  path_exchange_t *pe = (path_exchange_t *)arg;
+  return dial_service(pe->agent, receiver_service_port);
+}
+
+static int dial_sender(void *arg) {
+  path_exchange_t *pe = (path_exchange_t *)arg;
+  return dial_service(pe->agent, sender_service_port);
+}
+
+// 协议：路径字符串（以 0 结尾）、文件大小（u64）、探测摘要（见 contentstore.h），
+// 内容仓库里没有同名条目时回复 CONTENTSTORE_MISS，之后按 transfer_sink 续传；
+// 有的话回复 CONTENTSTORE_CHECK，发送端再发完整的 sha256，
+// 对得上回复 CONTENTSTORE_HIT 并结束，否则回复 CONTENTSTORE_MISS 续传；
+// 大小为 TRANSFER_SIZE_DIR 时没有摘要，之后是 dirstream
 static int file_receiver_request(void *p) {
   int sd = (int)(intptr_t)p;
   vnet_setsocketdefaultopt(sd);
   char recv_buf[READ_CHUNK_SIZE];
-  int n, nwrote;
   log_info("sd: %d", sd);
   if (vnet_readstring(sd, recv_buf, READ_CHUNK_SIZE) == 0) {
     lwip_close(sd);
     return 0;
   }
+  if (recv_buf[0] == '\0') {
+    transfer_join(sd);
+    lwip_close(sd);
+    return 0;
+  }
+  uint64_t size;
+  if (transfer_read_u64(sd, &size) != 0) {
+    lwip_close(sd);
+    return 0;
+  }
   char *target_file_path = recv_buf;
-  log_info("target_file %s", target_file_path);
-  int f = open(target_file_path, O_CREAT | O_RDWR, 0600);
-  log_info("fd %d", f);
-  while (true) {
-    log_info("file_receiver_request read");
-    if ((n = lwip_read(sd, recv_buf, READ_CHUNK_SIZE)) < 0) {
-      log_error("read error");
-      break;
+  log_info("target_file %s size %llu", target_file_path,
+           (unsigned long long)size);
+  if (size == TRANSFER_SIZE_DIR) {
+    if (dirstream_recv(sd, target_file_path, NULL) != 0) {
+      log_error("receive folder %s failed", target_file_path);
     }
-    if (n == 0) {
-      log_error("read eof");
-      break;
+    lwip_close(sd);
+    return 0;
+  }
+  unsigned char probe[HASH_SHA256_SIZE];
+  unsigned char digest[HASH_SHA256_SIZE];
+  if (transfer_read_full(sd, probe, sizeof(probe)) != 0) {
+    lwip_close(sd);
+    return 0;
+  }
+  bool check = contentstore_has(probe, size);
+  if (check && (transfer_write_u64(sd, CONTENTSTORE_CHECK) != 0 ||
+                transfer_read_full(sd, digest, sizeof(digest)) != 0)) {
+    lwip_close(sd);
+    return 0;
+  }
+  if (check &&
+      contentstore_materialize(probe, size, digest, target_file_path) == 0) {
+    // 之前中断留下的 .ttpart 已经没用了
+    char part[PATH_MAX];
+    if (snprintf(part, sizeof(part), "%s%s", target_file_path,
+                 TRANSFER_PART_SUFFIX) < (int)sizeof(part)) {
+      unlink(part);
     }
-    log_debug("write");
-    int w = write(f, recv_buf, n);
-    log_info("w: %d %d", w, errno);
+    transfer_write_u64(sd, CONTENTSTORE_HIT);
+  } else if (transfer_write_u64(sd, CONTENTSTORE_MISS) != 0 ||
+             transfer_sink(sd, target_file_path, size, NULL, NULL,
+                           NULL) != 0) {
+    log_error("receive %s failed", target_file_path);
+  } else {
+    contentstore_add(probe, size, target_file_path);
   }
-  close(f);
-  log_error("virserver process_echo_request closeed!!");
-  /* close connection */
   lwip_close(sd);
   return 0;
 }
@@ -76,40 +136,46 @@ int file_receiver_start() {
         file_receiver_request, "file_receiver_worker");
 }
 
+// 协议：对端发来路径字符串，回复文件大小（u64，打开失败时为
+// TRANSFER_SIZE_ERROR，目录为 TRANSFER_SIZE_DIR），之后按 transfer_source
+// 续传或者发送 dirstream
 static int file_sender_request(void *p) {
   int sd = (int)(intptr_t)p;
   vnet_setsocketdefaultopt(sd);
   char recv_buf[READ_CHUNK_SIZE];
-  int n, nwrote;
   log_info("sd: %d", sd);
   if (vnet_readstring(sd, recv_buf, READ_CHUNK_SIZE) == 0) {
     lwip_close(sd);
     return 0;
   }
+  if (recv_buf[0] == '\0') {
+    transfer_join(sd);
+    lwip_close(sd);
+    return 0;
+  }
   char *target_file_path = recv_buf;
   log_info("target_file %s", target_file_path);
+  struct stat st;
   int f = open(target_file_path, O_RDONLY);
-  if (f < 0) {
-    // TODO
-  }
-  log_info("read fd %d", f);
-  // n = lwip_read(sd, recv_buf, RECV_BUF_SIZE)
-  while (1) {
-    log_info("file_sender_request read");
-    /* read a max of RECV_BUF_SIZE bytes from socket */
-    if ((n = read(f, recv_buf, READ_CHUNK_SIZE)) < 0) {
-      // xil_printf("%s: error reading from socket %d, closing socket\r\n",
-      // __FUNCTION__, sd);
-      break;
+  if (f < 0 || fstat(f, &st) != 0) {
+    log_error("open %s error %s", target_file_path, strerror(errno));
+    transfer_write_u64(sd, TRANSFER_SIZE_ERROR);
+    if (f >= 0) {
+      close(f);
     }
-    /* break if client closed connectxion */
-    if (n == 0) break;
-
-    int w = lwip_write(sd, recv_buf, n);
+    lwip_close(sd);
+    return 0;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    if (transfer_write_u64(sd, TRANSFER_SIZE_DIR) != 0 ||
+        dirstream_send(sd, target_file_path, NULL) != 0) {
+      log_error("send folder %s failed", target_file_path);
+    }
+  } else if (transfer_write_u64(sd, st.st_size) != 0 ||
+             transfer_source(sd, f, st.st_size, NULL, NULL, NULL) != 0) {
+    log_error("send %s failed", target_file_path);
   }
   close(f);
-  log_error("virserver process_echo_request closeed!!");
-  /* close connection */
   lwip_close(sd);
   return 0;
 }
@@ -120,46 +186,85 @@ int file_sender_start() {
 
 }
 
+static void exchange_done(path_exchange_t *pe, bool ok) {
+  progress_end(pe->progress, ok);
+  task_finished(pe->src_path, ok);
+  free(pe);
+}
+
 static int file_send_request(path_exchange_t *pe) {
-  set_running_task_changed(1);
-  int nfd = vnet_tcp_connect(receiver_service_port);
   log_debug("open local %s to send file %s", pe->src_path, pe->dst_path);
-  vnet_send(nfd, pe->dst_path, strlen(pe->dst_path) + 1);  // with_zero_as_split
+  struct stat st;
   int fd = open(pe->src_path, O_RDONLY);
-  if (fd < 0) {
+  if (fd < 0 || fstat(fd, &st) != 0) {
     log_error("open_error");
-    vnet_close(nfd);
-    set_running_task_changed(-1);
+    if (fd >= 0) {
+      close(fd);
+    }
+    exchange_done(pe, false);
+    return -1;
+  }
+  int nfd = vnet_tcp_connect(pe->agent, receiver_service_port);
+  if (nfd < 0) {
+    close(fd);
+    exchange_done(pe, false);
     return -1;
   }
-  char buf[READ_CHUNK_SIZE];
-  while (true) {
-    int readbytes = read(fd, buf, READ_CHUNK_SIZE);
-    if (readbytes < 0) {
-      log_debug("readbytes<0");
+  vnet_send(nfd, pe->dst_path, strlen(pe->dst_path) + 1);  // with_zero_as_split
+  bool ok = false;
+  if (S_ISDIR(st.st_mode)) {
+    if (transfer_write_u64(nfd, TRANSFER_SIZE_DIR) != 0 ||
+        dirstream_send(nfd, pe->src_path, pe->progress) != 0) {
+      log_error("send folder %s failed", pe->src_path);
+    } else {
+      ok = true;
+    }
+  } else {
+    progress_set_total(pe->progress, st.st_size);
+    // 摘要算不出来时发全 0，对端不会命中
+    unsigned char probe[HASH_SHA256_SIZE];
+    unsigned char digest[HASH_SHA256_SIZE];
+    if (contentstore_probe_fd(fd, st.st_size, probe) != 0) {
+      memset(probe, 0, sizeof(probe));
     }
-    if (readbytes == 0) {
-      log_debug("readbytes==0");
-      break;
+    uint64_t found;
+    bool sent = transfer_write_u64(nfd, st.st_size) == 0 &&
+                transfer_write_full(nfd, probe, sizeof(probe)) == 0 &&
+                transfer_read_u64(nfd, &found) == 0;
+    if (sent && found == CONTENTSTORE_CHECK) {
+      // 对端有大小和首尾都相同的内容，这时才读整个文件
+      if (contentstore_digest_fd(fd, digest) != 0) {
+        memset(digest, 0, sizeof(digest));
+      }
+      sent = transfer_write_full(nfd, digest, sizeof(digest)) == 0 &&
+             transfer_read_u64(nfd, &found) == 0;
+    }
+    if (!sent) {
+      log_error("send %s failed", pe->src_path);
+    } else if (found == CONTENTSTORE_HIT) {
+      log_info("%s already on remote", pe->src_path);
+      ok = true;
+    } else if (transfer_source(nfd, fd, st.st_size, dial_receiver, pe,
+                               pe->progress) != 0) {
+      log_error("send %s failed", pe->src_path);
+    } else {
+      ok = true;
     }
-    log_debug("vnet_send %d", readbytes);
-    vnet_send(nfd, buf, readbytes);
-    log_debug("vnet_send_end");
   }
-  // check path is exist, file can writeable.
   vnet_close(nfd);
   close(fd);
-  set_running_task_changed(-1);
+  exchange_done(pe, ok);
   return 0;
 }
 
-int file_send_start(char *src_path, char *dst_path) {
+int file_send_start(int agent, char *src_path, char *dst_path) {
   log_info("file_send_start1");
   path_exchange_t *pe = (path_exchange_t *)malloc(sizeof(path_exchange_t));
   if (pe == NULL) {
     log_error("malloc path_exchange_t failed");
     return -1;
   }
+  pe->agent = agent;
   if (snprintf(pe->src_path, sizeof(pe->src_path), "%s", src_path) >=
           (int)sizeof(pe->src_path) ||
       snprintf(pe->dst_path, sizeof(pe->dst_path), "%s", dst_path) >=
@@ -183,52 +288,57 @@ int file_send_start(char *src_path, char *dst_path) {
     // uv_async_send(pe->exchange_notify);
   }
   log_info("file_send_start2");
+  // 在主循环里登记，cli 随后的进度和任务数请求一定能看到这个传输
+  pe->progress = progress_begin(src_path, -1);
+  task_started(src_path);
   sys_thread_new("file_send", (lwip_thread_fn)file_send_request, (void *)pe,
                  DEFAULT_THREAD_STACKSIZE, DEFAULT_THREAD_PRIO);
   return 0;
 }
 
 static int file_recv_request(path_exchange_t *pe) {
-  set_running_task_changed(1);  // TODO 计数机制问题
-  int nfd = vnet_tcp_connect(sender_service_port);
+  int nfd = vnet_tcp_connect(pe->agent, sender_service_port);
+  if (nfd < 0) {
+    exchange_done(pe, false);
+    return 0;
+  }
   vnet_send(nfd, pe->src_path, strlen(pe->src_path) + 1);  // with_zero_as_split
-  log_info("open %s for write to recv", pe->dst_path);
-  // TODO read stat info
-  int fd = open(pe->dst_path, O_WRONLY | O_CREAT, 0600);  // TODO chmod
-  if (fd < 0) {
+  uint64_t size;
+  if (transfer_read_u64(nfd, &size) != 0 || size == TRANSFER_SIZE_ERROR) {
+    log_error("remote open %s failed", pe->src_path);
     vnet_close(nfd);
-    log_error("open error");
-    set_running_task_changed(-1);
+    exchange_done(pe, false);
     return 0;
   }
-  char buf[READ_CHUNK_SIZE];
-  while (true) {
-    int readbytes = vnet_recv(nfd, buf, READ_CHUNK_SIZE);
-    log_error("recv done");
-    if (readbytes < 0) {
-      // TODO
-      log_error("<0");
-      break;
+  log_info("open %s for write to recv", pe->dst_path);
+  bool ok = false;
+  if (size == TRANSFER_SIZE_DIR) {
+    if (dirstream_recv(nfd, pe->dst_path, pe->progress) != 0) {
+      log_error("receive folder %s failed", pe->src_path);
+    } else {
+      ok = true;
     }
-    if (readbytes == 0) {
-      log_error("==0");
-      break;
+  } else {
+    progress_set_total(pe->progress, size);
+    if (transfer_sink(nfd, pe->dst_path, size, dial_sender, pe,
+                      pe->progress) != 0) {
+      log_error("receive %s failed", pe->src_path);
+    } else {
+      ok = true;
     }
-    write(fd, buf, readbytes);
   }
-  // TODO(jdz) check path is exist, file can writeable.
   vnet_close(nfd);
-  close(fd);
-  set_running_task_changed(-1);
+  exchange_done(pe, ok);
   return 0;
 }
 
-int file_recv_start(char *src_path, char *dst_path) {
+int file_recv_start(int agent, char *src_path, char *dst_path) {
   path_exchange_t *pe = (path_exchange_t *)malloc(sizeof(path_exchange_t));
   if (pe == NULL) {
     log_error("malloc path_exchange_t failed");
     return -1;
   }
+  pe->agent = agent;
   if (snprintf(pe->src_path, sizeof(pe->src_path), "%s", src_path) >=
           (int)sizeof(pe->src_path) ||
       snprintf(pe->dst_path, sizeof(pe->dst_path), "%s", dst_path) >=
@@ -238,6 +348,8 @@ int file_recv_start(char *src_path, char *dst_path) {
     return -1;
   }
   log_debug("file_recv_start");
+  pe->progress = progress_begin(src_path, -1);
+  task_started(src_path);
   sys_thread_new("file_recv", (lwip_thread_fn)file_recv_request, (void *)pe,
                  DEFAULT_THREAD_STACKSIZE, DEFAULT_THREAD_PRIO);
   return 0;
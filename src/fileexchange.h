@@ -9,10 +9,11 @@
 #define TERMTUNNEL_FILEEXCHANGE_H
 #include <stdint.h>
 
-int file_send_start(char *src_path, char *dst_path);
+// agent 是对端 agent 的编号，见 route.h
+int file_send_start(int agent, char *src_path, char *dst_path);
 int file_receiver_start(void);
 
-int file_recv_start(char *src_path, char *dst_path);
+int file_recv_start(int agent, char *src_path, char *dst_path);
 int file_sender_start(void);
 
 #endif
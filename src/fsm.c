@@ -38,14 +38,24 @@ void fallback_to_plaintext(fsm_context *ctx) {
   ctx->processed = ctx->offset;
 }
 
-void fsm_append_output(fsm_context *ctx, char *output, int output_size) {
+void fsm_append_output(fsm_context *ctx, const char *output, int output_size) {
   if (!ctx->output) {
     ctx->output_cap = 1024;
     ctx->output = (char *)malloc(ctx->output_cap);
   }
+  if (output_size + ctx->output_size > ctx->output_cap &&
+      ctx->output_head > 0) {
+    // 已经取走的帧腾出来
+    ctx->output_size -= ctx->output_head;
+    memmove(ctx->output, ctx->output + ctx->output_head, ctx->output_size);
+    ctx->output_head = 0;
+  }
   if (output_size + ctx->output_size > ctx->output_cap) {
-    ctx->output_cap *= 2;
+    while (output_size + ctx->output_size > ctx->output_cap) {
+      ctx->output_cap *= 2;
+    }
     ctx->output = realloc(ctx->output, ctx->output_cap);
+    CHECK(ctx->output, "!ctx->output");
   }
   memmerge(ctx->output, output, ctx->output_size, output_size);
   ctx->output_size += output_size;
@@ -90,15 +100,21 @@ void handle_plaintext(fsm_context *ctx) {
   char a = ctx->input[ctx->offset];
   if (a == '[' - 64) {
     ctx->state = ESCAPE_ENTER;
-  } else {
-    // if (ctx->process)
-    // printf("? %d %d\n",ctx->bg_colorflag, ctx->fg_colorflag);
-    if (ctx->bg_colorflag && ctx->fg_colorflag) {
-      fsm_append_output(ctx, &a, 1);
-    }
-    ctx->processed = ctx->offset;
+    ctx->offset++;
+    return;
   }
-  ctx->offset++;
+  // 到下一个 ESC 之前都是正文，整段一起处理。帧的正文里没有 ESC，
+  // 一帧只用一次 memchr 和一次拷贝
+  const char *start = ctx->input + ctx->offset;
+  const char *esc = memchr(start, '[' - 64, ctx->input_size - ctx->offset);
+  int n = esc != NULL ? (int)(esc - start) : ctx->input_size - ctx->offset;
+  // if (ctx->process)
+  // printf("? %d %d\n",ctx->bg_colorflag, ctx->fg_colorflag);
+  if (ctx->bg_colorflag && ctx->fg_colorflag) {
+    fsm_append_output(ctx, start, n);
+  }
+  ctx->offset += n;
+  ctx->processed = ctx->offset - 1;
 }
 
 void handle_escape_enter(fsm_context *ctx) {
@@ -343,19 +359,16 @@ int fsm_pop_output(fsm_context *ctx, char *dst, int max_size) {
 
   //======================== 如果没有碰到!，就不返回结果。
 
-  int loop_size = ctx->output_size;
-  int last = -1;
-  for (int i = 0; i < loop_size; i++) {
-    if (ctx->output[i] == '!') {
-      last = i;
-      break;
-    }
-  }
+  const char *head = ctx->output + ctx->output_head;
+  const char *last =
+      ctx->output_size > ctx->output_head
+          ? memchr(head, '!', ctx->output_size - ctx->output_head)
+          : NULL;
   //如果没有出现过 !
-  if (last == -1) {
+  if (last == NULL) {
     return 0;
   } else {
-    size = last + 1;  //算上！本身的大小
+    size = last - head + 1;  //算上！本身的大小
   }
   //========================
   // int opsize= max_size > size? size:max_size;
@@ -363,7 +376,7 @@ int fsm_pop_output(fsm_context *ctx, char *dst, int max_size) {
   //至少可以写入一frame
   CHECK(size + 1 <= max_size, "no mem to write frame");
   int opsize = size;
-  memcpy(dst, ctx->output, opsize);
+  memcpy(dst, head, opsize);
   dst[opsize] = '\0';
   // debug
 #if 0
@@ -374,9 +387,12 @@ int fsm_pop_output(fsm_context *ctx, char *dst, int max_size) {
     free(a);
 #endif
 
-  ctx->output_size -= opsize;
-
-  memmove(ctx->output, opsize + ctx->output, ctx->output_size);
+  // 只移动读的位置，剩下的留到下次追加时再挪
+  ctx->output_head += opsize;
+  if (ctx->output_head == ctx->output_size) {
+    ctx->output_head = 0;
+    ctx->output_size = 0;
+  }
   return opsize;
 }
 
@@ -37,6 +37,7 @@ typedef struct {
   char *output;
   int output_cap;
   int output_size;
+  int output_head;  // output 里还没取走的帧从这里开始
   // ringbuf_t buf;
   csi_info *csi;
 
@@ -0,0 +1,316 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+// 文件分块校验用的哈希。
+// xxh64 按 https://github.com/Cyan4973/xxHash 的规范实现，两端可能是不同
+// 字节序的机器，输入统一按小端读取。
+// sha256 按 FIPS 180-4 实现，用来给文件内容寻址。
+// crc32 是 IEEE 802.3 的多项式（反射，0xEDB88320），用来校验链路上的帧。
+// crc32c 是 Castagnoli 多项式（反射，0x82F63B78），CPU 有 SSE4.2 或 ARMv8
+// crc 指令时用指令算，否则查表。
+#include "hash.h"
+
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read_le64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
+
+static inline uint32_t read_le32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap32(v);
+#endif
+  return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+  acc += input * XXH_PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+  acc ^= xxh64_round(0, val);
+  return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+uint64_t hash_xxh64(const void *data, size_t len, uint64_t seed) {
+  const unsigned char *p = (const unsigned char *)data;
+  const unsigned char *end = p + len;
+  uint64_t h;
+  if (len >= 32) {
+    const unsigned char *limit = end - 32;
+    uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    uint64_t v2 = seed + XXH_PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - XXH_PRIME64_1;
+    do {
+      v1 = xxh64_round(v1, read_le64(p));
+      v2 = xxh64_round(v2, read_le64(p + 8));
+      v3 = xxh64_round(v3, read_le64(p + 16));
+      v4 = xxh64_round(v4, read_le64(p + 24));
+      p += 32;
+    } while (p <= limit);
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = xxh64_merge(h, v1);
+    h = xxh64_merge(h, v2);
+    h = xxh64_merge(h, v3);
+    h = xxh64_merge(h, v4);
+  } else {
+    h = seed + XXH_PRIME64_5;
+  }
+  h += (uint64_t)len;
+  while (p + 8 <= end) {
+    h ^= xxh64_round(0, read_le64(p));
+    h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    p += 8;
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t)read_le32(p) * XXH_PRIME64_1;
+    h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+    p += 4;
+  }
+  while (p < end) {
+    h ^= (*p) * XXH_PRIME64_5;
+    h = rotl64(h, 11) * XXH_PRIME64_1;
+    p++;
+  }
+  h ^= h >> 33;
+  h *= XXH_PRIME64_2;
+  h ^= h >> 29;
+  h *= XXH_PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+static uint32_t crc32_table[256];
+static uint32_t crc32c_table[256];
+
+static void crc_init_table(uint32_t table[256], uint32_t poly) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = c & 1 ? poly ^ (c >> 1) : c >> 1;
+    }
+    table[i] = c;
+  }
+}
+
+static uint32_t crc_by_table(const uint32_t table[256], uint32_t c,
+                             const unsigned char *p, size_t len) {
+  while (len--) {
+    c = table[(c ^ *p++) & 0xff] ^ (c >> 8);
+  }
+  return c;
+}
+
+uint32_t hash_crc32(const void *data, size_t len) {
+  // 表的最后一项不为 0 说明已经生成好了
+  if (crc32_table[255] == 0) {
+    crc_init_table(crc32_table, 0xEDB88320u);
+  }
+  return crc_by_table(crc32_table, 0xFFFFFFFFu, (const unsigned char *)data,
+                      len) ^
+         0xFFFFFFFFu;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(
+    uint32_t c, const unsigned char *p, size_t len) {
+#if defined(__x86_64__)
+  uint64_t c64 = c;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    c64 = _mm_crc32_u64(c64, v);
+  }
+  c = (uint32_t)c64;
+#endif
+  for (; len >= 4; p += 4, len -= 4) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    c = _mm_crc32_u32(c, v);
+  }
+  while (len--) {
+    c = _mm_crc32_u8(c, *p++);
+  }
+  return c;
+}
+
+static int crc32c_hw_usable() {
+  static int usable = -1;
+  if (usable < 0) {
+    __builtin_cpu_init();
+    usable = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+  }
+  return usable;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hw(uint32_t c, const unsigned char *p, size_t len) {
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    c = __crc32cd(c, v);
+  }
+  while (len--) {
+    c = __crc32cb(c, *p++);
+  }
+  return c;
+}
+
+static int crc32c_hw_usable() { return 1; }
+#else
+static uint32_t crc32c_hw(uint32_t c, const unsigned char *p, size_t len) {
+  return c;
+}
+
+static int crc32c_hw_usable() { return 0; }
+#endif
+
+uint32_t hash_crc32c(const void *data, size_t len) {
+  const unsigned char *p = (const unsigned char *)data;
+  // crc 指令按小端读多字节，和逐字节查表的结果一致
+  if (crc32c_hw_usable()) {
+    return crc32c_hw(0xFFFFFFFFu, p, len) ^ 0xFFFFFFFFu;
+  }
+  if (crc32c_table[255] == 0) {
+    crc_init_table(crc32c_table, 0x82F63B78u);
+  }
+  return crc_by_table(crc32c_table, 0xFFFFFFFFu, p, len) ^ 0xFFFFFFFFu;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline uint32_t rotr32(uint32_t x, int r) {
+  return (x >> r) | (x << (32 - r));
+}
+
+static void sha256_compress(uint32_t state[8], const unsigned char *p) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = ((uint32_t)p[i * 4] << 24) | ((uint32_t)p[i * 4 + 1] << 16) |
+           ((uint32_t)p[i * 4 + 2] << 8) | p[i * 4 + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^
+                  (w[i - 15] >> 3);
+    uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^
+                  (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+    uint32_t ch = (e & f) ^ (~e & g);
+    uint32_t t1 = h + s1 + ch + sha256_k[i] + w[i];
+    uint32_t s0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+    uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+    uint32_t t2 = s0 + maj;
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+void hash_sha256_init(hash_sha256_t *ctx) {
+  static const uint32_t iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                 0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                 0x1f83d9ab, 0x5be0cd19};
+  memcpy(ctx->state, iv, sizeof(iv));
+  ctx->length = 0;
+  ctx->used = 0;
+}
+
+void hash_sha256_update(hash_sha256_t *ctx, const void *data, size_t len) {
+  const unsigned char *p = (const unsigned char *)data;
+  ctx->length += len;
+  if (ctx->used > 0) {
+    size_t take = 64 - ctx->used < len ? 64 - ctx->used : len;
+    memcpy(ctx->block + ctx->used, p, take);
+    ctx->used += take;
+    p += take;
+    len -= take;
+    if (ctx->used < 64) {
+      return;
+    }
+    sha256_compress(ctx->state, ctx->block);
+    ctx->used = 0;
+  }
+  for (; len >= 64; p += 64, len -= 64) {
+    sha256_compress(ctx->state, p);
+  }
+  memcpy(ctx->block, p, len);
+  ctx->used = len;
+}
+
+void hash_sha256_final(hash_sha256_t *ctx, unsigned char out[HASH_SHA256_SIZE]) {
+  uint64_t bits = ctx->length * 8;
+  ctx->block[ctx->used++] = 0x80;
+  if (ctx->used > 56) {
+    memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+    sha256_compress(ctx->state, ctx->block);
+    ctx->used = 0;
+  }
+  memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+  for (int i = 0; i < 8; i++) {
+    ctx->block[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+  }
+  sha256_compress(ctx->state, ctx->block);
+  for (int i = 0; i < 8; i++) {
+    out[i * 4] = (unsigned char)(ctx->state[i] >> 24);
+    out[i * 4 + 1] = (unsigned char)(ctx->state[i] >> 16);
+    out[i * 4 + 2] = (unsigned char)(ctx->state[i] >> 8);
+    out[i * 4 + 3] = (unsigned char)ctx->state[i];
+  }
+}
@@ -0,0 +1,28 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#ifndef TERMTUNNEL_HASH_H
+#define TERMTUNNEL_HASH_H
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_SHA256_SIZE 32
+
+typedef struct {
+  uint32_t state[8];
+  uint64_t length;
+  unsigned char block[64];
+  size_t used;
+} hash_sha256_t;
+
+uint64_t hash_xxh64(const void *data, size_t len, uint64_t seed);
+uint32_t hash_crc32(const void *data, size_t len);
+uint32_t hash_crc32c(const void *data, size_t len);
+void hash_sha256_init(hash_sha256_t *ctx);
+void hash_sha256_update(hash_sha256_t *ctx, const void *data, size_t len);
+void hash_sha256_final(hash_sha256_t *ctx, unsigned char out[HASH_SHA256_SIZE]);
+#endif
@@ -0,0 +1,584 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+// HTTP/1.1 报文解析，供 http 代理（agent 侧）和本地缓存使用。
+// 只做代理需要的部分：请求行/状态行、头部、Content-Length/chunked 分帧。
+#include "http.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include "log.h"
+
+static const char *hop_by_hop_headers[] = {
+    "connection",          "keep-alive", "proxy-connection",
+    "proxy-authorization", "te",         "trailer",
+    "upgrade",             NULL};
+
+void http_stream_init(http_stream_t *s, int fd, http_read_fn r,
+                      http_write_fn w) {
+  s->fd = fd;
+  s->read = r;
+  s->write = w;
+  s->rpos = 0;
+  s->rend = 0;
+  s->tee_fd = -1;
+  s->tee_limit = 0;
+  s->tee_bytes = 0;
+}
+
+void http_stream_set_tee(http_stream_t *s, int fd, int64_t limit) {
+  s->tee_fd = fd;
+  s->tee_limit = limit;
+  s->tee_bytes = 0;
+}
+
+static void tee_write(http_stream_t *s, const char *buf, int n) {
+  if (s->tee_fd < 0) {
+    return;
+  }
+  if (s->tee_bytes + n > s->tee_limit) {
+    s->tee_fd = -1;
+    return;
+  }
+  int left = n;
+  while (left > 0) {
+    ssize_t w = write(s->tee_fd, buf + (n - left), left);
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      s->tee_fd = -1;
+      return;
+    }
+    left -= w;
+  }
+  s->tee_bytes += n;
+}
+
+int http_stream_prefill(http_stream_t *s, const char *data, int size) {
+  if (size < 0 || s->rend + size > HTTP_BUFFER_SIZE) {
+    return -1;
+  }
+  memcpy(s->buf + s->rend, data, size);
+  s->rend += size;
+  return size;
+}
+
+int http_stream_buffered(http_stream_t *s) { return s->rend - s->rpos; }
+
+static int http_stream_fill(http_stream_t *s) {
+  if (s->rpos > 0) {
+    memmove(s->buf, s->buf + s->rpos, s->rend - s->rpos);
+    s->rend -= s->rpos;
+    s->rpos = 0;
+  }
+  if (s->rend == HTTP_BUFFER_SIZE) {
+    return -1;
+  }
+  while (true) {
+    ssize_t n = s->read(s->fd, s->buf + s->rend, HTTP_BUFFER_SIZE - s->rend);
+    if (n < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      return -1;
+    }
+    s->rend += n;
+    return (int)n;
+  }
+}
+
+int http_writen(http_stream_t *s, const void *buf, int n) {
+  const char *ptr = (const char *)buf;
+  tee_write(s, ptr, n);
+  int left = n;
+  while (left > 0) {
+    ssize_t w = s->write(s->fd, ptr, left);
+    if (w < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      return -1;
+    }
+    if (w == 0) {
+      return -1;
+    }
+    left -= w;
+    ptr += w;
+  }
+  return n;
+}
+
+static int find_head_end(const char *buf, int size) {
+  for (int i = 0; i + 1 < size; i++) {
+    if (buf[i] != '\n') {
+      continue;
+    }
+    if (buf[i + 1] == '\n') {
+      return i + 2;
+    }
+    if (i + 2 < size && buf[i + 1] == '\r' && buf[i + 2] == '\n') {
+      return i + 3;
+    }
+  }
+  return -1;
+}
+
+// 读取到空行为止，多读的部分留在 stream 中（pipelining 的下一个请求）。
+// 返回头部长度，0 表示对端在请求之间正常关闭，-1 表示出错。
+int http_read_head(http_stream_t *s, http_message_t *m) {
+  while (true) {
+    int buffered = s->rend - s->rpos;
+    int end = find_head_end(s->buf + s->rpos, buffered);
+    if (end > 0) {
+      if (end >= (int)sizeof(m->head)) {
+        return -1;
+      }
+      memcpy(m->head, s->buf + s->rpos, end);
+      m->head[end] = '\0';
+      m->head_len = end;
+      s->rpos += end;
+      return end;
+    }
+    int n = http_stream_fill(s);
+    if (n < 0) {
+      log_info("http head too large or read error");
+      return -1;
+    }
+    if (n == 0) {
+      return (s->rend - s->rpos) == 0 ? 0 : -1;
+    }
+  }
+}
+
+static char *next_line(char **cursor) {
+  char *line = *cursor;
+  char *nl = strchr(line, '\n');
+  if (nl == NULL) {
+    return NULL;
+  }
+  *nl = '\0';
+  if (nl > line && *(nl - 1) == '\r') {
+    *(nl - 1) = '\0';
+  }
+  *cursor = nl + 1;
+  return line;
+}
+
+static char *trim(char *s) {
+  while (*s == ' ' || *s == '\t') {
+    s++;
+  }
+  char *e = s + strlen(s);
+  while (e > s && (*(e - 1) == ' ' || *(e - 1) == '\t')) {
+    *(--e) = '\0';
+  }
+  return s;
+}
+
+bool http_header_has_token(const char *value, const char *token) {
+  if (value == NULL) {
+    return false;
+  }
+  size_t token_len = strlen(token);
+  const char *p = value;
+  while (*p) {
+    while (*p == ' ' || *p == '\t' || *p == ',') {
+      p++;
+    }
+    const char *start = p;
+    while (*p && *p != ',') {
+      p++;
+    }
+    const char *end = p;
+    while (end > start && (*(end - 1) == ' ' || *(end - 1) == '\t')) {
+      end--;
+    }
+    if ((size_t)(end - start) == token_len &&
+        strncasecmp(start, token, token_len) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool http_is_hop_by_hop(const char *name) {
+  for (int i = 0; hop_by_hop_headers[i] != NULL; i++) {
+    if (strcasecmp(name, hop_by_hop_headers[i]) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *http_get_header(http_message_t *m, const char *name) {
+  for (int i = 0; i < m->header_count; i++) {
+    if (strcasecmp(m->headers[i].name, name) == 0) {
+      return m->headers[i].value;
+    }
+  }
+  return NULL;
+}
+
+static int parse_headers(http_message_t *m, char *cursor) {
+  m->header_count = 0;
+  m->content_length = -1;
+  m->chunked = false;
+  char *line;
+  while ((line = next_line(&cursor)) != NULL) {
+    if (*line == '\0') {
+      break;
+    }
+    char *colon = strchr(line, ':');
+    if (colon == NULL || colon == line) {
+      return -1;
+    }
+    if (m->header_count >= HTTP_MAX_HEADERS) {
+      return -1;
+    }
+    *colon = '\0';
+    http_header_t *h = &m->headers[m->header_count++];
+    h->name = trim(line);
+    h->value = trim(colon + 1);
+    if (strcasecmp(h->name, "Content-Length") == 0) {
+      char *end = NULL;
+      long long v = strtoll(h->value, &end, 10);
+      if (end == h->value || v < 0) {
+        return -1;
+      }
+      m->content_length = v;
+    } else if (strcasecmp(h->name, "Transfer-Encoding") == 0) {
+      m->chunked = http_header_has_token(h->value, "chunked");
+    }
+  }
+  if (m->chunked) {
+    m->content_length = -1;
+  }
+  const char *conn = http_get_header(m, "Connection");
+  const char *pconn = http_get_header(m, "Proxy-Connection");
+  if (m->minor_version >= 1) {
+    m->keep_alive = !http_header_has_token(conn, "close") &&
+                    !http_header_has_token(pconn, "close");
+  } else {
+    m->keep_alive = http_header_has_token(conn, "keep-alive") ||
+                    http_header_has_token(pconn, "keep-alive");
+  }
+  return 0;
+}
+
+static int parse_authority(http_message_t *m, const char *start,
+                           const char *end, uint16_t default_port) {
+  const char *host_end = end;
+  const char *port_start = NULL;
+  if (start < end && *start == '[') {
+    const char *bracket = memchr(start, ']', end - start);
+    if (bracket == NULL) {
+      return -1;
+    }
+    start++;
+    host_end = bracket;
+    if (bracket + 1 < end && *(bracket + 1) == ':') {
+      port_start = bracket + 2;
+    }
+  } else {
+    const char *colon = memchr(start, ':', end - start);
+    if (colon != NULL) {
+      host_end = colon;
+      port_start = colon + 1;
+    }
+  }
+  size_t host_len = host_end - start;
+  if (host_len == 0 || host_len >= sizeof(m->host)) {
+    return -1;
+  }
+  memcpy(m->host, start, host_len);
+  m->host[host_len] = '\0';
+  m->port = default_port;
+  if (port_start != NULL && port_start < end) {
+    long port = strtol(port_start, NULL, 10);
+    if (port <= 0 || port > 65535) {
+      return -1;
+    }
+    m->port = (uint16_t)port;
+  }
+  return 0;
+}
+
+static int parse_version(const char *s, int *minor) {
+  if (strncmp(s, "HTTP/1.", 7) != 0 || !isdigit((unsigned char)s[7])) {
+    return -1;
+  }
+  *minor = s[7] - '0';
+  return 0;
+}
+
+int http_parse_request(http_message_t *m) {
+  char *cursor = m->head;
+  char *line = next_line(&cursor);
+  if (line == NULL) {
+    return -1;
+  }
+  char *sp1 = strchr(line, ' ');
+  if (sp1 == NULL) {
+    return -1;
+  }
+  *sp1 = '\0';
+  char *sp2 = strchr(sp1 + 1, ' ');
+  if (sp2 == NULL) {
+    return -1;
+  }
+  *sp2 = '\0';
+  m->method = line;
+  m->target = sp1 + 1;
+  for (char *p = m->method; *p; p++) {
+    *p = (char)toupper((unsigned char)*p);
+  }
+  if (parse_version(sp2 + 1, &m->minor_version) != 0) {
+    return -1;
+  }
+  if (parse_headers(m, cursor) != 0) {
+    return -1;
+  }
+  m->host[0] = '\0';
+  m->port = 80;
+  if (strcmp(m->method, "CONNECT") == 0) {
+    m->path = m->target;
+    return parse_authority(m, m->target, m->target + strlen(m->target), 443);
+  }
+  if (strncasecmp(m->target, "http://", 7) == 0) {
+    char *authority = m->target + 7;
+    char *slash = strchr(authority, '/');
+    char *end = slash ? slash : authority + strlen(authority);
+    if (parse_authority(m, authority, end, 80) != 0) {
+      return -1;
+    }
+    m->path = slash ? slash : "/";
+    return 0;
+  }
+  // origin-form, 透明代理场景下依赖 Host 头
+  const char *host = http_get_header(m, "Host");
+  if (host == NULL || m->target[0] != '/') {
+    return -1;
+  }
+  m->path = m->target;
+  return parse_authority(m, host, host + strlen(host), 80);
+}
+
+int http_parse_response(http_message_t *m) {
+  char *cursor = m->head;
+  char *line = next_line(&cursor);
+  if (line == NULL) {
+    return -1;
+  }
+  if (parse_version(line, &m->minor_version) != 0) {
+    return -1;
+  }
+  char *p = line + 8;
+  while (*p == ' ') {
+    p++;
+  }
+  m->status = (int)strtol(p, &p, 10);
+  if (m->status < 100 || m->status > 999) {
+    return -1;
+  }
+  while (*p == ' ') {
+    p++;
+  }
+  m->reason = p;
+  return parse_headers(m, cursor);
+}
+
+bool http_response_has_body(http_message_t *req, http_message_t *resp) {
+  if (req != NULL && strcmp(req->method, "HEAD") == 0) {
+    return false;
+  }
+  if ((resp->status >= 100 && resp->status < 200) || resp->status == 204 ||
+      resp->status == 304) {
+    return false;
+  }
+  return true;
+}
+
+static int append(char *out, int cap, int len, const char *fmt, ...) {
+  if (len < 0 || len >= cap) {
+    return -1;
+  }
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(out + len, cap - len, fmt, ap);
+  va_end(ap);
+  if (n < 0 || n >= cap - len) {
+    return -1;
+  }
+  return len + n;
+}
+
+// 改写为 origin-form 发往上游，去掉逐跳头部，统一使用持久连接。
+int http_serialize_request(http_message_t *m, char *out, int cap) {
+  int len = append(out, cap, 0, "%s %s HTTP/1.1\r\n", m->method, m->path);
+  bool has_host = false;
+  for (int i = 0; i < m->header_count && len > 0; i++) {
+    http_header_t *h = &m->headers[i];
+    if (http_is_hop_by_hop(h->name)) {
+      continue;
+    }
+    if (strcasecmp(h->name, "Host") == 0) {
+      has_host = true;
+    }
+    len = append(out, cap, len, "%s: %s\r\n", h->name, h->value);
+  }
+  if (!has_host) {
+    if (m->port == 80) {
+      len = append(out, cap, len, "Host: %s\r\n", m->host);
+    } else {
+      len = append(out, cap, len, "Host: %s:%hu\r\n", m->host, m->port);
+    }
+  }
+  return append(out, cap, len, "\r\n");
+}
+
+int http_serialize_response(http_message_t *m, bool keep_alive, char *out,
+                            int cap) {
+  int len = append(out, cap, 0, "HTTP/1.1 %d %s\r\n", m->status, m->reason);
+  for (int i = 0; i < m->header_count && len > 0; i++) {
+    http_header_t *h = &m->headers[i];
+    if (http_is_hop_by_hop(h->name)) {
+      continue;
+    }
+    len = append(out, cap, len, "%s: %s\r\n", h->name, h->value);
+  }
+  len = append(out, cap, len, "Connection: %s\r\n",
+               keep_alive ? "keep-alive" : "close");
+  return append(out, cap, len, "\r\n");
+}
+
+static int forward_exact(http_stream_t *src, http_stream_t *dst,
+                         int64_t left) {
+  while (left > 0) {
+    if (src->rend == src->rpos) {
+      int n = http_stream_fill(src);
+      if (n <= 0) {
+        return -1;
+      }
+    }
+    int avail = src->rend - src->rpos;
+    int will = avail < left ? avail : (int)left;
+    if (http_writen(dst, src->buf + src->rpos, will) < 0) {
+      return -1;
+    }
+    src->rpos += will;
+    left -= will;
+  }
+  return 0;
+}
+
+static int read_line(http_stream_t *src, char *line, int cap) {
+  while (true) {
+    char *start = src->buf + src->rpos;
+    char *nl = memchr(start, '\n', src->rend - src->rpos);
+    if (nl != NULL) {
+      int len = (int)(nl - start) + 1;
+      if (len >= cap) {
+        return -1;
+      }
+      memcpy(line, start, len);
+      line[len] = '\0';
+      src->rpos += len;
+      return len;
+    }
+    int n = http_stream_fill(src);
+    if (n <= 0) {
+      return -1;
+    }
+  }
+}
+
+static int forward_chunked(http_stream_t *src, http_stream_t *dst) {
+  char line[1024];
+  while (true) {
+    int len = read_line(src, line, sizeof(line));
+    if (len < 0) {
+      return -1;
+    }
+    char *end = NULL;
+    long long size = strtoll(line, &end, 16);
+    if (end == line || size < 0) {
+      return -1;
+    }
+    if (http_writen(dst, line, len) < 0) {
+      return -1;
+    }
+    if (size == 0) {
+      // trailer，直到空行
+      do {
+        len = read_line(src, line, sizeof(line));
+        if (len < 0 || http_writen(dst, line, len) < 0) {
+          return -1;
+        }
+      } while (!(len == 1 || (len == 2 && line[0] == '\r')));
+      return 0;
+    }
+    if (forward_exact(src, dst, size) != 0) {
+      return -1;
+    }
+    len = read_line(src, line, sizeof(line));
+    if (len < 0 || http_writen(dst, line, len) < 0) {
+      return -1;
+    }
+  }
+}
+
+int http_forward_body(http_stream_t *src, http_stream_t *dst,
+                      int64_t content_length, bool chunked) {
+  if (chunked) {
+    return forward_chunked(src, dst);
+  }
+  if (content_length > 0) {
+    return forward_exact(src, dst, content_length);
+  }
+  return 0;
+}
+
+int http_forward_until_close(http_stream_t *src, http_stream_t *dst) {
+  while (true) {
+    if (src->rend > src->rpos) {
+      if (http_writen(dst, src->buf + src->rpos, src->rend - src->rpos) < 0) {
+        return -1;
+      }
+      src->rpos = src->rend;
+    }
+    int n = http_stream_fill(src);
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      return 0;
+    }
+  }
+}
+
+int http_reply_error(http_stream_t *s, int status, const char *message) {
+  char buffer[512];
+  if (message == NULL) {
+    message = "(null)";
+  }
+  const char *reason = status == 400 ? "Bad Request" : "Bad Gateway";
+  int n = snprintf(buffer, sizeof(buffer),
+                   "HTTP/1.1 %d %s\r\nContent-Type: text/plain\r\n"
+                   "Content-Length: %zu\r\nConnection: close\r\n\r\n%s",
+                   status, reason, strlen(message), message);
+  if (n < 0 || n >= (int)sizeof(buffer)) {
+    return -1;
+  }
+  return http_writen(s, buffer, n);
+}
@@ -0,0 +1,81 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#ifndef TERMTUNNEL_HTTP_H
+#define TERMTUNNEL_HTTP_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define HTTP_BUFFER_SIZE 16384
+#define HTTP_MAX_HEADERS 64
+#define HTTP_HOST_MAX_LENGTH 256
+
+typedef ssize_t (*http_read_fn)(int fd, void *buf, size_t len);
+typedef ssize_t (*http_write_fn)(int fd, const void *buf, size_t len);
+
+// 带缓冲的连接，lwip socket 和普通 socket 共用一套解析逻辑。
+typedef struct {
+  int fd;
+  http_read_fn read;
+  http_write_fn write;
+  char buf[HTTP_BUFFER_SIZE];
+  int rpos;
+  int rend;
+  // 写入的同时复制一份到 tee_fd（本地缓存落盘），写失败时置为 -1
+  int tee_fd;
+  int64_t tee_limit;
+  int64_t tee_bytes;
+} http_stream_t;
+
+typedef struct {
+  char *name;
+  char *value;
+} http_header_t;
+
+typedef struct {
+  char head[HTTP_BUFFER_SIZE];
+  int head_len;
+  // request
+  char *method;
+  char *target;
+  char host[HTTP_HOST_MAX_LENGTH];
+  uint16_t port;
+  char *path;
+  // response
+  int status;
+  char *reason;
+
+  int minor_version;
+  http_header_t headers[HTTP_MAX_HEADERS];
+  int header_count;
+  int64_t content_length;  // -1 if absent
+  bool chunked;
+  bool keep_alive;
+} http_message_t;
+
+void http_stream_init(http_stream_t *s, int fd, http_read_fn r,
+                      http_write_fn w);
+int http_stream_prefill(http_stream_t *s, const char *data, int size);
+int http_stream_buffered(http_stream_t *s);
+void http_stream_set_tee(http_stream_t *s, int fd, int64_t limit);
+int http_read_head(http_stream_t *s, http_message_t *m);
+int http_parse_request(http_message_t *m);
+int http_parse_response(http_message_t *m);
+const char *http_get_header(http_message_t *m, const char *name);
+bool http_header_has_token(const char *value, const char *token);
+bool http_is_hop_by_hop(const char *name);
+bool http_response_has_body(http_message_t *req, http_message_t *resp);
+int http_writen(http_stream_t *s, const void *buf, int n);
+int http_serialize_request(http_message_t *m, char *out, int cap);
+int http_serialize_response(http_message_t *m, bool keep_alive, char *out,
+                            int cap);
+int http_forward_body(http_stream_t *src, http_stream_t *dst,
+                      int64_t content_length, bool chunked);
+int http_forward_until_close(http_stream_t *src, http_stream_t *dst);
+int http_reply_error(http_stream_t *s, int status, const char *message);
+#endif
@@ -0,0 +1,721 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+// local_listen ... 0 的本地 http 缓存层。
+// 新鲜的缓存直接在本地返回，不经过终端；过期的缓存带上 If-None-Match /
+// If-Modified-Since 回源，304 时只需要一个很小的响应头穿过隧道。
+// 缓存文件为 <dir>/<fnv64(url)>：去掉逐跳头部的响应头（不含空行）+ 原始 body，
+// 索引保存在 <dir>/index，每行 name head_len body_len expires last_used url。
+#define _GNU_SOURCE
+#include "httpcache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "http.h"
+#include "log.h"
+#include "portforward.h"
+#include "socksproxy.h"
+#include "thirdparty/uthash.h"
+#include "vclient.h"
+#include "vnet.h"
+
+typedef struct cache_entry {
+  char *url;
+  char name[17];
+  int64_t head_len;
+  int64_t body_len;
+  time_t expires;
+  time_t last_used;
+  UT_hash_handle hh;
+} cache_entry_t;
+
+typedef struct {
+  int agent;
+  http_stream_t client;
+  http_stream_t upstream;
+  http_message_t req;
+  http_message_t resp;
+  http_message_t stored;
+  char url[HTTPCACHE_MAX_URL_LENGTH];
+  char out[HTTP_BUFFER_SIZE];
+} cache_session_t;
+
+static char *cache_dir = NULL;
+static int64_t cache_max_bytes = 0;
+static int64_t cache_bytes = 0;
+static cache_entry_t *cache_index = NULL;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static void cache_path(char *out, size_t size, const char *name) {
+  snprintf(out, size, "%s/%s", cache_dir, name);
+}
+
+static void url_to_name(const char *url, char *name) {
+  uint64_t h = 14695981039346656037ULL;
+  for (const char *p = url; *p; p++) {
+    h ^= (unsigned char)*p;
+    h *= 1099511628211ULL;
+  }
+  snprintf(name, 17, "%016llx", (unsigned long long)h);
+}
+
+// 以下 *_locked 函数调用方需要持有 cache_lock
+static void index_save_locked() {
+  char path[PATH_MAX];
+  char tmp[PATH_MAX];
+  cache_path(path, sizeof(path), "index");
+  cache_path(tmp, sizeof(tmp), "index.tmp");
+  FILE *f = fopen(tmp, "w");
+  if (f == NULL) {
+    log_warn("http cache write index error %s", strerror(errno));
+    return;
+  }
+  cache_entry_t *e, *next;
+  HASH_ITER(hh, cache_index, e, next) {
+    fprintf(f, "%s %lld %lld %lld %lld %s\n", e->name, (long long)e->head_len,
+            (long long)e->body_len, (long long)e->expires,
+            (long long)e->last_used, e->url);
+  }
+  if (fclose(f) != 0 || rename(tmp, path) != 0) {
+    log_warn("http cache write index error %s", strerror(errno));
+    unlink(tmp);
+  }
+}
+
+static void entry_remove_locked(cache_entry_t *e, bool remove_file) {
+  HASH_DEL(cache_index, e);
+  cache_bytes -= e->head_len + e->body_len;
+  if (remove_file) {
+    char path[PATH_MAX];
+    cache_path(path, sizeof(path), e->name);
+    unlink(path);
+  }
+  free(e->url);
+  free(e);
+}
+
+// 按最近使用时间淘汰，直到能放下 incoming 字节
+static void evict_locked(int64_t incoming) {
+  while (cache_index != NULL && cache_bytes + incoming > cache_max_bytes) {
+    cache_entry_t *oldest = cache_index;
+    cache_entry_t *e, *next;
+    HASH_ITER(hh, cache_index, e, next) {
+      if (e->last_used < oldest->last_used) {
+        oldest = e;
+      }
+    }
+    log_debug("http cache evict %s", oldest->url);
+    entry_remove_locked(oldest, true);
+  }
+}
+
+static void index_load() {
+  char path[PATH_MAX];
+  cache_path(path, sizeof(path), "index");
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return;
+  }
+  char line[HTTPCACHE_MAX_URL_LENGTH + 128];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char name[17];
+    long long head_len, body_len, expires, last_used;
+    int offset = 0;
+    if (sscanf(line, "%16s %lld %lld %lld %lld %n", name, &head_len, &body_len,
+               &expires, &last_used, &offset) != 5 ||
+        offset == 0) {
+      continue;
+    }
+    char *url = line + offset;
+    url[strcspn(url, "\r\n")] = '\0';
+    if (*url == '\0') {
+      continue;
+    }
+    // 文件缺失或者大小对不上（写到一半退出），丢弃这条索引
+    char file[PATH_MAX];
+    struct stat st;
+    cache_path(file, sizeof(file), name);
+    if (stat(file, &st) != 0 || st.st_size != head_len + body_len) {
+      continue;
+    }
+    cache_entry_t *e = NULL;
+    HASH_FIND_STR(cache_index, url, e);
+    if (e != NULL) {
+      continue;
+    }
+    e = (cache_entry_t *)calloc(1, sizeof(cache_entry_t));
+    if (e == NULL || (e->url = strdup(url)) == NULL) {
+      free(e);
+      break;
+    }
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    e->head_len = head_len;
+    e->body_len = body_len;
+    e->expires = (time_t)expires;
+    e->last_used = (time_t)last_used;
+    HASH_ADD_KEYPTR(hh, cache_index, e->url, strlen(e->url), e);
+    cache_bytes += head_len + body_len;
+  }
+  fclose(f);
+  evict_locked(0);
+}
+
+static void cache_init() {
+  const char *dir = getenv(HTTPCACHE_DIR_ENV);
+  if (dir == NULL || *dir == '\0') {
+    return;
+  }
+  if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+    log_error("http cache mkdir %s error %s", dir, strerror(errno));
+    return;
+  }
+  long long size_mb = HTTPCACHE_DEFAULT_SIZE_MB;
+  const char *size = getenv(HTTPCACHE_SIZE_ENV);
+  if (size != NULL && atoll(size) > 0) {
+    size_mb = atoll(size);
+  }
+  cache_max_bytes = (int64_t)size_mb * 1024 * 1024;
+  cache_dir = strdup(dir);
+  pthread_mutex_lock(&cache_lock);
+  index_load();
+  pthread_mutex_unlock(&cache_lock);
+  log_info("http cache at %s, %d entries, %lld bytes", cache_dir,
+           HASH_COUNT(cache_index), (long long)cache_bytes);
+}
+
+bool httpcache_enabled() {
+  pthread_once(&cache_once, cache_init);
+  return cache_dir != NULL;
+}
+
+// 查找 Cache-Control 中的指令，返回指令名之后的位置，不存在返回 NULL
+static const char *cache_control_find(const char *value,
+                                      const char *directive) {
+  if (value == NULL) {
+    return NULL;
+  }
+  size_t len = strlen(directive);
+  const char *p = value;
+  while (*p) {
+    while (*p == ' ' || *p == '\t' || *p == ',') {
+      p++;
+    }
+    if (strncasecmp(p, directive, len) == 0 &&
+        (p[len] == '\0' || p[len] == ',' || p[len] == '=' || p[len] == ' ' ||
+         p[len] == '\t')) {
+      return p + len;
+    }
+    while (*p && *p != ',') {
+      p++;
+    }
+  }
+  return NULL;
+}
+
+static long cache_control_seconds(const char *value, const char *directive) {
+  const char *p = cache_control_find(value, directive);
+  if (p == NULL || *p != '=') {
+    return -1;
+  }
+  p++;
+  if (*p == '"') {
+    p++;
+  }
+  long v = strtol(p, NULL, 10);
+  return v < 0 ? 0 : v;
+}
+
+static time_t parse_http_date(const char *value) {
+  if (value == NULL) {
+    return -1;
+  }
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL) {
+    return -1;
+  }
+  return timegm(&tm);
+}
+
+// 计算过期时间点，0 表示每次使用前都要回源验证
+static time_t response_expires(http_message_t *resp, time_t now) {
+  const char *cc = http_get_header(resp, "Cache-Control");
+  if (cache_control_find(cc, "no-cache") != NULL) {
+    return 0;
+  }
+  long lifetime = cache_control_seconds(cc, "s-maxage");
+  if (lifetime < 0) {
+    lifetime = cache_control_seconds(cc, "max-age");
+  }
+  time_t date = parse_http_date(http_get_header(resp, "Date"));
+  if (date < 0) {
+    date = now;
+  }
+  if (lifetime < 0) {
+    const char *expires = http_get_header(resp, "Expires");
+    time_t last_modified =
+        parse_http_date(http_get_header(resp, "Last-Modified"));
+    if (expires != NULL) {
+      time_t t = parse_http_date(expires);
+      lifetime = t < 0 ? 0 : (long)(t - date);
+    } else if (last_modified >= 0 && last_modified < date) {
+      lifetime = (long)((date - last_modified) / 10);
+      if (lifetime > HTTPCACHE_HEURISTIC_MAX_S) {
+        lifetime = HTTPCACHE_HEURISTIC_MAX_S;
+      }
+    } else {
+      lifetime = 0;
+    }
+  }
+  const char *age = http_get_header(resp, "Age");
+  if (age != NULL) {
+    lifetime -= strtol(age, NULL, 10);
+  }
+  return lifetime > 0 ? now + lifetime : 0;
+}
+
+static bool has_validator(http_message_t *resp) {
+  return http_get_header(resp, "ETag") != NULL ||
+         http_get_header(resp, "Last-Modified") != NULL;
+}
+
+static bool request_cacheable(http_message_t *req) {
+  static const char *skip_headers[] = {
+      "Authorization", "Range",    "If-None-Match", "If-Modified-Since",
+      "If-Match",      "If-Range", "If-Unmodified-Since", NULL};
+  if (strcmp(req->method, "GET") != 0 || req->chunked ||
+      req->content_length > 0) {
+    return false;
+  }
+  for (int i = 0; skip_headers[i] != NULL; i++) {
+    if (http_get_header(req, skip_headers[i]) != NULL) {
+      return false;
+    }
+  }
+  return cache_control_find(http_get_header(req, "Cache-Control"),
+                            "no-store") == NULL;
+}
+
+static bool request_wants_revalidate(http_message_t *req) {
+  const char *cc = http_get_header(req, "Cache-Control");
+  return cache_control_find(cc, "no-cache") != NULL ||
+         cache_control_seconds(cc, "max-age") == 0 ||
+         http_header_has_token(http_get_header(req, "Pragma"), "no-cache");
+}
+
+static bool response_storable(http_message_t *resp) {
+  const char *cc = http_get_header(resp, "Cache-Control");
+  if (resp->status != 200 || cache_control_find(cc, "no-store") != NULL ||
+      cache_control_find(cc, "private") != NULL ||
+      http_get_header(resp, "Vary") != NULL ||
+      http_get_header(resp, "Set-Cookie") != NULL) {
+    return false;
+  }
+  return resp->chunked || resp->content_length >= 0;
+}
+
+static int serialize_stored_head(http_message_t *resp, char *out, int cap) {
+  int len = snprintf(out, cap, "HTTP/1.1 %d %s\r\n", resp->status,
+                     resp->reason);
+  for (int i = 0; i < resp->header_count && len > 0 && len < cap; i++) {
+    http_header_t *h = &resp->headers[i];
+    if (http_is_hop_by_hop(h->name)) {
+      continue;
+    }
+    len += snprintf(out + len, cap - len, "%s: %s\r\n", h->name, h->value);
+  }
+  // 读出来时还要追加 Connection 头和空行
+  if (len < 0 || len + 64 >= cap) {
+    return -1;
+  }
+  return len;
+}
+
+// 读取缓存文件的响应头，返回打开的文件，调用方负责关闭
+static int open_entry(const char *url, char *head, int cap, int64_t *head_len,
+                      int64_t *body_len) {
+  char path[PATH_MAX];
+  pthread_mutex_lock(&cache_lock);
+  cache_entry_t *e = NULL;
+  HASH_FIND_STR(cache_index, url, e);
+  if (e == NULL) {
+    pthread_mutex_unlock(&cache_lock);
+    return -1;
+  }
+  cache_path(path, sizeof(path), e->name);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || e->head_len >= cap) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    entry_remove_locked(e, true);
+    index_save_locked();
+    pthread_mutex_unlock(&cache_lock);
+    return -1;
+  }
+  *head_len = e->head_len;
+  *body_len = e->body_len;
+  e->last_used = time(NULL);
+  pthread_mutex_unlock(&cache_lock);
+
+  if (pread(fd, head, *head_len, 0) != *head_len) {
+    close(fd);
+    return -1;
+  }
+  head[*head_len] = '\0';
+  return fd;
+}
+
+// 返回 0 成功，1 缓存不可用需要回源，-1 写客户端失败
+static int serve_from_cache(cache_session_t *s, bool keep_alive) {
+  int64_t head_len, body_len;
+  int fd = open_entry(s->url, s->out, sizeof(s->out), &head_len, &body_len);
+  if (fd < 0) {
+    return 1;
+  }
+  int len = (int)head_len;
+  len += snprintf(s->out + len, sizeof(s->out) - len,
+                  "Connection: %s\r\n\r\n", keep_alive ? "keep-alive" : "close");
+  if (http_writen(&s->client, s->out, len) < 0) {
+    close(fd);
+    return -1;
+  }
+  off_t offset = head_len;
+  while (body_len > 0) {
+    int want = body_len < (int64_t)sizeof(s->out) ? (int)body_len
+                                                    : (int)sizeof(s->out);
+    ssize_t n = pread(fd, s->out, want, offset);
+    if (n <= 0) {
+      close(fd);
+      return -1;
+    }
+    if (http_writen(&s->client, s->out, (int)n) < 0) {
+      close(fd);
+      return -1;
+    }
+    offset += n;
+    body_len -= n;
+  }
+  close(fd);
+  return 0;
+}
+
+static void update_expires(const char *url, time_t expires) {
+  pthread_mutex_lock(&cache_lock);
+  cache_entry_t *e = NULL;
+  HASH_FIND_STR(cache_index, url, e);
+  if (e != NULL) {
+    e->expires = expires;
+    index_save_locked();
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+static void commit_entry(const char *url, const char *tmp, int64_t head_len,
+                         int64_t body_len, time_t expires) {
+  char name[17];
+  char path[PATH_MAX];
+  url_to_name(url, name);
+  cache_path(path, sizeof(path), name);
+  pthread_mutex_lock(&cache_lock);
+  cache_entry_t *e = NULL;
+  HASH_FIND_STR(cache_index, url, e);
+  if (e != NULL) {
+    entry_remove_locked(e, false);
+  }
+  evict_locked(head_len + body_len);
+  e = (cache_entry_t *)calloc(1, sizeof(cache_entry_t));
+  if (e == NULL || (e->url = strdup(url)) == NULL ||
+      rename(tmp, path) != 0) {
+    if (e != NULL) {
+      free(e->url);
+    }
+    free(e);
+    unlink(tmp);
+    index_save_locked();
+    pthread_mutex_unlock(&cache_lock);
+    return;
+  }
+  snprintf(e->name, sizeof(e->name), "%s", name);
+  e->head_len = head_len;
+  e->body_len = body_len;
+  e->expires = expires;
+  e->last_used = time(NULL);
+  HASH_ADD_KEYPTR(hh, cache_index, e->url, strlen(e->url), e);
+  cache_bytes += head_len + body_len;
+  index_save_locked();
+  pthread_mutex_unlock(&cache_lock);
+  log_debug("http cache store %s %lld bytes", url, (long long)body_len);
+}
+
+// 原样转发 CONNECT，之后双向透传
+static void cache_tunnel(cache_session_t *s, int *up_fd, const char *raw,
+                         int raw_len) {
+  if (*up_fd < 0) {
+    *up_fd = vnet_tcp_connect(s->agent, socks5_port);
+    if (*up_fd < 0) {
+      return;
+    }
+    http_stream_init(&s->upstream, *up_fd, lwip_read, lwip_write);
+  }
+  if (http_writen(&s->upstream, raw, raw_len) < 0) {
+    return;
+  }
+  int buffered = http_stream_buffered(&s->client);
+  if (buffered > 0 && http_writen(&s->upstream, s->client.buf + s->client.rpos,
+                                  buffered) < 0) {
+    return;
+  }
+  buffered = http_stream_buffered(&s->upstream);
+  if (buffered > 0 && http_writen(&s->client, s->upstream.buf + s->upstream.rpos,
+                                  buffered) < 0) {
+    return;
+  }
+  pipe_lwip_socket_and_socket_pair(*up_fd, s->client.fd);
+}
+
+// 把请求发往 agent 的 http 代理并读回最终响应头，返回 0 成功
+static int cache_roundtrip(cache_session_t *s, int *up_fd) {
+  bool has_body = s->req.chunked || s->req.content_length > 0;
+  int head_len = http_serialize_request(&s->req, s->out, sizeof(s->out));
+  if (head_len < 0) {
+    return -1;
+  }
+  for (int attempt = 0; attempt < 2; attempt++) {
+    bool reused = *up_fd >= 0;
+    if (*up_fd < 0) {
+      *up_fd = vnet_tcp_connect(s->agent, socks5_port);
+      if (*up_fd < 0) {
+        return -1;
+      }
+      http_stream_init(&s->upstream, *up_fd, lwip_read, lwip_write);
+    }
+    bool sent = http_writen(&s->upstream, s->out, head_len) == head_len &&
+                http_forward_body(&s->client, &s->upstream,
+                                  s->req.content_length, s->req.chunked) == 0;
+    int rn = sent ? http_read_head(&s->upstream, &s->resp) : -1;
+    while (rn > 0) {
+      if (http_parse_response(&s->resp) != 0 || s->resp.status == 101) {
+        rn = -1;
+        break;
+      }
+      if (s->resp.status >= 200) {
+        return 0;
+      }
+      rn = http_read_head(&s->upstream, &s->resp);
+    }
+    lwip_close(*up_fd);
+    *up_fd = -1;
+    if (!reused || has_body) {
+      break;
+    }
+  }
+  return -1;
+}
+
+// 给过期的缓存加上条件请求头，返回是否加上了
+static bool add_validators(cache_session_t *s) {
+  int64_t head_len, body_len;
+  int fd = open_entry(s->url, s->stored.head, sizeof(s->stored.head),
+                      &head_len, &body_len);
+  if (fd < 0) {
+    return false;
+  }
+  close(fd);
+  s->stored.head_len = (int)head_len;
+  if (http_parse_response(&s->stored) != 0) {
+    return false;
+  }
+  const char *etag = http_get_header(&s->stored, "ETag");
+  const char *last_modified = http_get_header(&s->stored, "Last-Modified");
+  bool added = false;
+  if (etag != NULL && s->req.header_count < HTTP_MAX_HEADERS) {
+    s->req.headers[s->req.header_count].name = "If-None-Match";
+    s->req.headers[s->req.header_count++].value = (char *)etag;
+    added = true;
+  }
+  if (last_modified != NULL && s->req.header_count < HTTP_MAX_HEADERS) {
+    s->req.headers[s->req.header_count].name = "If-Modified-Since";
+    s->req.headers[s->req.header_count++].value = (char *)last_modified;
+    added = true;
+  }
+  return added;
+}
+
+int httpcache_serve(int agent, int local_fd) {
+  unsigned char first;
+  ssize_t peeked = recv(local_fd, &first, 1, MSG_PEEK);
+  if (peeked <= 0) {
+    return 0;
+  }
+  if (first == 0x04 || first == 0x05) {  // socks 直接透传
+    return -1;
+  }
+  cache_session_t *s = (cache_session_t *)malloc(sizeof(cache_session_t));
+  if (s == NULL) {
+    return -1;
+  }
+  s->agent = agent;
+  http_stream_init(&s->client, local_fd, read, write);
+  int up_fd = -1;
+  while (true) {
+    int n = http_read_head(&s->client, &s->req);
+    if (n <= 0) {
+      break;
+    }
+    memcpy(s->out, s->req.head, n);
+    if (http_parse_request(&s->req) != 0) {
+      http_reply_error(&s->client, 400, "invalid HTTP request");
+      break;
+    }
+    if (strcmp(s->req.method, "CONNECT") == 0) {
+      cache_tunnel(s, &up_fd, s->out, n);
+      break;
+    }
+    bool cacheable = request_cacheable(&s->req) &&
+                     snprintf(s->url, sizeof(s->url), "http://%s:%hu%s",
+                              s->req.host, s->req.port,
+                              s->req.path) < (int)sizeof(s->url);
+    bool keep_alive = s->req.keep_alive;
+    bool conditional = false;
+    if (cacheable) {
+      time_t now = time(NULL);
+      time_t expires = -1;
+      pthread_mutex_lock(&cache_lock);
+      cache_entry_t *e = NULL;
+      HASH_FIND_STR(cache_index, s->url, e);
+      if (e != NULL) {
+        expires = e->expires;
+      }
+      pthread_mutex_unlock(&cache_lock);
+      if (expires > now && !request_wants_revalidate(&s->req)) {
+        int ret = serve_from_cache(s, keep_alive);
+        if (ret == 0) {
+          log_info("http cache hit %s", s->url);
+          if (!keep_alive) {
+            break;
+          }
+          continue;
+        }
+        if (ret < 0) {
+          break;
+        }
+      } else if (expires >= 0) {
+        conditional = add_validators(s);
+      }
+    }
+
+    if (cache_roundtrip(s, &up_fd) != 0) {
+      http_reply_error(&s->client, 502, "upstream error");
+      break;
+    }
+    bool has_resp_body = http_response_has_body(&s->req, &s->resp);
+    bool delimited =
+        !has_resp_body || s->resp.chunked || s->resp.content_length >= 0;
+    if (!delimited || !s->resp.keep_alive) {
+      keep_alive = false;
+    }
+
+    if (conditional && s->resp.status == 304) {
+      time_t now = time(NULL);
+      time_t expires = response_expires(&s->resp, now);
+      if (http_get_header(&s->resp, "Cache-Control") == NULL &&
+          http_get_header(&s->resp, "Expires") == NULL) {
+        expires = response_expires(&s->stored, now);
+      }
+      update_expires(s->url, expires);
+      if (!s->resp.keep_alive && up_fd >= 0) {
+        lwip_close(up_fd);
+        up_fd = -1;
+      }
+      keep_alive = s->req.keep_alive;
+      int ret = serve_from_cache(s, keep_alive);
+      if (ret > 0) {
+        http_reply_error(&s->client, 502, "cache entry lost");
+      }
+      log_info("http cache revalidated %s", s->url);
+      if (ret != 0 || !keep_alive) {
+        break;
+      }
+      continue;
+    }
+
+    time_t expires = response_expires(&s->resp, time(NULL));
+    bool store = cacheable && has_resp_body && response_storable(&s->resp) &&
+                 (expires > 0 || has_validator(&s->resp));
+    int stored_len = 0;
+    int tmp_fd = -1;
+    char tmp[PATH_MAX];
+    if (store) {
+      stored_len = serialize_stored_head(&s->resp, s->out, sizeof(s->out));
+      snprintf(tmp, sizeof(tmp), "%s/tmp.XXXXXX", cache_dir);
+      if (stored_len > 0 && (tmp_fd = mkstemp(tmp)) >= 0 &&
+          write(tmp_fd, s->out, stored_len) != stored_len) {
+        close(tmp_fd);
+        unlink(tmp);
+        tmp_fd = -1;
+      }
+    }
+    int head_len = http_serialize_response(&s->resp, keep_alive, s->out,
+                                           sizeof(s->out));
+    if (head_len < 0 || http_writen(&s->client, s->out, head_len) < 0) {
+      if (tmp_fd >= 0) {
+        close(tmp_fd);
+        unlink(tmp);
+      }
+      break;
+    }
+    int ret = 0;
+    if (tmp_fd >= 0) {
+      http_stream_set_tee(&s->client, tmp_fd, cache_max_bytes - stored_len);
+    }
+    if (has_resp_body) {
+      if (delimited) {
+        ret = http_forward_body(&s->upstream, &s->client,
+                                s->resp.content_length, s->resp.chunked);
+      } else {
+        ret = http_forward_until_close(&s->upstream, &s->client);
+      }
+    }
+    if (tmp_fd >= 0) {
+      bool complete = ret == 0 && s->client.tee_fd >= 0;
+      int64_t body_len = s->client.tee_bytes;
+      http_stream_set_tee(&s->client, -1, 0);
+      close(tmp_fd);
+      if (complete) {
+        commit_entry(s->url, tmp, stored_len, body_len, expires);
+      } else {
+        unlink(tmp);
+      }
+    }
+    if ((ret != 0 || !delimited || !s->resp.keep_alive) && up_fd >= 0) {
+      lwip_close(up_fd);
+      up_fd = -1;
+    }
+    if (ret != 0 || !keep_alive) {
+      break;
+    }
+  }
+  if (up_fd >= 0) {
+    lwip_close(up_fd);
+  }
+  free(s);
+  return 0;
+}
@@ -0,0 +1,22 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#ifndef TERMTUNNEL_HTTPCACHE_H
+#define TERMTUNNEL_HTTPCACHE_H
+#include <stdbool.h>
+
+#define HTTPCACHE_DIR_ENV "TERMTUNNEL_HTTP_CACHE"
+#define HTTPCACHE_SIZE_ENV "TERMTUNNEL_HTTP_CACHE_SIZE"
+#define HTTPCACHE_DEFAULT_SIZE_MB 1024
+#define HTTPCACHE_MAX_URL_LENGTH 2048
+// 没有显式过期时间时，按 Last-Modified 的 10% 估算，最多一天
+#define HTTPCACHE_HEURISTIC_MAX_S 86400
+
+bool httpcache_enabled();
+// 回源经由 agent 上的 socks5
+int httpcache_serve(int agent, int local_fd);
+#endif
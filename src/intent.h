@@ -22,6 +22,7 @@
 #define COMMAND_TTY_PLAIN_DATA 1
 #define COMMAND_CMD_EXIT 2
 #define COMMAND_TTY_WIN_RESIZE 3
+// oneshot 时带着 agent 的参数：int32_t argc 和以 0 结尾的字符串
 #define COMMAND_ENTER_REPL 4
 #define COMMAND_TTY_PING 5
 #define COMMAND_EXIT_REPL 6
@@ -29,8 +30,19 @@
 #define COMMAND_PORT_FORWARD 8
 #define COMMAND_RETURN 9
 #define COMMAND_GET_RUNNING_TASK_COUNT 10
-#define COMMAND_GET_ARGS 11
-#define COMMAND_GET_ARGS_REPLY 12
+// server -> cli，transfer_progress_t 数组
+#define COMMAND_TRANSFER_PROGRESS 13
+// cli -> server，int32_t 为 WATCH_* 的组合，0 停止；server 停止后原样回复一次
+#define COMMAND_WATCH 14
+// server -> cli，task_event_t
+#define COMMAND_TASK_EVENT 15
+// cli -> server，bench_intent_t
+#define COMMAND_BENCH 16
+// cli -> server，agent_intent_t，server 用 COMMAND_RETURN 回复一段文字
+#define COMMAND_AGENT 17
+
+#define WATCH_PROGRESS 1
+#define WATCH_TASKS 2
 
 # define FLAG_ONESHOT 1<<0
 
@@ -46,9 +58,46 @@ typedef struct {
   int32_t trans_mode;
 } file_exchange_intent_t;
 
+typedef struct {
+  int64_t total;
+  int32_t conns;
+} bench_intent_t;
+
+#define AGENT_NAME_SIZE 32
+#define AGENT_COMMAND_SIZE 1024
+#define AGENT_OP_ADD 1
+#define AGENT_OP_LIST 2
+#define AGENT_OP_USE 3
+typedef struct {
+  int32_t op;
+  char name[AGENT_NAME_SIZE];
+  char command[AGENT_COMMAND_SIZE];  // AGENT_OP_ADD 时在上一级 agent 上运行
+} agent_intent_t;
+
 #define TRANS_MODE_SEND_FILE 1
 #define TRANS_MODE_RECV_FILE 2
 
+#define PROGRESS_NAME_SIZE 64
+#define PROGRESS_RUNNING 0
+#define PROGRESS_DONE 1
+#define PROGRESS_FAILED 2
+#define PROGRESS_MAX_ENTRIES 16
+typedef struct {
+  char name[PROGRESS_NAME_SIZE];
+  int64_t done;
+  int64_t total;     // 目录等未知大小时为 -1
+  int64_t rate;      // 最近一个周期，字节/秒
+  int64_t avg_rate;  // 从开始到现在，字节/秒
+  int64_t eta;       // 秒，未知为 -1
+  int32_t state;
+} transfer_progress_t;
+
+typedef struct {
+  int32_t event;    // TASK_* in state.h
+  int32_t running;  // 写出这个事件时 server 上还在运行的任务数
+  char name[PROGRESS_NAME_SIZE];
+} task_event_t;
+
 #define IPV4_AND_IPV6_MAX_LENGTH 64
 typedef struct {
   int32_t forward_type;
@@ -56,6 +105,7 @@ typedef struct {
   char dst_host[IPV4_AND_IPV6_MAX_LENGTH];
   uint16_t src_port;
   uint16_t dst_port;
+  int32_t pool_size;  // 目标端保持的预连接数
 } port_forward_intent_t;
 
 #define FORWARD_DYNAMIC_PORT_MAP 2
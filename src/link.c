@@ -0,0 +1,347 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "link.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#include "config.h"
+#include "hash.h"
+#include "log.h"
+#include "slab.h"
+
+static uint64_t now_ms() { return uv_now(uv_default_loop()); }
+
+// 序号 a 是否不早于 b
+static bool seq_geq(uint16_t a, uint16_t b) {
+  return (uint16_t)(a - b) < 0x8000;
+}
+
+static void put_header(link_t *l, char *frame, uint8_t type, uint16_t seq) {
+  frame[0] = type | (l->tx_crc32c ? LINK_CRC32C : 0);
+  frame[1] = seq >> 8;
+  frame[2] = seq & 0xff;
+}
+
+static uint32_t frame_crc(const char *frame, size_t body_len) {
+  if (frame[0] & LINK_CRC32C) {
+    return hash_crc32c(frame, body_len);
+  }
+  return hash_crc32(frame, body_len);
+}
+
+static void put_crc(char *frame, size_t body_len) {
+  uint32_t crc = frame_crc(frame, body_len);
+  char *p = frame + body_len;
+  p[0] = crc >> 24;
+  p[1] = (crc >> 16) & 0xff;
+  p[2] = (crc >> 8) & 0xff;
+  p[3] = crc & 0xff;
+}
+
+static void send_control(link_t *l, uint8_t type, uint16_t seq) {
+  char frame[LINK_OVERHEAD];
+  put_header(l, frame, type, seq);
+  put_crc(frame, LINK_HDR_SIZE);
+  l->output(l, frame, sizeof(frame));
+}
+
+static void send_nack(link_t *l, uint16_t seq, uint16_t count) {
+  char frame[LINK_OVERHEAD + 2];
+  put_header(l, frame, LINK_NACK, seq);
+  frame[LINK_HDR_SIZE] = count >> 8;
+  frame[LINK_HDR_SIZE + 1] = count & 0xff;
+  put_crc(frame, LINK_HDR_SIZE + 2);
+  l->output(l, frame, sizeof(frame));
+  l->nack_time = now_ms();
+}
+
+static void clear_ring(link_slot_t *ring) {
+  for (int i = 0; i < LINK_RING_SIZE; i++) {
+    slab_free(ring[i].buf);
+    ring[i].buf = NULL;
+  }
+}
+
+void link_init(link_t *l, link_output_t out, link_deliver_t in,
+               link_lost_t lost) {
+  clear_ring(l->tx_ring);
+  clear_ring(l->rx_ring);
+  l->output = out;
+  l->deliver = in;
+  l->lost = lost;
+  l->reset_pending = false;
+  l->tx_next = 0;
+  l->tx_count = 0;
+  l->tx_probes = LINK_PROBE_COUNT;
+  l->tx_crc32c = false;
+  l->rx_next = 0;
+  l->rx_high = 0;
+  l->inited = true;
+}
+
+void link_deinit(link_t *l) {
+  clear_ring(l->tx_ring);
+  clear_ring(l->rx_ring);
+  l->inited = false;
+}
+
+void link_send(link_t *l, const char *pkt, size_t len) {
+  link_slot_t *s = &l->tx_ring[l->tx_next % LINK_RING_SIZE];
+  char *frame = (char *)slab_alloc(len + LINK_OVERHEAD);
+  if (frame == NULL) {
+    log_error("malloc link frame failed");
+    return;
+  }
+  put_header(l, frame, LINK_DATA, l->tx_next);
+  memcpy(frame + LINK_HDR_SIZE, pkt, len);
+  put_crc(frame, LINK_HDR_SIZE + len);
+  slab_free(s->buf);
+  s->buf = frame;
+  s->len = len + LINK_OVERHEAD;
+  l->tx_next++;
+  if (l->tx_count < LINK_RING_SIZE) {
+    l->tx_count++;
+  }
+  l->tx_last_send = now_ms();
+  l->tx_probes = 0;
+  l->output(l, s->buf, s->len);
+}
+
+static void retransmit(link_t *l, uint16_t seq, uint16_t count) {
+  uint16_t behind = l->tx_next - seq;
+  if (behind == 0 || behind >= 0x8000) {
+    return;
+  }
+  if (behind > l->tx_count) {
+    // 太旧的帧已经被覆盖，让收端跳过
+    uint16_t oldest = l->tx_next - l->tx_count;
+    log_warn("link frames lost for good, skip to %u", oldest);
+    send_control(l, LINK_SKIP, oldest);
+    uint16_t gone = behind - l->tx_count;
+    count = count > gone ? count - gone : 0;
+    seq = oldest;
+  }
+  log_debug("link retransmit %u+%u", seq, count);
+  for (; count > 0 && seq != l->tx_next; seq++, count--) {
+    link_slot_t *s = &l->tx_ring[seq % LINK_RING_SIZE];
+    l->output(l, s->buf, s->len);
+  }
+  l->tx_last_send = now_ms();
+  l->tx_probes = 0;
+}
+
+// 交付 rx_next 开始连续到齐的帧
+static void deliver_ready(link_t *l) {
+  link_slot_t *s;
+  while ((s = &l->rx_ring[l->rx_next % LINK_RING_SIZE])->buf != NULL) {
+    char *buf = s->buf;
+    s->buf = NULL;
+    l->rx_next++;
+    l->deliver(l, buf, s->len);
+    slab_free(buf);
+  }
+}
+
+// 本端丢了帧，先清掉自己的上下文，再让对端也清掉
+static void rx_lost(link_t *l) {
+  l->lost(l, true);
+  l->reset_pending = true;
+  l->reset_seq = l->rx_next;
+  l->reset_time = now_ms();
+  send_control(l, LINK_RESET, l->reset_seq);
+}
+
+// seq 之前缺的帧不要了，已经收到的照样交付
+static void skip_to(link_t *l, uint16_t seq) {
+  bool lost = false;
+  while (l->rx_next != seq) {
+    link_slot_t *s = &l->rx_ring[l->rx_next % LINK_RING_SIZE];
+    l->rx_next++;
+    if (s->buf == NULL && !lost) {
+      // 缺口后面的帧可能依赖缺的帧里的上下文
+      lost = true;
+      rx_lost(l);
+    }
+    if (s->buf != NULL) {
+      char *buf = s->buf;
+      s->buf = NULL;
+      l->deliver(l, buf, s->len);
+      slab_free(buf);
+    }
+  }
+  if (!seq_geq(l->rx_high, l->rx_next)) {
+    l->rx_high = l->rx_next;
+  }
+  deliver_ready(l);
+}
+
+// 发端说下一帧是 seq，[rx_high, seq) 都还没见过
+static void saw_seq(link_t *l, uint16_t seq) {
+  if (seq_geq(l->rx_high, seq)) {
+    return;
+  }
+  send_nack(l, l->rx_high, seq - l->rx_high);
+  l->rx_high = seq;
+}
+
+static void input_data(link_t *l, uint16_t seq, char *pkt, size_t len) {
+  uint16_t ahead = seq - l->rx_next;
+  if (ahead >= 0x8000) {
+    // 重发过来的重复帧
+    return;
+  }
+  if (ahead >= LINK_RING_SIZE) {
+    log_warn("link receive window overrun, skip to %u",
+             (uint16_t)(seq - LINK_RING_SIZE + 1));
+    skip_to(l, seq - LINK_RING_SIZE + 1);
+    ahead = seq - l->rx_next;
+  }
+  saw_seq(l, seq);
+  if (seq == l->rx_high) {
+    l->rx_high++;
+  }
+  if (ahead == 0) {
+    l->rx_next++;
+    l->deliver(l, pkt, len);
+    deliver_ready(l);
+    return;
+  }
+  link_slot_t *s = &l->rx_ring[seq % LINK_RING_SIZE];
+  if (s->buf != NULL) {
+    return;
+  }
+  s->buf = (char *)slab_alloc(len);
+  if (s->buf == NULL) {
+    log_error("malloc link frame failed");
+    return;
+  }
+  memcpy(s->buf, pkt, len);
+  s->len = len;
+}
+
+void link_input(link_t *l, char *frame, size_t len) {
+  if (!l->inited) {
+    return;
+  }
+  if (len < LINK_OVERHEAD) {
+    link_input_corrupt(l);
+    return;
+  }
+  const unsigned char *c = (const unsigned char *)frame + len - LINK_CRC_SIZE;
+  uint32_t crc = (uint32_t)c[0] << 24 | (uint32_t)c[1] << 16 |
+                 (uint32_t)c[2] << 8 | c[3];
+  if (crc != frame_crc(frame, len - LINK_CRC_SIZE)) {
+    link_input_corrupt(l);
+    return;
+  }
+  uint8_t type = frame[0] & ~LINK_CRC32C;
+  uint16_t seq = (uint8_t)frame[1] << 8 | (uint8_t)frame[2];
+  char *payload = frame + LINK_HDR_SIZE;
+  size_t payload_len = len - LINK_OVERHEAD;
+  switch (type) {
+    case LINK_DATA:
+      input_data(l, seq, payload, payload_len);
+      break;
+    case LINK_SYNC:
+      if (seq_geq(seq, l->rx_next)) {
+        saw_seq(l, seq);
+      }
+      break;
+    case LINK_NACK:
+      if (payload_len == 2) {
+        retransmit(l, seq, (uint8_t)payload[0] << 8 | (uint8_t)payload[1]);
+      }
+      break;
+    case LINK_SKIP:
+      if (seq_geq(seq, l->rx_next)) {
+        skip_to(l, seq);
+      }
+      break;
+    case LINK_RESET:
+      // 重复的请求也要确认，确认可能丢了
+      l->lost(l, false);
+      send_control(l, LINK_RESET_ACK, seq);
+      break;
+    case LINK_RESET_ACK:
+      if (seq == l->reset_seq) {
+        l->reset_pending = false;
+      }
+      break;
+    default:
+      log_error("unknown link frame type %d", type);
+      break;
+  }
+}
+
+void link_input_corrupt(link_t *l) {
+  if (!l->inited) {
+    return;
+  }
+  log_debug("corrupt link frame, waiting for %u", l->rx_next);
+}
+
+// 缺口一直没补上，NACK 可能丢了，把还缺的帧重新要一遍
+static void request_missing(link_t *l) {
+  uint16_t seq = l->rx_next;
+  while (seq != l->rx_high) {
+    if (l->rx_ring[seq % LINK_RING_SIZE].buf != NULL) {
+      seq++;
+      continue;
+    }
+    uint16_t start = seq;
+    while (seq != l->rx_high &&
+           l->rx_ring[seq % LINK_RING_SIZE].buf == NULL) {
+      seq++;
+    }
+    send_nack(l, start, seq - start);
+  }
+}
+
+void link_tick(link_t *l) {
+  if (!l->inited) {
+    return;
+  }
+  uint64_t now = now_ms();
+  if (l->tx_probes < LINK_PROBE_COUNT &&
+      now - l->tx_last_send >= (uint64_t)LINK_PROBE_MS << (2 * l->tx_probes)) {
+    l->tx_probes++;
+    send_control(l, LINK_SYNC, l->tx_next);
+  }
+  if (l->rx_next != l->rx_high && now - l->nack_time >= LINK_NACK_RETRY_MS) {
+    request_missing(l);
+  }
+  if (l->reset_pending && now - l->reset_time >= LINK_NACK_RETRY_MS) {
+    l->reset_time = now;
+    send_control(l, LINK_RESET, l->reset_seq);
+  }
+}
+
+uint32_t link_caps() {
+#if VNET_LINK_CRC32C
+  return LINK_CAP_CRC32C;
+#else
+  return 0;
+#endif
+}
+
+uint32_t link_parse_caps(const char *s, size_t len) {
+  uint32_t caps = 0;
+  for (size_t i = 0; i < len && s[i] >= '0' && s[i] <= '9'; i++) {
+    caps = caps * 10 + (s[i] - '0');
+  }
+  return caps;
+}
+
+void link_use_crc32c(link_t *l, bool on) {
+  if (l->tx_crc32c != on) {
+    log_info("link frames use %s", on ? "crc32c" : "crc32");
+  }
+  l->tx_crc32c = on;
+}
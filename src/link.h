@@ -0,0 +1,101 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#ifndef TERMTUNNEL_LINK_H
+#define TERMTUNNEL_LINK_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// 终端上的链路层：给每个 vnet 帧加上序号和 crc32，收端按序交付。
+// base64 或 crc 出错的帧直接丢掉，收端从序号跳变或尾部探测发现缺帧，
+// 先收下后面的帧，立即对缺的那几帧回 NACK，发端只重发这几帧。
+// 终端里积压的帧可能有几百个，所以不用 go-back-N。
+// 丢一帧只多花一个 RTT，不用等 TCP 超时。
+// 帧格式（base64 之前）：类型(u8) 序号(u16) [数据] crc32(u32)，大端。
+// 类型的最高位表示 crc 是 crc32c，握手时双方都声明支持后才会用
+#define LINK_DATA 1
+#define LINK_NACK 2  // 数据为帧数(u16)，请求重发从序号开始的这几帧
+#define LINK_SYNC 3  // 序号为发端的下一帧，一批帧发完后的尾部探测
+#define LINK_SKIP 4  // 缺的帧已经不在重发队列里了，收端从这个序号继续
+// 收端跳过了没收到的帧，请发端清掉头部压缩的上下文，之后发完整的头。
+// 收端每隔 LINK_NACK_RETRY_MS 重发，直到收到 LINK_RESET_ACK
+#define LINK_RESET 5
+#define LINK_RESET_ACK 6
+#define LINK_CRC32C 0x80
+
+// 握手时交换的能力位：agent 在 MAGIC 之后发 "C<十进制>!"，
+// server 回 "C<双方都有的>"。旧版本不认识这个帧，两边就都不用
+#define LINK_CAP_CRC32C 1
+
+#define LINK_HDR_SIZE 3
+#define LINK_CRC_SIZE 4
+#define LINK_OVERHEAD (LINK_HDR_SIZE + LINK_CRC_SIZE)
+// 发端保留最近多少帧用于重发，收端最多缓存多少乱序的帧
+#define LINK_RING_SIZE 4096
+// 发完一批帧后空闲多久发尾部探测，ms。之后按 4 倍退避，最多探测几次
+#define LINK_PROBE_MS 100
+#define LINK_PROBE_COUNT 3
+// 缺口一直没补上时重发 NACK 的间隔，ms
+#define LINK_NACK_RETRY_MS 1000
+
+typedef struct link_s link_t;
+typedef void (*link_output_t)(link_t *link, const char *frame, size_t len);
+typedef void (*link_deliver_t)(link_t *link, char *pkt, size_t len);
+// 有帧永远丢了，上层按帧维护的状态（头部压缩）要重来。
+// rx 为 true 时是本端跳过了没收到的帧，在交付缺口之后的帧之前调用；
+// false 时是对端跳过了本端发的帧，之后发出的帧不能再依赖之前的上下文
+typedef void (*link_lost_t)(link_t *link, bool rx);
+
+typedef struct {
+  char *buf;
+  size_t len;
+} link_slot_t;
+
+// 每条终端链路一份。server 上每个 agent 一条，agent 上只有到 server 的一条
+struct link_s {
+  void *data;  // 调用方自用
+  link_output_t output;
+  link_deliver_t deliver;
+  link_lost_t lost;
+  bool inited;
+  // 发端，tx_ring 存整帧，含链路头和 crc
+  link_slot_t tx_ring[LINK_RING_SIZE];
+  uint16_t tx_next;
+  uint32_t tx_count;  // 发过的帧数，最多算到 LINK_RING_SIZE
+  uint64_t tx_last_send;
+  int tx_probes;
+  bool tx_crc32c;
+  // 收端，rx_ring 存 rx_next 之后先到的帧的数据
+  link_slot_t rx_ring[LINK_RING_SIZE];
+  uint16_t rx_next;
+  uint16_t rx_high;  // 见过的最大序号 + 1
+  uint64_t nack_time;
+  bool reset_pending;  // 发了 LINK_RESET 还没收到确认
+  uint16_t reset_seq;  // LINK_RESET 带的序号，确认原样带回来
+  uint64_t reset_time;
+};
+
+// 都在 libuv 线程里调用。每次握手时重新 init，两端从序号 0 开始。
+// link 第一次 init 之前要清零
+void link_init(link_t *link, link_output_t output, link_deliver_t deliver,
+               link_lost_t lost);
+// 释放缓存的帧，之后不再收发
+void link_deinit(link_t *link);
+void link_send(link_t *link, const char *pkt, size_t len);
+void link_input(link_t *link, char *frame, size_t len);
+// 收到了一个解不出来的帧，缺口等后面的帧来发现
+void link_input_corrupt(link_t *link);
+// 由 REPEAT_MS 的定时器调用
+void link_tick(link_t *link);
+// 本端支持的能力位
+uint32_t link_caps(void);
+// 解析 "C" 之后的十进制能力位
+uint32_t link_parse_caps(const char *s, size_t len);
+// 之后发出的帧用 crc32c。收端总是按帧里的标志校验
+void link_use_crc32c(link_t *link, bool on);
+#endif
@@ -0,0 +1,66 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "lwipmem.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#include "config.h"
+#include "log.h"
+#include "slab.h"
+
+static size_t budget = (size_t)VNET_MEM_BUDGET_MB * 1024 * 1024;
+static size_t used;
+static uint64_t last_warn;
+
+void lwipmem_init() {
+  const char *mb = getenv(VNET_MEM_BUDGET_ENV);
+  if (mb != NULL && atoll(mb) > 0) {
+    budget = (size_t)atoll(mb) * 1024 * 1024;
+  }
+  log_info("vnet memory budget %zuMB", budget >> 20);
+}
+
+void *lwipmem_malloc(size_t size) {
+  void *p = slab_alloc(size);
+  if (p == NULL) {
+    return NULL;
+  }
+  size_t n = slab_size(p);
+  if (__atomic_add_fetch(&used, n, __ATOMIC_RELAXED) <= budget) {
+    return p;
+  }
+  __atomic_sub_fetch(&used, n, __ATOMIC_RELAXED);
+  slab_free(p);
+  // 一直超预算时每秒最多报一次
+  uint64_t now = uv_hrtime() / 1000000000;
+  if (__atomic_exchange_n(&last_warn, now, __ATOMIC_RELAXED) != now) {
+    log_warn("vnet memory budget %zuMB exhausted", budget >> 20);
+  }
+  return NULL;
+}
+
+void *lwipmem_calloc(size_t count, size_t size) {
+  if (size != 0 && count > SIZE_MAX / size) {
+    return NULL;
+  }
+  void *p = lwipmem_malloc(count * size);
+  if (p != NULL) {
+    memset(p, 0, count * size);
+  }
+  return p;
+}
+
+void lwipmem_free(void *p) {
+  if (p == NULL) {
+    return;
+  }
+  __atomic_sub_fetch(&used, slab_size(p), __ATOMIC_RELAXED);
+  slab_free(p);
+}
@@ -0,0 +1,19 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#ifndef TERMTUNNEL_LWIPMEM_H
+#define TERMTUNNEL_LWIPMEM_H
+#include <stddef.h>
+
+// lwIP 的堆：pbuf、段、pcb、netconn 和 socket 表都从这里分配，底下是 slab。
+// 不限制各类对象的个数，只限制总字节数，超过预算时分配失败，由 lwIP 按
+// 内存不足处理。预算默认 VNET_MEM_BUDGET_MB，可以用环境变量覆盖
+void lwipmem_init();
+void *lwipmem_malloc(size_t size);
+void *lwipmem_calloc(size_t count, size_t size);
+void lwipmem_free(void *p);
+#endif
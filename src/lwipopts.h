@@ -12,6 +12,11 @@
 #define LWIP_POSIX_SOCKETS_IO_NAMES 0
 #define MEMP_MEM_MALLOC 1
 #define MEM_LIBC_MALLOC 1
+// pbuf、段和 API 消息都从 slab 的线程缓存里分配，总量受预算限制，见 lwipmem.h
+#include "lwipmem.h"
+#define mem_clib_malloc lwipmem_malloc
+#define mem_clib_free lwipmem_free
+#define mem_clib_calloc lwipmem_calloc
 
 #define LWIP_IPV4 1
 #define LWIP_IPV6 0
@@ -82,13 +87,14 @@ a lot of data that needs to be copied, this should be set high. */
 #define MEMP_NUM_UDP_PCB 4
 /* MEMP_NUM_TCP_PCB: the number of simulatenously active TCP
    connections. */
-#define MEMP_NUM_TCP_PCB 320
+// MEMP_MEM_MALLOC 下个数不受限制，只用于统计，实际受 lwipmem 的预算约束
+#define MEMP_NUM_TCP_PCB VNET_MAX_SOCKETS
 /* MEMP_NUM_TCP_PCB_LISTEN: the number of listening TCP
    connections. */
 #define MEMP_NUM_TCP_PCB_LISTEN 32
 /* MEMP_NUM_TCP_SEG: the number of simultaneously queued TCP
    segments. */
-#define MEMP_NUM_TCP_SEG 32000
+#define MEMP_NUM_TCP_SEG 0x10000
 // 修改
 /* MEMP_NUM_SYS_TIMEOUT: the number of simulateously active
    timeouts. */
@@ -99,11 +105,11 @@ a lot of data that needs to be copied, this should be set high. */
 /* MEMP_NUM_NETBUF: the number of struct netbufs. */
 #define MEMP_NUM_NETBUF 200000
 /* MEMP_NUM_NETCONN: the number of struct netconns. */
-#ifdef __CYGWIN__
-#define MEMP_NUM_NETCONN 20
-#else
-#define MEMP_NUM_NETCONN 200  // number of socket
-#endif
+#define MEMP_NUM_NETCONN VNET_MAX_SOCKETS
+// socket 表按块增长，空闲的 socket 串成链表，分配和释放都是 O(1)
+#define NUM_SOCKETS VNET_MAX_SOCKETS
+// select 用定长的 fd_set，只能用 poll
+#define LWIP_SOCKET_SELECT 0
 /* MEMP_NUM_TCPIP_MSG_*: the number of struct tcpip_msg, which is used
    for sequential API communication and incoming packets. Used in
    src/api/tcpip.c. */
@@ -149,7 +155,14 @@ a lot of data that needs to be copied, this should be set high. */
 
 /* TCP sender buffer space (pbufs). This must be at least = 2 *
    TCP_SND_BUF/TCP_MSS for things to work. */
-#define TCP_SND_QUEUELEN (8 * TCP_SND_BUF / TCP_MSS)
+// 发送缓冲会自动增长，这里只防止 snd_queuelen 溢出，实际的限制是 snd_buf
+#define TCP_SND_QUEUELEN 0xfff0
+
+// 从 TCP_SND_BUF 开始按带宽时延积增长，见 sndtune.h
+#include "sndtune.h"
+#define TCP_SND_BUF_TUNE_STATE sndtune_t
+#define TCP_SND_BUF_TUNE(pcb) sndtune_acked(pcb)
+#define TCP_SND_BUF_RELEASE(pcb) sndtune_release(pcb)
 
 /* TCP writable space (bytes). This must be less than or equal
    to TCP_SND_BUF. It is the amount of space which must be
@@ -166,6 +179,20 @@ a lot of data that needs to be copied, this should be set high. */
 /* Maximum number of retransmissions of SYN segments. */
 #define TCP_SYNMAXRTX 4
 
+// 终端链路不丢包也不乱序：不用拥塞窗口，PSH 立即 ACK，
+// 超时重传只作为最后手段。可以用 TERMTUNNEL_TCP_PROFILE 在运行时切换
+extern int vnet_tcp_lossless;
+#define TCP_LOSSLESS_LINK vnet_tcp_lossless
+#define TCP_LOSSLESS_RTO (30000 / TCP_SLOW_INTERVAL)
+// 按 TCP_LOSSLESS_RTO 重传这么多次还没有 ACK，对端已经不在了，断开连接
+#define TCP_LOSSLESS_MAXRTX 10
+
+// 接收邮箱按需增长，要装得下整个窗口，否则满了会丢掉已经收到的段
+#define DEFAULT_TCP_RECVMBOX_SIZE (TCP_WND / 536)
+// 一下子进来很多连接时，accept 邮箱满了新连接会被直接断开
+#define DEFAULT_ACCEPTMBOX_SIZE 4096
+#define TCPIP_MBOX_SIZE 65536
+
 /* ---------- ARP options ---------- */
 #define LWIP_ARP 1
 #define ARP_TABLE_SIZE 10
@@ -184,6 +211,14 @@ a lot of data that needs to be copied, this should be set high. */
 #define MEMP_NUM_REASSDATA 40
 #define IP_FRAG 1
 
+// 链路帧已经有 crc32c 时，两端协商后关掉 vnet 网口上的校验和，见 link.h
+#define LWIP_CHECKSUM_CTRL_PER_NETIF 1
+// 校验和用向量指令算，tcp_write 拷贝数据时顺便算好，见 chksum.h
+#include "chksum.h"
+#define LWIP_CHKSUM chksum_inet
+#define LWIP_CHECKSUM_ON_COPY 1
+#define LWIP_CHKSUM_COPY(dst, src, len) chksum_inet_copy(dst, src, len)
+
 /* ---------- ICMP options ---------- */
 #define ICMP_TTL 255
 
@@ -12,6 +12,7 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -26,16 +27,23 @@
 #include <unistd.h>
 #include <uv.h>
 
+#include "ackthin.h"
 #include "agent.h"
 #include "agentcall.h"
+#include "bench.h"
 #include "config.h"
+#include "connpool.h"
 #include "fileexchange.h"
 #include "fsm.h"
 #include "intent.h"
+#include "link.h"
 #include "log.h"
 #include "portforward.h"
+#include "progress.h"
 #include "pty.h"
 #include "repl.h"
+#include "route.h"
+#include "slab.h"
 #include "state.h"
 #include "thirdparty/base64.h"
 #include "thirdparty/queue/queue.h"
@@ -43,6 +51,7 @@
 #include "thirdparty/setproctitle.h"
 #include "utils.h"
 #include "state.h"
+#include "vjcomp.h"
 #include "vnet.h"
 static uv_pipe_t in_pipe;
 static uv_pipe_t out_pipe;
@@ -52,10 +61,13 @@ static uv_async_t data_income_notify;
 
 
 #define FLUASH_QUEUE_ON_TIMER
-void send_base64binary_to_agent(const char *buf, size_t size);
+// 一次从出队队列里取多少帧，ACK 精简在这一批里进行
+#define OUTBOUND_BATCH_MAX 256
+void send_base64binary_to_agent(int agent, const char *buf, size_t size);
+void send_data_to_agent(int agent, const char *buf, size_t size);
 
 bool server_see_agent_is_repl = false;
-void server_handle_agent_data(char *buf, int size);
+void server_handle_agent_data(route_agent_t *a, char *buf, int size);
 fsm_context *global_fsm_context;
 static int64_t pending_send = 0;  //记录待转发的字节，用于tty 流控
 bool exiting = false;
@@ -76,6 +88,7 @@ static void common_read_tty(uv_stream_t *stream, ssize_t nread,
 void server_handle_client_packet(int64_t type, char *buf, ssize_t len);
 
 typedef struct {
+  int agent;
   char *buf;
   size_t len;
 } frame_data;
@@ -93,39 +106,110 @@ extern void agent_read_stdin(uv_stream_t *stream, ssize_t nread,
 #include "vnet.h"
 
 void free_frame_data(frame_data *f) {
-  if (f->buf != NULL) free(f->buf);
-  free(f);
+  slab_free(f->buf);
+  slab_free(f);
 }
 
 queue_t *q;
 
+static void send_link_frame(int agent, const char *frame, size_t frame_len) {
+  if (get_state_mode() == MODE_SERVER_PROCESS) {
+    send_base64binary_to_agent(agent, frame, frame_len);
+  } else {
+    write_binary_to_server(frame, frame_len);
+  }
+}
+
+static void link_output(link_t *link, const char *frame, size_t len) {
+  send_link_frame((int)(intptr_t)link->data, frame, len);
+}
+
+static void link_deliver(link_t *link, char *pkt, size_t len) {
+  vnet_data_income((int)(intptr_t)link->data, pkt, len);
+}
+
+static void link_lost(link_t *link, bool rx) {
+  int agent = (int)(intptr_t)link->data;
+#if VNET_RAW_IP && VNET_HEADER_COMPRESSION
+  // 缺帧之后的压缩包会按旧的上下文还原出错的 seq/ack，关了校验和也查不出来
+  if (rx) {
+    vnet_reset_header_compression(agent);
+  } else {
+    route_agent_t *a = route_get(agent);
+    if (a != NULL) {
+      vjcomp_reset(&a->vj_tx);
+    }
+  }
+#endif
+  log_info("agent %d link lost frames, %s header context reset", agent,
+           rx ? "rx" : "tx");
+}
+
+static void send_frame_to_peer(frame_data *f) {
+  route_agent_t *a = route_get(f->agent);
+  if (a == NULL || a->state != ROUTE_UP || a->relay) {
+    // agent 已经不在了，TCP 自己会超时
+    return;
+  }
+  char *frame = f->buf;
+  size_t frame_len = f->len;
+#if VNET_RAW_IP && VNET_HEADER_COMPRESSION
+  // 在出队时压缩，出队之后的帧不会再被丢弃，两端的上下文保持一致
+  static uint8_t vj_frame[VIR_MTU + VJCOMP_MAX_GROWTH];
+  if (f->len <= VIR_MTU) {
+    frame = (char *)vj_frame;
+    frame_len = vjcomp_compress(&a->vj_tx, (uint8_t *)f->buf, f->len, vj_frame);
+  }
+#endif
+#if VNET_LINK_RELIABLE
+  link_send(&a->link, frame, frame_len);
+#else
+  send_link_frame(a->id, frame, frame_len);
+#endif
+}
+
 // from libuv
 void uvloop_process_income(uv_async_t *handle) {
   // log_info("process income queue\n");
-  frame_data *f;
+  static frame_data *batch[OUTBOUND_BATCH_MAX];
   size_t dry = (size_t)handle->data;
   if (!dry) {
     return;
   }
+  if (get_state_mode() == MODE_SERVER_PROCESS && !server_see_agent_is_repl) {
+    return;
+  }
   queue_lock_internal(q);
 
   while (!queue_empty_internal(q)) {
-    int ret = queue_get_frame_data(q, &f);
-    if (ret != 0) {
-      log_info("queue pass");
+    int n = 0;
+    while (n < OUTBOUND_BATCH_MAX && !queue_empty_internal(q)) {
+      if (queue_get_frame_data(q, &batch[n]) != 0) {
+        log_info("queue pass");
+        break;
+      }
+      n++;
+    }
+    if (n == 0) {
       break;
     }
-
-    if (get_state_mode() == MODE_SERVER_PROCESS) {
-      if (!server_see_agent_is_repl) {
-        queue_unlock_internal(q);
-        return;
+#if VNET_RAW_IP && VNET_ACK_THINNING
+    // 同一条流后面还有更新的 ACK 时，前面排队的纯 ACK 不用再发
+    static ackthin_t thin;
+    ackthin_reset(&thin);
+    for (int i = n - 1; i >= 0; i--) {
+      if (ackthin_superseded(&thin, (uint8_t *)batch[i]->buf, batch[i]->len)) {
+        free_frame_data(batch[i]);
+        batch[i] = NULL;
+      }
+    }
+#endif
+    for (int i = 0; i < n; i++) {
+      if (batch[i] != NULL) {
+        send_frame_to_peer(batch[i]);
+        free_frame_data(batch[i]);
       }
-      send_base64binary_to_agent(f->buf, f->len);
-    } else {
-      write_binary_to_server(f->buf, f->len);
     }
-    free_frame_data(f);
   }
   handle->data = 0;
   queue_unlock_internal(q);
@@ -133,18 +217,21 @@ void uvloop_process_income(uv_async_t *handle) {
   return;
 }
 
-int vnet_notify_to_libuv(char *buf, size_t size) {
-  frame_data *f = (frame_data *)malloc(sizeof(frame_data));
+int vnet_notify_to_libuv(int agent, char *buf, size_t size) {
+  // 在 tcpip 线程分配，在 libuv 线程释放，都走 slab
+  frame_data *f = (frame_data *)slab_alloc(sizeof(frame_data));
   if (f == NULL) {
     log_error("malloc frame_data failed");
     return -1;
   }
-  f->buf = memdup(buf, size);
+  f->buf = (char *)slab_alloc(size);
   if (f->buf == NULL) {
-    free(f);
+    slab_free(f);
     log_error("memdup frame_data failed");
     return -1;
   }
+  memcpy(f->buf, buf, size);
+  f->agent = agent;
   f->len = size;
   queue_put(q, f);
   // log_info("add queue");
@@ -154,8 +241,22 @@ int vnet_notify_to_libuv(char *buf, size_t size) {
 }
 
 
+// 每次握手两端都从序号 0 开始，能力重新协商
+static void agent_link_init(route_agent_t *a) {
+  a->state = ROUTE_UP;
+  vnet_set_relay_only(a->id, a->relay);
+  if (a->relay) {
+    return;
+  }
+#if VNET_LINK_RELIABLE
+  link_init(&a->link, link_output, link_deliver, link_lost);
+  vnet_set_checksum(a->id, true);
+#endif
+}
+
 int libuv_add_vnet_notify() {
   static bool added = false;
+  agent_link_init(route_get(0));
   if (added) {
     return 0;
   }
@@ -173,10 +274,11 @@ int libuv_add_vnet_notify() {
   return 0;
 }
 
+// 读缓冲在读回调里用完就还给 slab，下一次读直接复用
 static void alloc_buffer(uv_handle_t *handle, size_t suggested_size,
                          uv_buf_t *buf) {
-  buf->base = (char *)malloc(suggested_size);
-  buf->len = suggested_size;
+  buf->base = (char *)slab_alloc(suggested_size);
+  buf->len = buf->base != NULL ? suggested_size : 0;
 }
 
 static void tty_write_cb_with_free(uv_write_t *req, int status) {
@@ -185,9 +287,9 @@ static void tty_write_cb_with_free(uv_write_t *req, int status) {
 
   // printf("%d\n",pending_send);
   // printf("%s\n",((uv_buf_t*)(req->data))->base);
-  free(((uv_buf_t *)(req->data))->base);
-  free(req->data);
-  free(req);
+  slab_free(((uv_buf_t *)(req->data))->base);
+  slab_free(req->data);
+  slab_free(req);
 }
 
 static void write_cb_with_free(uv_write_t *req, int status) {
@@ -196,8 +298,8 @@ static void write_cb_with_free(uv_write_t *req, int status) {
     uv_read_start((uv_stream_t *)&tty, alloc_buffer, common_read_tty);
   }
   free(((uv_buf_t *)(req->data))->base);
-  free(req->data);
-  free(req);
+  slab_free(req->data);
+  slab_free(req);
 }
 
 static void write_cb_without_free(uv_write_t *req, int status) {
@@ -205,8 +307,8 @@ static void write_cb_without_free(uv_write_t *req, int status) {
   if (pending_send == 0) {
     uv_read_start((uv_stream_t *)&tty, alloc_buffer, common_read_tty);
   }
-  free(req->data);
-  free(req);
+  slab_free(req->data);
+  slab_free(req);
 }
 
 static void comm_write_data_to_cli(void *buf, size_t s, bool autofree) {
@@ -214,11 +316,11 @@ static void comm_write_data_to_cli(void *buf, size_t s, bool autofree) {
   if (pending_send > TTY_WATERMARK) {
     uv_read_stop((uv_stream_t *)&tty);
   }
-  uv_write_t *req1 = malloc(sizeof(uv_write_t));
-  uv_buf_t *b = malloc(sizeof(uv_buf_t));
+  uv_write_t *req1 = slab_alloc(sizeof(uv_write_t));
+  uv_buf_t *b = slab_alloc(sizeof(uv_buf_t));
   if (req1 == NULL || b == NULL) {
-    free(req1);
-    free(b);
+    slab_free(req1);
+    slab_free(b);
     if (autofree) {
       free(buf);
     }
@@ -339,22 +441,21 @@ ssize_t parser(char *buf, ssize_t nread) {
 static void common_read_data_from_cli(uv_stream_t *stream, ssize_t nread,
                                       const uv_buf_t *buf) {
   if (nread == 0) {
+    slab_free(buf->base);
     return;
   }
   if (nread < 0) {
     if (nread != UV_EOF) {
       CHECK(nread == UV_EOF, "read_cb");
     }
-    // free(buf);
+    slab_free(buf->base);
     uv_read_stop(stream);
     return;
   } else if (nread > 0) {
     parser(buf->base, nread);
   }
 
-  if (buf->base) {
-    free(buf->base);
-  }
+  slab_free(buf->base);
 }
 
 // 快速、及时发送给 console
@@ -379,6 +480,7 @@ void send_tty_to_client(char *buf, int nread) {
 static void common_read_tty(uv_stream_t *stream, ssize_t nread,
                             const uv_buf_t *buf) {
   if (nread == 0) {
+    slab_free(buf->base);
     return;
   }
   if (nread < 0) {
@@ -390,7 +492,7 @@ static void common_read_tty(uv_stream_t *stream, ssize_t nread,
       // CHECK(nread == UV_EOF, "read_cb %s",uv_strerror(nread));
     }
 
-    free(buf->base);
+    slab_free(buf->base);
     uv_read_stop(stream);
     return;
   } else {
@@ -412,9 +514,7 @@ static void common_read_tty(uv_stream_t *stream, ssize_t nread,
     free(dst);
   }
 
-  if (buf->base) {
-    free(buf->base);
-  }
+  slab_free(buf->base);
   return;
 }
 
@@ -434,6 +534,84 @@ int push_data() {
   return  uv_async_send(&data_income_notify);
 }
 
+// cli 在等任务结束时才打开，只有它在读的时候才推送，
+// 否则没人读的包会堆积到 TTY_WATERMARK 以上把终端卡住
+static int32_t watch_mask = 0;
+
+static void push_progress() {
+  static uint64_t last_ms = 0;
+  uint64_t now = uv_now(uv_default_loop());
+  if (now - last_ms < PROGRESS_INTERVAL_MS) {
+    return;
+  }
+  last_ms = now;
+  transfer_progress_t list[PROGRESS_MAX_ENTRIES];
+  // 没人看也要取快照，结束的传输在这里释放
+  int n = progress_snapshot(list, PROGRESS_MAX_ENTRIES);
+  if (!(watch_mask & WATCH_PROGRESS)) {
+    return;
+  }
+  // n 为 0 也要发，cli 由此知道没有传输在进行
+  size_t size = n * sizeof(transfer_progress_t);
+  void *buf = memdup(list, size > 0 ? size : 1);
+  if (buf == NULL) {
+    return;
+  }
+  comm_write_packet_to_cli(COMMAND_TRANSFER_PROGRESS, buf, size);
+}
+
+typedef struct task_event_node {
+  task_event_t event;
+  struct task_event_node *next;
+} task_event_node_t;
+
+static pthread_mutex_t task_event_lock = PTHREAD_MUTEX_INITIALIZER;
+static task_event_node_t *task_event_head = NULL;
+static task_event_node_t *task_event_tail = NULL;
+static uv_async_t task_event_notify;
+
+// 任务线程里调用，排队后交给主循环写给 cli
+static void post_task_event(int32_t event, const char *name) {
+  task_event_node_t *n =
+      (task_event_node_t *)calloc(1, sizeof(task_event_node_t));
+  if (n == NULL) {
+    log_error("malloc task event failed");
+    return;
+  }
+  const char *base = strrchr(name, '/');
+  base = base != NULL && base[1] != '\0' ? base + 1 : name;
+  n->event.event = event;
+  snprintf(n->event.name, sizeof(n->event.name), "%s", base);
+  pthread_mutex_lock(&task_event_lock);
+  if (task_event_tail == NULL) {
+    task_event_head = n;
+  } else {
+    task_event_tail->next = n;
+  }
+  task_event_tail = n;
+  pthread_mutex_unlock(&task_event_lock);
+  uv_async_send(&task_event_notify);
+}
+
+static void flush_task_events(uv_async_t *handle) {
+  pthread_mutex_lock(&task_event_lock);
+  task_event_node_t *n = task_event_head;
+  task_event_head = task_event_tail = NULL;
+  pthread_mutex_unlock(&task_event_lock);
+  while (n != NULL) {
+    task_event_node_t *next = n->next;
+    if (watch_mask & WATCH_TASKS) {
+      // 写出时再取任务数，cli 按收到的顺序取最后一个就是当前值
+      n->event.running = get_running_task_count();
+      comm_write_packet_to_cli(COMMAND_TASK_EVENT,
+                               memdup(&n->event, sizeof(n->event)),
+                               sizeof(n->event));
+    }
+    free(n);
+    n = next;
+  }
+}
+
 void timer_callback() {
 
   //log_info("get_running_task_count %d", get_running_task_count());
@@ -447,6 +625,10 @@ void timer_callback() {
   }
 
 #endif
+#if VNET_LINK_RELIABLE
+  route_tick();
+#endif
+  push_progress();
 
   if (exiting) {
     // TODO (jdz）实际上设置exiting的时候，有没有写入成功的可能，因此，最好来说，我们要握手退出)
@@ -563,6 +745,12 @@ void server(int argc, char *argv[]) {
     log_error("uv_async_init async_process_exit failed: %d", rc);
     exit(EXIT_FAILURE);
   }
+  rc = uv_async_init(loop, &task_event_notify, flush_task_events);
+  if (rc != 0) {
+    log_error("uv_async_init task_event_notify failed: %d", rc);
+    exit(EXIT_FAILURE);
+  }
+  set_task_listener(post_task_event);
   pty_run(argc, argv, pty_process_on_exit);
   // close(1);
   // close(0);  //TODO linux 可以close，但是mac 关闭后会导致 libuv 异常 exit
@@ -579,36 +767,44 @@ void server(int argc, char *argv[]) {
   exit(EXIT_SUCCESS);
 }
 
-void send_data_to_agent(char *buf, size_t size) {
-  uv_write_t *req1 = malloc(sizeof(uv_write_t));
-  uv_buf_t *b = malloc(sizeof(uv_buf_t));
+// 发给经由别的 agent 转发的 agent 时，前面加上每一级的编号
+void send_data_to_agent(int agent, const char *buf, size_t size) {
+  char prefix[ROUTE_PREFIX_MAX];
+  int prefix_len = route_prefix(agent, prefix, sizeof(prefix));
+  if (prefix_len < 0) {
+    log_error("no route to agent %d", agent);
+    return;
+  }
+  uv_write_t *req1 = slab_alloc(sizeof(uv_write_t));
+  uv_buf_t *b = slab_alloc(sizeof(uv_buf_t));
   if (req1 == NULL || b == NULL) {
-    free(req1);
-    free(b);
+    slab_free(req1);
+    slab_free(b);
     log_error("malloc send_data_to_agent req failed");
     return;
   }
-  char *buf_tmp = (char *)malloc(size + 2);
+  char *buf_tmp = (char *)slab_alloc(prefix_len + size + 2);
   if (buf_tmp == NULL) {
-    free(req1);
-    free(b);
+    slab_free(req1);
+    slab_free(b);
     log_error("malloc send_data_to_agent buffer failed");
     return;
   }
-  memcpy(buf_tmp, buf, size);
-  memcpy(buf_tmp + size, "!\n", 2);
+  memcpy(buf_tmp, prefix, prefix_len);
+  memcpy(buf_tmp + prefix_len, buf, size);
+  memcpy(buf_tmp + prefix_len + size, "!\n", 2);
   b->base = buf_tmp;
-  b->len = size + 2;
+  b->len = prefix_len + size + 2;
   req1->data = b;
   int ret = uv_write(req1, (uv_stream_t *)&tty, b, 1, tty_write_cb_with_free);
   if (ret != 0) {
-    free(((uv_buf_t *)(req1->data))->base);
-    free(req1->data);
-    free(req1);
+    slab_free(((uv_buf_t *)(req1->data))->base);
+    slab_free(req1->data);
+    slab_free(req1);
   }
 }
 
-void send_base64binary_to_agent(const char *buf, size_t size) {
+void send_base64binary_to_agent(int agent, const char *buf, size_t size) {
   size_t elen = 0;
   unsigned char *ebuf =
       base64_encode((const unsigned char *)buf, size, &elen);
@@ -625,105 +821,129 @@ void send_base64binary_to_agent(const char *buf, size_t size) {
   }
   tmp[0] = 'B';
   memcpy(tmp + 1, (const char *)ebuf, elen);
-  send_data_to_agent(tmp, elen + 1);
+  send_data_to_agent(agent, tmp, elen + 1);
   free(tmp);
   free(ebuf);
 }
 
-int termtunnel_notify(void* s) {
-  return uv_async_send(s);
-}
-
-void get_args_done_callback(uv_async_t *a){
-  size_t total_size = sizeof(int32_t);
-  if (g_oneshot_argc < 0) {
-    g_oneshot_argc = 0;
-  }
-  for (int i = 0; i < g_oneshot_argc; i++) {
-    if (g_oneshot_argv == NULL || g_oneshot_argv[i] == NULL) {
-      continue;
+// agent_add 在当前的 agent 上启动一个下级 agent，agents 列出所有 agent，
+// use 选后续命令发给哪个 agent
+static void server_handle_agent_intent(agent_intent_t *a) {
+  char reply[4096];
+  a->name[sizeof(a->name) - 1] = '\0';
+  a->command[sizeof(a->command) - 1] = '\0';
+  route_agent_t *found = route_find(a->name);
+  switch (a->op) {
+    case AGENT_OP_ADD: {
+      route_agent_t *parent = route_get(route_target());
+      if (a->name[0] == '\0' || a->command[0] == '\0') {
+        snprintf(reply, sizeof(reply), "agent name and command required\n");
+        break;
+      }
+      if (found != NULL) {
+        snprintf(reply, sizeof(reply), "agent %s already exists\n", a->name);
+        break;
+      }
+      int id = route_add(a->name, parent->id);
+      if (id < 0) {
+        snprintf(reply, sizeof(reply),
+                 "cannot add agent under %s: not up, too many or too deep\n",
+                 parent->name);
+        break;
+      }
+      // "S<编号>:<base64 的命令>"，见 relay.h
+      size_t elen = 0;
+      unsigned char *ebuf = base64_encode((const unsigned char *)a->command,
+                                          strlen(a->command), &elen);
+      char *frame = ebuf != NULL ? (char *)malloc(elen + 16) : NULL;
+      if (frame == NULL) {
+        free(ebuf);
+        route_down(id);
+        snprintf(reply, sizeof(reply), "malloc failed\n");
+        break;
+      }
+      int n = snprintf(frame, 16, "S%d:", id);
+      memcpy(frame + n, ebuf, elen);
+      send_data_to_agent(parent->id, frame, n + elen);
+      free(frame);
+      free(ebuf);
+      snprintf(reply, sizeof(reply),
+               "agent %s starting on %s, check it with agents\n", a->name,
+               parent->name);
+      break;
     }
-    size_t arg_len = strlen(g_oneshot_argv[i]) + 1;
-    if (total_size > SIZE_MAX - arg_len) {
-      log_error("get_args_done_callback size overflow");
-      total_size = sizeof(int32_t);
-      g_oneshot_argc = 0;
+    case AGENT_OP_LIST: {
+      route_describe(reply, sizeof(reply));
       break;
     }
-    total_size += arg_len;
-  }
-  char *buf = malloc(total_size);
-  if (buf == NULL) {
-    log_error("get_args_done_callback malloc failed");
-    return;
-  }
-  memcpy(buf, &g_oneshot_argc, sizeof(int32_t));
-  char *wptr = buf + sizeof(int32_t);
-  for (int i = 0; i < g_oneshot_argc; i++) {
-    if (g_oneshot_argv == NULL || g_oneshot_argv[i] == NULL) {
-      continue;
+    case AGENT_OP_USE: {
+      if (found == NULL || found->state != ROUTE_UP) {
+        snprintf(reply, sizeof(reply), "agent %s is not up\n", a->name);
+        break;
+      }
+      route_use(found->id);
+      if (found->relay) {
+        snprintf(reply, sizeof(reply),
+                 "agent %s only relays, use agent_add to start agents behind "
+                 "it\n",
+                 found->name);
+        break;
+      }
+      snprintf(reply, sizeof(reply), "commands now go to agent %s\n",
+               found->name);
+      break;
+    }
+    default: {
+      snprintf(reply, sizeof(reply), "unknown agent op %d\n", a->op);
+      break;
     }
-    size_t arg_len = strlen(g_oneshot_argv[i]) + 1;
-    memcpy(wptr, g_oneshot_argv[i], arg_len);
-    wptr += arg_len;
-    free(g_oneshot_argv[i]);
   }
-  free(g_oneshot_argv);
-  g_oneshot_argv = NULL;
-  g_oneshot_argc = 0;
-  comm_write_packet_to_cli(COMMAND_GET_ARGS_REPLY, buf, (size_t)(wptr - buf));
-  // free(a); //TODO!!!
+  comm_write_packet_to_cli(COMMAND_RETURN, strdup(reply), strlen(reply) + 1);
 }
 
-
-int call_bootstrap_get_args(get_args_callback bootstrap_args_ready) {
-  // async
-  uv_async_t *s = malloc(sizeof(uv_async_t));
-  if (s == NULL) {
-    log_error("malloc async callback failed");
-    return -1;
-  }
-  int rc = uv_async_init(uv_default_loop(), s, (uv_async_cb)bootstrap_args_ready);
-  if (rc != 0) {
-    free(s);
-    log_error("uv_async_init bootstrap args failed: %d", rc);
-    return -1;
-  }
-  pthread_t p;
-  rc = pthread_create(&p, NULL, (void*)bootstrap_get_args, s);
-  if (rc != 0) {
-    free(s);
-    log_error("pthread_create bootstrap args failed: %d", rc);
-    return -1;
+// 目标只转发帧时不能传输。cli 发完命令马上在 watch_transfers 里读，
+// 失败事件不等 COMMAND_WATCH 直接写过去
+static bool reject_on_relay(const char *name) {
+  route_agent_t *t = route_get(route_target());
+  if (t == NULL || !t->relay) {
+    return false;
   }
-  pthread_detach(p);
-  return 0;
+  log_error("agent %s only relays, %s rejected", t->name, name);
+  task_event_t e = {.event = TASK_FAILED,
+                    .running = get_running_task_count()};
+  const char *base = strrchr(name, '/');
+  base = base != NULL && base[1] != '\0' ? base + 1 : name;
+  snprintf(e.name, sizeof(e.name), "%s on relay %s", base, t->name);
+  comm_write_packet_to_cli(COMMAND_TASK_EVENT, memdup(&e, sizeof(e)),
+                           sizeof(e));
+  return true;
 }
 
 void server_handle_client_packet(int64_t type, char *buf, ssize_t len) {
   switch (type) {
     case COMMAND_TTY_PLAIN_DATA: {
       // from cli keyborad stream
-      uv_write_t *req1 = malloc(sizeof(uv_write_t));
-      uv_buf_t *b = malloc(sizeof(uv_buf_t));
+      uv_write_t *req1 = slab_alloc(sizeof(uv_write_t));
+      uv_buf_t *b = slab_alloc(sizeof(uv_buf_t));
       if (req1 == NULL || b == NULL) {
-        free(req1);
-        free(b);
+        slab_free(req1);
+        slab_free(b);
         break;
       }
-      b->base = memdup(buf, len);
+      b->base = slab_alloc(len);
       if (b->base == NULL) {
-        free(b);
-        free(req1);
+        slab_free(b);
+        slab_free(req1);
         break;
       }
+      memcpy(b->base, buf, len);
       b->len = len;
       req1->data = b;
       int ret = uv_write(req1, (uv_stream_t *)&tty, b, 1, tty_write_cb_with_free);
       if (ret != 0) {
-        free(((uv_buf_t *)(req1->data))->base);
-        free(req1->data);
-        free(req1);
+        slab_free(((uv_buf_t *)(req1->data))->base);
+        slab_free(req1->data);
+        slab_free(req1);
       }
       break;
     }
@@ -732,22 +952,24 @@ void server_handle_client_packet(int64_t type, char *buf, ssize_t len) {
       resize_pty(ttysize);
       break;
     }
-    case COMMAND_GET_ARGS: {
-  
-      call_bootstrap_get_args((void*)get_args_done_callback);
-      //comm_write_packet_to_cli(COMMAND_TTY_PLAIN_DATA, "11", 2);
-      break;
-    }
     case COMMAND_EXIT_REPL: {
       server_see_agent_is_repl = false;
-      send_data_to_agent("EXIT", 4);
+      // 下面的 agent 先退出，恢复各自的终端
+      for (int i = VNET_MAX_AGENTS - 1; i > 0; i--) {
+        route_agent_t *a = route_get(i);
+        if (a != NULL && a->state == ROUTE_UP) {
+          send_data_to_agent(i, "EXIT", 4);
+        }
+      }
+      route_reset();
+      send_data_to_agent(0, "EXIT", 4);
       break;
     }
 
     // case :
     case COMMAND_TTY_PING: {
       // DATA
-      send_data_to_agent("PING", 4);
+      send_data_to_agent(0, "PING", 4);
       break;
     }
 
@@ -755,17 +977,42 @@ void server_handle_client_packet(int64_t type, char *buf, ssize_t len) {
       file_exchange_intent_t *a = (file_exchange_intent_t *)buf;
       log_info("server do open file");
       log_info("%s->%s %d\n", a->src_path, a->dst_path, a->trans_mode);
+      if (reject_on_relay(a->src_path)) {
+        break;
+      }
       if (a->trans_mode == TRANS_MODE_RECV_FILE) {
-        file_recv_start(a->src_path, a->dst_path);
+        file_recv_start(route_target(), a->src_path, a->dst_path);
       } else if (a->trans_mode == TRANS_MODE_SEND_FILE) {
-        file_send_start(a->src_path, a->dst_path);
+        file_send_start(route_target(), a->src_path, a->dst_path);
       } else {
-        // TODO add folder
+        // 目录也走这两种模式，由 fileexchange 按路径类型切换到 dirstream
+        log_error("unknown trans_mode %d", a->trans_mode);
       }
 
       log_info("start ok");
       break;
     }
+    case COMMAND_BENCH: {
+      bench_intent_t *a = (bench_intent_t *)buf;
+      log_info("bench %lld bytes over %d connections", (long long)a->total,
+               a->conns);
+      char name[PROGRESS_NAME_SIZE];
+      snprintf(name, sizeof(name), "bench x%d", a->conns);
+      if (reject_on_relay(name)) {
+        break;
+      }
+      bench_start(route_target(), a->total, a->conns);
+      break;
+    }
+    case COMMAND_WATCH: {
+      watch_mask = *(int32_t *)buf;
+      if (watch_mask == 0) {
+        // 回一个确认，cli 读到它之后就不会再有推送了
+        void *ack = memdup(&watch_mask, sizeof(watch_mask));
+        comm_write_packet_to_cli(COMMAND_WATCH, ack, sizeof(watch_mask));
+      }
+      break;
+    }
     case COMMAND_GET_RUNNING_TASK_COUNT: {
 
       int c = get_running_task_count();
@@ -777,24 +1024,47 @@ void server_handle_client_packet(int64_t type, char *buf, ssize_t len) {
       port_forward_intent_t *a = (port_forward_intent_t *)buf;
       log_info("portforward %s:%hu <-> %s:%hu", a->src_host, a->src_port,
                a->dst_host, a->dst_port);
+      route_agent_t *t = route_get(route_target());
+      if (t != NULL && t->relay) {
+        char reply[128];
+        snprintf(reply, sizeof(reply), "agent %s only relays, can not forward\n",
+                 t->name);
+        comm_write_packet_to_cli(COMMAND_RETURN, strdup(reply),
+                                 strlen(reply) + 1);
+        break;
+      }
       if (a->forward_type == FORWARD_DYNAMIC_PORT_MAP) {
         // portforward_st(a->src_path, a->dst_path);
       } else if (a->forward_type == FORWARD_STATIC_PORT_MAP)  // TODO(jdz)
       {
-        portforward_static_start(a->src_host, a->src_port, a->dst_host,
-                                 a->dst_port);
+        // 连接目标的是 agent，预连接池也放在 agent 上
+        if (a->pool_size > 0 && a->dst_port != 0) {
+          char buf[READ_CHUNK_SIZE];
+          snprintf(buf, READ_CHUNK_SIZE, "%s:%hu:%d", a->dst_host, a->dst_port,
+                   a->pool_size);
+          server_call_agent(route_target(), METHOD_CALL_WARM_POOL, buf);
+        }
+        portforward_static_start(route_target(), a->src_host, a->src_port,
+                                 a->dst_host, a->dst_port);
       } else if (a->forward_type == FORWARD_STATIC_PORT_MAP_LISTEN_ON_AGENT) {
         log_info("remote mode");
+        if (a->pool_size > 0 && a->dst_port != 0) {
+          connpool_warm(a->dst_host, a->dst_port, a->pool_size);
+        }
         char buf[READ_CHUNK_SIZE];
         snprintf(buf, READ_CHUNK_SIZE, "%s:%hu:%s:%hu",
             a->src_host, a->src_port, a->dst_host, a->dst_port);
-        server_call_agent(METHOD_CALL_FORWARD_STATIC, buf);
+        server_call_agent(route_target(), METHOD_CALL_FORWARD_STATIC, buf);
         comm_write_packet_to_cli(COMMAND_RETURN, strdup("bind done (guess)\n"),
                               sizeof("bind done (guess)\n"));
       }
 
       break;
     }
+    case COMMAND_AGENT: {
+      server_handle_agent_intent((agent_intent_t *)buf);
+      break;
+    }
 
     default: {
       log_error("server_handle_packet unknown type %d", type);
@@ -803,14 +1073,158 @@ void server_handle_client_packet(int64_t type, char *buf, ssize_t len) {
   return;
 }
 
+// 还没收齐的 oneshot 参数（base64）
+static char *oneshot_args = NULL;
+static size_t oneshot_args_len = 0;
+
+// "A...!" 帧，见 agent.c 的 write_oneshot_args
+static void server_handle_oneshot_args(char *buf, int size) {
+  if (size > 2) {
+    size_t n = size - 2;
+    if (oneshot_args_len + n > ONESHOT_ARGS_MAX_SIZE) {
+      log_error("oneshot args too long");
+      return;
+    }
+    char *p = realloc(oneshot_args, oneshot_args_len + n);
+    if (p == NULL) {
+      log_error("realloc oneshot args failed");
+      return;
+    }
+    oneshot_args = p;
+    memcpy(oneshot_args + oneshot_args_len, buf + 1, n);
+    oneshot_args_len += n;
+    return;
+  }
+  size_t result_len = 0;
+  unsigned char *result = NULL;
+  if (oneshot_args_len > 0) {
+    result = base64_decode((const unsigned char *)oneshot_args,
+                           oneshot_args_len, &result_len);
+  }
+  free(oneshot_args);
+  oneshot_args = NULL;
+  oneshot_args_len = 0;
+  if (result == NULL || result_len < sizeof(int32_t)) {
+    // 参数坏了也要让 cli 进入 oneshot，由它报错退出
+    log_error("invalid oneshot args");
+    free(result);
+    int32_t argc = 0;
+    result = memdup(&argc, sizeof(argc));
+    result_len = sizeof(argc);
+  }
+  comm_write_packet_to_cli(COMMAND_ENTER_REPL, result, result_len);
+}
+
+#if VNET_LINK_RELIABLE
+static void server_handle_caps(route_agent_t *a, char *buf, int size) {
+  uint32_t caps = link_parse_caps(buf + 1, size - 1) & link_caps();
+  char reply[16];
+  int n = snprintf(reply, sizeof(reply), "C%u", caps);
+  send_data_to_agent(a->id, reply, n);
+  // 回复之后生成的包才不带校验和，agent 收到回复时就不再检查了
+  bool crc32c = caps & LINK_CAP_CRC32C;
+  link_use_crc32c(&a->link, crc32c);
+  vnet_set_checksum(a->id, !crc32c);
+}
+#endif
+
+// 链路上的帧，每个 agent 都一样
+static void server_handle_link_packet(route_agent_t *a, char *buf, int size) {
+#if VNET_LINK_RELIABLE
+  if (size > 1 && buf[0] == 'C') {
+    server_handle_caps(a, buf, size);
+    return;
+  }
+#endif
+  if (size > 1 && buf[0] == 'B') {
+    size_t result_len = 0;
+    unsigned char *result =
+        base64_decode((const unsigned char *)(buf + 1), size - 1,
+                      &result_len);
+    if (result_len == 0 || result == NULL) {
+      log_error("found a error base64 [%*s]\n", size - 1, buf + 1);
+#if VNET_LINK_RELIABLE
+      link_input_corrupt(&a->link);
+#endif
+      return;
+    }
+    server_handle_agent_data(a, (char *)result, result_len);
+    free(result);
+    return;
+  }
+#if VNET_LINK_RELIABLE
+  // 帧头被改坏了
+  link_input_corrupt(&a->link);
+#endif
+}
+
+// 经由别的 agent 转发来的帧，见 route.h
+static void server_handle_relayed_packet(int id, char *buf, int size) {
+  route_agent_t *a = route_get(id);
+  if (a == NULL || a->state == ROUTE_DOWN) {
+    log_debug("frame from unknown agent %d", id);
+    return;
+  }
+  if (size == sizeof("MAGIC!") - 1 && memcmp(buf, "MAGIC!", size) == 0) {
+    if (vnet_add_agent(id) != 0) {
+      return;
+    }
+    agent_link_init(a);
+    // agent 按编号换到自己的网段，之后才会有 vnet 的帧
+    char frame[16];
+    int n = snprintf(frame, sizeof(frame), "I%d", id);
+    send_data_to_agent(id, frame, n);
+    log_info("agent %d %s up", id, a->name);
+    return;
+  }
+  if (size == sizeof("RELAY!") - 1 && memcmp(buf, "RELAY!", size) == 0) {
+    // 只转发帧，不加网口也不用链路
+    a->relay = true;
+    agent_link_init(a);
+    log_info("agent %d %s up as relay", id, a->name);
+    return;
+  }
+  if (size == sizeof("EXIT!") - 1 && memcmp(buf, "EXIT!", size) == 0) {
+    route_down(id);
+    return;
+  }
+  if (a->state != ROUTE_UP || a->relay) {
+    // 上一级 pty 里还没启动 agent，比如 ssh 的提示
+    return;
+  }
+  if (size > 0 && (buf[0] == 'A' || buf[0] == 'O')) {
+    log_error("agent %d %s: oneshot only works on the main agent", id, a->name);
+    return;
+  }
+  if ((size == sizeof("PING!") - 1 && memcmp(buf, "PING!", size) == 0) ||
+      (size == sizeof("NOP!") - 1 && memcmp(buf, "NOP!", size) == 0)) {
+    return;
+  }
+  server_handle_link_packet(a, buf, size);
+}
+
 //命令
 void server_handle_green_packet(char *buf, int size) {
+  // 转发来的帧取最里面的编号
+  int agent = 0;
+  int prefix_len = 0;
+  int id;
+  while ((id = route_parse(buf, size, &prefix_len)) >= 0) {
+    agent = id;
+    buf += prefix_len;
+    size -= prefix_len;
+  }
+  if (agent != 0) {
+    server_handle_relayed_packet(agent, buf, size);
+    return;
+  }
   //首包认为是：AGENT_VERSION: 1
   // handshake()
   // MAGIC
   //log_debug("server handle agent data: %*s(%d)", size, buf, size);
-  char *handshake_strs[] = {"ONESHOT!", "MAGIC!", NULL};
-  int handshake_lengths[] = {sizeof("ONESHOT!")-1, sizeof("MAGIC!")-1, 0};
+  char *handshake_strs[] = {"ONESHOT!", "MAGIC!", "RELAY!", NULL};
+  int handshake_lengths[] = {sizeof("ONESHOT!")-1, sizeof("MAGIC!")-1,
+                             sizeof("RELAY!")-1, 0};
   char *handshake_str = NULL;
   int i = 0;
   do {
@@ -819,16 +1233,13 @@ void server_handle_green_packet(char *buf, int size) {
     if (size == handshake_length &&
         memcmp(handshake_str, buf, handshake_length) == 0) {
       server_see_agent_is_repl = true;
-      int64_t flag;
-      switch (i) {
-        case 0:
-          flag = 1;
-          char* dup = memdup(&flag, sizeof(flag));
-          comm_write_packet_to_cli(COMMAND_ENTER_REPL, dup, sizeof(int64_t));
-          break;
-        case 1:
-          comm_write_packet_to_cli(COMMAND_ENTER_REPL, NULL, 0);
-
+      // 新的 0 号 agent，之前由它转发的 agent 都已经退出了
+      route_reset();
+      // termtunnel -r 只能用 agent_add 在它下面启动 agent
+      route_get(0)->relay = i == 2;
+      // oneshot 等参数帧收齐后再通知 cli
+      if (i != 0) {
+        comm_write_packet_to_cli(COMMAND_ENTER_REPL, NULL, 0);
       }
       libuv_add_vnet_notify();
       vnet_init(vnet_notify_to_libuv);
@@ -848,26 +1259,22 @@ void server_handle_green_packet(char *buf, int size) {
     log_debug("server green nop!");
     return;
   }
-  if (size > 1 && buf[0] == 'B') {
-    size_t result_len = 0;
-    unsigned char *result =
-        base64_decode((const unsigned char *)(buf + 1), size - 1,
-                      &result_len);
-    if (result_len == 0 || result == NULL) {
-      log_error("found a error base64 [%*s]\n", size - 1, buf + 1);
-      return;
-    }
-    server_handle_agent_data((char *)result, result_len);
-    free(result);
+  if (size > 1 && buf[0] == 'A') {
+    server_handle_oneshot_args(buf, size);
+    return;
   }
-  return;
+  server_handle_link_packet(route_get(0), buf, size);
 }
 
 //流量
-void server_handle_agent_data(char *buf, int size) {
+void server_handle_agent_data(route_agent_t *a, char *buf, int size) {
   //log_debug("server handle agent binary data: %*s(%d)", size, buf, size);
   // TCPIP
-  vnet_data_income(buf, size);
+#if VNET_LINK_RELIABLE
+  link_input(&a->link, buf, size);
+#else
+  vnet_data_income(a->id, buf, size);
+#endif
 
   //其他可能的扩展操作
   // send_base64binary_to_agent(buf, size);
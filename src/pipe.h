@@ -17,12 +17,11 @@ extern queue_t *q;
 extern int in_fd[2];
 extern int out_fd[2];
 extern void agent_write_data_to_server(char *buf, size_t s, bool autofree);
-extern void send_base64binary_to_agent(const char *buf, size_t size);
+extern void send_base64binary_to_agent(int agent, const char *buf, size_t size);
 void server(int argc, char *argv[]);
 int libuv_add_vnet_notify();
-extern int vnet_notify_to_libuv(char *buf, size_t size);
+extern int vnet_notify_to_libuv(int agent, char *buf, size_t size);
 void comm_write_packet_to_cli(int64_t type, void *buf, size_t s);
 void comm_write_static_packet_to_cli(int64_t type, void *buf, size_t s);
 int push_data();
-int termtunnel_notify(void* s);
 #endif
@@ -19,6 +19,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include "state.h"
+#include "connpool.h"
+#include "httpcache.h"
 #include "intent.h"
 #include "log.h"
 #include "lwip/api.h"
@@ -44,11 +46,18 @@ struct lwip_sockaddr_in {
 static int port_forward_static_service_port = 7000;
 
 typedef struct port_listen {
+  int agent;  // 连哪个 agent，agent 上监听时是 0
   char host[IPV4_AND_IPV6_MAX_LENGTH];
   int local_fd;
   uint16_t port;
+  bool stopped;              // agent 已经下线，accept 循环该退出了
+  struct port_listen *next;  // 只有监听用的那个挂在 listeners 上
 } port_listen_t;
 
+// 正在监听的转发，agent 下线时按 agent 找出来停掉
+static pthread_mutex_t listeners_lock = PTHREAD_MUTEX_INITIALIZER;
+static port_listen_t *listeners = NULL;
+
 static void portforward_static_server_request(void *p) {
   int sd = (int)(intptr_t)p;
   vnet_setsocketdefaultopt(sd);
@@ -81,48 +90,23 @@ static void portforward_static_server_request(void *p) {
 
   log_info("target %s %hu", host, port);
 
-  int sock;
-  if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-    lwip_close(sd);
-    return;
+  // 优先使用预连接池中已经建立好的连接
+  int sock = connpool_take_warm(host, port);
+  if (sock >= 0) {
+    log_info("use warm connection to %s:%hu", host, port);
+  } else {
+    log_info("start connect %s:%hu", host, port);
+    sock = connpool_connect(host, port);
   }
-
-  char portaddr[6];
-  struct addrinfo *res;
-  snprintf(portaddr, sizeof(portaddr), "%d", port);
-
-  char* ip = safe_gethostbyname(host, port);
-  if (ip == NULL) {
-    close(sock);
+  if (sock < 0) {
     lwip_close(sd);
     return;
   }
-
-  log_info("use ip %s:%hu for domain", ip, port);
-  struct sockaddr_in addr;
-  memset(&addr, 0, sizeof(addr));
-#ifdef __APPLE__
-  addr.sin_len = sizeof(addr);
-#endif
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(port);
-  addr.sin_addr.s_addr = inet_addr(ip);
-
-  log_info("start connect %s:%hu", ip, port);
-  free(ip);
-  int ret = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
-  if (ret != 0) {
-    lwip_close(sd);
-    close(sock);
-    log_info("connect error return %d errno:%d %s", ret, errno,
-             strerror(errno));
-    return;
-  }
   log_info("connect succ");
   pipe_lwip_socket_and_socket_pair(sd, sock);
   // free(host);
   log_info("lwip_close %d", sd);
-  ret = lwip_close(sd);
+  int ret = lwip_close(sd);
   CHECK(ret == 0, "lwip_close %d", ret);
   close(sock);
   return;
@@ -135,136 +119,103 @@ int  portforward_static_remote_server_start() {
 
 pthread_mutex_t lock;
 
-static void loop_lwipsocket_to_socket(int *arg) {
-  int lwip_fd = arg[0];
-  int fd = arg[1];
-  while (true) {
-    char buf[READ_CHUNK_SIZE];
-    fd_set fdset;
-    FD_ZERO(&fdset);
-    FD_SET(lwip_fd, &fdset);
-    struct timeval tv;
-    tv.tv_usec = 500;
-    tv.tv_sec = 0;
-    int ret = lwip_select(lwip_fd + 1, &fdset, NULL, NULL, &tv);
+// 另一个方向 lwip_shutdown 时会唤醒 lwip_poll，超时只是兜底
+#define PIPE_POLL_MS 5000
+
+typedef struct {
+  int lwip_fd;
+  int fd;
+  bool done;  // 真实 fd 到 lwip 的方向已经结束
+} pipe_pair_t;
+
+// lwip_recv 不能阻塞着和另一个线程的 lwip_shutdown 并发，先 lwip_poll 再非阻塞地读
+static void loop_lwipsocket_to_socket(pipe_pair_t *pair) {
+  char buf[READ_CHUNK_SIZE];
+  while (!__atomic_load_n(&pair->done, __ATOMIC_ACQUIRE)) {
+    int ret = vnet_wait_readable(pair->lwip_fd, PIPE_POLL_MS);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
     if (ret < 0) {
-      if (errno == EINTR) continue;
-      CHECK(ret > 0, "select ret:%d", ret);
+      log_error("lwip_poll %d error %s", pair->lwip_fd, strerror(errno));
+      break;
     }
     if (ret == 0) {
       continue;
     }
-    log_info("select ret %d", ret);
-    if (!FD_ISSET(lwip_fd, &fdset)) {
-      // pass
-    }
-    int r = lwip_recv(lwip_fd, buf, READ_CHUNK_SIZE,
-                      MSG_DONTWAIT);
-    log_info("lwip_readed %d", r);
-    if (r < 0) {
-      close(fd);
-      return;
+    ssize_t r = lwip_recv(pair->lwip_fd, buf, READ_CHUNK_SIZE, MSG_DONTWAIT);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      continue;
     }
-    if (r == 0) {
-      close(fd);
-      return;
+    if (r <= 0) {
+      break;
     }
-    log_info("write expect %d %d", fd, r);
-    int writebytes = write(fd, buf, r);
-    log_info("written %d", writebytes);
-    if (writebytes < 0) {
-      lwip_shutdown(lwip_fd, SHUT_RDWR);
-      return;
+    ssize_t left = r;
+    char *p = buf;
+    while (left > 0) {
+      ssize_t w = write(pair->fd, p, left);
+      if (w < 0 && errno == EINTR) {
+        continue;
+      }
+      if (w <= 0) {
+        lwip_shutdown(pair->lwip_fd, SHUT_RDWR);
+        break;
+      }
+      left -= w;
+      p += w;
     }
-    if (writebytes == 0) {
-      lwip_shutdown(lwip_fd, SHUT_RDWR);
-      return;
+    if (left > 0) {
+      break;
     }
   }
-  return;
+  // 唤醒另一个方向阻塞着的 read，fd 由调用方关闭
+  shutdown(pair->fd, SHUT_RDWR);
 }
 
-static void loop_socket_to_lwipsocket(int *arg) {
-  int lwip_fd = arg[0];
-  int fd = arg[1];
+static void *loop_socket_to_lwipsocket(void *arg) {
+  pipe_pair_t *pair = (pipe_pair_t *)arg;
+  char buf[READ_CHUNK_SIZE];
   while (true) {
-    char buf[READ_CHUNK_SIZE];
-
-    fd_set fdset;
-    FD_ZERO(&fdset);
-    FD_SET(fd, &fdset);
-    struct timeval tv;
-    tv.tv_usec = 500;
-    tv.tv_sec = 0;
-    int ret = select(fd + 1, &fdset, NULL, NULL, &tv);
-    if (ret < 0) {
-      if (errno == EINTR) continue;
-      if (errno == EBADF) {
-        log_fatal("fd: %d", fd);
-        return;  // TODO(jdz) fix
-      }
-      CHECK(ret > 0, "select ret:%d %s", ret, strerror(errno));
-    }
-    if (ret == 0) {
+    ssize_t r = read(pair->fd, buf, READ_CHUNK_SIZE);
+    if (r < 0 && errno == EINTR) {
       continue;
     }
-    log_info("select ret %d", ret);
-    if (!FD_ISSET(fd, &fdset)) {
-      // pass
-    }
-    // TODO 这中间可能被close 导致read到 无效的fd
-    int r = read(fd, buf, READ_CHUNK_SIZE);  // TODO
-    if (r < 0) {
-      lwip_shutdown(lwip_fd, SHUT_RDWR);  // TODO(jdz) 最好去掉
-      return;
-    }
-    if (r == 0) {
-      lwip_shutdown(lwip_fd, SHUT_RDWR);  // TODO(jdz) 最好去掉
-      return;
+    if (r <= 0) {
+      break;
     }
-
-    int writebytes = lwip_write(lwip_fd, buf, r);
-    if (writebytes < 0) {
-      close(fd);
-      lwip_close(lwip_fd);
-      return;
+    if (lwip_write(pair->lwip_fd, buf, r) != r) {
+      break;
     }
-    if (writebytes == 0) {
-      close(fd);
-      lwip_close(lwip_fd);
-      return;
-    }
-    log_info("lwip_write %d %d", r, writebytes);
   }
-  return;
+  lwip_shutdown(pair->lwip_fd, SHUT_RDWR);
+  __atomic_store_n(&pair->done, true, __ATOMIC_RELEASE);
+  return NULL;
 }
 
-// 就直接启动两个线程即可。无法一起select。因为一个是lwip的fd一个是真实的fd。
+// 一个是 lwip 的 fd 一个是真实的 fd，没法放在一起等，每个方向一个线程。
+// 真实 fd 直接阻塞读，结束时用 shutdown 互相唤醒，不用轮询。
+// 两个 fd 都由调用方关闭
 int pipe_lwip_socket_and_socket_pair(int lwip_fd, int fd) {
-  int *array = (int *)malloc(2 * sizeof(int));
-  if (array == NULL) {
-    return -1;
-  }
-  *(array) = lwip_fd;
-  *(array + 1) = fd;
+  pipe_pair_t pair = {.lwip_fd = lwip_fd, .fd = fd, .done = false};
   pthread_t worker2;
-  int rc =
-      pthread_create(&worker2, NULL, (void *)&loop_socket_to_lwipsocket,
-                     (void *)array);
-  if (rc != 0) {
-    free(array);
+  if (pthread_create(&worker2, NULL, loop_socket_to_lwipsocket, &pair) != 0) {
     return -1;
   }
-  loop_lwipsocket_to_socket((void *)array);
+  loop_lwipsocket_to_socket(&pair);
   pthread_join(worker2, NULL);
-  log_info("lwip ip pair %d %d", lwip_fd, fd);
-  free(array);
+  log_debug("lwip ip pair %d %d", lwip_fd, fd);
   return 0;
 }
 
 void portforward_static_server_pipe(port_listen_t *pe) {
   log_info("connect %s", pe->host);
-  int lwip_fd = vnet_tcp_connect(port_forward_static_service_port);
+  int lwip_fd = vnet_tcp_connect(pe->agent, port_forward_static_service_port);
+  if (lwip_fd < 0) {
+    log_error("connect agent %d failed", pe->agent);
+    close(pe->local_fd);
+    free(pe);
+    return;
+  }
   vnet_send(lwip_fd, pe->host, strlen(pe->host) + 1);  // with_zero_as_split
   uint16_t tmp = htons(pe->port);
   vnet_send(lwip_fd, &tmp, sizeof(uint16_t));
@@ -278,7 +229,19 @@ void portforward_static_server_pipe(port_listen_t *pe) {
 }
 
 void portforward_transparent_server_pipe(port_listen_t *pe) {
-  int lwip_fd = vnet_tcp_connect(socks5_port);
+  // 开启本地缓存时 http 请求先经过缓存层，socks 流量仍然直接透传
+  if (httpcache_enabled() && httpcache_serve(pe->agent, pe->local_fd) == 0) {
+    close(pe->local_fd);
+    free(pe);
+    return;
+  }
+  int lwip_fd = vnet_tcp_connect(pe->agent, socks5_port);
+  if (lwip_fd < 0) {
+    log_error("connect agent %d failed", pe->agent);
+    close(pe->local_fd);
+    free(pe);
+    return;
+  }
   pipe_lwip_socket_and_socket_pair(lwip_fd, pe->local_fd);
   close(pe->local_fd);
   int ret = lwip_close(lwip_fd);
@@ -290,7 +253,6 @@ void portforward_transparent_server_pipe(port_listen_t *pe) {
 static void portforward_service_handler(port_listen_t *pe) {
   int new_sd;
   int listen_fd = pe->local_fd;
-  set_running_task_changed(1);
   while (true) {
     if ((new_sd = accept(listen_fd, NULL, NULL)) >= 0) {
       pthread_t *worker = (pthread_t *)malloc(sizeof(pthread_t));  // TODO(jdz)  free
@@ -308,8 +270,11 @@ static void portforward_service_handler(port_listen_t *pe) {
         free(child_pe);
         continue;
       }
+      child_pe->agent = pe->agent;
       child_pe->port = pe->port;
       child_pe->local_fd = new_sd;
+      child_pe->stopped = false;
+      child_pe->next = NULL;
       if (pe->port == 0) {  // socks/http proxy
         int rc = pthread_create(worker, NULL,
                                 (void *)&portforward_transparent_server_pipe,
@@ -334,16 +299,46 @@ static void portforward_service_handler(port_listen_t *pe) {
       pthread_detach(*worker);
       free(worker);
 
+    } else if (__atomic_load_n(&pe->stopped, __ATOMIC_ACQUIRE)) {
+      break;
     } else {
       log_info("abort the accept");
     }
   }
-  set_running_task_changed(-1);
+  pthread_mutex_lock(&listeners_lock);
+  for (port_listen_t **p = &listeners; *p != NULL; p = &(*p)->next) {
+    if (*p == pe) {
+      *p = pe->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&listeners_lock);
+  close(listen_fd);
+  char name[sizeof(pe->host) + sizeof(":65535")];
+  snprintf(name, sizeof(name), "%s:%hu", pe->host, pe->port);
+  task_finished(name, false);
+  free(pe);
   return;
 }
 
-int portforward_static_start(char *src_host, uint16_t src_port, char *dst_host,
-                             uint16_t dst_port) {
+void portforward_stop_agent(int agent) {
+  if (agent == 0) {
+    return;
+  }
+  pthread_mutex_lock(&listeners_lock);
+  for (port_listen_t *pe = listeners; pe != NULL; pe = pe->next) {
+    if (pe->agent == agent && !pe->stopped) {
+      log_info("stop listening %s:%hu of agent %d", pe->host, pe->port, agent);
+      __atomic_store_n(&pe->stopped, true, __ATOMIC_RELEASE);
+      // shutdown 唤醒阻塞着的 accept，fd 由 accept 线程自己关
+      shutdown(pe->local_fd, SHUT_RDWR);
+    }
+  }
+  pthread_mutex_unlock(&listeners_lock);
+}
+
+int portforward_static_start(int agent, char *src_host, uint16_t src_port,
+                             char *dst_host, uint16_t dst_port) {
   int sock;
   if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
     log_error("local socket error");
@@ -372,7 +367,7 @@ int portforward_static_start(char *src_host, uint16_t src_port, char *dst_host,
     }
     goto fail;
   }
-  ret = listen(sock, 20);
+  ret = listen(sock, SOMAXCONN);
   if (ret != 0) {
     log_error("listen error");
     if (get_state_mode() != MODE_AGENT_PROCESS) {
@@ -392,8 +387,10 @@ int portforward_static_start(char *src_host, uint16_t src_port, char *dst_host,
     free(pe);
     goto fail;
   }
+  pe->agent = agent;
   pe->port = dst_port;
   pe->local_fd = sock;
+  pe->stopped = false;
   log_debug("portforward_static_start");
   if (get_state_mode() != MODE_AGENT_PROCESS) {
     comm_write_packet_to_cli(COMMAND_RETURN, strdup("bind local port done\n"),
@@ -401,6 +398,14 @@ int portforward_static_start(char *src_host, uint16_t src_port, char *dst_host,
                            // TODO(jdz) agent监听模式，cli暂时无法获取结果
   }
 
+  // 在这里计数，oneshot 随后查询任务数时一定能看到
+  char name[sizeof(pe->host) + sizeof(":65535")];
+  snprintf(name, sizeof(name), "%s:%hu", pe->host, pe->port);
+  task_started(name);
+  pthread_mutex_lock(&listeners_lock);
+  pe->next = listeners;
+  listeners = pe;
+  pthread_mutex_unlock(&listeners_lock);
   sys_thread_new("portforward_static", (lwip_thread_fn)portforward_service_handler, (void *)pe,
                  DEFAULT_THREAD_STACKSIZE, DEFAULT_THREAD_PRIO);
   return 0;
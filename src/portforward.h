@@ -9,8 +9,11 @@
 #define TERMTUNNEL_PORTFORWARD_H
 #include <stdint.h>
 int portforward_static_remote_server_start();
-int portforward_static_start(char *src_host, uint16_t src_port, char *dst_host,
-                             uint16_t dst_port);
+// 本地监听 src，连接经由 agent 转到 dst，agent 上监听时 agent 是 0
+int portforward_static_start(int agent, char *src_host, uint16_t src_port,
+                             char *dst_host, uint16_t dst_port);
+// agent 下线时停掉经由它的监听，已经建立的连接不管
+void portforward_stop_agent(int agent);
 int pipe_lwip_socket_and_socket_pair(int lwip_fd, int fd);
 
 #endif
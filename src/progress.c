@@ -0,0 +1,130 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+// server 侧正在进行的传输，传输线程更新字节数，
+// pipe 的定时器定期取快照计算速度后推给 cli。
+// 结束的传输在下一次快照里带上最终状态，然后释放。
+#include "progress.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+struct progress {
+  char name[PROGRESS_NAME_SIZE];
+  int64_t total;
+  int64_t done;
+  int64_t last_done;
+  uint64_t start_ms;
+  uint64_t last_ms;
+  int64_t rate;
+  int32_t state;
+  struct progress *next;
+};
+
+static progress_t *progress_list = NULL;
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ms() { return uv_hrtime() / 1000000; }
+
+progress_t *progress_begin(const char *name, int64_t total) {
+  progress_t *p = (progress_t *)calloc(1, sizeof(progress_t));
+  if (p == NULL) {
+    return NULL;
+  }
+  // 只保留路径的最后一部分
+  const char *base = strrchr(name, '/');
+  base = base != NULL && base[1] != '\0' ? base + 1 : name;
+  snprintf(p->name, sizeof(p->name), "%s", base);
+  p->total = total;
+  p->start_ms = now_ms();
+  p->last_ms = p->start_ms;
+  p->state = PROGRESS_RUNNING;
+  pthread_mutex_lock(&progress_lock);
+  p->next = progress_list;
+  progress_list = p;
+  pthread_mutex_unlock(&progress_lock);
+  return p;
+}
+
+void progress_set_total(progress_t *p, int64_t total) {
+  if (p == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&progress_lock);
+  p->total = total;
+  pthread_mutex_unlock(&progress_lock);
+}
+
+void progress_add(progress_t *p, int64_t bytes) {
+  if (p == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&progress_lock);
+  p->done += bytes;
+  pthread_mutex_unlock(&progress_lock);
+}
+
+void progress_set(progress_t *p, int64_t done) {
+  if (p == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&progress_lock);
+  p->done = done;
+  pthread_mutex_unlock(&progress_lock);
+}
+
+// 调用之后 p 归快照所有，传输线程不能再使用
+void progress_end(progress_t *p, bool ok) {
+  if (p == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&progress_lock);
+  p->state = ok ? PROGRESS_DONE : PROGRESS_FAILED;
+  if (ok && p->total >= 0) {
+    p->done = p->total;
+  }
+  pthread_mutex_unlock(&progress_lock);
+}
+
+int progress_snapshot(transfer_progress_t *out, int max) {
+  uint64_t now = now_ms();
+  int n = 0;
+  pthread_mutex_lock(&progress_lock);
+  progress_t **pp = &progress_list;
+  while (*pp != NULL) {
+    progress_t *p = *pp;
+    if (now > p->last_ms) {
+      p->rate = (p->done - p->last_done) * 1000 / (int64_t)(now - p->last_ms);
+      p->last_done = p->done;
+      p->last_ms = now;
+    }
+    if (n < max) {
+      transfer_progress_t *o = &out[n++];
+      memcpy(o->name, p->name, sizeof(o->name));
+      o->done = p->done;
+      o->total = p->total;
+      o->rate = p->rate;
+      o->avg_rate =
+          now > p->start_ms ? p->done * 1000 / (int64_t)(now - p->start_ms) : 0;
+      o->eta = p->total >= 0 && o->avg_rate > 0
+                   ? (p->total - p->done) / o->avg_rate
+                   : -1;
+      o->state = p->state;
+    }
+    if (p->state != PROGRESS_RUNNING) {
+      *pp = p->next;
+      free(p);
+    } else {
+      pp = &p->next;
+    }
+  }
+  pthread_mutex_unlock(&progress_lock);
+  return n;
+}
@@ -0,0 +1,25 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#ifndef TERMTUNNEL_PROGRESS_H
+#define TERMTUNNEL_PROGRESS_H
+#include <stdbool.h>
+#include <stdint.h>
+#include "intent.h"
+
+// 推送给 cli 的最小间隔
+#define PROGRESS_INTERVAL_MS 250
+
+typedef struct progress progress_t;
+
+progress_t *progress_begin(const char *name, int64_t total);
+void progress_set_total(progress_t *p, int64_t total);
+void progress_add(progress_t *p, int64_t bytes);
+void progress_set(progress_t *p, int64_t done);
+void progress_end(progress_t *p, bool ok);
+int progress_snapshot(transfer_progress_t *out, int max);
+#endif
@@ -5,6 +5,7 @@
  * https://opensource.org/licenses/MIT
  */
 
+#define _GNU_SOURCE
 #include "pty.h"
 
 #include <assert.h>
@@ -81,7 +82,7 @@ static int do_exec(const char *name, int ptypt, char **argv, int argc) {
   dup2(slavept, 2);
 
   close(slavept);
-  close(pty_fd);
+  close(ptypt);
 
   int32_t fdlimit = (int32_t)sysconf(_SC_OPEN_MAX);
   for (int i = STDERR_FILENO + 1; i < fdlimit; i++) {
@@ -131,6 +132,39 @@ int do_waitpid_wrap(thread_pass_arg_t *arg) {
   return exitcode;
 }
 
+// 打开一个新的 pty 主端，返回 fd，name 放从端的路径
+static int open_pty(char *name, size_t size) {
+  int fd = open("/dev/ptmx", O_RDWR | O_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+  if (grantpt(fd) != 0 || unlockpt(fd) != 0 || ptsname_r(fd, name, size) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int pty_spawn(int argc, char *argv[], pid_t *pid) {
+  char name[PATH_MAX];
+  int fd = open_pty(name, sizeof(name));
+  if (fd == -1) {
+    log_error("open pty failed %s", strerror(errno));
+    return -1;
+  }
+  *pid = fork();
+  if (*pid == 0) {
+    do_exec(name, fd, argv, argc);
+    exit(EXIT_FAILURE);
+  }
+  if (*pid < 0) {
+    log_error("fork failed %s", strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
 int pty_run(int argc, char *argv[], tell_exitcode_callback *cb) {
   pty_fd = open("/dev/ptmx", O_RDWR | O_CLOEXEC);
   if (pty_fd == -1) {
@@ -7,9 +7,12 @@
 
 #ifndef TERMTUNNEL_PTY_H
 #define TERMTUNNEL_PTY_H
+#include <sys/types.h>
 #include <termios.h>
 typedef int tell_exitcode_callback(int exitcode);
 extern int pty_run(int argc, char *argv[], tell_exitcode_callback *cb);
+// 在新的 pty 里运行 argv，返回主端的 fd，子进程由调用方回收
+extern int pty_spawn(int argc, char *argv[], pid_t *pid);
 extern int get_pty_fd();
 typedef struct winsize winsize_t;
 extern void resize_pty(winsize_t *a);
@@ -0,0 +1,264 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "relay.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <uv.h>
+
+#include "agent.h"
+#include "config.h"
+#include "fsm.h"
+#include "log.h"
+#include "pipe.h"
+#include "pty.h"
+#include "route.h"
+#include "slab.h"
+#include "thirdparty/base64.h"
+#include "utils.h"
+
+typedef struct {
+  int id;
+  pid_t pid;
+  bool closed;  // pty 读到头了，等着回收子进程
+  uv_pipe_t pipe;
+  fsm_context *fsm;
+  // 一次读 stdin 里发给它的帧攒在一起，relay_flush 时一次写进 pty
+  char *pending;
+  size_t pending_len;
+  size_t pending_cap;
+} relay_child_t;
+
+static relay_child_t *children[VNET_MAX_AGENTS];
+
+// 颜色加上这一级的前缀
+#define GREEN_HEAD_MAX (sizeof(GREEN_PREFIX) + 16)
+
+static void alloc_buffer(uv_handle_t *handle, size_t suggested_size,
+                         uv_buf_t *buf) {
+  buf->base = (char *)slab_alloc(suggested_size);
+  buf->len = buf->base != NULL ? suggested_size : 0;
+}
+
+static void on_close(uv_handle_t *handle) {
+  relay_child_t *c = (relay_child_t *)handle->data;
+  fsm_free(c->fsm);
+  c->fsm = NULL;
+  free(c->pending);
+  c->pending = NULL;
+  c->pending_len = 0;
+  c->closed = true;
+}
+
+static void send_exit(int id) {
+  char frame[16];
+  int n = snprintf(frame, sizeof(frame), "@%d:EXIT", id);
+  write_frame_to_server(frame, n);
+}
+
+static void on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+  relay_child_t *c = (relay_child_t *)stream->data;
+  if (nread < 0) {
+    // 命令退出后主端读到 EIO
+    log_info("relay %d closed: %s", c->id, uv_strerror(nread));
+    slab_free(buf->base);
+    uv_read_stop(stream);
+    uv_close((uv_handle_t *)stream, on_close);
+    send_exit(c->id);
+    return;
+  }
+  if (nread > 0) {
+    fsm_append_input(c->fsm, buf->base, nread);
+    fsm_run(c->fsm);
+    // 帧带着 '!' 取出来，加上颜色和这一级的前缀直接拼成绿色帧，
+    // 这次读到的帧合成一次写，不经过 write_frame_to_server 一帧一帧地编码
+    char head[GREEN_HEAD_MAX];
+    int n = snprintf(head, sizeof(head), GREEN_PREFIX "@%d:", c->id);
+    size_t post = sizeof(GREEN_POSTFIX) - 1;
+    size_t cap = 0;
+    size_t len = 0;
+    char *out = NULL;
+    for (;;) {
+      if (cap - len < n + 5 * VIR_MTU + post) {
+        cap = cap == 0 ? 4 * (n + 5 * VIR_MTU + post) : cap * 2;
+        char *tmp = (char *)realloc(out, cap);
+        if (tmp == NULL) {
+          log_error("malloc relay frame failed");
+          break;
+        }
+        out = tmp;
+      }
+      int sz = fsm_pop_output(c->fsm, out + len + n, 5 * VIR_MTU);
+      if (sz <= 0) {
+        break;
+      }
+      memcpy(out + len, head, n);
+      memcpy(out + len + n + sz, GREEN_POSTFIX, post);
+      len += n + sz + post;
+    }
+    if (len > 0) {
+      agent_write_data_to_server(out, len, true);
+    } else {
+      free(out);
+    }
+  }
+  slab_free(buf->base);
+}
+
+// 子进程退出了就释放，没退出返回 false
+static bool reap(relay_child_t *c) {
+  pid_t r = waitpid(c->pid, NULL, WNOHANG);
+  if (r == 0) {
+    return false;
+  }
+  children[c->id] = NULL;
+  free(c);
+  return true;
+}
+
+void relay_spawn(const char *frame, int size) {
+  int id = 0;
+  int i = 1;
+  for (; i < size && frame[i] >= '0' && frame[i] <= '9'; i++) {
+    id = id * 10 + (frame[i] - '0');
+    if (id >= VNET_MAX_AGENTS) {
+      break;
+    }
+  }
+  if (i == 1 || i >= size || frame[i] != ':' || id <= 0 ||
+      id >= VNET_MAX_AGENTS) {
+    log_error("invalid spawn frame [%.*s]", size, frame);
+    return;
+  }
+  relay_child_t *old = children[id];
+  if (old != NULL && !old->closed) {
+    log_error("relay %d already running", id);
+    return;
+  }
+  if (old != NULL && !reap(old)) {
+    // 编号要重新用，旧的命令已经关了 pty，等它退出
+    kill(old->pid, SIGKILL);
+    waitpid(old->pid, NULL, 0);
+    children[id] = NULL;
+    free(old);
+  }
+  size_t len = 0;
+  unsigned char *command = base64_decode(
+      (const unsigned char *)frame + i + 1, size - i - 1, &len);
+  char *cmd = command != NULL ? (char *)malloc(len + 1) : NULL;
+  relay_child_t *c = (relay_child_t *)calloc(1, sizeof(relay_child_t));
+  if (cmd == NULL || c == NULL) {
+    log_error("relay %d: invalid command", id);
+    free(command);
+    free(cmd);
+    free(c);
+    send_exit(id);
+    return;
+  }
+  memcpy(cmd, command, len);
+  cmd[len] = '\0';
+  free(command);
+  log_info("relay %d: %s", id, cmd);
+  char *argv[] = {"/bin/sh", "-c", cmd, NULL};
+  int fd = pty_spawn(3, argv, &c->pid);
+  free(cmd);
+  if (fd < 0) {
+    free(c);
+    send_exit(id);
+    return;
+  }
+  c->id = id;
+  c->fsm = fsm_alloc();
+  uv_loop_t *loop = uv_default_loop();
+  if (uv_pipe_init(loop, &c->pipe, 0) != 0 ||
+      uv_pipe_open(&c->pipe, fd) != 0) {
+    log_error("relay %d: open pty failed", id);
+    close(fd);
+    kill(c->pid, SIGKILL);
+    waitpid(c->pid, NULL, 0);
+    fsm_free(c->fsm);
+    free(c);
+    send_exit(id);
+    return;
+  }
+  c->pipe.data = c;
+  children[id] = c;
+  uv_read_start((uv_stream_t *)&c->pipe, alloc_buffer, on_read);
+}
+
+static void write_cb(uv_write_t *req, int status) {
+  free(req->data);
+  slab_free(req);
+}
+
+void relay_input(const char *frame, int size) {
+  int prefix_len = 0;
+  int id = route_parse(frame, size, &prefix_len);
+  relay_child_t *c = id > 0 ? children[id] : NULL;
+  if (c == NULL || c->closed || c->fsm == NULL) {
+    log_debug("drop frame for relay %d", id);
+    return;
+  }
+  // 和 server 写给终端的一样，以 "!\n" 结尾
+  size_t len = size - prefix_len;
+  if (c->pending_cap - c->pending_len < len + 2) {
+    size_t cap = c->pending_cap == 0 ? 64 * 1024 : c->pending_cap;
+    while (cap - c->pending_len < len + 2) {
+      cap *= 2;
+    }
+    char *tmp = (char *)realloc(c->pending, cap);
+    if (tmp == NULL) {
+      log_error("malloc relay write failed");
+      return;
+    }
+    c->pending = tmp;
+    c->pending_cap = cap;
+  }
+  memcpy(c->pending + c->pending_len, frame + prefix_len, len);
+  memcpy(c->pending + c->pending_len + len, "!\n", 2);
+  c->pending_len += len + 2;
+}
+
+void relay_flush() {
+  for (int i = 1; i < VNET_MAX_AGENTS; i++) {
+    relay_child_t *c = children[i];
+    if (c == NULL || c->closed || c->fsm == NULL || c->pending_len == 0) {
+      continue;
+    }
+    // 缓冲整个交给写请求，下次追加时再分配
+    uv_write_t *req = (uv_write_t *)slab_alloc(sizeof(uv_write_t));
+    if (req == NULL) {
+      log_error("malloc relay write failed");
+      c->pending_len = 0;
+      continue;
+    }
+    req->data = c->pending;
+    uv_buf_t b = uv_buf_init(c->pending, c->pending_len);
+    c->pending = NULL;
+    c->pending_len = 0;
+    c->pending_cap = 0;
+    if (uv_write(req, (uv_stream_t *)&c->pipe, &b, 1, write_cb) != 0) {
+      free(req->data);
+      slab_free(req);
+    }
+  }
+}
+
+void relay_tick() {
+  for (int i = 1; i < VNET_MAX_AGENTS; i++) {
+    if (children[i] != NULL && children[i]->closed) {
+      reap(children[i]);
+    }
+  }
+}
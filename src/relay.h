@@ -0,0 +1,23 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#ifndef TERMTUNNEL_RELAY_H
+#define TERMTUNNEL_RELAY_H
+
+// agent 上转发下级 agent 的帧，路由的规则见 route.h。
+// server 发来 "S<编号>:<base64 的命令>" 时在新的 pty 里用 sh -c 运行命令，
+// 命令里启动的 termtunnel -a 就是这个编号的 agent，比如 ssh -t host termtunnel -a。
+// "@<编号>:<帧>" 去掉这一级的前缀写进它的 pty，它输出的绿色帧原样加上
+// "@<编号>:" 发给 server，其他输出丢掉，所以命令不能等人输入。
+// pty 关闭时发 "@<编号>:EXIT!"。都在 libuv 线程里调用
+void relay_spawn(const char *frame, int size);
+void relay_input(const char *frame, int size);
+// 处理完一次读到的 stdin 后调用，把 relay_input 攒下的帧写进各自的 pty
+void relay_flush(void);
+// 由 REPEAT_MS 的定时器调用，回收退出的命令
+void relay_tick(void);
+#endif
@@ -31,8 +31,12 @@
 static int in;
 static int out;
 bool g_oneshot_mode = false;
+static char *oneshot_args = NULL;
+static int64_t oneshot_args_size = 0;
 
 int print_command_usage(char *command_name);
+int update_processbar(float percent, char string[]);
+static void watch_transfers();
 bool keyboard_break = false;
 int64_t ping_count = 0;
 
@@ -258,7 +262,8 @@ file_exchange_intent_t *new_file_exchange_intent(char *src, char *dst,
 port_forward_intent_t *new_port_forward_intent(int forward_type, char *src_host,
                                                uint16_t src_port,
                                                char *dst_host,
-                                               uint16_t dst_port) {
+                                               uint16_t dst_port,
+                                               int pool_size) {
   port_forward_intent_t *tmp =
       (port_forward_intent_t *)malloc(sizeof(port_forward_intent_t));
   if (tmp == NULL) {
@@ -275,11 +280,12 @@ port_forward_intent_t *new_port_forward_intent(int forward_type, char *src_host,
   }
   tmp->src_port = src_port;
   tmp->dst_port = dst_port;
+  tmp->pool_size = pool_size;
   return tmp;
 }
 
 int portforward_func(int argc, char **argv) {
-  if (argc != 5) {
+  if (argc != 5 && argc != 6) {
     print_command_usage(argv[0]);
     return 0;
   }
@@ -288,6 +294,7 @@ int portforward_func(int argc, char **argv) {
   int src_port = atoi(argv[2]);
   char *dst_host = argv[3];
   int dst_port = atoi(argv[4]);
+  int pool_size = argc == 6 ? atoi(argv[5]) : 0;
   int forward_type;
   if (strcmp(argv[0], "remote_listen") == 0) {
     forward_type = FORWARD_STATIC_PORT_MAP_LISTEN_ON_AGENT;
@@ -296,7 +303,7 @@ int portforward_func(int argc, char **argv) {
   }
 
   port_forward_intent_t *a = new_port_forward_intent(
-      forward_type, src_host, src_port, dst_host, dst_port);
+      forward_type, src_host, src_port, dst_host, dst_port, pool_size);
   if (a == NULL) {
     printf("invalid forward args\n");
     return 0;
@@ -360,6 +367,7 @@ int upload_func(int argc, char **argv) {
   send_binary(out, COMMAND_FILE_EXCHANGE, a, sizeof(file_exchange_intent_t));
   free(a);
   free(url);
+  watch_transfers();
   return 0;
 }
 
@@ -419,6 +427,66 @@ int download_func(int argc, char **argv) {
   free(url);
   free(a);
   free(tmp_pf);
+  watch_transfers();
+  return 0;
+}
+
+int bench_func(int argc, char **argv) {
+  if (argc > 3) {
+    print_command_usage(argv[0]);
+    return 0;
+  }
+  int size_mb = argc >= 2 ? atoi(argv[1]) : 100;
+  int conns = argc >= 3 ? atoi(argv[2]) : 1;
+  if (size_mb <= 0 || conns <= 0) {
+    print_command_usage(argv[0]);
+    return 0;
+  }
+  bench_intent_t a = {.total = (int64_t)size_mb * 1024 * 1024,
+                      .conns = conns};
+  printf("bench %dMB over %d connection(s)\n", size_mb, conns);
+  send_binary(out, COMMAND_BENCH, &a, sizeof(a));
+  watch_transfers();
+  return 0;
+}
+
+int agent_func(int argc, char **argv) {
+  agent_intent_t a;
+  memset(&a, 0, sizeof(a));
+  if (strcmp(argv[0], "agents") == 0 && argc == 1) {
+    a.op = AGENT_OP_LIST;
+  } else if (strcmp(argv[0], "use") == 0 && argc == 2) {
+    a.op = AGENT_OP_USE;
+    snprintf(a.name, sizeof(a.name), "%s", argv[1]);
+  } else if (strcmp(argv[0], "agent_add") == 0 && argc >= 3) {
+    a.op = AGENT_OP_ADD;
+    snprintf(a.name, sizeof(a.name), "%s", argv[1]);
+    // 命令的各段用空格拼回去
+    size_t len = 0;
+    for (int i = 2; i < argc && len < sizeof(a.command); i++) {
+      len += snprintf(a.command + len, sizeof(a.command) - len, "%s%s",
+                      i > 2 ? " " : "", argv[i]);
+    }
+    if (len >= sizeof(a.command)) {
+      printf("command too long\n");
+      return 0;
+    }
+  } else {
+    print_command_usage(argv[0]);
+    return 0;
+  }
+  send_binary(out, COMMAND_AGENT, &a, sizeof(a));
+
+  int64_t type;
+  char *buf;
+  int64_t size;
+  recv_data(in, &type, &buf, &size);
+  if (type == COMMAND_RETURN) {
+    printf("%s", buf);
+  } else {
+    printf("type: %lld", type);
+  }
+  free(buf);
   return 0;
 }
 
@@ -437,17 +505,39 @@ int help_func(int argc, char **argv);
 
 actionfinder_t action_table[] = {
     {"local_listen", portforward_func, "port forward bind on local host",
-     "local_listen [local_host] [local_port] [remote_host] [remote_port]\n"
+     "local_listen [local_host] [local_port] [remote_host] [remote_port] "
+     "[pool_size]\n"
      "when remote_port==0, the service listen on remote_port will be a "
-     "socks5+http proxy server.", FLAG_ONESHOT},
+     "socks5+http proxy server.\n"
+     "pool_size keeps that many connections to remote_host:remote_port "
+     "open in advance.", FLAG_ONESHOT},
     {"remote_listen", portforward_func, "port forward bind on remote host",
-     "remote_listen [remote_host] [remote_port] [local_host] [local_port]\n"
+     "remote_listen [remote_host] [remote_port] [local_host] [local_port] "
+     "[pool_size]\n"
      "when local_port==0, the service listen on remote_port  will be a "
-     "socks5+http proxy server.", 0},
-    {"upload", upload_func, "upload a file", "usage", FLAG_ONESHOT},
+     "socks5+http proxy server.\n"
+     "pool_size keeps that many connections to local_host:local_port "
+     "open in advance.", 0},
+    {"upload", upload_func, "upload a file or folder", "usage", FLAG_ONESHOT},
     {"rz", upload_func, "alias upload", "usage", FLAG_ONESHOT},
-    {"download", download_func, "download a file", "usage", FLAG_ONESHOT},
+    {"download", download_func, "download a file or folder", "usage",
+     FLAG_ONESHOT},
     {"sz", download_func, "alias download", "usage", FLAG_ONESHOT},
+    {"bench", bench_func, "measure vnet throughput to the remote host",
+     "bench [size_mb] [connections]\n"
+     "sends size_mb (default 100) of zeros to the remote host, split over "
+     "connections (default 1) opened one after another.",
+     FLAG_ONESHOT},
+    {"agent_add", agent_func, "start another agent from the current one",
+     "agent_add [name] [command...]\n"
+     "runs command in a new pty on the current agent, the command must end "
+     "up running termtunnel -a without asking for input, e.g.\n"
+     "  agent_add db ssh -t db-host termtunnel -a", 0},
+    {"agents", agent_func, "list agents", "agents", 0},
+    {"use", agent_func, "send later commands to another agent",
+     "use [name]\n"
+     "upload, download, bench, port forward and agent_add go to this agent, "
+     "the first one is named main.", 0},
     {"help", help_func, "view help manpage", "usage", FLAG_ONESHOT},
     {"exit", exit_func, "exit application", "usage", 0},
 };
@@ -585,16 +675,164 @@ int update_processbar(float percent, char string[])
     return 0;
 }
 
-int get_server_running_task(){
+static void format_bytes(char *buf, size_t size, int64_t n) {
+  const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+  double v = n;
+  int u = 0;
+  while (v >= 1024 && u < 4) {
+    v /= 1024;
+    u++;
+  }
+  snprintf(buf, size, u == 0 ? "%.0f%s" : "%.1f%s", v, units[u]);
+}
+
+// 多个传输同时进行时合并成一行
+static float render_progress(transfer_progress_t *list, int n, char *line,
+                             size_t size) {
+  transfer_progress_t sum = *list;
+  int failed = list->state == PROGRESS_FAILED;
+  for (int i = 1; i < n; i++) {
+    sum.done += list[i].done;
+    sum.total = sum.total < 0 || list[i].total < 0
+                    ? -1
+                    : sum.total + list[i].total;
+    sum.rate += list[i].rate;
+    sum.avg_rate += list[i].avg_rate;
+    sum.eta = sum.eta < list[i].eta ? list[i].eta : sum.eta;
+    failed += list[i].state == PROGRESS_FAILED;
+  }
+  if (n > 1) {
+    snprintf(sum.name, sizeof(sum.name), "%d transfers", n);
+  }
+  char done[16], total[16], rate[16], avg[16];
+  format_bytes(done, sizeof(done), sum.done);
+  format_bytes(total, sizeof(total), sum.total);
+  format_bytes(rate, sizeof(rate), sum.rate);
+  format_bytes(avg, sizeof(avg), sum.avg_rate);
+  char eta[32] = "";
+  if (failed > 0) {
+    snprintf(eta, sizeof(eta), "  failed");
+  } else if (sum.eta >= 0) {
+    snprintf(eta, sizeof(eta), "  ETA %02lld:%02lld",
+             (long long)sum.eta / 60, (long long)sum.eta % 60);
+  }
+  snprintf(line, size, "%s  %s/%s  %s/s (avg %s/s)%s", sum.name, done,
+           sum.total < 0 ? "?" : total, rate, avg, eta);
+  if (sum.total <= 0) {
+    return 0;
+  }
+  float percent = (float)sum.done * 100 / sum.total;
+  return percent > 100 ? 100 : percent;
+}
+
+// 停止推送，之前已经发出的包在这里读掉，直到 server 的确认
+static void unwatch() {
+  int32_t mask = 0;
+  send_binary(out, COMMAND_WATCH, &mask, sizeof(mask));
+  while (true) {
+    int64_t type;
+    char *buf;
+    int64_t size;
+    recv_data(in, &type, &buf, &size);
+    free(buf);
+    if (type == COMMAND_WATCH) {
+      break;
+    }
+    CHECK(type == COMMAND_TRANSFER_PROGRESS || type == COMMAND_TASK_EVENT ||
+              type == COMMAND_RETURN,
+          "unexpected type %lld", (long long)type);
+  }
+}
+
+// 跟随 server 推送的进度直到传输结束，Ctrl-C 只停止显示
+static void watch_transfers() {
+  int32_t mask = WATCH_PROGRESS | WATCH_TASKS;
+  send_binary(out, COMMAND_WATCH, &mask, sizeof(mask));
+  bool shown = false;
+  bool running = true;
+  char line[256] = "";
+  char failed[PROGRESS_NAME_SIZE] = "";
+  while (running && !keyboard_break) {
+    struct pollfd pfd = {.fd = in, .events = POLLIN};
+    if (poll(&pfd, 1, 100) <= 0) {
+      continue;
+    }
+    int64_t type;
+    char *buf;
+    int64_t size;
+    recv_data(in, &type, &buf, &size);
+    if (type == COMMAND_TASK_EVENT) {
+      // 结束事件到了就返回，不用等下一次进度
+      task_event_t *e = (task_event_t *)buf;
+      if (e->event == TASK_FINISHED && shown) {
+        update_processbar(100, line);
+      } else if (e->event == TASK_FAILED) {
+        snprintf(failed, sizeof(failed), "%s", e->name);
+      }
+      running = e->event == TASK_STARTED;
+      free(buf);
+      continue;
+    }
+    CHECK(type == COMMAND_TRANSFER_PROGRESS,
+          "type != COMMAND_TRANSFER_PROGRESS");
+    int n = size / sizeof(transfer_progress_t);
+    transfer_progress_t *list = (transfer_progress_t *)buf;
+    // 订阅之前就结束了的传输只能从进度里看出来
+    running = false;
+    for (int i = 0; i < n; i++) {
+      running = running || list[i].state == PROGRESS_RUNNING;
+    }
+    if (n > 0) {
+      float percent = render_progress(list, n, line, sizeof(line));
+      // 结束时画满进度条，光标留在进度条下面
+      update_processbar(running ? percent : 100, line);
+      shown = true;
+    }
+    free(buf);
+  }
+  if (shown) {
+    printf("\n");
+  }
+  if (failed[0] != '\0') {
+    printf("%s failed\n", failed);
+  }
+  if (keyboard_break) {
+    keyboard_break = false;
+    printf("transfer continues in background\n");
+  }
+  unwatch();
+}
+
+// 等 server 上的任务全部结束。任务数和结束事件都按写出时的值推过来，
+// 按收到的顺序取最后一个就是当前的任务数
+static void wait_tasks() {
+  int32_t mask = WATCH_TASKS;
+  send_binary(out, COMMAND_WATCH, &mask, sizeof(mask));
   send_binary(out, COMMAND_GET_RUNNING_TASK_COUNT, NULL, 0);
-  int64_t type;
-  char *buf;
-  int64_t size;
-  recv_data(in, &type, &buf, &size);
-  CHECK(type == COMMAND_RETURN, "type != COMMAND_RETURN");
-  int count = *(int*)buf;
-  free(buf);
-  return count;
+  int running = -1;
+  while (running != 0 && !keyboard_break) {
+    struct pollfd pfd = {.fd = in, .events = POLLIN};
+    if (poll(&pfd, 1, 100) <= 0) {
+      continue;
+    }
+    int64_t type;
+    char *buf;
+    int64_t size;
+    recv_data(in, &type, &buf, &size);
+    if (type == COMMAND_RETURN) {
+      running = *(int *)buf;
+    } else {
+      CHECK(type == COMMAND_TASK_EVENT, "type != COMMAND_TASK_EVENT");
+      task_event_t *e = (task_event_t *)buf;
+      if (e->event == TASK_FAILED) {
+        printf("%s failed\n", e->name);
+      }
+      running = e->running;
+    }
+    free(buf);
+  }
+  keyboard_break = false;
+  unwatch();
 }
 
 void oneshot_run(int _in, int _out) {
@@ -609,24 +847,29 @@ void oneshot_run(int _in, int _out) {
     fflush(stdout);
   }*/
 
-  // get args
-  send_binary(out, COMMAND_GET_ARGS, NULL, 0);
-  char *buf = NULL;
-  int64_t size;
-  int64_t type = 0;
-  recv_data(_in, &type, &buf, &size);
-  if (type != COMMAND_GET_ARGS_REPLY) {
-    if (buf) {
-      free(buf);
+  // 参数由 server 随 COMMAND_ENTER_REPL 带过来，逐个检查不越界
+  char *buf = oneshot_args;
+  int64_t size = oneshot_args_size;
+  oneshot_args = NULL;
+  int32_t argc = size >= (int64_t)sizeof(int32_t) ? *(int32_t *)buf : 0;
+  if (argc < 0 || argc > ARG_MAX) {
+    argc = 0;
+  }
+  char **argv = malloc(sizeof(char *) * (argc + 1));
+  char *ptr = buf + sizeof(int32_t);
+  char *limit = buf + size;
+  for (int i = 0; i < argc; i++) {
+    char *end = ptr < limit ? memchr(ptr, '\0', limit - ptr) : NULL;
+    if (end == NULL) {
+      argc = i;
+      break;
     }
-      return;
-  }
-  int32_t argc = *(int32_t*)buf;
-  char* ptr = buf+  sizeof(int32_t);
-  char** argv = malloc(sizeof(char*) * argc);
-  for (int i=0; i < argc; i++) {
     argv[i] = ptr;
-    ptr += strlen(ptr)+ 1;
+    ptr = end + 1;
+  }
+  if (argc == 0) {
+    printf("no command given.\n");
+    goto end;
   }
   if (!(get_command_flags(argv[0]) & FLAG_ONESHOT)) {
     printf("the command is REPL only.\n");
@@ -634,18 +877,7 @@ void oneshot_run(int _in, int _out) {
   }
 
   repl_execve(argc, argv);
-  // spinlock wait
-  while (true) {
-    int ret = usleep(500000);
-    // TODO(jdz) 仍有可能极小概率任务还没有开始就开始判定，未来可增加健壮性。
-    if (ret < 0 && errno == SIGINT) {
-      keyboard_break = true;
-    }
-    if (get_server_running_task() == 0 || keyboard_break) {
-      keyboard_break = false;
-      goto end;
-    }
-  }
+  wait_tasks();
 
   end:
   printf("end\n");
@@ -700,22 +932,26 @@ void interact_run(int _in, int _out) {
         }
         case COMMAND_ENTER_REPL:
         {
-          if (sizeof(int64_t) == size) { // TODO(jdz)
-            g_oneshot_mode = true;
+          // 带参数的是 oneshot，参数留给 oneshot_run
+          g_oneshot_mode = size > 0;
+          if (g_oneshot_mode) {
+            oneshot_args = buf;
+            oneshot_args_size = size;
           } else {
-            g_oneshot_mode = false;
-          }
-          if (buf) {
             free(buf);
           }
           return;
-
-          break;
         }
         case COMMAND_TTY_PING: {
           ping_count++;
           break;
         }
+        case COMMAND_TRANSFER_PROGRESS:
+        case COMMAND_TASK_EVENT:
+        case COMMAND_WATCH: {
+          // 迟到的推送，REPL 已经退出，不再显示
+          break;
+        }
         default: {
           CHECK(0, "repl error\n");
         }
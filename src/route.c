@@ -0,0 +1,184 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "route.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "portforward.h"
+#include "utils.h"
+#include "vnet.h"
+
+static route_agent_t *agents[VNET_MAX_AGENTS];
+static int target = 0;
+
+route_agent_t *route_get(int id) {
+  if (id < 0 || id >= VNET_MAX_AGENTS) {
+    return NULL;
+  }
+  if (id == 0 && agents[0] == NULL) {
+    route_agent_t *a = (route_agent_t *)calloc(1, sizeof(route_agent_t));
+    CHECK(a != NULL, "malloc route_agent_t failed");
+    a->parent = -1;
+    a->state = ROUTE_PENDING;
+    snprintf(a->name, sizeof(a->name), "main");
+    agents[0] = a;
+  }
+  return agents[id];
+}
+
+route_agent_t *route_find(const char *name) {
+  for (int i = 0; i < VNET_MAX_AGENTS; i++) {
+    route_agent_t *a = route_get(i);
+    if (a != NULL && a->state != ROUTE_DOWN && strcmp(a->name, name) == 0) {
+      return a;
+    }
+  }
+  return NULL;
+}
+
+static int depth(int id) {
+  int n = 0;
+  for (route_agent_t *a = route_get(id); a != NULL; a = route_get(a->parent)) {
+    n++;
+  }
+  return n;
+}
+
+int route_add(const char *name, int parent) {
+  route_agent_t *p = route_get(parent);
+  if (p == NULL || p->state != ROUTE_UP || route_find(name) != NULL ||
+      depth(parent) >= VNET_MAX_AGENT_DEPTH) {
+    return -1;
+  }
+  for (int i = 1; i < VNET_MAX_AGENTS; i++) {
+    if (agents[i] != NULL && agents[i]->state != ROUTE_DOWN) {
+      continue;
+    }
+    // 下线的编号重新用，链路和头部压缩的上下文都从头开始
+    route_agent_t *a = (route_agent_t *)calloc(1, sizeof(route_agent_t));
+    if (a == NULL) {
+      log_error("malloc route_agent_t failed");
+      return -1;
+    }
+    free(agents[i]);
+    a->id = i;
+    a->parent = parent;
+    a->state = ROUTE_PENDING;
+    a->link.data = (void *)(intptr_t)i;
+    snprintf(a->name, sizeof(a->name), "%s", name);
+    agents[i] = a;
+    return i;
+  }
+  return -1;
+}
+
+static bool is_under(int id, int ancestor) {
+  for (route_agent_t *a = route_get(id); a != NULL; a = route_get(a->parent)) {
+    if (a->id == ancestor) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void route_down(int id) {
+  for (int i = 1; i < VNET_MAX_AGENTS; i++) {
+    route_agent_t *a = agents[i];
+    if (a == NULL || a->state == ROUTE_DOWN || !is_under(i, id)) {
+      continue;
+    }
+    log_info("agent %d %s down", i, a->name);
+    a->state = ROUTE_DOWN;
+    link_deinit(&a->link);
+    portforward_stop_agent(i);
+    vnet_remove_agent(i);
+    if (target == i) {
+      target = 0;
+    }
+  }
+}
+
+void route_reset() { route_down(0); }
+
+int route_parse(const char *buf, int size, int *prefix_len) {
+  if (size < 3 || buf[0] != '@') {
+    return -1;
+  }
+  int id = 0;
+  int i = 1;
+  for (; i < size && buf[i] >= '0' && buf[i] <= '9'; i++) {
+    id = id * 10 + (buf[i] - '0');
+    if (id >= VNET_MAX_AGENTS) {
+      return -1;
+    }
+  }
+  if (i == 1 || i >= size || buf[i] != ':') {
+    return -1;
+  }
+  *prefix_len = i + 1;
+  return id;
+}
+
+int route_prefix(int id, char *dst, size_t cap) {
+  int chain[VNET_MAX_AGENT_DEPTH];
+  int n = 0;
+  for (route_agent_t *a = route_get(id); a != NULL && a->id != 0 &&
+                                         n < VNET_MAX_AGENT_DEPTH;
+       a = route_get(a->parent)) {
+    chain[n++] = a->id;
+  }
+  int len = 0;
+  for (int i = n - 1; i >= 0; i--) {
+    int w = snprintf(dst + len, cap - len, "@%d:", chain[i]);
+    if (w < 0 || (size_t)w >= cap - len) {
+      return -1;
+    }
+    len += w;
+  }
+  return len;
+}
+
+int route_target() { return target; }
+
+void route_use(int id) { target = id; }
+
+int route_describe(char *buf, size_t cap) {
+  static const char *states[] = {"starting", "up", "down"};
+  int len = snprintf(buf, cap, "  %-4s%-16s%-16s%-16s%s\n", "id", "name",
+                     "address", "via", "state");
+  for (int i = 0; i < VNET_MAX_AGENTS && len >= 0 && (size_t)len < cap; i++) {
+    route_agent_t *a = route_get(i);
+    if (a == NULL) {
+      continue;
+    }
+    char ip[16];
+    vnet_agent_ip(i, ip, sizeof(ip));
+    if (a->relay) {
+      snprintf(ip, sizeof(ip), "-");
+    }
+    route_agent_t *p = route_get(a->parent);
+    len += snprintf(buf + len, cap - len, "%c %-4d%-16s%-16s%-16s%s\n",
+                    i == target ? '*' : ' ', i, a->name, ip,
+                    p != NULL ? p->name : "-",
+                    a->relay && a->state == ROUTE_UP ? "relay"
+                                                     : states[a->state]);
+  }
+  return len;
+}
+
+void route_tick() {
+  for (int i = 0; i < VNET_MAX_AGENTS; i++) {
+    if (agents[i] != NULL) {
+      link_tick(&agents[i]->link);
+    }
+  }
+}
@@ -0,0 +1,61 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#ifndef TERMTUNNEL_ROUTE_H
+#define TERMTUNNEL_ROUTE_H
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "config.h"
+#include "intent.h"
+#include "link.h"
+#include "vjcomp.h"
+
+// server 上每个 agent 一项。0 号是直接跑在终端里的 agent，其他的由上一级
+// agent 在自己的 pty 里启动，所有帧都经过同一个终端：
+// 发给 agent k 的文本帧前面加上从 0 号开始每一级的 "@<编号>:"，
+// agent k 的绿色帧由每一级转发时在前面加上 "@k:"，server 取最里面的编号。
+// 上一级只按前缀转发，不解 base64 也不经过自己的 lwIP。
+// agent 上只用 0 号，表示到 server 的链路
+#define ROUTE_PENDING 0  // 已经让上一级启动，还没握手
+#define ROUTE_UP 1
+#define ROUTE_DOWN 2
+// 最长的前缀
+#define ROUTE_PREFIX_MAX (VNET_MAX_AGENT_DEPTH * 8)
+
+typedef struct {
+  int id;
+  int parent;  // 经由哪个 agent 转发，0 号自己是 -1
+  int state;
+  bool relay;  // termtunnel -r，只转发下级的帧，没有 vnet 和链路
+  char name[AGENT_NAME_SIZE];
+  link_t link;  // link.data 是编号
+  vjcomp_t vj_tx;
+} route_agent_t;
+
+// 以下都在 libuv 线程里调用
+// 没有这个 agent 时返回 NULL，0 号总是在
+route_agent_t *route_get(int id);
+route_agent_t *route_find(const char *name);
+// 新加一个经由 parent 转发的 agent，返回编号。重名、满了或者太深时返回 -1
+int route_add(const char *name, int parent);
+// agent 和它下面的 agent 都不在了
+void route_down(int id);
+// 0 号重新握手时，其他 agent 都随上一级退出了
+void route_reset(void);
+// 解析 buf 开头的一个 "@<编号>:"，返回编号和前缀长度，不是前缀返回 -1
+int route_parse(const char *buf, int size, int *prefix_len);
+// 写出发给 id 的前缀，返回长度
+int route_prefix(int id, char *dst, size_t cap);
+// 不指定 agent 的命令发给哪个 agent
+int route_target(void);
+void route_use(int id);
+// agents 命令的输出
+int route_describe(char *buf, size_t cap);
+// 对在线的链路调 link_tick
+void route_tick(void);
+#endif
@@ -0,0 +1,193 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "slab.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLAB_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_LARGE UINT32_MAX
+
+// 放在每块前面，保持返回的指针按 max_align_t 对齐
+typedef union slab_hdr {
+  struct {
+    union {
+      union slab_hdr *next;  // 空闲时串成链表
+      size_t size;           // 直接 malloc 的大块记下大小
+    };
+    uint32_t cls;
+  } h;
+  max_align_t align;
+} slab_hdr_t;
+
+typedef struct {
+  slab_hdr_t *head[SLAB_CLASSES];
+  size_t count[SLAB_CLASSES];
+  bool registered;
+} slab_cache_t;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static slab_hdr_t *pool_head[SLAB_CLASSES];
+
+static __thread slab_cache_t cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static size_t block_stride(uint32_t cls) {
+  return sizeof(slab_hdr_t) + ((size_t)1 << (cls + SLAB_MIN_SHIFT));
+}
+
+static size_t cache_limit(uint32_t cls) {
+  size_t n = SLAB_CACHE_BYTES / block_stride(cls);
+  return n < 2 ? 2 : n;
+}
+
+static uint32_t size_class(size_t size) {
+  if (size > ((size_t)1 << SLAB_MAX_SHIFT)) {
+    return SLAB_LARGE;
+  }
+  uint32_t shift = SLAB_MIN_SHIFT;
+  while (((size_t)1 << shift) < size) {
+    shift++;
+  }
+  return shift - SLAB_MIN_SHIFT;
+}
+
+// 把 from 链表头上的 n 块挪到 to 上，返回实际挪了几块
+static size_t move_blocks(slab_hdr_t **from, slab_hdr_t **to, size_t n) {
+  size_t moved = 0;
+  while (moved < n && *from != NULL) {
+    slab_hdr_t *b = *from;
+    *from = b->h.next;
+    b->h.next = *to;
+    *to = b;
+    moved++;
+  }
+  return moved;
+}
+
+static void cache_flush(void *arg) {
+  slab_cache_t *c = (slab_cache_t *)arg;
+  pthread_mutex_lock(&pool_lock);
+  for (uint32_t cls = 0; cls < SLAB_CLASSES; cls++) {
+    move_blocks(&c->head[cls], &pool_head[cls], c->count[cls]);
+    c->count[cls] = 0;
+  }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+static void cache_key_create() { pthread_key_create(&cache_key, cache_flush); }
+
+// 线程退出时把缓存交回全局池
+static slab_cache_t *get_cache() {
+  slab_cache_t *c = &cache;
+  if (!c->registered) {
+    c->registered = true;
+    pthread_once(&cache_key_once, cache_key_create);
+    pthread_setspecific(cache_key, c);
+  }
+  return c;
+}
+
+static void refill(slab_cache_t *c, uint32_t cls) {
+  size_t want = cache_limit(cls) / 2;
+  pthread_mutex_lock(&pool_lock);
+  size_t moved = move_blocks(&pool_head[cls], &c->head[cls], want);
+  pthread_mutex_unlock(&pool_lock);
+  c->count[cls] += moved;
+  if (moved > 0) {
+    return;
+  }
+  // 全局池也空了，切一块新的
+  size_t stride = block_stride(cls);
+  size_t n = SLAB_CHUNK_SIZE / stride;
+  if (n == 0) {
+    n = 1;
+  }
+  char *chunk = (char *)malloc(n * stride);
+  if (chunk == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < n; i++) {
+    slab_hdr_t *b = (slab_hdr_t *)(chunk + i * stride);
+    b->h.cls = cls;
+    b->h.next = c->head[cls];
+    c->head[cls] = b;
+  }
+  c->count[cls] += n;
+}
+
+void *slab_alloc(size_t size) {
+  uint32_t cls = size_class(size);
+  if (cls == SLAB_LARGE) {
+    slab_hdr_t *b = (slab_hdr_t *)malloc(sizeof(slab_hdr_t) + size);
+    if (b == NULL) {
+      return NULL;
+    }
+    b->h.cls = SLAB_LARGE;
+    b->h.size = size;
+    return b + 1;
+  }
+  slab_cache_t *c = get_cache();
+  if (c->head[cls] == NULL) {
+    refill(c, cls);
+    if (c->head[cls] == NULL) {
+      return NULL;
+    }
+  }
+  slab_hdr_t *b = c->head[cls];
+  c->head[cls] = b->h.next;
+  c->count[cls]--;
+  return b + 1;
+}
+
+void *slab_calloc(size_t count, size_t size) {
+  if (size != 0 && count > SIZE_MAX / size) {
+    return NULL;
+  }
+  void *p = slab_alloc(count * size);
+  if (p != NULL) {
+    memset(p, 0, count * size);
+  }
+  return p;
+}
+
+size_t slab_size(const void *p) {
+  const slab_hdr_t *b = (const slab_hdr_t *)p - 1;
+  if (b->h.cls == SLAB_LARGE) {
+    return b->h.size;
+  }
+  return (size_t)1 << (b->h.cls + SLAB_MIN_SHIFT);
+}
+
+void slab_free(void *p) {
+  if (p == NULL) {
+    return;
+  }
+  slab_hdr_t *b = (slab_hdr_t *)p - 1;
+  uint32_t cls = b->h.cls;
+  if (cls == SLAB_LARGE) {
+    free(b);
+    return;
+  }
+  slab_cache_t *c = get_cache();
+  b->h.next = c->head[cls];
+  c->head[cls] = b;
+  if (++c->count[cls] <= cache_limit(cls)) {
+    return;
+  }
+  size_t n = c->count[cls] / 2;
+  pthread_mutex_lock(&pool_lock);
+  move_blocks(&c->head[cls], &pool_head[cls], n);
+  pthread_mutex_unlock(&pool_lock);
+  c->count[cls] -= n;
+}
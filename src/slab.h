@@ -0,0 +1,28 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#ifndef TERMTUNNEL_SLAB_H
+#define TERMTUNNEL_SLAB_H
+#include <stddef.h>
+
+// 按 2 的幂分级的内存池，给 lwIP 的 pbuf/段/消息、vnet 帧、uv 写请求和
+// 读缓冲用。每级从 SLAB_CHUNK_SIZE 的大块里切，释放后留在池里不还给 libc，
+// 常驻内存只跟峰值有关，不会因为碎片慢慢涨。
+// 每个线程先用自己的缓存，空了或满了才和全局池成批交换，线程退出时交回全局池。
+// 超过最大一级的直接走 malloc。slab_free 只能释放 slab_alloc 来的指针
+#define SLAB_MIN_SHIFT 5   // 32 字节
+#define SLAB_MAX_SHIFT 16  // 64KB，正好放下 libuv 建议的读缓冲
+#define SLAB_CHUNK_SIZE (64 * 1024)
+// 线程缓存每级最多留这么多字节，多出来的一半交回全局池
+#define SLAB_CACHE_BYTES (128 * 1024)
+
+void *slab_alloc(size_t size);
+void *slab_calloc(size_t count, size_t size);
+void slab_free(void *p);
+// slab_alloc 来的指针实际可用的字节数
+size_t slab_size(const void *p);
+#endif
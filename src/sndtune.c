@@ -0,0 +1,76 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "sndtune.h"
+
+#include "config.h"
+#include "lwip/sys.h"
+#include "lwip/tcp.h"
+#include "lwipopts.h"
+
+static uint32_t budget_used;
+
+static uint32_t send_limit(struct tcp_pcb *pcb) {
+#ifdef TCP_LOSSLESS_LINK
+  if (TCP_LOSSLESS_LINK) {
+    return pcb->snd_wnd;
+  }
+#endif
+  return LWIP_MIN(pcb->snd_wnd, pcb->cwnd);
+}
+
+static void grow(struct tcp_pcb *pcb, uint32_t target) {
+  sndtune_t *t = &pcb->sndtune;
+  uint32_t size = TCP_SND_BUF + t->extra;
+  // 比对端通告过的最大窗口还大也发不出去
+  target = LWIP_MIN(target, LWIP_MAX(pcb->snd_wnd_max, TCP_SND_BUF));
+  target = LWIP_MIN(target, VNET_SND_BUF_MAX);
+  if (target <= size) {
+    return;
+  }
+  uint32_t delta = LWIP_MIN(target - size, VNET_SND_BUF_BUDGET - budget_used);
+  t->extra += delta;
+  budget_used += delta;
+  pcb->snd_buf += delta;
+}
+
+void sndtune_acked(struct tcp_pcb *pcb) {
+  sndtune_t *t = &pcb->sndtune;
+  uint32_t now = sys_now();
+  uint32_t size = TCP_SND_BUF + t->extra;
+  uint32_t inflight = pcb->snd_nxt - pcb->lastack;
+  // 缓冲里有一半以上的数据，而窗口还能再发，说明是缓冲限制了发送
+  if (size - pcb->snd_buf >= size / 2 && inflight + pcb->mss <= send_limit(pcb)) {
+    t->limited = true;
+  }
+  if (t->timing && (int32_t)(pcb->lastack - t->seq) > 0) {
+    uint32_t rtt = LWIP_MAX(now - t->start, 1);
+    if (t->rtt_min == 0 || rtt < t->rtt_min) {
+      t->rtt_min = rtt;
+    }
+    // 排队会拉长 rtt，用最小 rtt 估计带宽时延积，留一倍的余量
+    uint64_t delivered = pcb->lastack - t->start_ack;
+    if (t->limited) {
+      grow(pcb, (uint32_t)LWIP_MIN(2 * delivered * t->rtt_min / rtt,
+                                   VNET_SND_BUF_MAX));
+    }
+    t->timing = false;
+  }
+  if (!t->timing && pcb->snd_nxt != pcb->lastack) {
+    t->timing = true;
+    t->limited = false;
+    t->seq = pcb->snd_nxt;
+    t->start = now;
+    t->start_ack = pcb->lastack;
+  }
+}
+
+void sndtune_release(struct tcp_pcb *pcb) {
+  sndtune_t *t = &pcb->sndtune;
+  budget_used -= t->extra;
+  t->extra = 0;
+}
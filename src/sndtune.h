@@ -0,0 +1,31 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#ifndef TERMTUNNEL_SNDTUNE_H
+#define TERMTUNNEL_SNDTUNE_H
+#include <stdbool.h>
+#include <stdint.h>
+
+// lwIP 发送缓冲的自动调整。每条连接从 TCP_SND_BUF 开始，每个 RTT 按
+// 测到的带宽时延积增长，单条不超过 VNET_SND_BUF_MAX，所有连接多出来的
+// 部分加起来不超过 VNET_SND_BUF_BUDGET。只在 tcpip 线程里调用
+typedef struct {
+  uint32_t extra;      // 超出 TCP_SND_BUF 的部分，计入预算
+  uint32_t seq;        // 这个序号被确认时结束一轮测量
+  uint32_t start;      // 这一轮开始的时间，ms
+  uint32_t start_ack;  // 这一轮开始时已确认的序号
+  uint32_t rtt_min;    // ms，0 表示还没有测到
+  bool timing;
+  bool limited;        // 这一轮里发送缓冲曾经是瓶颈
+} sndtune_t;
+
+struct tcp_pcb;
+// 收到推进了 lastack 的 ACK 之后调用
+void sndtune_acked(struct tcp_pcb *pcb);
+// 连接不再发送数据时归还预算，可以重复调用
+void sndtune_release(struct tcp_pcb *pcb);
+#endif
@@ -25,6 +25,8 @@
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+#include "connpool.h"
+#include "http.h"
 #include "utils.h"
 #include "log.h"
 #include "portforward.h"
@@ -75,212 +77,155 @@ int readn(int fd, void *buf, int n) {
   return n;
 }
 
-int readtocharR(int fd, char *buf, int bufsize) {
-  int readbytes = 0;
-  while (readbytes < bufsize) {
-    int n = lwip_read(fd, buf + readbytes, 1);
-    if (n < 0) {
-      if (errno == EINTR || errno == EAGAIN) {
-        continue;
-      }
-      return -1;
-    }
-    if (n == 0) {
-      return 0;
-    }
-    readbytes += n;
-    // Require at least 4 bytes before checking CRLFCRLF to avoid OOB access.
-    if (readbytes >= 4 &&
-        memcmp(buf + readbytes - 4, "\r\n\r\n", 4) == 0) {
-      break;
-    }
+static int http_tunnel(http_stream_t *client, http_message_t *req) {
+  int rfd = connpool_connect(req->host, req->port);
+  if (rfd < 0) {
+    http_reply_error(client, 502, "connect failed");
+    return -1;
   }
-  return readbytes;
-}
-
-int report_error_to_client(int fd, char *message) {
-  if (message == NULL) {
-        message = "(null)";
+  char *reply = "HTTP/1.1 200 Connection Established\r\n\r\n";
+  if (http_writen(client, reply, strlen(reply)) < 0) {
+    close(rfd);
+    return -1;
+  }
+  int buffered = http_stream_buffered(client);
+  if (buffered > 0 &&
+      writen(rfd, client->buf + client->rpos, buffered) != buffered) {
+    close(rfd);
+    return -1;
   }
-  char buffer[512];
-  snprintf(buffer, sizeof(buffer), "HTTP/1.1 500 Internal Server Error %s\r\n\r\n", message);
-  return lwip_writen(fd, buffer, strlen(buffer));
+  pipe_lwip_socket_and_socket_pair(client->fd, rfd);
+  close(rfd);
+  return 0;
 }
 
+// HTTP/1.1 正向代理：客户端连接保持长连接，逐个解析 absolute-URI 请求，
+// 上游连接在同一个 host:port 的请求之间复用，结束后归还给连接池。
 int http_proxy(int fd, char *prefetch_data, int prefetch_data_size) {
-  uint16_t httpport = 80;
-  char buffer[4096];
-  char buf2[512];
-  char *url;
-  char host[128];
-  char *h, *rest;
-  char *host_end = host + sizeof(host) - 1;
-  uint16_t port;
-  char cmd[16];
-  int read_bytes = 0;
-  char *header = NULL;
-  // char *prefetch_data, prefetch_data_size);
-  //  TODO read to HTTP1.1
-  if (prefetch_data_size < 0 ||
-      prefetch_data_size >= (int)sizeof(buffer) - 1) {
-    log_info("invalid prefetch size: %d", prefetch_data_size);
-    return 0;
+  http_stream_t *client = (http_stream_t *)malloc(sizeof(http_stream_t));
+  http_stream_t *upstream = (http_stream_t *)malloc(sizeof(http_stream_t));
+  http_message_t *req = (http_message_t *)malloc(sizeof(http_message_t));
+  http_message_t *resp = (http_message_t *)malloc(sizeof(http_message_t));
+  char *out = (char *)malloc(HTTP_BUFFER_SIZE);
+  if (client == NULL || upstream == NULL || req == NULL || resp == NULL ||
+      out == NULL) {
+    log_error("malloc http proxy state failed");
+    goto end;
   }
-  memcpy(buffer, prefetch_data, prefetch_data_size);
-  //int n = lwip_read(fd, buffer + prefetch_data_size,
-  //              sizeof(buffer) - prefetch_data_size);
-  int n = readtocharR(fd, buffer + prefetch_data_size,
-                      sizeof(buffer) - 1 - prefetch_data_size);
-  header = buffer;
-  read_bytes = n + prefetch_data_size;
-  if (n < 1) {
-    if (1) {
-      if (n < 0) perror("read");
-      log_info("nothing read.");
-    }
-    return 0;
-  }
-  buffer[read_bytes] = '\0';
-  log_info("prefetch %d bytes", n);
-  int i = 0;
-  for (i = 0; i < 15; i++)
-    if (buffer[i] && (buffer[i] != ' ')) {
-      cmd[i] = (char)toupper((int)buffer[i]);
-    } else {
+  http_stream_init(client, fd, lwip_read, lwip_write);
+  http_stream_prefill(client, prefetch_data, prefetch_data_size);
+
+  int rfd = -1;
+  char rhost[HTTP_HOST_MAX_LENGTH] = {0};
+  uint16_t rport = 0;
+  while (true) {
+    int n = http_read_head(client, req);
+    if (n <= 0) {
       break;
     }
-  // printf("i:[%d]\n",i);
-  cmd[i] = '\0';
-  // printf("cmd:[%s]\n",cmd);
-  if (strcmp(cmd, "GET") && strcmp(cmd, "POST") && strcmp(cmd, "CONNECT")) {
-    report_error_to_client(fd, "This command is not supported");
-    lwip_close(fd);  // TODO (jdz) 遗留bug
-    return 0;
-  }
-
-  if (strcmp(cmd, "CONNECT") == 0) {
-    // CONNECT g.cn:443 HTTP/1.1
-    url = buffer + 8;  //"CONNECT "
-    h = host;
-    for (; *url && (*url != ':') && (*url != '/') && (*url != ' ') &&
-           (h < host_end);
-         url++)
-      *(h++) = *url;
-    *h = '\0';
-    if (*url == ' ' || *url == '\0') {
-      report_error_to_client(fd, "invalid CONNECT request");
-      lwip_close(fd);
-      return 0;
-    }
-    if (*url == ':') {
-      port = strtoul(url + 1, NULL, 0);
-      while (*url && *url != '/' && *url != ' ' && *url != '\r' &&
-             *url != '\n')
-        url++;
-    } else {
-      port = httpport;
-    }
-    if (*url == '\0' || *url == '\r' || *url == '\n') {
-      report_error_to_client(fd, "invalid CONNECT request");
-      lwip_close(fd);
-      return 0;
-    }
-    for (rest = url; *rest && (*rest != '\n'); rest++);
-    if (*rest) {
-      *rest = '\0';
-      rest++;
+    if (http_parse_request(req) != 0) {
+      log_info("invalid http request");
+      http_reply_error(client, 400, "invalid HTTP request");
+      break;
     }
-  } else {
-    //GET http://g.cn:80
-    for (url = buffer; *url && (*url != '/'); url++)
-      ;
-    if (*url == '\0') {
-      report_error_to_client(fd, "invalid HTTP request");
-      lwip_close(fd);
-      return 0;
+    log_info("http %s %s:%hu%s", req->method, req->host, req->port, req->path);
+    if (strcmp(req->method, "CONNECT") == 0) {
+      connpool_release(rhost, rport, rfd, true);
+      rfd = -1;
+      http_tunnel(client, req);
+      break;
     }
-    url += 2;
-    h = host;
-    for (; *url && (*url != ':') && (*url != '/') && (h < host_end); url++)
-      *(h++) = *url;
-    *h = '\0';
-    if (*url == '\0') {
-      report_error_to_client(fd, "invalid HTTP request");
-      lwip_close(fd);
-      return 0;
+    if (rfd >= 0 && (strcmp(rhost, req->host) != 0 || rport != req->port)) {
+      connpool_release(rhost, rport, rfd, true);
+      rfd = -1;
     }
-    if (*url == ':') {
-      port = strtoul(url + 1, NULL, 0);
-      while (*url && *url != '/' && *url != ' ' && *url != '\r' &&
-             *url != '\n')
-        url++;
-    } else {
-      port = httpport;
+    bool has_body = req->chunked || req->content_length > 0;
+    int head_len = http_serialize_request(req, out, HTTP_BUFFER_SIZE);
+    if (head_len < 0) {
+      http_reply_error(client, 400, "request header too large");
+      break;
     }
-    if (*url == '\0' || *url == '\r' || *url == '\n') {
-      report_error_to_client(fd, "invalid HTTP request");
-      lwip_close(fd);
-      return 0;
+    bool ok = false;
+    for (int attempt = 0; attempt < 2; attempt++) {
+      bool reused = true;
+      if (rfd < 0) {
+        rfd = connpool_acquire(req->host, req->port, &reused);
+        if (rfd < 0) {
+          break;
+        }
+        snprintf(rhost, sizeof(rhost), "%s", req->host);
+        rport = req->port;
+        http_stream_init(upstream, rfd, read, write);
+      }
+      bool sent = http_writen(upstream, out, head_len) == head_len &&
+                  http_forward_body(client, upstream, req->content_length,
+                                    req->chunked) == 0;
+      // 跳过 100 Continue 之类的中间响应
+      int rn = sent ? http_read_head(upstream, resp) : -1;
+      while (rn > 0) {
+        if (http_parse_response(resp) != 0 || resp->status == 101) {
+          rn = -1;
+          break;
+        }
+        if (resp->status >= 200) {
+          break;
+        }
+        rn = http_read_head(upstream, resp);
+      }
+      if (rn > 0) {
+        ok = true;
+        break;
+      }
+      close(rfd);
+      rfd = -1;
+      // 空闲连接可能已被上游关闭，没有请求体时可以安全重试一次
+      if (!reused || has_body) {
+        break;
+      }
+      log_info("stale upstream connection, retry");
     }
-    for (rest = url; *rest && (*rest != '\n'); rest++);
-    if (*rest) {
-      *rest = '\0';
-      rest++;
+    if (!ok) {
+      http_reply_error(client, 502, "upstream error");
+      break;
     }
-  }
-  int rfd;
-  if ((rfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-    log_info("socket error");
-    return 0;
-  }
-  char* ip = safe_gethostbyname(host, port);
-  if (ip == NULL) {
-    log_info("safe_gethostbyname empty ip");
-    report_error_to_client(fd, "empty ip");
-    lwip_close(fd);
-    close(rfd);
-    return 0;
-  }
-  struct sockaddr_in sin;
-  sin.sin_family = AF_INET;
-  sin.sin_addr.s_addr = inet_addr(ip);
-  free(ip);
-  sin.sin_port = htons(port);
-  if (connect(rfd, (struct sockaddr *)&sin, sizeof(struct sockaddr_in)) < 0) {
-    report_error_to_client(fd, strerror(errno));
-    lwip_close(fd);
-    close(rfd);
-    return 0;
-  }
-  if (strcmp(cmd, "CONNECT") != 0) {
-    snprintf(buf2, sizeof(buf2), "%s %s\n", cmd, url);
-    if (write(rfd, buf2, strlen(buf2)) < 1) {
-      lwip_close(fd);
+
+    bool has_resp_body = http_response_has_body(req, resp);
+    bool delimited =
+        !has_resp_body || resp->chunked || resp->content_length >= 0;
+    bool client_keep_alive = req->keep_alive && delimited;
+    head_len = http_serialize_response(resp, client_keep_alive, out,
+                                       HTTP_BUFFER_SIZE);
+    if (head_len < 0 || http_writen(client, out, head_len) < 0) {
+      // 响应体还没读，连接不能再给别的请求用
       close(rfd);
-      return 0;
+      rfd = -1;
+      break;
     }
-  } else {
-    char *reply = "HTTP/1.1 200 Connection Established\r\n\r\n";
-    if (lwip_writen(fd, reply, strlen(reply)) < 1) {
-      lwip_close(fd);
+    int ret = 0;
+    if (has_resp_body) {
+      if (delimited) {
+        ret = http_forward_body(upstream, client, resp->content_length,
+                                resp->chunked);
+      } else {
+        ret = http_forward_until_close(upstream, client);
+      }
+    }
+    if (ret != 0 || !delimited || !resp->keep_alive) {
       close(rfd);
-      return 0;
+      rfd = -1;
     }
-  }
-  if (strcmp(cmd, "CONNECT") != 0) {
-    int valid_bytes = read_bytes - (rest - header);
-    if (valid_bytes > 0) {  // strlen(rest)
-      if (write(rfd, rest, valid_bytes) < 1) {
-        perror("write[b]");
-        lwip_close(fd);
-        close(rfd);
-        return 0;
-      }
+    if (ret != 0 || !client_keep_alive) {
+      break;
     }
   }
-  pipe_lwip_socket_and_socket_pair(fd, rfd);
-
-  close(rfd);
+  connpool_release(rhost, rport, rfd, true);
+
+end:
+  free(client);
+  free(upstream);
+  free(req);
+  free(resp);
+  free(out);
   lwip_close(fd);
   return 0;
 }
@@ -38,6 +38,25 @@ int get_running_task_count() {
   return utils_counter_get(&task_counter);
 }
 
+// 只有 server 会注册，agent 上的任务只计数
+static task_listener_fn task_listener = NULL;
+
+void set_task_listener(task_listener_fn fn) { task_listener = fn; }
+
+void task_started(const char *name) {
+  set_running_task_changed(1);
+  if (task_listener != NULL) {
+    task_listener(TASK_STARTED, name);
+  }
+}
+
+void task_finished(const char *name, bool ok) {
+  set_running_task_changed(-1);
+  if (task_listener != NULL) {
+    task_listener(ok ? TASK_FINISHED : TASK_FAILED, name);
+  }
+}
+
 int termtunnel_state_init() {
   utils_counter_init(&task_counter);
   return 0;
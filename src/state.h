@@ -8,6 +8,8 @@
 #ifndef TERMTUNNEL_STATE_H
 
 #define TERMTUNNEL_STATE_H
+#include <stdbool.h>
+#include <stdint.h>
 
 #define STATE_MODE_INTERACT 0
 #define MODE_CLIENT_PROCESS 1
@@ -22,4 +24,13 @@ extern int set_agent_process();
 extern int termtunnel_state_init();
 extern int get_running_task_count();
 extern void set_running_task_changed(int value);
+
+#define TASK_STARTED 0
+#define TASK_FINISHED 1
+#define TASK_FAILED 2
+// 任务开始和结束时调用，可能在任意线程
+typedef void (*task_listener_fn)(int32_t event, const char *name);
+extern void set_task_listener(task_listener_fn fn);
+extern void task_started(const char *name);
+extern void task_finished(const char *name, bool ok);
 #endif
\ No newline at end of file
@@ -0,0 +1,1265 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+// 文件传输引擎：按 TRANSFER_BLOCK_SIZE 的大块读写，磁盘和网络两个阶段
+// 通过双缓冲并发执行。lwip socket 在用户态，数据总要拷进 pbuf，
+// 所以用不上 sendfile，这里用大块 pread/pwrite 减少系统调用次数。
+#define _GNU_SOURCE
+#include "transfer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "delta.h"
+#include "hash.h"
+#include "log.h"
+#include "vclient.h"
+
+typedef struct {
+  char *buf;
+  size_t len;
+  int64_t offset;
+  uint64_t hash;
+  bool full;
+} transfer_slot_t;
+
+typedef struct transfer_pipeline transfer_pipeline_t;
+// 按单元（一个块或一条记录）填充/消费缓冲区，成功返回 0，
+// 单元数未知（units < 0）时 fill 返回 PIPELINE_FILL_END 表示结束
+#define PIPELINE_FILL_END 1
+typedef int (*transfer_fill_fn)(transfer_pipeline_t *p, transfer_slot_t *slot,
+                                int64_t unit);
+typedef int (*transfer_drain_fn)(transfer_pipeline_t *p, transfer_slot_t *slot);
+
+struct transfer_pipeline {
+  int sd;
+  int fd;
+  int64_t offset;
+  int64_t size;
+  int64_t units;
+  void *ctx;
+  transfer_fill_fn fill;
+  transfer_drain_fn drain;
+  transfer_slot_t slots[TRANSFER_PIPELINE_DEPTH];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool producer_done;
+  bool failed;
+};
+
+int transfer_write_full(int sd, const void *buf, size_t n) {
+  const char *ptr = (const char *)buf;
+  size_t left = n;
+  while (left > 0) {
+    ssize_t w = lwip_write(sd, ptr, left);
+    if (w < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      return -1;
+    }
+    if (w == 0) {
+      return -1;
+    }
+    left -= w;
+    ptr += w;
+  }
+  return 0;
+}
+
+// 读满 n 字节返回 0，连接提前关闭或出错返回 -1
+int transfer_read_full(int sd, void *buf, size_t n) {
+  char *ptr = (char *)buf;
+  size_t left = n;
+  while (left > 0) {
+    ssize_t r = lwip_read(sd, ptr, left);
+    if (r < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      return -1;
+    }
+    if (r == 0) {
+      return -1;
+    }
+    left -= r;
+    ptr += r;
+  }
+  return 0;
+}
+
+// 两端可能是不同架构的机器，整数统一按网络字节序传输
+int transfer_write_u64(int sd, uint64_t v) {
+  unsigned char b[8];
+  for (int i = 0; i < 8; i++) {
+    b[i] = (unsigned char)(v >> (56 - 8 * i));
+  }
+  return transfer_write_full(sd, b, sizeof(b));
+}
+
+int transfer_read_u64(int sd, uint64_t *v) {
+  unsigned char b[8];
+  if (transfer_read_full(sd, b, sizeof(b)) != 0) {
+    return -1;
+  }
+  *v = 0;
+  for (int i = 0; i < 8; i++) {
+    *v = (*v << 8) | b[i];
+  }
+  return 0;
+}
+
+int transfer_preallocate(int fd, int64_t size) {
+#ifdef __linux__
+  if (size > 0 && fallocate(fd, 0, 0, size) == 0) {
+    return 0;
+  }
+#endif
+  return ftruncate(fd, size);
+}
+
+// 把 [offset, offset + len) 变成空洞，不支持打洞的文件系统上写 0
+int transfer_punch_hole(int fd, int64_t offset, int64_t len) {
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+  if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) ==
+      0) {
+    return 0;
+  }
+#endif
+  static const char zeros[64 * 1024];
+  while (len > 0) {
+    size_t n = len < (int64_t)sizeof(zeros) ? (size_t)len : sizeof(zeros);
+    ssize_t w = pwrite(fd, zeros, n, offset);
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      return -1;
+    }
+    offset += w;
+    len -= w;
+  }
+  return 0;
+}
+
+// 用 SEEK_DATA/SEEK_HOLE 找出文件里的空洞，按偏移升序存入 holes，
+// 每个空洞占两个元素（偏移，长度），返回空洞个数
+int64_t transfer_find_holes(int fd, int64_t size, int64_t **holes) {
+  *holes = NULL;
+  int64_t count = 0;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  int64_t cap = 0;
+  int64_t off = 0;
+  while (off < size && count < TRANSFER_MAX_HOLES) {
+    int64_t data = lseek(fd, off, SEEK_DATA);
+    if (data < 0 && errno != ENXIO) {
+      break;  // 文件系统不支持
+    }
+    int64_t end = data < 0 || data > size ? size : data;
+    if (end > off) {
+      if (count == cap) {
+        cap = cap == 0 ? 16 : cap * 2;
+        int64_t *grown = (int64_t *)realloc(*holes, cap * 2 * sizeof(int64_t));
+        if (grown == NULL) {
+          break;
+        }
+        *holes = grown;
+      }
+      (*holes)[count * 2] = off;
+      (*holes)[count * 2 + 1] = end - off;
+      count++;
+    }
+    if (end >= size) {
+      break;
+    }
+    off = lseek(fd, end, SEEK_HOLE);
+    if (off < 0) {
+      break;
+    }
+  }
+#endif
+  return count;
+}
+
+static void pipeline_fail(transfer_pipeline_t *p) {
+  pthread_mutex_lock(&p->lock);
+  p->failed = true;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+}
+
+static void *pipeline_producer(void *arg) {
+  transfer_pipeline_t *p = (transfer_pipeline_t *)arg;
+  for (int64_t unit = 0; p->units < 0 || unit < p->units; unit++) {
+    transfer_slot_t *slot = &p->slots[unit % TRANSFER_PIPELINE_DEPTH];
+    pthread_mutex_lock(&p->lock);
+    while (slot->full && !p->failed) {
+      pthread_cond_wait(&p->cond, &p->lock);
+    }
+    bool failed = p->failed;
+    pthread_mutex_unlock(&p->lock);
+    if (failed) {
+      break;
+    }
+    int rc = p->fill(p, slot, unit);
+    if (rc == PIPELINE_FILL_END && p->units < 0) {
+      break;
+    }
+    if (rc != 0) {
+      pipeline_fail(p);
+      break;
+    }
+    pthread_mutex_lock(&p->lock);
+    slot->full = true;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+  }
+  pthread_mutex_lock(&p->lock);
+  p->producer_done = true;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+// 生产者在独立线程里填充缓冲区，当前线程负责消费，全部单元完成返回 0
+static int pipeline_run(transfer_pipeline_t *p) {
+  int ret = 0;
+  bool allocated = true;
+  for (int i = 0; i < TRANSFER_PIPELINE_DEPTH; i++) {
+    p->slots[i].buf = (char *)malloc(TRANSFER_BLOCK_SIZE);
+    p->slots[i].full = false;
+    allocated = allocated && p->slots[i].buf != NULL;
+  }
+  p->producer_done = false;
+  p->failed = false;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->cond, NULL);
+  pthread_t producer;
+  if (!allocated || pthread_create(&producer, NULL, pipeline_producer, p) != 0) {
+    log_error("start transfer pipeline failed");
+    ret = -1;
+    goto end;
+  }
+  int64_t done = 0;
+  while (p->units < 0 || done < p->units) {
+    transfer_slot_t *slot = &p->slots[done % TRANSFER_PIPELINE_DEPTH];
+    pthread_mutex_lock(&p->lock);
+    while (!slot->full && !p->producer_done && !p->failed) {
+      pthread_cond_wait(&p->cond, &p->lock);
+    }
+    bool ready = slot->full && !p->failed;
+    pthread_mutex_unlock(&p->lock);
+    if (!ready) {
+      break;
+    }
+    if (p->drain(p, slot) != 0) {
+      pipeline_fail(p);
+      break;
+    }
+    pthread_mutex_lock(&p->lock);
+    slot->full = false;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    done++;
+  }
+  pthread_join(producer, NULL);
+  if (p->failed || (p->units >= 0 && done != p->units)) {
+    ret = -1;
+  }
+
+end:
+  for (int i = 0; i < TRANSFER_PIPELINE_DEPTH; i++) {
+    free(p->slots[i].buf);
+  }
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->cond);
+  return ret;
+}
+
+static int pread_full(int fd, char *buf, size_t len, int64_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pread(fd, buf + done, len - done, offset + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+static int pwrite_full(int fd, const char *buf, size_t len, int64_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pwrite(fd, buf + done, len - done, offset + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      log_error("pwrite error %s", strerror(errno));
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+static int64_t chunk_count(int64_t size) {
+  return (size + TRANSFER_BLOCK_SIZE - 1) / TRANSFER_BLOCK_SIZE;
+}
+
+static size_t chunk_len(int64_t size, int64_t index) {
+  int64_t left = size - index * TRANSFER_BLOCK_SIZE;
+  return left < TRANSFER_BLOCK_SIZE ? (size_t)left : TRANSFER_BLOCK_SIZE;
+}
+
+// 不带分块校验的连续传输
+static void raw_locate(transfer_pipeline_t *p, transfer_slot_t *slot,
+                       int64_t unit) {
+  slot->offset = p->offset + unit * TRANSFER_BLOCK_SIZE;
+  int64_t left = p->offset + p->size - slot->offset;
+  slot->len = left < TRANSFER_BLOCK_SIZE ? (size_t)left : TRANSFER_BLOCK_SIZE;
+}
+
+static int raw_disk_fill(transfer_pipeline_t *p, transfer_slot_t *slot,
+                         int64_t unit) {
+  raw_locate(p, slot, unit);
+  return pread_full(p->fd, slot->buf, slot->len, slot->offset);
+}
+
+static int raw_disk_drain(transfer_pipeline_t *p, transfer_slot_t *slot) {
+  return pwrite_full(p->fd, slot->buf, slot->len, slot->offset);
+}
+
+static int raw_net_fill(transfer_pipeline_t *p, transfer_slot_t *slot,
+                        int64_t unit) {
+  raw_locate(p, slot, unit);
+  return transfer_read_full(p->sd, slot->buf, slot->len);
+}
+
+static int raw_net_drain(transfer_pipeline_t *p, transfer_slot_t *slot) {
+  return transfer_write_full(p->sd, slot->buf, slot->len);
+}
+
+static int64_t raw_transfer(int sd, int fd, int64_t offset, int64_t size,
+                            transfer_fill_fn fill, transfer_drain_fn drain) {
+  transfer_pipeline_t p;
+  p.sd = sd;
+  p.fd = fd;
+  p.offset = offset;
+  p.size = size;
+  p.units = chunk_count(size);
+  p.fill = fill;
+  p.drain = drain;
+  return pipeline_run(&p) == 0 ? size : -1;
+}
+
+int64_t transfer_send_file(int sd, int fd, int64_t offset, int64_t size) {
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, offset, size, POSIX_FADV_SEQUENTIAL);
+#endif
+  return raw_transfer(sd, fd, offset, size, raw_disk_fill, raw_net_drain);
+}
+
+int64_t transfer_recv_file(int sd, int fd, int64_t offset, int64_t size) {
+  return raw_transfer(sd, fd, offset, size, raw_net_fill, raw_disk_drain);
+}
+
+// 分块校验的可续传传输。
+// 接收端写入 <dst>.ttpart，先把已有的完整块的哈希发给发送端；
+// 发送端回复需要传输的块数(u64)和空洞表（个数(u64)，每项偏移、长度），
+// 整块落在空洞里的不传输；发起方再发送任务 id(u64)。
+// 之后发送端逐条发送记录：块序号(u64) + 数据 + xxh64(u64)，
+// 块序号为 TRANSFER_RECORD_END 表示这条连接上没有更多记录。
+// 接收端逐块校验后 pwrite，全部完成后 rename 为目标文件并回复状态
+// (u64, 0 为成功)。中途断开时 .ttpart 保留，下次传输同一个文件时从这里继续。
+//
+// 单条 lwip 连接的吞吐受限于发送窗口除以终端的往返时间，
+// 所以发起方会按观测到的吞吐量增开连接（最多 TRANSFER_MAX_STREAMS 条），
+// 新连接带上任务 id 加入同一个任务，从共享的待发送列表里取块。
+typedef struct transfer_job transfer_job_t;
+struct transfer_job {
+  uint64_t id;
+  int fd;
+  int64_t size;
+  bool sink;
+  int64_t *needed;  // 发送端：需要发送的块序号
+  int64_t count;
+  int64_t next;     // 发送端：下一个分配出去的块
+  int64_t written;  // 接收端：已经校验写入的块
+  int64_t bytes;
+  progress_t *progress;
+  int streams;
+  int refs;
+  bool finished;
+  transfer_dial_fn dial;
+  void *dial_arg;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  transfer_job_t *next_job;
+};
+
+static transfer_job_t *jobs = NULL;
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+static void deadline_after(struct timespec *ts, int ms) {
+  clock_gettime(CLOCK_REALTIME, ts);
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (long)(ms % 1000) * 1000000;
+  if (ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+static uint64_t job_new_id() {
+  static uint64_t seq = 0;
+  uint64_t n = __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED);
+  return ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 16) ^ n;
+}
+
+static transfer_job_t *job_new(int fd, int64_t size, bool sink,
+                               progress_t *progress) {
+  transfer_job_t *job = (transfer_job_t *)calloc(1, sizeof(transfer_job_t));
+  if (job == NULL) {
+    return NULL;
+  }
+  // 额外的连接可能比主连接晚结束，任务持有自己的 fd
+  job->fd = dup(fd);
+  if (job->fd < 0) {
+    free(job);
+    return NULL;
+  }
+  job->size = size;
+  job->sink = sink;
+  job->progress = progress;
+  job->refs = 1;
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->cond, NULL);
+  return job;
+}
+
+static void job_release(transfer_job_t *job) {
+  pthread_mutex_lock(&job->lock);
+  bool last = --job->refs == 0;
+  pthread_mutex_unlock(&job->lock);
+  if (!last) {
+    return;
+  }
+  close(job->fd);
+  free(job->needed);
+  pthread_mutex_destroy(&job->lock);
+  pthread_cond_destroy(&job->cond);
+  free(job);
+}
+
+static void job_register(transfer_job_t *job) {
+  pthread_mutex_lock(&jobs_lock);
+  job->next_job = jobs;
+  jobs = job;
+  pthread_cond_broadcast(&jobs_cond);
+  pthread_mutex_unlock(&jobs_lock);
+}
+
+static void job_unregister(transfer_job_t *job) {
+  pthread_mutex_lock(&jobs_lock);
+  for (transfer_job_t **pp = &jobs; *pp != NULL; pp = &(*pp)->next_job) {
+    if (*pp == job) {
+      *pp = job->next_job;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&jobs_lock);
+}
+
+// 加入请求可能比主连接上的任务 id 先到，等待一段时间
+static transfer_job_t *job_find(uint64_t id) {
+  struct timespec deadline;
+  deadline_after(&deadline, TRANSFER_JOIN_TIMEOUT_MS);
+  transfer_job_t *job = NULL;
+  pthread_mutex_lock(&jobs_lock);
+  while (true) {
+    for (job = jobs; job != NULL && job->id != id; job = job->next_job) {
+    }
+    if (job != NULL ||
+        pthread_cond_timedwait(&jobs_cond, &jobs_lock, &deadline) != 0) {
+      break;
+    }
+  }
+  if (job != NULL) {
+    pthread_mutex_lock(&job->lock);
+    job->refs++;
+    pthread_mutex_unlock(&job->lock);
+  }
+  pthread_mutex_unlock(&jobs_lock);
+  return job;
+}
+
+static void job_add_bytes(transfer_job_t *job, size_t n, bool chunk_done) {
+  progress_add(job->progress, n);
+  pthread_mutex_lock(&job->lock);
+  job->bytes += n;
+  if (chunk_done) {
+    job->written++;
+    pthread_cond_broadcast(&job->cond);
+  }
+  pthread_mutex_unlock(&job->lock);
+}
+
+static int record_disk_fill(transfer_pipeline_t *p, transfer_slot_t *slot,
+                            int64_t unit) {
+  transfer_job_t *job = (transfer_job_t *)p->ctx;
+  pthread_mutex_lock(&job->lock);
+  int64_t index = job->next < job->count ? job->needed[job->next++] : -1;
+  pthread_mutex_unlock(&job->lock);
+  if (index < 0) {
+    return PIPELINE_FILL_END;
+  }
+  slot->offset = index * TRANSFER_BLOCK_SIZE;
+  slot->len = chunk_len(p->size, index);
+  if (pread_full(p->fd, slot->buf, slot->len, slot->offset) != 0) {
+    return -1;
+  }
+  slot->hash = hash_xxh64(slot->buf, slot->len, 0);
+  return 0;
+}
+
+static int record_net_drain(transfer_pipeline_t *p, transfer_slot_t *slot) {
+  if (transfer_write_u64(p->sd, slot->offset / TRANSFER_BLOCK_SIZE) != 0 ||
+      transfer_write_full(p->sd, slot->buf, slot->len) != 0 ||
+      transfer_write_u64(p->sd, slot->hash) != 0) {
+    return -1;
+  }
+  job_add_bytes((transfer_job_t *)p->ctx, slot->len, false);
+  return 0;
+}
+
+static int record_net_fill(transfer_pipeline_t *p, transfer_slot_t *slot,
+                           int64_t unit) {
+  uint64_t index;
+  if (transfer_read_u64(p->sd, &index) != 0) {
+    return -1;
+  }
+  if (index == TRANSFER_RECORD_END) {
+    return PIPELINE_FILL_END;
+  }
+  if (index >= (uint64_t)chunk_count(p->size)) {
+    return -1;
+  }
+  slot->offset = index * TRANSFER_BLOCK_SIZE;
+  slot->len = chunk_len(p->size, index);
+  if (transfer_read_full(p->sd, slot->buf, slot->len) != 0) {
+    return -1;
+  }
+  return transfer_read_u64(p->sd, &slot->hash);
+}
+
+static int record_disk_drain(transfer_pipeline_t *p, transfer_slot_t *slot) {
+  if (hash_xxh64(slot->buf, slot->len, 0) != slot->hash) {
+    log_error("chunk at %lld corrupted", (long long)slot->offset);
+    return -1;
+  }
+  if (pwrite_full(p->fd, slot->buf, slot->len, slot->offset) != 0) {
+    return -1;
+  }
+  job_add_bytes((transfer_job_t *)p->ctx, slot->len, true);
+  return 0;
+}
+
+// 在一条连接上传输任务的记录，直到待发送列表取完
+static int job_stream(transfer_job_t *job, int sd) {
+  pthread_mutex_lock(&job->lock);
+  job->streams++;
+  pthread_mutex_unlock(&job->lock);
+  transfer_pipeline_t p;
+  p.sd = sd;
+  p.fd = job->fd;
+  p.offset = 0;
+  p.size = job->size;
+  p.units = -1;
+  p.ctx = job;
+  p.fill = job->sink ? record_net_fill : record_disk_fill;
+  p.drain = job->sink ? record_disk_drain : record_net_drain;
+  int ret = pipeline_run(&p);
+  if (ret == 0 && !job->sink) {
+    ret = transfer_write_u64(sd, TRANSFER_RECORD_END);
+  }
+  pthread_mutex_lock(&job->lock);
+  job->streams--;
+  pthread_cond_broadcast(&job->cond);
+  pthread_mutex_unlock(&job->lock);
+  return ret;
+}
+
+int transfer_join(int sd) {
+  uint64_t id;
+  if (transfer_read_u64(sd, &id) != 0) {
+    return -1;
+  }
+  transfer_job_t *job = job_find(id);
+  if (job == NULL) {
+    log_info("transfer job %llx not found", (unsigned long long)id);
+    return -1;
+  }
+  int ret = job_stream(job, sd);
+  job_release(job);
+  return ret;
+}
+
+static void *job_extra_stream(void *arg) {
+  transfer_job_t *job = (transfer_job_t *)arg;
+  int sd = job->dial(job->dial_arg);
+  if (sd >= 0) {
+    if (transfer_write_u64(sd, job->id) == 0) {
+      job_stream(job, sd);
+    }
+    lwip_close(sd);
+  }
+  job_release(job);
+  return NULL;
+}
+
+// 发起方每隔一段时间测一次吞吐量，上次增开连接后吞吐量还有明显提升
+// 就继续增开，否则认为终端已经跑满，不再增加
+static void *job_scaler(void *arg) {
+  transfer_job_t *job = (transfer_job_t *)arg;
+  int64_t last_bytes = 0;
+  int64_t base_rate = -1;
+  int streams = 1;
+  while (streams < TRANSFER_MAX_STREAMS) {
+    struct timespec deadline;
+    deadline_after(&deadline, TRANSFER_SCALE_INTERVAL_MS);
+    pthread_mutex_lock(&job->lock);
+    while (!job->finished &&
+           pthread_cond_timedwait(&job->cond, &job->lock, &deadline) == 0) {
+    }
+    int64_t left = job->count - (job->sink ? job->written : job->next);
+    int64_t rate = job->bytes - last_bytes;
+    last_bytes = job->bytes;
+    bool finished = job->finished;
+    pthread_mutex_unlock(&job->lock);
+    if (finished || left <= streams) {
+      break;
+    }
+    if (base_rate >= 0 &&
+        rate * 100 < base_rate * (100 + TRANSFER_SCALE_MIN_GAIN)) {
+      break;
+    }
+    pthread_mutex_lock(&job->lock);
+    job->refs++;
+    pthread_mutex_unlock(&job->lock);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, job_extra_stream, job) != 0) {
+      job_release(job);
+      break;
+    }
+    pthread_detach(tid);
+    streams++;
+    base_rate = rate;
+    log_debug("transfer %llx streams %d", (unsigned long long)job->id,
+              streams);
+  }
+  job_release(job);
+  return NULL;
+}
+
+// 交换任务 id 并开始调整连接数，发起方(dial != NULL)生成 id
+static int job_start(transfer_job_t *job, int sd, transfer_dial_fn dial,
+                     void *dial_arg) {
+  if (dial == NULL) {
+    if (transfer_read_u64(sd, &job->id) != 0) {
+      return -1;
+    }
+    job_register(job);
+    return 0;
+  }
+  job->id = job_new_id();
+  job->dial = dial;
+  job->dial_arg = dial_arg;
+  if (transfer_write_u64(sd, job->id) != 0) {
+    return -1;
+  }
+  if (job->count > 1) {
+    job->refs++;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, job_scaler, job) != 0) {
+      job->refs--;
+    } else {
+      pthread_detach(tid);
+    }
+  }
+  return 0;
+}
+
+static void job_finish(transfer_job_t *job) {
+  job_unregister(job);
+  pthread_mutex_lock(&job->lock);
+  job->finished = true;
+  pthread_cond_broadcast(&job->cond);
+  pthread_mutex_unlock(&job->lock);
+  job_release(job);
+}
+
+static int write_u64_array(int sd, const uint64_t *values, int64_t count) {
+  unsigned char buf[8 * 512];
+  int64_t i = 0;
+  while (i < count) {
+    int n = 0;
+    for (; i < count && n < (int)sizeof(buf); i++, n += 8) {
+      for (int b = 0; b < 8; b++) {
+        buf[n + b] = (unsigned char)(values[i] >> (56 - 8 * b));
+      }
+    }
+    if (transfer_write_full(sd, buf, n) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int hash_chunk(int fd, int64_t size, int64_t index, char *buf,
+                      uint64_t *hash) {
+  size_t len = chunk_len(size, index);
+  if (pread_full(fd, buf, len, index * TRANSFER_BLOCK_SIZE) != 0) {
+    return -1;
+  }
+  *hash = hash_xxh64(buf, len, 0);
+  return 0;
+}
+
+// holes 升序，块序号也升序调用，cursor 记录扫描到的空洞
+static bool chunk_in_hole(const int64_t *holes, int64_t count, int64_t *cursor,
+                          int64_t index, int64_t size) {
+  int64_t start = index * TRANSFER_BLOCK_SIZE;
+  int64_t end = start + chunk_len(size, index);
+  while (*cursor < count &&
+         holes[*cursor * 2] + holes[*cursor * 2 + 1] <= start) {
+    (*cursor)++;
+  }
+  return *cursor < count && holes[*cursor * 2] <= start &&
+         holes[*cursor * 2] + holes[*cursor * 2 + 1] >= end;
+}
+
+static int chunk_source(int sd, int fd, int64_t size, transfer_dial_fn dial,
+                        void *dial_arg, progress_t *progress) {
+  int64_t chunks = chunk_count(size);
+  uint64_t have;
+  if (transfer_read_u64(sd, &have) != 0 || have > (uint64_t)chunks) {
+    return -1;
+  }
+  transfer_job_t *job = job_new(fd, size, false, progress);
+  if (job == NULL) {
+    return -1;
+  }
+  int ret = -1;
+  int64_t *holes = NULL;
+  int64_t hole_count = transfer_find_holes(fd, size, &holes);
+  int64_t cursor = 0;
+  int64_t skipped = 0;
+  int64_t needed_bytes = 0;
+  char *buf = (char *)malloc(TRANSFER_BLOCK_SIZE);
+  job->needed = (int64_t *)malloc((chunks + 1) * sizeof(int64_t));
+  if (job->needed == NULL || buf == NULL) {
+    goto end;
+  }
+  for (int64_t i = 0; i < chunks; i++) {
+    uint64_t remote, local;
+    if (i < (int64_t)have && transfer_read_u64(sd, &remote) != 0) {
+      goto end;
+    }
+    // 整块都在空洞里的不用发，接收端会打洞
+    if (chunk_in_hole(holes, hole_count, &cursor, i, size)) {
+      skipped++;
+      continue;
+    }
+    if (i < (int64_t)have) {
+      if (hash_chunk(fd, size, i, buf, &local) != 0) {
+        goto end;
+      }
+      if (remote == local) {
+        continue;
+      }
+    }
+    job->needed[job->count++] = i;
+    needed_bytes += chunk_len(size, i);
+  }
+  progress_add(progress, size - needed_bytes);
+  if (have > 0) {
+    log_info("resume transfer, %lld of %lld chunks to send",
+             (long long)job->count, (long long)chunks);
+  }
+  if (hole_count > 0) {
+    log_info("sparse file, %lld holes, %lld chunks skipped",
+             (long long)hole_count, (long long)skipped);
+  }
+  if (transfer_write_u64(sd, job->count) != 0 ||
+      transfer_write_u64(sd, hole_count) != 0 ||
+      write_u64_array(sd, (uint64_t *)holes, hole_count * 2) != 0 ||
+      job_start(job, sd, dial, dial_arg) != 0) {
+    goto end;
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+#endif
+  uint64_t status;
+  if (job_stream(job, sd) == 0 && transfer_read_u64(sd, &status) == 0 &&
+      status == 0) {
+    ret = 0;
+  }
+
+end:
+  free(buf);
+  free(holes);
+  job_finish(job);
+  return ret;
+}
+
+// 主连接传输完以后，等其他连接把剩下的块写完；
+// 其他连接可能还没有加入，所以没有连接时也再等一段时间
+static bool chunk_sink_wait(transfer_job_t *job) {
+  pthread_mutex_lock(&job->lock);
+  int64_t last_written = job->written;
+  struct timespec stall;
+  deadline_after(&stall, TRANSFER_STALL_TIMEOUT_MS);
+  while (job->written < job->count) {
+    if (job->streams > 0) {
+      if (pthread_cond_timedwait(&job->cond, &job->lock, &stall) == 0) {
+        if (job->written != last_written) {
+          last_written = job->written;
+          deadline_after(&stall, TRANSFER_STALL_TIMEOUT_MS);
+        }
+        continue;
+      }
+      if (job->written == last_written) {
+        log_error("transfer stalled, %d streams, %lld of %lld chunks",
+                  job->streams, (long long)job->written,
+                  (long long)job->count);
+        break;
+      }
+      last_written = job->written;
+      deadline_after(&stall, TRANSFER_STALL_TIMEOUT_MS);
+      continue;
+    }
+    struct timespec deadline;
+    deadline_after(&deadline, TRANSFER_JOIN_TIMEOUT_MS);
+    if (pthread_cond_timedwait(&job->cond, &job->lock, &deadline) != 0 &&
+        job->streams == 0) {
+      break;
+    }
+  }
+  bool ok = job->written == job->count;
+  pthread_mutex_unlock(&job->lock);
+  return ok;
+}
+
+static mode_t default_mode;
+static pthread_once_t default_mode_once = PTHREAD_ONCE_INIT;
+
+// umask 只能改了再改回来，只在第一次用到时取一次
+static void load_default_mode() {
+  mode_t mask = umask(0);
+  umask(mask);
+  default_mode = 0666 & ~mask;
+}
+
+// .ttpart 建出来是 0600，替换目标之前换成旧文件的权限，没有旧文件时按 umask
+static void keep_mode(int fd, const struct stat *old) {
+  mode_t mode;
+  if (old != NULL && S_ISREG(old->st_mode)) {
+    mode = old->st_mode & 07777;
+  } else {
+    pthread_once(&default_mode_once, load_default_mode);
+    mode = default_mode;
+  }
+  if (fchmod(fd, mode) != 0) {
+    log_warn("fchmod %o error %s", (unsigned)mode, strerror(errno));
+  }
+}
+
+static int chunk_sink(int sd, int fd, const char *part, const char *dst_path,
+                      int64_t size, transfer_dial_fn dial, void *dial_arg,
+                      progress_t *progress) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return -1;
+  }
+  transfer_job_t *job = job_new(fd, size, true, progress);
+  if (job == NULL) {
+    return -1;
+  }
+  int ret = -1;
+  int64_t chunks = chunk_count(size);
+  int64_t have = st.st_size >= size ? chunks : st.st_size / TRANSFER_BLOCK_SIZE;
+  uint64_t *hashes = (uint64_t *)malloc((have + 1) * sizeof(uint64_t));
+  char *buf = (char *)malloc(TRANSFER_BLOCK_SIZE);
+  if (hashes == NULL || buf == NULL) {
+    goto end;
+  }
+  for (int64_t i = 0; i < have; i++) {
+    if (hash_chunk(fd, size, i, buf, &hashes[i]) != 0) {
+      have = i;
+      break;
+    }
+  }
+  if (transfer_write_u64(sd, have) != 0 ||
+      write_u64_array(sd, hashes, have) != 0) {
+    goto end;
+  }
+  if (st.st_size > size && ftruncate(fd, size) != 0) {
+    goto end;
+  }
+  uint64_t count;
+  uint64_t hole_count;
+  if (transfer_read_u64(sd, &count) != 0 || count > (uint64_t)chunks ||
+      transfer_read_u64(sd, &hole_count) != 0 ||
+      hole_count > TRANSFER_MAX_HOLES) {
+    goto end;
+  }
+  job->count = count;
+  // 只知道块数，按完整块估算已有的部分
+  progress_add(progress, (int64_t)count * TRANSFER_BLOCK_SIZE >= size
+                             ? 0
+                             : size - (int64_t)count * TRANSFER_BLOCK_SIZE);
+  // 源文件有空洞时只设置长度，不预分配，空洞部分打洞
+  if (hole_count == 0) {
+    transfer_preallocate(fd, size);
+  } else if (ftruncate(fd, size) != 0) {
+    goto end;
+  }
+  for (uint64_t i = 0; i < hole_count; i++) {
+    uint64_t off, len;
+    if (transfer_read_u64(sd, &off) != 0 || transfer_read_u64(sd, &len) != 0 ||
+        off > (uint64_t)size || len > (uint64_t)size - off) {
+      goto end;
+    }
+    if (transfer_punch_hole(fd, off, len) != 0) {
+      log_error("punch hole error %s", strerror(errno));
+      goto end;
+    }
+  }
+  if (job_start(job, sd, dial, dial_arg) != 0) {
+    goto end;
+  }
+  job_stream(job, sd);
+  if (chunk_sink_wait(job)) {
+    struct stat old;
+    keep_mode(fd, stat(dst_path, &old) == 0 ? &old : NULL);
+    if (rename(part, dst_path) == 0) {
+      ret = 0;
+    }
+  }
+  transfer_write_u64(sd, ret == 0 ? 0 : 1);
+
+end:
+  free(hashes);
+  free(buf);
+  job_finish(job);
+  return ret;
+}
+
+// 差量模式：接收端已经有同名的旧文件时，发送它的分块签名，
+// 发送端回复 delta.h 里的指令流，接收端据此在 .ttpart 里拼出新文件，
+// 校验整个文件的 xxh64 后 rename。
+#define DELTA_SIG_WIRE_SIZE 12
+
+typedef struct {
+  delta_scanner_t *scanner;
+  progress_t *progress;
+} delta_ctx_t;
+
+static int delta_fill(transfer_pipeline_t *p, transfer_slot_t *slot,
+                      int64_t unit) {
+  delta_ctx_t *ctx = (delta_ctx_t *)p->ctx;
+  size_t n = delta_scanner_fill(ctx->scanner, slot->buf, TRANSFER_BLOCK_SIZE);
+  if (n == 0) {
+    return PIPELINE_FILL_END;
+  }
+  int64_t literal, copied;
+  delta_scanner_stats(ctx->scanner, &literal, &copied);
+  progress_set(ctx->progress, literal + copied);
+  slot->len = n;
+  return 0;
+}
+
+static uint64_t get_be(const unsigned char *p, int bytes) {
+  uint64_t v = 0;
+  for (int i = 0; i < bytes; i++) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+static int delta_source(int sd, int fd, int64_t size, progress_t *progress) {
+  uint64_t block_size, count;
+  if (transfer_read_u64(sd, &block_size) != 0 ||
+      transfer_read_u64(sd, &count) != 0 ||
+      block_size < DELTA_MIN_BLOCK_SIZE || block_size > DELTA_MAX_BLOCK_SIZE ||
+      count > ((uint64_t)1 << 40) / block_size) {
+    return -1;
+  }
+  int ret = -1;
+  delta_signature_t sig;
+  sig.block_size = block_size;
+  sig.count = count;
+  sig.blocks = (delta_block_sig_t *)malloc((count + 1) *
+                                           sizeof(delta_block_sig_t));
+  unsigned char buf[DELTA_SIG_WIRE_SIZE * 512];
+  unsigned char *data = NULL;
+  delta_scanner_t *scanner = NULL;
+  if (sig.blocks == NULL) {
+    return -1;
+  }
+  for (uint64_t i = 0; i < count;) {
+    uint64_t batch = count - i < 512 ? count - i : 512;
+    if (transfer_read_full(sd, buf, batch * DELTA_SIG_WIRE_SIZE) != 0) {
+      goto end;
+    }
+    for (uint64_t j = 0; j < batch; j++, i++) {
+      sig.blocks[i].weak = (uint32_t)get_be(buf + j * DELTA_SIG_WIRE_SIZE, 4);
+      sig.blocks[i].strong = get_be(buf + j * DELTA_SIG_WIRE_SIZE + 4, 8);
+    }
+  }
+  if (size > 0) {
+    data = (unsigned char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      data = NULL;
+      log_error("mmap error %s", strerror(errno));
+      goto end;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+  }
+  scanner = delta_scanner_new(&sig, data, size);
+  if (scanner == NULL) {
+    goto end;
+  }
+  transfer_pipeline_t p;
+  p.sd = sd;
+  p.fd = fd;
+  p.offset = 0;
+  p.size = size;
+  p.units = -1;
+  delta_ctx_t ctx = {scanner, progress};
+  p.ctx = &ctx;
+  p.fill = delta_fill;
+  p.drain = raw_net_drain;
+  uint64_t status;
+  if (pipeline_run(&p) == 0 && transfer_read_u64(sd, &status) == 0 &&
+      status == 0) {
+    ret = 0;
+  }
+  int64_t literal, copied;
+  delta_scanner_stats(scanner, &literal, &copied);
+  log_info("delta transfer, %lld literal bytes, %lld bytes reused",
+           (long long)literal, (long long)copied);
+
+end:
+  delta_scanner_free(scanner);
+  if (data != NULL) {
+    munmap(data, size);
+  }
+  free(sig.blocks);
+  return ret;
+}
+
+static int send_signature(int sd, delta_signature_t *sig) {
+  unsigned char buf[DELTA_SIG_WIRE_SIZE * 512];
+  if (transfer_write_u64(sd, sig->block_size) != 0 ||
+      transfer_write_u64(sd, sig->count) != 0) {
+    return -1;
+  }
+  int n = 0;
+  for (int64_t i = 0; i < sig->count; i++) {
+    for (int b = 0; b < 4; b++) {
+      buf[n++] = (unsigned char)(sig->blocks[i].weak >> (24 - 8 * b));
+    }
+    for (int b = 0; b < 8; b++) {
+      buf[n++] = (unsigned char)(sig->blocks[i].strong >> (56 - 8 * b));
+    }
+    if (n == (int)sizeof(buf) || i + 1 == sig->count) {
+      if (transfer_write_full(sd, buf, n) != 0) {
+        return -1;
+      }
+      n = 0;
+    }
+  }
+  return 0;
+}
+
+static int file_xxh64(int fd, int64_t size, uint64_t *hash) {
+  if (size == 0) {
+    *hash = hash_xxh64(NULL, 0, 0);
+    return 0;
+  }
+  void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    return -1;
+  }
+  *hash = hash_xxh64(data, size, 0);
+  munmap(data, size);
+  return 0;
+}
+
+// 逐条执行指令，收到 END 并且整个文件校验通过返回 0
+static int apply_delta(int sd, int fd, int old_fd, delta_signature_t *sig,
+                       int64_t size, char *buf, progress_t *progress) {
+  int64_t w = 0;
+  while (true) {
+    progress_set(progress, w);
+    unsigned char op;
+    if (transfer_read_full(sd, &op, 1) != 0) {
+      return -1;
+    }
+    if (op == DELTA_OP_COPY) {
+      uint64_t start, count;
+      if (transfer_read_u64(sd, &start) != 0 ||
+          transfer_read_u64(sd, &count) != 0 || start > (uint64_t)sig->count ||
+          count > (uint64_t)sig->count - start ||
+          w + (int64_t)count * sig->block_size > size) {
+        return -1;
+      }
+      int64_t from = start * sig->block_size;
+      int64_t left = count * sig->block_size;
+      while (left > 0) {
+        size_t n = left < TRANSFER_BLOCK_SIZE ? (size_t)left
+                                              : TRANSFER_BLOCK_SIZE;
+        if (pread_full(old_fd, buf, n, from) != 0 ||
+            pwrite_full(fd, buf, n, w) != 0) {
+          return -1;
+        }
+        from += n;
+        w += n;
+        left -= n;
+      }
+    } else if (op == DELTA_OP_LITERAL) {
+      unsigned char b[4];
+      if (transfer_read_full(sd, b, sizeof(b)) != 0) {
+        return -1;
+      }
+      uint32_t n = (uint32_t)get_be(b, 4);
+      if (n > DELTA_MAX_LITERAL || w + n > size ||
+          transfer_read_full(sd, buf, n) != 0 ||
+          pwrite_full(fd, buf, n, w) != 0) {
+        return -1;
+      }
+      w += n;
+    } else if (op == DELTA_OP_END) {
+      uint64_t new_size, expect, actual;
+      if (transfer_read_u64(sd, &new_size) != 0 ||
+          transfer_read_u64(sd, &expect) != 0 || w != size ||
+          new_size != (uint64_t)size || file_xxh64(fd, size, &actual) != 0) {
+        return -1;
+      }
+      if (actual != expect) {
+        log_error("delta result checksum mismatch");
+        return -1;
+      }
+      return 0;
+    } else {
+      return -1;
+    }
+  }
+}
+
+static int delta_sink(int sd, int fd, int old_fd, int64_t old_size,
+                      const char *part, const char *dst_path, int64_t size,
+                      progress_t *progress) {
+  delta_signature_t sig;
+  if (delta_signature_build(old_fd, old_size, &sig) != 0) {
+    return -1;
+  }
+  int ret = -1;
+  char *buf = (char *)malloc(TRANSFER_BLOCK_SIZE);
+  if (buf == NULL || send_signature(sd, &sig) != 0) {
+    goto end;
+  }
+  transfer_preallocate(fd, size);
+  if (apply_delta(sd, fd, old_fd, &sig, size, buf, progress) == 0) {
+    struct stat old;
+    keep_mode(fd, fstat(old_fd, &old) == 0 ? &old : NULL);
+    if (rename(part, dst_path) == 0) {
+      ret = 0;
+    }
+  }
+  transfer_write_u64(sd, ret == 0 ? 0 : 1);
+
+end:
+  free(buf);
+  delta_signature_free(&sig);
+  return ret;
+}
+
+int transfer_source(int sd, int fd, int64_t size, transfer_dial_fn dial,
+                    void *dial_arg, progress_t *progress) {
+  uint64_t mode;
+  if (transfer_read_u64(sd, &mode) != 0) {
+    return -1;
+  }
+  if (mode == TRANSFER_MODE_DELTA) {
+    return delta_source(sd, fd, size, progress);
+  }
+  if (mode == TRANSFER_MODE_CHUNKS) {
+    return chunk_source(sd, fd, size, dial, dial_arg, progress);
+  }
+  log_error("unknown transfer mode %llu", (unsigned long long)mode);
+  return -1;
+}
+
+// 接收端决定传输模式：有未完成的 .ttpart 时续传，
+// 否则目标位置已有旧文件时走差量，都没有时整个传输。
+// 差量中断后留下的 .ttpart 是新文件的前缀，下次可以直接续传。
+// 完成后替换目标，权限沿用原来的文件。
+int transfer_sink(int sd, const char *dst_path, int64_t size,
+                  transfer_dial_fn dial, void *dial_arg, progress_t *progress) {
+  char part[PATH_MAX];
+  if (snprintf(part, sizeof(part), "%s%s", dst_path, TRANSFER_PART_SUFFIX) >=
+      (int)sizeof(part)) {
+    return -1;
+  }
+  struct stat st;
+  int old_fd = -1;
+  int64_t old_size = 0;
+  bool resumable = stat(part, &st) == 0 && st.st_size > 0;
+  if (!resumable && stat(dst_path, &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_size >= TRANSFER_DELTA_MIN_SIZE) {
+    old_fd = open(dst_path, O_RDONLY);
+    old_size = st.st_size;
+  }
+  int flags = old_fd >= 0 ? O_CREAT | O_RDWR | O_TRUNC : O_CREAT | O_RDWR;
+  int fd = open(part, flags, 0600);
+  if (fd < 0) {
+    log_error("open %s error %s", part, strerror(errno));
+    if (old_fd >= 0) {
+      close(old_fd);
+    }
+    return -1;
+  }
+  int ret = -1;
+  if (old_fd >= 0) {
+    log_info("delta transfer against %s", dst_path);
+    if (transfer_write_u64(sd, TRANSFER_MODE_DELTA) == 0) {
+      ret = delta_sink(sd, fd, old_fd, old_size, part, dst_path, size,
+                       progress);
+    }
+    close(old_fd);
+  } else if (transfer_write_u64(sd, TRANSFER_MODE_CHUNKS) == 0) {
+    ret = chunk_sink(sd, fd, part, dst_path, size, dial, dial_arg, progress);
+  }
+  close(fd);
+  return ret;
+}
@@ -0,0 +1,59 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#ifndef TERMTUNNEL_TRANSFER_H
+#define TERMTUNNEL_TRANSFER_H
+#include <stdint.h>
+#include <sys/types.h>
+#include "progress.h"
+
+#define TRANSFER_BLOCK_SIZE (1024 * 1024)
+#define TRANSFER_PIPELINE_DEPTH 2
+// 对端打开文件失败时，用它代替文件大小
+#define TRANSFER_SIZE_ERROR UINT64_MAX
+// 路径是目录，之后按 dirstream 传输
+#define TRANSFER_SIZE_DIR (UINT64_MAX - 1)
+// 接收中的临时文件，完成后 rename 为目标文件
+#define TRANSFER_PART_SUFFIX ".ttpart"
+// 接收端选择的传输模式
+#define TRANSFER_MODE_CHUNKS 1
+#define TRANSFER_MODE_DELTA 2
+// 旧文件小于这个大小时不做差量
+#define TRANSFER_DELTA_MIN_SIZE (64 * 1024)
+// 分块模式下一个任务最多使用的连接数
+#define TRANSFER_MAX_STREAMS 8
+#define TRANSFER_SCALE_INTERVAL_MS 1000
+// 增开连接后吞吐量至少提升这个百分比才继续增开
+#define TRANSFER_SCALE_MIN_GAIN 10
+#define TRANSFER_JOIN_TIMEOUT_MS 3000
+// 还有连接但这么久一块都没写完，认为对端已经不在了。
+// lossless 配置下 TCP 不会自己断开，只能在这里放弃
+#define TRANSFER_STALL_TIMEOUT_MS 60000
+// 空洞表的最大项数，更零碎的部分按普通数据发送
+#define TRANSFER_MAX_HOLES (1024 * 1024)
+// 记录流结束标记
+#define TRANSFER_RECORD_END UINT64_MAX
+
+// 发起方用来建立额外连接的回调，返回的连接已经发送过加入标记
+typedef int (*transfer_dial_fn)(void *arg);
+
+int transfer_write_full(int sd, const void *buf, size_t n);
+int transfer_read_full(int sd, void *buf, size_t n);
+int transfer_write_u64(int sd, uint64_t v);
+int transfer_read_u64(int sd, uint64_t *v);
+int transfer_preallocate(int fd, int64_t size);
+int transfer_punch_hole(int fd, int64_t offset, int64_t len);
+int64_t transfer_find_holes(int fd, int64_t size, int64_t **holes);
+int64_t transfer_send_file(int sd, int fd, int64_t offset, int64_t size);
+int64_t transfer_recv_file(int sd, int fd, int64_t offset, int64_t size);
+// progress 只在发起方传入，可以为 NULL
+int transfer_source(int sd, int fd, int64_t size, transfer_dial_fn dial,
+                    void *dial_arg, progress_t *progress);
+int transfer_sink(int sd, const char *dst_path, int64_t size,
+                  transfer_dial_fn dial, void *dial_arg, progress_t *progress);
+int transfer_join(int sd);
+#endif
@@ -31,10 +31,10 @@ struct termios ttystate_backup;
 static bool _stdin_is_raw = false;
 
 char *green_encode(const char *buf, int len, int *result_len) {
-  const char *prefix = "\e[32;42m";
-  const int prefix_len = sizeof("\e[32;42m") - 1;
-  const char *postfix = "\e[0m";
-  const int postfix_len = sizeof("\e[0m") - 1;
+  const char *prefix = GREEN_PREFIX;
+  const int prefix_len = sizeof(GREEN_PREFIX) - 1;
+  const char *postfix = GREEN_POSTFIX;
+  const int postfix_len = sizeof(GREEN_POSTFIX) - 1;
   *result_len = prefix_len + postfix_len + len;
   char *ret = (char *)malloc(*result_len + 1);
   char *s = ret;
@@ -28,6 +28,9 @@ extern int writen(int fd, void *buf, int n);
 extern void set_stdin_raw();
 extern void restore_stdin();
 extern void *memdup(const void *src, size_t n);
+// agent 写给 server 的帧夹在这两段之间
+#define GREEN_PREFIX "\e[32;42m"
+#define GREEN_POSTFIX "\e[0m"
 extern char *green_encode(const char *buf, int len, int *result_len);
 
 
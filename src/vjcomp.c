@@ -0,0 +1,254 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "vjcomp.h"
+
+#include <string.h>
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+
+static uint16_t get16(const uint8_t *p) { return (uint16_t)(p[0] << 8 | p[1]); }
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v & 0xff;
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  put16(p, v >> 16);
+  put16(p + 2, v & 0xffff);
+}
+
+static uint8_t *put_varint(uint8_t *p, uint32_t v) {
+  while (v >= 0x80) {
+    *p++ = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  *p++ = v;
+  return p;
+}
+
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end,
+                                 uint32_t *v) {
+  uint32_t r = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (p >= end) {
+      return NULL;
+    }
+    uint8_t b = *p++;
+    r |= (uint32_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *v = r;
+      return p;
+    }
+  }
+  return NULL;
+}
+
+static uint16_t ip_checksum(const uint8_t *hdr) {
+  uint32_t sum = 0;
+  for (int i = 0; i < 20; i += 2) {
+    sum += get16(hdr + i);
+  }
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return ~sum & 0xffff;
+}
+
+// 没有选项、没有分片的 TCP 包才有上下文
+static bool is_plain_tcp(const uint8_t *pkt, size_t len) {
+  return len >= VJCOMP_HDR_SIZE && pkt[0] == 0x45 && pkt[9] == 6 &&
+         (get16(pkt + 6) & 0x3fff) == 0 && get16(pkt + 2) == len &&
+         (pkt[32] >> 4) == 5;
+}
+
+static bool same_flow(const uint8_t *a, const uint8_t *b) {
+  return memcmp(a + 12, b + 12, 12) == 0;
+}
+
+void vjcomp_reset(vjcomp_t *vj) { memset(vj, 0, sizeof(*vj)); }
+
+static vjcomp_slot_t *find_slot(vjcomp_t *vj, const uint8_t *pkt,
+                                bool *found) {
+  vjcomp_slot_t *victim = &vj->slot[0];
+  for (int i = 0; i < VJCOMP_SLOTS; i++) {
+    vjcomp_slot_t *s = &vj->slot[i];
+    if (s->valid && same_flow(s->hdr, pkt)) {
+      *found = true;
+      return s;
+    }
+    // 空位优先，否则替换最久没用的
+    if (victim->valid && (!s->valid || s->used < victim->used)) {
+      victim = s;
+    }
+  }
+  *found = false;
+  return victim;
+}
+
+static size_t send_uncompressed(vjcomp_slot_t *s, uint8_t id,
+                                const uint8_t *pkt, size_t len, uint8_t *out) {
+  s->valid = true;
+  memcpy(s->hdr, pkt, VJCOMP_HDR_SIZE);
+  out[0] = VJCOMP_TYPE_UNCOMPRESSED;
+  out[1] = id;
+  memcpy(out + 2, pkt, len);
+  return len + 2;
+}
+
+size_t vjcomp_compress(vjcomp_t *vj, const uint8_t *pkt, size_t len,
+                       uint8_t *out) {
+  uint8_t flags = len >= VJCOMP_HDR_SIZE ? pkt[33] : 0;
+  if (!is_plain_tcp(pkt, len) || !(flags & TCP_ACK) ||
+      (flags & ~(TCP_ACK | TCP_PSH))) {
+    memcpy(out, pkt, len);
+    return len;
+  }
+  bool found;
+  vjcomp_slot_t *s = find_slot(vj, pkt, &found);
+  uint8_t id = (uint8_t)(s - vj->slot);
+  s->used = ++vj->tick;
+  if (!found) {
+    return send_uncompressed(s, id, pkt, len, out);
+  }
+  const uint8_t *ctx = s->hdr;
+  // 除了会变的字段，其余都要和上下文一致
+  uint8_t tmp[VJCOMP_HDR_SIZE];
+  memcpy(tmp, pkt, VJCOMP_HDR_SIZE);
+  memcpy(tmp + 2, ctx + 2, 4);
+  memcpy(tmp + 10, ctx + 10, 2);
+  memcpy(tmp + 24, ctx + 24, 8);
+  tmp[33] = (tmp[33] & ~TCP_PSH) | (ctx[33] & TCP_PSH);
+  memcpy(tmp + 34, ctx + 34, 4);
+  if (memcmp(tmp, ctx, VJCOMP_HDR_SIZE) != 0) {
+    return send_uncompressed(s, id, pkt, len, out);
+  }
+  uint32_t dseq = get32(pkt + 24) - get32(ctx + 24);
+  uint32_t dack = get32(pkt + 28) - get32(ctx + 28);
+  uint16_t dipid = get16(pkt + 4) - get16(ctx + 4);
+  bool window = get16(pkt + 34) != get16(ctx + 34);
+  size_t payload = len - VJCOMP_HDR_SIZE;
+  // 回退的序号、重传的数据、重复的 ACK 都发完整的头，
+  // 对端如果丢过帧可以借此恢复上下文
+  if (dseq >= 0x80000000u || dack >= 0x80000000u ||
+      (payload > 0 && dseq == 0) ||
+      (payload == 0 && dseq == 0 && dack == 0 && !window)) {
+    return send_uncompressed(s, id, pkt, len, out);
+  }
+  uint8_t type = VJCOMP_TYPE_COMPRESSED;
+  uint8_t *p = out + 4;
+  if (dseq) {
+    type |= VJCOMP_SEQ;
+    p = put_varint(p, dseq);
+  }
+  if (dack) {
+    type |= VJCOMP_ACK;
+    p = put_varint(p, dack);
+  }
+  if (window) {
+    type |= VJCOMP_WINDOW;
+    memcpy(p, pkt + 34, 2);
+    p += 2;
+  }
+  if (dipid != 1) {
+    type |= VJCOMP_IPID;
+    p = put_varint(p, dipid);
+  }
+  if (flags & TCP_PSH) {
+    type |= VJCOMP_PUSH;
+  }
+  out[0] = type;
+  out[1] = id;
+  memcpy(out + 2, pkt + 36, 2);
+  memcpy(p, pkt + VJCOMP_HDR_SIZE, payload);
+  memcpy(s->hdr, pkt, VJCOMP_HDR_SIZE);
+  return p - out + payload;
+}
+
+size_t vjcomp_decompress(vjcomp_t *vj, const uint8_t *frame, size_t len,
+                         uint8_t *out) {
+  if (len == 0) {
+    return 0;
+  }
+  uint8_t type = frame[0];
+  if (type >> 4 == 4) {
+    memcpy(out, frame, len);
+    return len;
+  }
+  if (type == VJCOMP_TYPE_UNCOMPRESSED) {
+    if (len < 2 || !is_plain_tcp(frame + 2, len - 2)) {
+      return 0;
+    }
+    vjcomp_slot_t *s = &vj->slot[frame[1]];
+    s->valid = true;
+    memcpy(s->hdr, frame + 2, VJCOMP_HDR_SIZE);
+    memcpy(out, frame + 2, len - 2);
+    return len - 2;
+  }
+  if ((type & 0xe0) != VJCOMP_TYPE_COMPRESSED || len < 4) {
+    return 0;
+  }
+  vjcomp_slot_t *s = &vj->slot[frame[1]];
+  // 上下文丢了就一直丢弃，直到对端发来完整的头
+  if (!s->valid) {
+    return 0;
+  }
+  uint8_t *h = out;
+  memcpy(h, s->hdr, VJCOMP_HDR_SIZE);
+  const uint8_t *p = frame + 4;
+  const uint8_t *end = frame + len;
+  uint32_t v;
+  if (type & VJCOMP_SEQ) {
+    if ((p = get_varint(p, end, &v)) == NULL) {
+      goto toss;
+    }
+    put32(h + 24, get32(h + 24) + v);
+  }
+  if (type & VJCOMP_ACK) {
+    if ((p = get_varint(p, end, &v)) == NULL) {
+      goto toss;
+    }
+    put32(h + 28, get32(h + 28) + v);
+  }
+  if (type & VJCOMP_WINDOW) {
+    if (end - p < 2) {
+      goto toss;
+    }
+    memcpy(h + 34, p, 2);
+    p += 2;
+  }
+  v = 1;
+  if ((type & VJCOMP_IPID) && (p = get_varint(p, end, &v)) == NULL) {
+    goto toss;
+  }
+  put16(h + 4, get16(h + 4) + v);
+  h[33] = (h[33] & ~TCP_PSH) | (type & VJCOMP_PUSH ? TCP_PSH : 0);
+  memcpy(h + 36, frame + 2, 2);
+  size_t payload = end - p;
+  if (VJCOMP_HDR_SIZE + payload > 0xffff) {
+    goto toss;
+  }
+  put16(h + 2, VJCOMP_HDR_SIZE + payload);
+  put16(h + 10, 0);
+  put16(h + 10, ip_checksum(h));
+  memcpy(h + VJCOMP_HDR_SIZE, p, payload);
+  memcpy(s->hdr, h, VJCOMP_HDR_SIZE);
+  return VJCOMP_HDR_SIZE + payload;
+toss:
+  s->valid = false;
+  return 0;
+}
@@ -0,0 +1,53 @@
+/**
+ * Copyright (c) 2022 Jindong Zhang
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#ifndef TERMTUNNEL_VJCOMP_H
+#define TERMTUNNEL_VJCOMP_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// 点对点链路上的 TCP/IP 头压缩（RFC 1144 的思路）。
+// 帧的第一个字节区分类型：
+//   0x4_  原样的 IPv4 包，不影响上下文
+//   0x70  连接号(u8) + 完整的包，建立或刷新这个连接号的上下文
+//   0x8_  压缩包：标志(低 5 位) 连接号(u8) TCP 校验和(u16)
+//         [seq 增量] [ack 增量] [窗口(u16)] [ip id 增量] 负载
+//         增量都是 LEB128 变长整数
+#define VJCOMP_SLOTS 256
+#define VJCOMP_HDR_SIZE 40
+// 帧最多比原包长出的字节数
+#define VJCOMP_MAX_GROWTH 2
+
+#define VJCOMP_TYPE_UNCOMPRESSED 0x70
+#define VJCOMP_TYPE_COMPRESSED 0x80
+#define VJCOMP_SEQ 0x01
+#define VJCOMP_ACK 0x02
+#define VJCOMP_WINDOW 0x04
+#define VJCOMP_IPID 0x08
+#define VJCOMP_PUSH 0x10
+
+typedef struct {
+  bool valid;
+  uint32_t used;
+  uint8_t hdr[VJCOMP_HDR_SIZE];
+} vjcomp_slot_t;
+
+// 发送和接收各用一份，只在一个线程里使用
+typedef struct {
+  vjcomp_slot_t slot[VJCOMP_SLOTS];
+  uint32_t tick;
+} vjcomp_t;
+
+void vjcomp_reset(vjcomp_t *vj);
+// out 至少 len + VJCOMP_MAX_GROWTH 字节，返回帧长度
+size_t vjcomp_compress(vjcomp_t *vj, const uint8_t *pkt, size_t len,
+                       uint8_t *out);
+// out 至少 len + VJCOMP_HDR_SIZE 字节，返回包长度，帧不可用时返回 0
+size_t vjcomp_decompress(vjcomp_t *vj, const uint8_t *frame, size_t len,
+                         uint8_t *out);
+#endif
@@ -17,29 +17,92 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include "agent.h"
 #include "config.h"
 #include "log.h"
+#include "lwipmem.h"
 #include "lwip/def.h"
 #include "lwip/ip.h"
 #include "lwip/mem.h"
 #include "lwip/pbuf.h"
+#include "lwip/priv/tcp_priv.h"
 #include "lwip/sys.h"
 #include "netif/etharp.h"
 #include "pipe.h"
 #include "state.h"
 #include "thirdparty/queue/queue.h"
 #include "utils.h"
+#include "vjcomp.h"
 #include "vnet.h"
 #include "fileexchange.h"
 #include "portforward.h"
 #include "socksproxy.h"
 #include "agentcall.h"
-// TODO: 都固定为相同 ip，如果 ip 不同，这里 arp 将不匹配，暂时没有去分析原因。
-char *agent_ip = "192.168.1.111";
-char *server_ip = "192.168.1.111";
+#include "bench.h"
+#define SERVER_HOST 1
+#define AGENT_HOST 2
+
+// agent k 和 server 之间的网段是 192.168.(k+1).0/24，server 是 .1，agent 是 .2
+static u32_t link_addr(int agent, int host) {
+#if VNET_RAW_IP
+  return lwip_htonl(0xc0a80000UL | (u32_t)(agent + 1) << 8 | (u32_t)host);
+#else
+  // TODO: 都固定为相同 ip，如果 ip 不同，这里 arp 将不匹配，暂时没有去分析原因。
+  return ipaddr_addr("192.168.1.111");
+#endif
+}
+
+// agent 上自己的编号，握手时由 server 告知，之前当作 0 号
+static int self_id = 0;
+// server 上只转发帧的 agent，没有 vnet，连它马上失败
+static bool relay_only[VNET_MAX_AGENTS];
+
+int vnet_tcp_lossless = VNET_TCP_PROFILE_LOSSLESS;
+
+static void select_tcp_profile() {
+  const char *profile = getenv(VNET_TCP_PROFILE_ENV);
+  if (profile != NULL && *profile != '\0') {
+    if (strcmp(profile, "lossless") == 0) {
+      vnet_tcp_lossless = 1;
+    } else if (strcmp(profile, "default") == 0) {
+      vnet_tcp_lossless = 0;
+    } else {
+      log_warn("unknown %s: %s", VNET_TCP_PROFILE_ENV, profile);
+    }
+  }
+  log_info("tcp profile: %s", vnet_tcp_lossless ? "lossless" : "default");
+}
+
+// 每条转发的连接在本地还要占一个真实的 fd，把软限制提到硬限制
+static void raise_nofile_limit() {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur >= rl.rlim_max) {
+    return;
+  }
+  rl.rlim_cur = rl.rlim_max;
+  if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+    log_warn("raise RLIMIT_NOFILE failed %s", strerror(errno));
+    return;
+  }
+  log_info("RLIMIT_NOFILE raised to %llu", (unsigned long long)rl.rlim_cur);
+}
+
+// 对端的地址，server 连 agent 上的服务，agent 连 server 上的服务
+static u32_t peer_addr(int agent) {
+  if (get_state_mode() == MODE_SERVER_PROCESS) {
+    return link_addr(agent, AGENT_HOST);
+  }
+  return link_addr(__atomic_load_n(&self_id, __ATOMIC_ACQUIRE), SERVER_HOST);
+}
+
+void vnet_agent_ip(int agent, char *buf, size_t size) {
+  ip4_addr_t addr;
+  addr.addr = link_addr(agent, AGENT_HOST);
+  ip4addr_ntoa_r(&addr, buf, size);
+}
 
 void vnet_setsocketdefaultopt(int nfd) {
   int flags;
@@ -97,6 +160,10 @@ int vnet_readn(int fd, void *buf, int n) {
 }
 
 
+// vnet_init 等各个服务都开始监听之后再返回。
+// 点对点链路上没有 ARP 的往返，对端的第一个 SYN 可能比 listen 先到
+static sys_sem_t listen_ready;
+
 int vnet_listen_at(uint16_t port, void *cb, char* thread_desc) {
   int sock, new_sd;
   struct lwip_sockaddr_in address, remote;
@@ -104,6 +171,7 @@ int vnet_listen_at(uint16_t port, void *cb, char* thread_desc) {
   int ret;
 
   if ((sock = lwip_socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    sys_sem_signal(&listen_ready);
     return -1;
   }
 
@@ -112,9 +180,10 @@ int vnet_listen_at(uint16_t port, void *cb, char* thread_desc) {
   address.sin_addr.s_addr = INADDR_ANY;  // inet_addr(server_ip); //
   ret = lwip_bind(sock, (struct sockaddr *)&address, sizeof(address));
   CHECK(ret == 0, "bind error");
-  ret = lwip_listen(sock, 10);
+  ret = lwip_listen(sock, DEFAULT_ACCEPTMBOX_SIZE);
   CHECK(ret >= 0, "lwip_listen error %d", ret);
   log_info("do listen");
+  sys_sem_signal(&listen_ready);
   while (true) {
     if ((new_sd = lwip_accept(sock, (struct sockaddr *)&remote, (socklen_t *)&size)) >= 0) {
       log_info("new tcp");
@@ -149,7 +218,12 @@ int lwip_writen(int fd, void *buf, int n) {
 }
 
 
-int vnet_tcp_connect(uint16_t port) {
+int vnet_tcp_connect(int agent, uint16_t port) {
+  if (agent >= 0 && agent < VNET_MAX_AGENTS &&
+      __atomic_load_n(&relay_only[agent], __ATOMIC_ACQUIRE)) {
+    log_error("agent %d only relays, no vnet on it", agent);
+    return -1;
+  }
   int s = lwip_socket(AF_INET, SOCK_STREAM, 0);
   LWIP_ASSERT("s >= 0", s >= 0);
   struct lwip_sockaddr_in addr;
@@ -157,7 +231,7 @@ int vnet_tcp_connect(uint16_t port) {
   addr.sin_len = sizeof(addr);
   addr.sin_family = AF_INET;
   addr.sin_port = lwip_htons(port);
-  addr.sin_addr.s_addr = inet_addr(server_ip);
+  addr.sin_addr.s_addr = peer_addr(agent);
   vnet_setsocketdefaultopt(s);
   int ret = lwip_connect(s, (struct sockaddr *)&addr, sizeof(addr));
   if (ret == 0) {
@@ -169,13 +243,13 @@ int vnet_tcp_connect(uint16_t port) {
 }
 
 
-int vnet_tcp_connect_with_retry(uint16_t port) {
+int vnet_tcp_connect_with_retry(int agent, uint16_t port) {
   int max_retry = 10;
   int retry = 0;
   int ret = 0;
   int base_sleep = 1000;
   while (retry < max_retry) {
-    ret = vnet_tcp_connect(port);
+    ret = vnet_tcp_connect(agent, port);
     if (ret > 0) {
        break;
     }
@@ -197,11 +271,23 @@ int vnet_recv(int s, void *data, size_t size) {
 
 int vnet_close(int s) { return lwip_close(s); }
 
+int vnet_wait_readable(int s, int timeout_ms) {
+  struct pollfd pfd;
+  pfd.fd = s;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  return lwip_poll(&pfd, 1, timeout_ms);
+}
+
 struct netif g_netif;
+// 按 agent 编号，0 号是 g_netif，agent 上只有 0 号
+static struct netif *netifs[VNET_MAX_AGENTS];
 
 struct tapif {
   struct eth_addr *ethaddr;
   /* Add whatever per-interface state that is needed here. */
+  int id;  // 对端 agent 的编号
+  vjcomp_t vj_rx;
   int fd;
   char *name;
   ip_addr_t ip_addr;
@@ -234,9 +320,17 @@ static err_t low_level_output(struct netif *netif, struct pbuf *p) {
   }
   CHECK(p->tot_len < 2000, "writebytes too big(%d)", p->tot_len);
 
-  callback(buf, p->tot_len);
+  callback(((struct tapif *)netif->state)->id, buf, p->tot_len);
   return ERR_OK;
 }
+
+#if VNET_RAW_IP
+// 点对点链路上只有对端一个邻居，IP 包直接发出，不加以太网头也不用 ARP
+static err_t raw_ip_output(struct netif *netif, struct pbuf *p,
+                           const ip4_addr_t *ipaddr) {
+  return low_level_output(netif, p);
+}
+#endif
 static struct pbuf *low_level_input(char *buf, u16_t len) {
   struct pbuf *p, *q;
   // TODO(jdz) max 1514
@@ -278,9 +372,14 @@ err_t tapif_init(struct netif *netif) {
   }
   netif->name[0] = IFNAME0;
   netif->name[1] = IFNAME1;
+  netif->mtu = VIR_MTU;  // hack!
+#if VNET_RAW_IP
+  netif->output = raw_ip_output;
+  // 没有 NETIF_FLAG_ETHARP，tcpip_input 直接交给 ip_input
+  netif->flags = NETIF_FLAG_LINK_UP;
+#else
   netif->output = etharp_output;
   netif->linkoutput = low_level_output;
-  netif->mtu = VIR_MTU;  // hack!
   /* hardware address length */
   // netif->hwaddr_len = 6;
   netif->hwaddr_len = ETHARP_HWADDR_LEN;
@@ -293,10 +392,17 @@ err_t tapif_init(struct netif *netif) {
   memcpy(netif->hwaddr, mac, 6);
   netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_LINK_UP |
                  NETIF_FLAG_ETHARP;  // NETIF_FLAG_POINTTOPOINT;
+#endif
   return ERR_OK;
 }
 
 struct tapif tapif;
+// lwip 的信号量最多记 1 次，逐个等待
+static void start_listener(const char *name, lwip_thread_fn fn) {
+  sys_thread_new(name, fn, NULL, DEFAULT_THREAD_STACKSIZE, DEFAULT_THREAD_PRIO);
+  sys_sem_wait(&listen_ready);
+}
+
 bool init_done = false;
 void *vnet_init(callback_t cb) {
   if (init_done) {
@@ -304,67 +410,220 @@ void *vnet_init(callback_t cb) {
   }
   init_done = true;
   callback = cb;
+  select_tcp_profile();
+  lwipmem_init();
+  raise_nofile_limit();
   tcpip_init(NULL, NULL);
   memset(&tapif, 0, sizeof(tapif));
   memset(&g_netif, 0, sizeof(g_netif));
 
   if (get_state_mode() == MODE_SERVER_PROCESS) {
-    tapif.ip_addr.addr = ipaddr_addr(server_ip);  // server
-    tapif.gw.addr = ipaddr_addr(server_ip);
+    tapif.ip_addr.addr = link_addr(0, SERVER_HOST);  // server
+    tapif.gw.addr = link_addr(0, SERVER_HOST);
     log_info("server init");
   } else {
-    tapif.ip_addr.addr = ipaddr_addr(agent_ip);  // agent
-    tapif.gw.addr = ipaddr_addr(agent_ip);
+    tapif.ip_addr.addr = link_addr(0, AGENT_HOST);  // agent
+    tapif.gw.addr = link_addr(0, AGENT_HOST);
     log_info("agent init");
   }
   tapif.netmask.addr = ipaddr_addr("0.0.0.0");  // all subnet
+#if VNET_RAW_IP
+  // 对端就是网关，所有地址都从这个口出去
+  tapif.gw.addr = peer_addr(0);
+  if (get_state_mode() == MODE_SERVER_PROCESS) {
+    // server 上每个 agent 一个网口，按网段选，其他地址走 0 号
+    tapif.netmask.addr = ipaddr_addr("255.255.255.0");
+  }
+#endif
 
   netif_add(&g_netif, &tapif.ip_addr, &tapif.netmask, &tapif.gw, &tapif,
             tapif_init, tcpip_input);
   netif_set_default(&g_netif);
+  netifs[0] = &g_netif;
 
   netif_set_up(&g_netif);
 
+  CHECK(sys_sem_new(&listen_ready, 0) == ERR_OK, "sys_sem_new error");
   if (get_state_mode() == MODE_AGENT_PROCESS) {
-    // pass
-      sys_thread_new("file_receiver", (lwip_thread_fn)file_receiver_start, NULL,
-                   DEFAULT_THREAD_STACKSIZE, DEFAULT_THREAD_PRIO);
-      sys_thread_new("file_sender", (lwip_thread_fn)file_sender_start, NULL,
-                   DEFAULT_THREAD_STACKSIZE, DEFAULT_THREAD_PRIO);
-      sys_thread_new("agentcall_server", (lwip_thread_fn)agentcall_server_start, NULL,
-                   DEFAULT_THREAD_STACKSIZE, DEFAULT_THREAD_PRIO);
-  }
-  sys_thread_new("portforward_static_server",
-                   (lwip_thread_fn)portforward_static_remote_server_start, NULL,
-                   DEFAULT_THREAD_STACKSIZE, DEFAULT_THREAD_PRIO);
-  sys_thread_new("socksproxy_server", (lwip_thread_fn)socksproxy_remote_start, NULL,
-                   DEFAULT_THREAD_STACKSIZE, DEFAULT_THREAD_PRIO);
+    start_listener("file_receiver", (lwip_thread_fn)file_receiver_start);
+    start_listener("file_sender", (lwip_thread_fn)file_sender_start);
+    start_listener("agentcall_server", (lwip_thread_fn)agentcall_server_start);
+    start_listener("bench_sink", (lwip_thread_fn)bench_sink_start);
+  }
+  start_listener("portforward_static_server",
+                 (lwip_thread_fn)portforward_static_remote_server_start);
+  start_listener("socksproxy_server", (lwip_thread_fn)socksproxy_remote_start);
 
   return &g_netif;
 }
 
 void vnet_deinit() { return; }
 
-void vnet_data_income(char *buf, size_t size) {
+int vnet_add_agent(int agent) {
+#if VNET_RAW_IP
+  if (!init_done || agent <= 0 || agent >= VNET_MAX_AGENTS) {
+    return -1;
+  }
+  if (netifs[agent] != NULL) {
+    // 编号重新用了，对端是新的 agent
+    vjcomp_reset(&((struct tapif *)netifs[agent]->state)->vj_rx);
+    LOCK_TCPIP_CORE();
+    netif_set_up(netifs[agent]);
+    UNLOCK_TCPIP_CORE();
+    return 0;
+  }
+  struct netif *netif = (struct netif *)calloc(1, sizeof(struct netif));
+  struct tapif *t = (struct tapif *)calloc(1, sizeof(struct tapif));
+  if (netif == NULL || t == NULL) {
+    free(netif);
+    free(t);
+    log_error("malloc netif failed");
+    return -1;
+  }
+  t->id = agent;
+  t->ip_addr.addr = link_addr(agent, SERVER_HOST);
+  t->gw.addr = link_addr(agent, AGENT_HOST);
+  t->netmask.addr = ipaddr_addr("255.255.255.0");
+  LOCK_TCPIP_CORE();
+  if (netif_add(netif, &t->ip_addr, &t->netmask, &t->gw, t, tapif_init,
+                tcpip_input) != NULL) {
+    netif_set_up(netif);
+  }
+  UNLOCK_TCPIP_CORE();
+  if (!netif_is_up(netif)) {
+    free(netif);
+    free(t);
+    log_error("netif_add agent %d failed", agent);
+    return -1;
+  }
+  netifs[agent] = netif;
+  log_info("vnet add agent %d", agent);
+  return 0;
+#else
+  log_error("multiple agents need VNET_RAW_IP");
+  return -1;
+#endif
+}
+
+void vnet_remove_agent(int agent) {
+#if VNET_RAW_IP
+  if (!init_done || agent <= 0 || agent >= VNET_MAX_AGENTS ||
+      netifs[agent] == NULL) {
+    return;
+  }
+  // 网口留着给重新用这个编号的 agent，已经投递的收包还会引用它。
+  // 断开经过它的连接，阻塞在上面的 socket 马上返回错误；
+  // 网口 down 之后迟到的帧被丢掉，新的连接也找不到路由
+  LOCK_TCPIP_CORE();
+  netif_set_down(netifs[agent]);
+  tcp_netif_ip_addr_changed(netif_ip_addr4(netifs[agent]), NULL);
+  UNLOCK_TCPIP_CORE();
+  log_info("vnet remove agent %d", agent);
+#endif
+}
+
+void vnet_set_agent_id(int agent) {
+#if VNET_RAW_IP
+  if (!init_done || agent < 0 || agent >= VNET_MAX_AGENTS) {
+    return;
+  }
+  __atomic_store_n(&self_id, agent, __ATOMIC_RELEASE);
+  ip4_addr_t ip, netmask, gw;
+  ip.addr = link_addr(agent, AGENT_HOST);
+  netmask.addr = ipaddr_addr("0.0.0.0");
+  gw.addr = link_addr(agent, SERVER_HOST);
+  LOCK_TCPIP_CORE();
+  netif_set_addr(&g_netif, &ip, &netmask, &gw);
+  UNLOCK_TCPIP_CORE();
+  char buf[16];
+  log_info("vnet agent %d at %s", agent, ip4addr_ntoa_r(&ip, buf, sizeof(buf)));
+#endif
+}
+
+void vnet_reset_header_compression(int agent) {
+  struct netif *netif =
+      agent >= 0 && agent < VNET_MAX_AGENTS ? netifs[agent] : NULL;
+  if (netif != NULL) {
+    vjcomp_reset(&((struct tapif *)netif->state)->vj_rx);
+  }
+}
+
+void vnet_set_relay_only(int agent, bool on) {
+  if (agent < 0 || agent >= VNET_MAX_AGENTS) {
+    return;
+  }
+  __atomic_store_n(&relay_only[agent], on, __ATOMIC_RELEASE);
+}
+
+// 参数的高 16 位是编号，低 16 位是 NETIF_CHECKSUM_*
+static void set_checksum_ctrl(void *arg) {
+  uintptr_t v = (uintptr_t)arg;
+  NETIF_SET_CHECKSUM_CTRL(netifs[v >> 16], (u16_t)(v & 0xffff));
+}
+
+void vnet_set_checksum(int agent, bool on) {
+  if (!init_done || agent < 0 || agent >= VNET_MAX_AGENTS ||
+      netifs[agent] == NULL) {
+    return;
+  }
+  log_info("vnet checksum %s", on ? "on" : "off");
+  // 在 tcpip 线程里改，和已经投递的收包按顺序生效
+  uintptr_t flags = on ? NETIF_CHECKSUM_ENABLE_ALL : NETIF_CHECKSUM_DISABLE_ALL;
+  flags |= (uintptr_t)agent << 16;
+  if (tcpip_callback(set_checksum_ctrl, (void *)flags) != ERR_OK) {
+    log_error("tcpip_callback set checksum failed");
+  }
+}
+
+void vnet_data_income(int agent, char *buf, size_t size) {
   struct tapif *tapif;
-  struct eth_hdr *ethhdr;
   struct pbuf *p;
 
-  tapif = (struct tapif *)g_netif.state;
+  struct netif *netif =
+      agent >= 0 && agent < VNET_MAX_AGENTS ? netifs[agent] : NULL;
+  if (netif == NULL) {
+    log_debug("drop frame for agent %d without netif", agent);
+    return;
+  }
+  tapif = (struct tapif *)netif->state;
 
+#if VNET_RAW_IP && VNET_HEADER_COMPRESSION
+  static uint8_t vj_packet[5 * VIR_MTU + VJCOMP_HDR_SIZE];
+  if (size > 5 * VIR_MTU) {
+    log_error("vnet frame too large %zu", size);
+    return;
+  }
+  size = vjcomp_decompress(&tapif->vj_rx, (uint8_t *)buf, size, vj_packet);
+  if (size == 0) {
+    log_debug("drop frame without header context");
+    return;
+  }
+  buf = (char *)vj_packet;
+#endif
   p = low_level_input(buf, size);
 
   if (p == NULL) {
     log_error("tapif_input: low_level_input returned NULL\n");
     return;
   }
-  ethhdr = (struct eth_hdr *)p->payload;
+#if VNET_RAW_IP
+  if (size < IP_HLEN || IPH_V((struct ip_hdr *)p->payload) != 4) {
+    log_info("other packet!!!");
+    pbuf_free(p);
+    return;
+  }
+  if (netif->input(p, netif) != ERR_OK) {
+    log_error("data incom error ");
+    pbuf_free(p);
+  }
+#else
+  struct eth_hdr *ethhdr = (struct eth_hdr *)p->payload;
 
   switch (htons(ethhdr->type)) {
     /* IP or ARP packet? */
     case ETHTYPE_IP:
     case ETHTYPE_ARP:
-      if (g_netif.input(p, &g_netif) != ERR_OK) {
+      if (netif->input(p, netif) != ERR_OK) {
         log_error("data incom error ");
         pbuf_free(p);
         p = NULL;
@@ -375,5 +634,6 @@ void vnet_data_income(char *buf, size_t size) {
       pbuf_free(p);
       break;
   }
+#endif
   return;
 }
@@ -7,20 +7,41 @@
 
 #ifndef TERMTUNNEL_VNET_H
 #define TERMTUNNEL_VNET_H
+#include <stdbool.h>
 #include <stdint.h>
-typedef int (*callback_t)(char *buf, size_t size);
+#include <stddef.h>
+// agent 是要发给的 agent 编号，agent 上总是 0
+typedef int (*callback_t)(int agent, char *buf, size_t size);
 
 void *vnet_init(callback_t cb);
-void vnet_data_income(char *buf, size_t size);
+// agent 是帧从哪个 agent 来的，agent 上总是 0
+void vnet_data_income(int agent, char *buf, size_t size);
 void vnet_deinit();
-int vnet_tcp_connect(uint16_t port);
+// server 上给新握手的 agent 加一个网口，它的地址见 vnet_agent_ip
+int vnet_add_agent(int agent);
+// agent 下线时关掉它的网口，断开经过它的连接
+void vnet_remove_agent(int agent);
+// agent 上换成 server 分配的编号对应的地址
+void vnet_set_agent_id(int agent);
+// server 上标记 termtunnel -r 启动的 agent，它只转发帧，vnet_tcp_connect 直接失败
+void vnet_set_relay_only(int agent, bool on);
+// 链路上丢了帧，清掉从 agent 来的帧的头部压缩上下文。在 libuv 线程里调用
+void vnet_reset_header_compression(int agent);
+// agent 在 vnet 上的地址
+void vnet_agent_ip(int agent, char *buf, size_t size);
+// 关掉时 IP/TCP 校验和既不生成也不检查，由链路帧的 crc 保证完整
+void vnet_set_checksum(int agent, bool on);
+// server 上连 agent 上的服务，agent 上连 server 上的服务，这时 agent 是 0
+int vnet_tcp_connect(int agent, uint16_t port);
 int vnet_send(int s, const void *data, size_t size);
 int vnet_recv(int s, void *data, size_t size);
 int vnet_listen_at(uint16_t port, void *cb,char* thread_desc);
 int vnet_close(int s);
+// 用 lwip_poll 等 s 可读，返回值同 poll。lwIP 的 POLL* 常量和系统的不同，只能在这里用
+int vnet_wait_readable(int s, int timeout_ms);
 int lwip_writen(int fd, void *buf, int n);
 void vnet_setsocketdefaultopt(int nfd);
 int vnet_readn(int fd, void *buf, int n);
 int vnet_readstring(int fd, char *buf, int n);
-int vnet_tcp_connect_with_retry(uint16_t port);
+int vnet_tcp_connect_with_retry(int agent, uint16_t port);
 #endif
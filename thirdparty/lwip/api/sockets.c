@@ -255,8 +255,21 @@ static void lwip_socket_unregister_mld6_membership(int s, unsigned int if_idx, c
 static void lwip_socket_drop_registered_mld6_memberships(int s);
 #endif /* LWIP_IPV6_MLD */
 
-/** The global array of available sockets */
-static struct lwip_sock sockets[NUM_SOCKETS];
+/** Number of sockets added to the socket table at a time */
+#ifndef LWIP_SOCKET_CHUNK
+#define LWIP_SOCKET_CHUNK 256
+#endif
+#define LWIP_SOCKET_CHUNKS ((NUM_SOCKETS + LWIP_SOCKET_CHUNK - 1) / LWIP_SOCKET_CHUNK)
+
+/** The global table of sockets. It grows by LWIP_SOCKET_CHUNK up to
+ * NUM_SOCKETS; chunks are never freed, so a struct lwip_sock never moves. */
+static struct lwip_sock *socket_chunks[LWIP_SOCKET_CHUNKS];
+/** Number of sockets in the allocated chunks */
+static int socket_count;
+/** Unused sockets, linked through free_next */
+static struct lwip_sock *socket_free_list;
+
+#define SOCKET_AT(i) (&socket_chunks[(i) / LWIP_SOCKET_CHUNK][(i) % LWIP_SOCKET_CHUNK])
 
 #if LWIP_SOCKET_SELECT || LWIP_SOCKET_POLL
 #if LWIP_TCPIP_CORE_LOCKING
@@ -410,11 +423,11 @@ static struct lwip_sock *
 tryget_socket_unconn_nouse(int fd)
 {
   int s = fd - LWIP_SOCKET_OFFSET;
-  if ((s < 0) || (s >= NUM_SOCKETS)) {
+  if ((s < 0) || (s >= socket_count)) {
     LWIP_DEBUGF(SOCKETS_DEBUG, ("tryget_socket_unconn(%d): invalid\n", fd));
     return NULL;
   }
-  return &sockets[s];
+  return SOCKET_AT(s);
 }
 
 struct lwip_sock *
@@ -479,7 +492,7 @@ get_socket(int fd)
 {
   struct lwip_sock *sock = tryget_socket(fd);
   if (!sock) {
-    if ((fd < LWIP_SOCKET_OFFSET) || (fd >= (LWIP_SOCKET_OFFSET + NUM_SOCKETS))) {
+    if ((fd < LWIP_SOCKET_OFFSET) || (fd >= (LWIP_SOCKET_OFFSET + socket_count))) {
       LWIP_DEBUGF(SOCKETS_DEBUG, ("get_socket(%d): invalid\n", fd));
     }
     set_errno(EBADF);
@@ -488,6 +501,36 @@ get_socket(int fd)
   return sock;
 }
 
+/**
+ * Add a chunk of unused sockets to the socket table (under lock).
+ *
+ * @return 1 on success, 0 if the table is full or out of memory
+ */
+static int
+grow_sockets_locked(void)
+{
+  int i, n;
+  struct lwip_sock *chunk;
+
+  if (socket_count >= NUM_SOCKETS) {
+    return 0;
+  }
+  n = LWIP_MIN(LWIP_SOCKET_CHUNK, NUM_SOCKETS - socket_count);
+  chunk = (struct lwip_sock *)mem_calloc((mem_size_t)n, sizeof(struct lwip_sock));
+  if (chunk == NULL) {
+    return 0;
+  }
+  for (i = n - 1; i >= 0; i--) {
+    chunk[i].index = socket_count + i;
+    chunk[i].free_next = socket_free_list;
+    socket_free_list = &chunk[i];
+  }
+  /* the chunk is in place before its indexes become valid */
+  socket_chunks[socket_count / LWIP_SOCKET_CHUNK] = chunk;
+  socket_count += n;
+  return 1;
+}
+
 /**
  * Allocate a new socket for a given netconn.
  *
@@ -499,41 +542,39 @@ get_socket(int fd)
 static int
 alloc_socket(struct netconn *newconn, int accepted)
 {
-  int i;
+  struct lwip_sock *sock;
   SYS_ARCH_DECL_PROTECT(lev);
   LWIP_UNUSED_ARG(accepted);
 
-  /* allocate a new socket identifier */
-  for (i = 0; i < NUM_SOCKETS; ++i) {
-    /* Protect socket array */
-    SYS_ARCH_PROTECT(lev);
-    if (!sockets[i].conn) {
+  /* Protect socket table */
+  SYS_ARCH_PROTECT(lev);
+  if (socket_free_list == NULL && !grow_sockets_locked()) {
+    SYS_ARCH_UNPROTECT(lev);
+    return -1;
+  }
+  sock = socket_free_list;
+  socket_free_list = sock->free_next;
+  sock->free_next = NULL;
+  LWIP_ASSERT("sock->conn == NULL", sock->conn == NULL);
 #if LWIP_NETCONN_FULLDUPLEX
-      if (sockets[i].fd_used) {
-        SYS_ARCH_UNPROTECT(lev);
-        continue;
-      }
-      sockets[i].fd_used    = 1;
-      sockets[i].fd_free_pending = 0;
+  LWIP_ASSERT("sock->fd_used == 0", sock->fd_used == 0);
+  sock->fd_used    = 1;
+  sock->fd_free_pending = 0;
 #endif
-      sockets[i].conn       = newconn;
-      /* The socket is not yet known to anyone, so no need to protect
-         after having marked it as used. */
-      SYS_ARCH_UNPROTECT(lev);
-      sockets[i].lastdata.pbuf = NULL;
+  sock->conn       = newconn;
+  /* The socket is not yet known to anyone, so no need to protect
+     after having marked it as used. */
+  SYS_ARCH_UNPROTECT(lev);
+  sock->lastdata.pbuf = NULL;
 #if LWIP_SOCKET_SELECT || LWIP_SOCKET_POLL
-      LWIP_ASSERT("sockets[i].select_waiting == 0", sockets[i].select_waiting == 0);
-      sockets[i].rcvevent   = 0;
-      /* TCP sendbuf is empty, but the socket is not yet writable until connected
-       * (unless it has been created by accept()). */
-      sockets[i].sendevent  = (NETCONNTYPE_GROUP(newconn->type) == NETCONN_TCP ? (accepted != 0) : 1);
-      sockets[i].errevent   = 0;
+  LWIP_ASSERT("sock->select_waiting == 0", sock->select_waiting == 0);
+  sock->rcvevent   = 0;
+  /* TCP sendbuf is empty, but the socket is not yet writable until connected
+   * (unless it has been created by accept()). */
+  sock->sendevent  = (NETCONNTYPE_GROUP(newconn->type) == NETCONN_TCP ? (accepted != 0) : 1);
+  sock->errevent   = 0;
 #endif /* LWIP_SOCKET_SELECT || LWIP_SOCKET_POLL */
-      return i + LWIP_SOCKET_OFFSET;
-    }
-    SYS_ARCH_UNPROTECT(lev);
-  }
-  return -1;
+  return sock->index + LWIP_SOCKET_OFFSET;
 }
 
 /** Free a socket (under lock)
@@ -562,6 +603,8 @@ free_socket_locked(struct lwip_sock *sock, int is_tcp, struct netconn **conn,
   sock->lastdata.pbuf = NULL;
   *conn = sock->conn;
   sock->conn = NULL;
+  sock->free_next = socket_free_list;
+  socket_free_list = sock;
   return 1;
 }
 
@@ -656,8 +699,8 @@ lwip_accept(int s, struct sockaddr *addr, socklen_t *addrlen)
     done_socket(sock);
     return -1;
   }
-  LWIP_ASSERT("invalid socket index", (newsock >= LWIP_SOCKET_OFFSET) && (newsock < NUM_SOCKETS + LWIP_SOCKET_OFFSET));
-  nsock = &sockets[newsock - LWIP_SOCKET_OFFSET];
+  LWIP_ASSERT("invalid socket index", (newsock >= LWIP_SOCKET_OFFSET) && (newsock < socket_count + LWIP_SOCKET_OFFSET));
+  nsock = SOCKET_AT(newsock - LWIP_SOCKET_OFFSET);
 
   /* See event_callback: If data comes in right away after an accept, even
    * though the server task might not have created a new socket yet.
@@ -1731,7 +1774,7 @@ lwip_socket(int domain, int type, int protocol)
     return -1;
   }
   conn->socket = i;
-  done_socket(&sockets[i - LWIP_SOCKET_OFFSET]);
+  done_socket(SOCKET_AT(i - LWIP_SOCKET_OFFSET));
   LWIP_DEBUGF(SOCKETS_DEBUG, ("%d\n", i));
   set_errno(0);
   return i;
@@ -165,6 +165,18 @@ static const u8_t tcp_backoff[13] =
 /* Times per slowtmr hits */
 static const u8_t tcp_persist_backoff[7] = { 3, 6, 12, 24, 48, 96, 120 };
 
+#ifdef TCP_LOSSLESS_LINK
+/* Connections still in SYN_SENT keep the normal SYN retransmission. */
+#define tcp_lossless_link(pcb) (TCP_LOSSLESS_LINK && (pcb)->state != SYN_SENT)
+#else
+#define tcp_lossless_link(pcb) 0
+#endif /* TCP_LOSSLESS_LINK */
+
+/* Retransmissions at TCP_LOSSLESS_RTO before giving up on the peer. */
+#ifndef TCP_LOSSLESS_MAXRTX
+#define TCP_LOSSLESS_MAXRTX TCP_MAXRTX
+#endif /* TCP_LOSSLESS_MAXRTX */
+
 /* The TCP PCB lists. */
 
 /** List of all TCP PCBs bound but not yet (connected || listening) */
@@ -213,6 +225,9 @@ tcp_free(struct tcp_pcb *pcb)
 #if LWIP_TCP_PCB_NUM_EXT_ARGS
   tcp_ext_arg_invoke_callbacks_destroyed(pcb->ext_args);
 #endif
+#ifdef TCP_SND_BUF_RELEASE
+  TCP_SND_BUF_RELEASE(pcb);
+#endif /* TCP_SND_BUF_RELEASE */
   memp_free(MEMP_TCP_PCB, pcb);
 }
 
@@ -1229,7 +1244,8 @@ tcp_slowtmr_start:
     if (pcb->state == SYN_SENT && pcb->nrtx >= TCP_SYNMAXRTX) {
       ++pcb_remove;
       LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: max SYN retries reached\n"));
-    } else if (pcb->nrtx >= TCP_MAXRTX) {
+    } else if (pcb->nrtx >= (tcp_lossless_link(pcb) ? TCP_LOSSLESS_MAXRTX
+                                                    : TCP_MAXRTX)) {
       ++pcb_remove;
       LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: max DATA retries reached\n"));
     } else {
@@ -1273,7 +1289,22 @@ tcp_slowtmr_start:
           ++pcb->rtime;
         }
 
-        if (pcb->rtime >= pcb->rto) {
+        if (tcp_lossless_link(pcb)) {
+          /* Nothing gets lost on the link, a late ACK means the peer is
+             blocked. As a last resort resend only the oldest segment, the
+             peer still holds the rest. No backoff, cwnd is not used.
+             Every attempt counts towards TCP_LOSSLESS_MAXRTX, also when the
+             segment is still queued on the link and can not be resent, so a
+             peer that has gone away is eventually aborted. */
+          if (pcb->rtime >= TCP_LOSSLESS_RTO) {
+            pcb->rtime = 0;
+            if (tcp_rexmit(pcb) == ERR_OK) {
+              tcp_output(pcb);
+            } else if (pcb->nrtx < 0xFF) {
+              ++pcb->nrtx;
+            }
+          }
+        } else if (pcb->rtime >= pcb->rto) {
           /* Time for a retransmission. */
           LWIP_DEBUGF(TCP_RTO_DEBUG, ("tcp_slowtmr: rtime %"S16_F
                                       " pcb->rto %"S16_F"\n",
@@ -2168,6 +2199,10 @@ tcp_pcb_purge(struct tcp_pcb *pcb)
 #if TCP_OVERSIZE
     pcb->unsent_oversize = 0;
 #endif /* TCP_OVERSIZE */
+#ifdef TCP_SND_BUF_RELEASE
+    /* Nothing will be sent any more, e.g. when entering TIME_WAIT. */
+    TCP_SND_BUF_RELEASE(pcb);
+#endif /* TCP_SND_BUF_RELEASE */
   }
 }
 
@@ -1315,6 +1315,10 @@ tcp_receive(struct tcp_pcb *pcb)
 #endif /* LWIP_IPV6 && LWIP_ND6_TCP_REACHABILITY_HINTS*/
 
       pcb->snd_buf = (tcpwnd_size_t)(pcb->snd_buf + recv_acked);
+#ifdef TCP_SND_BUF_TUNE
+      /* May grow snd_buf further. */
+      TCP_SND_BUF_TUNE(pcb);
+#endif /* TCP_SND_BUF_TUNE */
       /* check if this ACK ends our retransmission of in-flight data */
       if (pcb->flags & TF_RTO) {
         /* RTO is done if
@@ -1623,6 +1627,13 @@ tcp_receive(struct tcp_pcb *pcb)
 
 
         /* Acknowledge the segment(s). */
+#ifdef TCP_LOSSLESS_LINK
+        /* Don't make the sender wait for the delayed ACK timer at the end
+           of a write. */
+        if (TCP_LOSSLESS_LINK && (flags & TCP_PSH)) {
+          tcp_ack_now(pcb);
+        } else
+#endif /* TCP_LOSSLESS_LINK */
         tcp_ack(pcb);
 
 #if LWIP_TCP_SACK_OUT
@@ -1260,6 +1260,12 @@ tcp_output(struct tcp_pcb *pcb)
     return ERR_OK;
   }
 
+#ifdef TCP_LOSSLESS_LINK
+  /* The link never drops or reorders: only the peer's window limits us. */
+  if (TCP_LOSSLESS_LINK) {
+    wnd = pcb->snd_wnd;
+  } else
+#endif /* TCP_LOSSLESS_LINK */
   wnd = LWIP_MIN(pcb->snd_wnd, pcb->cwnd);
 
   seg = pcb->unsent;
@@ -49,7 +49,9 @@
 extern "C" {
 #endif
 
+#ifndef NUM_SOCKETS
 #define NUM_SOCKETS MEMP_NUM_NETCONN
+#endif
 
 /** This is overridable for the rare case where more than 255 threads
  * select on the same socket...
@@ -89,6 +91,10 @@ struct lwip_sock {
 #define LWIP_SOCK_FD_FREE_TCP  1
 #define LWIP_SOCK_FD_FREE_FREE 2
 #endif
+  /** index of this socket in the socket table */
+  int index;
+  /** next free socket while this one is unused */
+  struct lwip_sock *free_next;
 };
 
 #ifndef set_errno
@@ -324,6 +324,10 @@ struct tcp_pcb {
   tcpwnd_size_t snd_wnd_max; /* the maximum sender window announced by the remote host */
 
   tcpwnd_size_t snd_buf;   /* Available buffer space for sending (in bytes). */
+#ifdef TCP_SND_BUF_TUNE
+  /* Send buffer autotuning state, owned by TCP_SND_BUF_TUNE. */
+  TCP_SND_BUF_TUNE_STATE sndtune;
+#endif /* TCP_SND_BUF_TUNE */
 #define TCP_SNDQUEUELEN_OVERFLOW (0xffffU-3)
   u16_t snd_queuelen; /* Number of pbufs currently in the send buffer. */
 
@@ -113,9 +113,13 @@ struct sys_mbox_msg {
 
 #define SYS_MBOX_SIZE 128
 
+/* Mailboxes start with SYS_MBOX_SIZE slots and grow on demand up to the
+   size given to sys_mbox_new(). */
 struct sys_mbox {
   int first, last;
-  void *msgs[SYS_MBOX_SIZE];
+  void **msgs;
+  int size;
+  int max_size;
   struct sys_sem *not_empty;
   struct sys_sem *not_full;
   struct sys_sem *mutex;
@@ -206,6 +210,8 @@ sys_thread_new(const char *name, lwip_thread_fn function, void *arg, int stacksi
 #endif
 
   if (0 == code) {
+    /* nobody joins lwIP threads; let per-connection threads release their stacks */
+    pthread_detach(tmp);
     st = introduce_thread(tmp);
   }
 
@@ -259,12 +265,18 @@ err_t
 sys_mbox_new(struct sys_mbox **mb, int size)
 {
   struct sys_mbox *mbox;
-  LWIP_UNUSED_ARG(size);
 
   mbox = (struct sys_mbox *)malloc(sizeof(struct sys_mbox));
   if (mbox == NULL) {
     return ERR_MEM;
   }
+  mbox->msgs = (void **)malloc(SYS_MBOX_SIZE * sizeof(void *));
+  if (mbox->msgs == NULL) {
+    free(mbox);
+    return ERR_MEM;
+  }
+  mbox->size = SYS_MBOX_SIZE;
+  mbox->max_size = LWIP_MAX(size, SYS_MBOX_SIZE);
   mbox->first = mbox->last = 0;
   mbox->not_empty = sys_sem_new_internal(0);
   mbox->not_full = sys_sem_new_internal(0);
@@ -289,10 +301,52 @@ sys_mbox_free(struct sys_mbox **mb)
     sys_sem_free_internal(mbox->mutex);
     mbox->not_empty = mbox->not_full = mbox->mutex = NULL;
     /*  LWIP_DEBUGF("sys_mbox_free: mbox 0x%lx\n", mbox); */
+    free(mbox->msgs);
     free(mbox);
   }
 }
 
+/* Called with mbox->mutex held. Returns 0 if the mailbox is still full. */
+static int
+sys_mbox_grow(struct sys_mbox *mbox)
+{
+  int count = mbox->last - mbox->first;
+  int size;
+  void **msgs;
+  int i;
+
+  if (mbox->size >= mbox->max_size) {
+    return 0;
+  }
+  size = LWIP_MIN(mbox->size * 2, mbox->max_size);
+  msgs = (void **)malloc(size * sizeof(void *));
+  if (msgs == NULL) {
+    return 0;
+  }
+  for (i = 0; i < count; i++) {
+    msgs[i] = mbox->msgs[(mbox->first + i) % mbox->size];
+  }
+  free(mbox->msgs);
+  mbox->msgs = msgs;
+  mbox->size = size;
+  mbox->first = 0;
+  mbox->last = count;
+  return 1;
+}
+
+/* Called with mbox->mutex held after taking a message. size is not always
+   a power of two once the mailbox has grown, so first and last are kept
+   below 2 * size instead of being left to wrap around. */
+static void
+sys_mbox_advance(struct sys_mbox *mbox)
+{
+  mbox->first++;
+  if (mbox->first >= mbox->size) {
+    mbox->first -= mbox->size;
+    mbox->last -= mbox->size;
+  }
+}
+
 err_t
 sys_mbox_trypost(struct sys_mbox **mb, void *msg)
 {
@@ -306,12 +360,13 @@ sys_mbox_trypost(struct sys_mbox **mb, void *msg)
   LWIP_DEBUGF(SYS_DEBUG, ("sys_mbox_trypost: mbox %p msg %p\n",
                           (void *)mbox, (void *)msg));
 
-  if ((mbox->last + 1) >= (mbox->first + SYS_MBOX_SIZE)) {
+  if ((mbox->last + 1) >= (mbox->first + mbox->size) &&
+      !sys_mbox_grow(mbox)) {
     sys_sem_signal(&mbox->mutex);
     return ERR_MEM;
   }
 
-  mbox->msgs[mbox->last % SYS_MBOX_SIZE] = msg;
+  mbox->msgs[mbox->last % mbox->size] = msg;
 
   if (mbox->last == mbox->first) {
     first = 1;
@@ -348,7 +403,8 @@ sys_mbox_post(struct sys_mbox **mb, void *msg)
 
   LWIP_DEBUGF(SYS_DEBUG, ("sys_mbox_post: mbox %p msg %p\n", (void *)mbox, (void *)msg));
 
-  while ((mbox->last + 1) >= (mbox->first + SYS_MBOX_SIZE)) {
+  while ((mbox->last + 1) >= (mbox->first + mbox->size) &&
+         !sys_mbox_grow(mbox)) {
     mbox->wait_send++;
     sys_sem_signal(&mbox->mutex);
     sys_arch_sem_wait(&mbox->not_full, 0);
@@ -356,7 +412,7 @@ sys_mbox_post(struct sys_mbox **mb, void *msg)
     mbox->wait_send--;
   }
 
-  mbox->msgs[mbox->last % SYS_MBOX_SIZE] = msg;
+  mbox->msgs[mbox->last % mbox->size] = msg;
 
   if (mbox->last == mbox->first) {
     first = 1;
@@ -389,13 +445,13 @@ sys_arch_mbox_tryfetch(struct sys_mbox **mb, void **msg)
 
   if (msg != NULL) {
     LWIP_DEBUGF(SYS_DEBUG, ("sys_mbox_tryfetch: mbox %p msg %p\n", (void *)mbox, *msg));
-    *msg = mbox->msgs[mbox->first % SYS_MBOX_SIZE];
+    *msg = mbox->msgs[mbox->first % mbox->size];
   }
   else{
     LWIP_DEBUGF(SYS_DEBUG, ("sys_mbox_tryfetch: mbox %p, null msg\n", (void *)mbox));
   }
 
-  mbox->first++;
+  sys_mbox_advance(mbox);
 
   if (mbox->wait_send) {
     sys_sem_signal(&mbox->not_full);
@@ -438,13 +494,13 @@ sys_arch_mbox_fetch(struct sys_mbox **mb, void **msg, u32_t timeout)
 
   if (msg != NULL) {
     LWIP_DEBUGF(SYS_DEBUG, ("sys_mbox_fetch: mbox %p msg %p\n", (void *)mbox, *msg));
-    *msg = mbox->msgs[mbox->first % SYS_MBOX_SIZE];
+    *msg = mbox->msgs[mbox->first % mbox->size];
   }
   else{
     LWIP_DEBUGF(SYS_DEBUG, ("sys_mbox_fetch: mbox %p, null msg\n", (void *)mbox));
   }
 
-  mbox->first++;
+  sys_mbox_advance(mbox);
 
   if (mbox->wait_send) {
     sys_sem_signal(&mbox->not_full);